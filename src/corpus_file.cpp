@@ -0,0 +1,226 @@
+#include "corpus_file.hpp"
+
+#include <cstring>
+#include <fmt/core.h>
+#include <msgpack.hpp>
+#include <optional>
+#include <stdexcept>
+#include <string_view>
+#include <type_traits>
+
+namespace corpus_search {
+
+static_assert(std::is_same_v<std::int32_t, int>, "tokens are stored as int32");
+static_assert(sizeof(sentid_t) <= sizeof(std::uint64_t));
+
+corpus_file::corpus_file(std::string const &path)
+    : file(path, mapped_file::advice::sequential)
+{
+    if (file.size() < sizeof(corpus_file_header)) {
+        throw std::runtime_error(fmt::format("{} is not a corpus file: too small", path));
+    }
+
+    // the mapping is page aligned, so the header is suitably aligned too
+    auto const &header = *reinterpret_cast<corpus_file_header const *>(file.data());
+    if (std::memcmp(header.magic, corpus_file_header::MAGIC, sizeof(header.magic)) != 0) {
+        throw std::runtime_error(fmt::format("{} is not a corpus file: bad magic", path));
+    }
+    if (header.version != corpus_file_header::VERSION
+        || header.header_size != sizeof(corpus_file_header)) {
+        throw std::runtime_error(
+            fmt::format("{}: unsupported corpus file version {}", path, header.version));
+    }
+    if (!in_bounds(file.size(), header.tokens_offset, header.num_tokens, sizeof(std::int32_t))
+        || !in_bounds(file.size(),
+                      header.sent_ids_offset,
+                      header.num_sentences,
+                      sizeof(std::uint64_t))
+        || !in_bounds(file.size(),
+                      header.offsets_offset,
+                      header.num_sentences + 1,
+                      sizeof(std::uint64_t))) {
+        throw std::runtime_error(fmt::format("{}: corrupt corpus file: truncated section", path));
+    }
+
+    m_tokens = {reinterpret_cast<std::int32_t const *>(file.data() + header.tokens_offset),
+                header.num_tokens};
+    m_sent_ids = {reinterpret_cast<std::uint64_t const *>(file.data() + header.sent_ids_offset),
+                  header.num_sentences};
+    m_offsets = {reinterpret_cast<std::uint64_t const *>(file.data() + header.offsets_offset),
+                 header.num_sentences + 1};
+
+    // tokens(i) relies on the offsets being sane
+    if (m_offsets.front() != 0 || m_offsets.back() != header.num_tokens) {
+        throw std::runtime_error(fmt::format("{}: corrupt corpus file: bad offsets", path));
+    }
+    for (std::size_t i = 1; i < m_offsets.size(); ++i) {
+        if (m_offsets[i] < m_offsets[i - 1]) {
+            throw std::runtime_error(fmt::format("{}: corrupt corpus file: bad offsets", path));
+        }
+    }
+}
+
+auto corpus_file::is_corpus_file(std::string const &path) -> bool
+{
+    auto file = std::ifstream(path, std::ios::binary);
+    char magic[sizeof(corpus_file_header::MAGIC)] = {};
+    file.read(magic, sizeof(magic));
+    return file.gcount() == sizeof(magic)
+           && std::memcmp(magic, corpus_file_header::MAGIC, sizeof(magic)) == 0;
+}
+
+corpus_file_writer::corpus_file_writer(std::string path)
+    : path(std::move(path))
+    , out(this->path, std::ios::binary | std::ios::trunc)
+{
+    if (!out) {
+        throw std::runtime_error(fmt::format("Error opening file {} for writing.", this->path));
+    }
+    // placeholder; the real header (with the magic) is written by finish()
+    auto header = corpus_file_header{};
+    out.write(reinterpret_cast<char const *>(&header), sizeof(header));
+}
+
+void corpus_file_writer::add_sentence(sentid_t sent_id, std::span<const int> tokens)
+{
+    if (finished) {
+        throw std::runtime_error("corpus_file_writer: add_sentence() after finish()");
+    }
+    out.write(reinterpret_cast<char const *>(tokens.data()), tokens.size_bytes());
+    sent_ids.push_back(sent_id);
+    offsets.push_back(offsets.back() + tokens.size());
+}
+
+void corpus_file_writer::finish()
+{
+    if (finished) {
+        return;
+    }
+
+    auto align = [this] {
+        constexpr std::uint64_t alignment = alignof(std::uint64_t);
+        static constexpr char zeros[alignment] = {};
+        auto pos = static_cast<std::uint64_t>(out.tellp());
+        out.write(zeros, (alignment - pos % alignment) % alignment);
+        return static_cast<std::uint64_t>(out.tellp());
+    };
+
+    auto header = corpus_file_header{};
+    std::memcpy(header.magic, corpus_file_header::MAGIC, sizeof(header.magic));
+    header.version = corpus_file_header::VERSION;
+    header.header_size = sizeof(corpus_file_header);
+    header.num_sentences = sent_ids.size();
+    header.num_tokens = offsets.back();
+    header.tokens_offset = sizeof(corpus_file_header);
+
+    header.sent_ids_offset = align();
+    out.write(reinterpret_cast<char const *>(sent_ids.data()),
+              sent_ids.size() * sizeof(std::uint64_t));
+
+    header.offsets_offset = align();
+    out.write(reinterpret_cast<char const *>(offsets.data()),
+              offsets.size() * sizeof(std::uint64_t));
+
+    out.seekp(0);
+    out.write(reinterpret_cast<char const *>(&header), sizeof(header));
+    out.close();
+    if (out.fail()) {
+        throw std::runtime_error(fmt::format("Error writing file {}.", path));
+    }
+    finished = true;
+}
+
+auto read_msgpack_corpus(std::string const &path,
+                         std::function<msgpack_sentence_callback> const &callback)
+    -> std::size_t
+{
+    auto file = std::ifstream(path, std::ios::binary);
+
+    if (!file) {
+        throw std::runtime_error("Error reading file.");
+    }
+
+    auto unpacker = msgpack::unpacker();
+    auto tokens = std::vector<int>{}; // reused across sentences
+
+    std::size_t load_count = 0;
+
+    constexpr int try_read_size = 16 * 1024 * 1024;
+    while (file) {
+        unpacker.reserve_buffer(try_read_size);
+
+        file.read(unpacker.buffer(), try_read_size);
+        auto n_bytes_read = file.gcount();
+        if (n_bytes_read == 0) {
+            break;
+        }
+        unpacker.buffer_consumed(n_bytes_read);
+
+        msgpack::object_handle handle;
+        while (unpacker.next(handle)) {
+            if (load_count % 100'000 == 0) {
+                fmt::println("Loaded {} sentences...", load_count);
+                std::fflush(stdout);
+            }
+
+            // walk the map in place instead of converting it to a std::unordered_map
+            auto const &obj = handle.get();
+            if (obj.type != msgpack::type::MAP) {
+                throw std::runtime_error("Malformed corpus: expected a map per sentence.");
+            }
+            auto sent_id = std::optional<sentid_t>{};
+            bool has_tokens = false;
+            for (std::uint32_t k = 0; k < obj.via.map.size; ++k) {
+                auto const &kv = obj.via.map.ptr[k];
+                if (kv.key.type != msgpack::type::STR) {
+                    continue;
+                }
+                auto key = std::string_view(kv.key.via.str.ptr, kv.key.via.str.size);
+                if (key == "id") {
+                    sent_id = kv.val.as<sentid_t>();
+                } else if (key == "tokens") {
+                    if (kv.val.type != msgpack::type::ARRAY) {
+                        throw std::runtime_error("Malformed corpus: tokens is not an array.");
+                    }
+                    auto const &array = kv.val.via.array;
+                    tokens.resize(array.size);
+                    for (std::uint32_t t = 0; t < array.size; ++t) {
+                        tokens[t] = array.ptr[t].as<int>();
+                    }
+                    has_tokens = true;
+                }
+            }
+            if (!sent_id.has_value() || !has_tokens) {
+                throw std::runtime_error("Malformed corpus: sentence without id or tokens.");
+            }
+
+            callback(*sent_id, tokens);
+
+            load_count += 1;
+        }
+    }
+
+    if (file.bad()) {
+        throw std::runtime_error("Error reading file.");
+    }
+
+    return load_count;
+}
+
+auto convert_msgpack_corpus(std::string const &msgpack_path, std::string const &corpus_path)
+    -> std::size_t
+{
+    auto writer = corpus_file_writer(corpus_path);
+    auto count = read_msgpack_corpus(msgpack_path,
+                                     [&writer](sentid_t sent_id, std::span<const int> tokens) {
+                                         writer.add_sentence(sent_id, tokens);
+                                     });
+    writer.finish();
+
+    fmt::println("Converted {} sentences from {} to {}", count, msgpack_path, corpus_path);
+    std::fflush(stdout);
+
+    return count;
+}
+
+} // namespace corpus_search
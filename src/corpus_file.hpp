@@ -0,0 +1,91 @@
+#ifndef CORPUS_FILE_HPP
+#define CORPUS_FILE_HPP
+
+#include "mapped_file.hpp"
+#include "sizes.h"
+
+#include <cstdint>
+#include <fstream>
+#include <functional>
+#include <span>
+#include <string>
+#include <vector>
+
+namespace corpus_search {
+
+// Flat, columnar file of tokenized sentences, meant to be mmap'd and indexed in place.
+// All integers are stored in native byte order. Sections are 8-byte aligned and may
+// appear in any order; the header records where each one starts.
+//
+//   header | tokens (int32)[num_tokens] | sent_ids (uint64)[num_sentences]
+//          | offsets (uint64)[num_sentences + 1]
+//
+// The tokens of the i-th sentence are tokens[offsets[i] .. offsets[i + 1]).
+struct corpus_file_header
+{
+    static constexpr char MAGIC[8] = {'C', 'S', 'C', 'O', 'R', 'P', 'U', 'S'};
+    static constexpr std::uint32_t VERSION = 1;
+
+    char magic[8];
+    std::uint32_t version;
+    std::uint32_t header_size;
+    std::uint64_t num_sentences;
+    std::uint64_t num_tokens;
+    std::uint64_t tokens_offset;
+    std::uint64_t sent_ids_offset;
+    std::uint64_t offsets_offset;
+};
+
+class corpus_file
+{
+    mapped_file file;
+    std::span<const std::int32_t> m_tokens;
+    std::span<const std::uint64_t> m_sent_ids;
+    std::span<const std::uint64_t> m_offsets;
+
+public:
+    explicit corpus_file(std::string const &path);
+
+    static auto is_corpus_file(std::string const &path) -> bool;
+
+    auto size() const -> std::size_t { return m_sent_ids.size(); }
+    auto num_tokens() const -> std::size_t { return m_tokens.size(); }
+    auto sent_id(std::size_t i) const -> sentid_t { return m_sent_ids[i]; }
+    auto tokens(std::size_t i) const -> std::span<const int>
+    {
+        return m_tokens.subspan(m_offsets[i], m_offsets[i + 1] - m_offsets[i]);
+    }
+};
+
+// Streams sentences into a corpus file. Sentence ids must be unique.
+// The file only gets its magic in finish(), so an unfinished file is never mistaken for a corpus.
+class corpus_file_writer
+{
+    std::string path;
+    std::ofstream out;
+    std::vector<std::uint64_t> sent_ids;
+    std::vector<std::uint64_t> offsets = {0};
+    bool finished = false;
+
+public:
+    explicit corpus_file_writer(std::string path);
+
+    void add_sentence(sentid_t sent_id, std::span<const int> tokens);
+    void finish();
+};
+
+using msgpack_sentence_callback = void(sentid_t sent_id, std::span<const int> tokens);
+
+// Stream sentences out of a msgpack dump of {"id": ..., "tokens": [...]} maps.
+// Returns the number of sentences read.
+auto read_msgpack_corpus(std::string const &path,
+                         std::function<msgpack_sentence_callback> const &callback)
+    -> std::size_t;
+
+// One-time conversion of a msgpack dump into a corpus file. Returns the number of sentences.
+auto convert_msgpack_corpus(std::string const &msgpack_path, std::string const &corpus_path)
+    -> std::size_t;
+
+} // namespace corpus_search
+
+#endif // CORPUS_FILE_HPP
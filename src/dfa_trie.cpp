@@ -1,91 +1,191 @@
 #include "dfa_trie.hpp"
+#include "parallel.hpp"
 #include "tokenizer.hpp"
 
-#include <queue>
+#include <algorithm>
+#include <cassert>
+#include <tuple>
 
 namespace corpus_search {
 
-struct trie_node
-{
-    std::vector<int> token_ids;
-    std::vector<std::unique_ptr<trie_node>> children;
+namespace {
 
-    trie_node();
+struct suffix
+{
+    std::string_view bytes;
+    std::uint32_t tid;
 };
 
-trie_node::trie_node()
-    : token_ids()
-    , children(256)
-{}
-
-struct trie
+// Append the subtree for suffixes[lo, hi), which share their first `depth` bytes,
+// below nodes[node_idx]. The suffixes are sorted, so DFS order is their order.
+void build_subtree(std::vector<dfa_trie_node>& nodes,
+                   std::uint32_t node_idx,
+                   std::vector<suffix> const& suffixes,
+                   std::size_t lo,
+                   std::size_t hi,
+                   std::size_t depth)
 {
-    std::unique_ptr<trie_node> root = std::make_unique<trie_node>();
+    auto own_end = lo;
+    while (own_end < hi && suffixes[own_end].bytes.size() == depth) {
+        own_end++;
+    }
 
-    void insert(int token_id, std::string_view word)
-    {
-        trie_node* node = root.get();
-        for (char c : word) {
-            int idx = c & 0xFF;
-            if (!node->children[idx]) {
-                node->children[idx] = std::make_unique<trie_node>();
-            }
-            node = node->children[idx].get();
+    // group the rest by their next byte; each group becomes a child
+    auto groups = std::vector<std::pair<std::size_t, std::size_t>>{};
+    for (auto i = own_end; i < hi;) {
+        auto j = i + 1;
+        while (j < hi && suffixes[j].bytes[depth] == suffixes[i].bytes[depth]) {
+            j++;
         }
-        node->token_ids.push_back(token_id);
+        groups.emplace_back(i, j);
+        i = j;
     }
-};
+
+    auto first_child = static_cast<std::uint32_t>(nodes.size());
+    nodes[node_idx].first_child = first_child;
+    nodes[node_idx].tokens_begin = lo;
+    nodes[node_idx].tokens_end = own_end;
+    nodes[node_idx].subtree_end = hi;
+    nodes[node_idx].n_children = groups.size();
+
+    for (auto [g_lo, g_hi] : groups) {
+        nodes.push_back({.label = static_cast<std::uint8_t>(suffixes[g_lo].bytes[depth])});
+    }
+    for (std::size_t k = 0; k < groups.size(); ++k) {
+        auto [g_lo, g_hi] = groups[k];
+        build_subtree(nodes, first_child + k, suffixes, g_lo, g_hi, depth + 1);
+    }
+}
+
+} // namespace
 
 dfa_trie::dfa_trie(tokenizer const& tok)
-    : tries(tok.max_token_bytes())
+    : roots(tok.max_token_bytes())
 {
+    auto suffixes = std::vector<suffix>{};
     for (int i = 0; i < tok.max_token_bytes(); ++i) {
+        suffixes.clear();
         for (auto&& [tid, token] : tok.get_tid_to_token()) {
             if (token.length() > i) {
-                tries[i].insert(tid, std::string_view(token.begin() + i, token.end()));
+                suffixes.push_back({std::string_view(token).substr(i),
+                                    static_cast<std::uint32_t>(tid)});
             }
         }
+        std::sort(suffixes.begin(), suffixes.end(), [](suffix const& a, suffix const& b) {
+            // compare as unsigned bytes, the order of the children
+            auto a_bytes = std::basic_string_view<unsigned char>(
+                reinterpret_cast<unsigned char const*>(a.bytes.data()), a.bytes.size());
+            auto b_bytes = std::basic_string_view<unsigned char>(
+                reinterpret_cast<unsigned char const*>(b.bytes.data()), b.bytes.size());
+            return std::tie(a_bytes, a.tid) < std::tie(b_bytes, b.tid);
+        });
+
+        auto offset = static_cast<std::uint32_t>(token_ids.size());
+        roots[i] = nodes.size();
+        nodes.push_back({});
+        build_subtree(nodes, roots[i], suffixes, 0, suffixes.size(), 0);
+        for (auto& node : std::span(nodes).subspan(roots[i])) {
+            node.tokens_begin += offset;
+            node.tokens_end += offset;
+            node.subtree_end += offset;
+        }
+        for (auto const& s : suffixes) {
+            token_ids.push_back(s.tid);
+        }
     }
 }
 
+dfa_trie::dfa_trie(std::span<const std::uint32_t> roots,
+                   std::span<const dfa_trie_node> nodes,
+                   std::span<const std::uint32_t> token_ids)
+    : roots(roots.begin(), roots.end())
+    , nodes(nodes.begin(), nodes.end())
+    , token_ids(token_ids.begin(), token_ids.end())
+{}
+
 dfa_trie::~dfa_trie() = default;
 
-static void recurse(trie_node* node,
+static void recurse_positions(std::span<const dfa_trie_node> nodes,
+                              std::uint32_t const* token_ids,
+                              std::uint32_t node_idx,
+                              regex::sm::graph const& dfa,
+                              regex::sm::position_set const& positions,
+                              int target_state,
+                              roaring::Roaring& result);
+
+static void recurse(std::span<const dfa_trie_node> nodes,
+                    std::uint32_t const* token_ids,
+                    std::uint32_t node_idx,
                     regex::sm::graph const& dfa,
                     int state,
                     int target_state,
                     roaring::Roaring& result)
 {
-    for (int tid : node->token_ids) {
-        if (target_state == -1 || state == target_state) {
-            result.add(tid);
-        }
-    }
-    if (dfa.accept_states.contains(state)) {
-        // collect all tokens in the subtree
-        std::queue<trie_node*> pending;
-        pending.push(node);
-        while (!pending.empty()) {
-            auto current = pending.front();
-            pending.pop();
-            for (int tid : current->token_ids) {
-                if (target_state == -1 || state == target_state) {
-                    result.add(tid);
-                }
-            }
-            for (auto& child : current->children) {
-                if (child) {
-                    pending.push(child.get());
-                }
-            }
+    auto const& node = nodes[node_idx];
+    bool wanted = target_state == -1 || state == target_state;
+    if (dfa.is_accept(state)) {
+        // every token in the subtree matches
+        if (wanted) {
+            result.addMany(node.subtree_end - node.tokens_begin, token_ids + node.tokens_begin);
         }
-    } else {
-        for (auto edge : dfa.edges.at(state)) {
-            for (int i = edge.range.min; i <= edge.range.max; ++i) {
-                if (node->children[i]) {
-                    recurse(node->children[i].get(), dfa, edge.target_state, target_state, result);
-                }
-            }
+        return;
+    }
+
+    if (wanted) {
+        result.addMany(node.tokens_end - node.tokens_begin, token_ids + node.tokens_begin);
+    }
+    // one class lookup per child, however many ranges the edges of state have
+    for (std::uint32_t k = 0; k < node.n_children; ++k) {
+        auto child_idx = node.first_child + k;
+        int cls = dfa.classes.of_byte[nodes[child_idx].label];
+        int next = dfa.next_state_by_class(state, cls);
+        if (next == regex::sm::graph::OVERFLOW) {
+            recurse_positions(nodes,
+                              token_ids,
+                              child_idx,
+                              dfa,
+                              dfa.step(dfa.positions(state), cls),
+                              target_state,
+                              result);
+        } else if (next != -1) {
+            recurse(nodes, token_ids, child_idx, dfa, next, target_state, result);
+        }
+    }
+}
+
+// recurse() below a lazy DFA's state budget: positions is a set that has no state
+static void recurse_positions(std::span<const dfa_trie_node> nodes,
+                              std::uint32_t const* token_ids,
+                              std::uint32_t node_idx,
+                              regex::sm::graph const& dfa,
+                              regex::sm::position_set const& positions,
+                              int target_state,
+                              roaring::Roaring& result)
+{
+    auto const& node = nodes[node_idx];
+    bool wanted = target_state == -1;
+    if (dfa.accepts(positions)) {
+        if (wanted) {
+            result.addMany(node.subtree_end - node.tokens_begin, token_ids + node.tokens_begin);
+        }
+        return;
+    }
+
+    if (wanted) {
+        result.addMany(node.tokens_end - node.tokens_begin, token_ids + node.tokens_begin);
+    }
+    for (std::uint32_t k = 0; k < node.n_children; ++k) {
+        auto child_idx = node.first_child + k;
+        auto next = dfa.step(positions, dfa.classes.of_byte[nodes[child_idx].label]);
+        if (next.empty()) {
+            continue;
+        }
+        // back on the DFA if this set was built after all
+        int state = dfa.find_state(next);
+        if (state != -1) {
+            recurse(nodes, token_ids, child_idx, dfa, state, target_state, result);
+        } else {
+            recurse_positions(nodes, token_ids, child_idx, dfa, next, target_state, result);
         }
     }
 }
@@ -96,20 +196,161 @@ auto dfa_trie::get_next_tids(regex::sm::graph const& dfa,
                              int prefix_length) const -> roaring::Roaring
 {
     roaring::Roaring result;
-    if (prefix_length >= tries.size()) {
+    if (prefix_length >= roots.size()) {
+        return result;
+    }
+    recurse(nodes, token_ids.data(), roots[prefix_length], dfa, state, target_state, result);
+    return result;
+}
+
+namespace {
+
+// walks one trie for many DFA states at once
+struct multi_state_walker
+{
+    std::span<const dfa_trie_node> nodes;
+    std::uint32_t const* token_ids;
+    regex::sm::graph const& dfa;
+    std::vector<roaring::Roaring>& result;
+
+    // (origin state, current state) pairs alive at each depth
+    std::vector<std::vector<std::pair<int, int>>> active;
+
+    void add_tokens(int origin, std::uint32_t begin, std::uint32_t end)
+    {
+        if (end > begin) {
+            result[origin].addMany(end - begin, token_ids + begin);
+        }
+    }
+
+    // follow the edge to nodes[child_idx] for every pair alive in the parent
+    void descend(std::uint32_t child_idx,
+                 std::size_t depth,
+                 std::vector<std::pair<int, int>> const& parent_active)
+    {
+        auto& cur = active[depth];
+        cur.clear();
+        int cls = dfa.classes.of_byte[nodes[child_idx].label];
+        for (auto [origin, state] : parent_active) {
+            int next = dfa.next_state_by_class(state, cls);
+            if (next != -1) {
+                cur.emplace_back(origin, next);
+            }
+        }
+        if (!cur.empty()) {
+            visit(child_idx, depth);
+        }
+    }
+
+    void visit(std::uint32_t node_idx, std::size_t depth)
+    {
+        auto const& node = nodes[node_idx];
+        auto& cur = active[depth];
+        std::size_t n_alive = 0;
+        for (auto [origin, state] : cur) {
+            if (dfa.is_accept(state)) {
+                // every token in the subtree matches
+                add_tokens(origin, node.tokens_begin, node.subtree_end);
+            } else {
+                add_tokens(origin, node.tokens_begin, node.tokens_end);
+                cur[n_alive++] = {origin, state};
+            }
+        }
+        cur.resize(n_alive);
+        if (cur.empty()) {
+            return;
+        }
+        for (std::uint32_t k = 0; k < node.n_children; ++k) {
+            descend(node.first_child + k, depth + 1, cur);
+        }
+    }
+};
+
+} // namespace
+
+auto dfa_trie::get_next_tids_all(regex::sm::graph const& dfa,
+                                 int prefix_length,
+                                 int num_threads) const -> std::vector<roaring::Roaring>
+{
+    assert(!dfa.is_lazy());
+    auto result = std::vector<roaring::Roaring>(dfa.num_states);
+    if (prefix_length >= roots.size()) {
         return result;
     }
-    recurse(tries[prefix_length].root.get(), dfa, state, target_state, result);
+
+    // The root has no tokens of its own; states accepting there take the whole trie.
+    auto const& root = nodes[roots[prefix_length]];
+    auto root_active = std::vector<std::pair<int, int>>{};
+    for (int state = 0; state < dfa.num_states; ++state) {
+        if (dfa.is_accept(state)) {
+            result[state].addMany(root.subtree_end - root.tokens_begin,
+                                  token_ids.data() + root.tokens_begin);
+        } else {
+            root_active.emplace_back(state, state);
+        }
+    }
+
+    num_threads = std::min<int>(resolve_num_threads(num_threads), root.n_children);
+    if (num_threads <= 1) {
+        auto walker = multi_state_walker{nodes, token_ids.data(), dfa, result};
+        walker.active.resize(roots.size() + 1);
+        for (std::uint32_t k = 0; k < root.n_children; ++k) {
+            walker.descend(root.first_child + k, 1, root_active);
+        }
+        return result;
+    }
+
+    // each thread takes every num_threads-th child of the root
+    auto partial = std::vector<std::vector<roaring::Roaring>>(num_threads);
+    run_parallel(num_threads, [&](int t) {
+        partial[t].resize(dfa.num_states);
+        auto walker = multi_state_walker{nodes, token_ids.data(), dfa, partial[t]};
+        walker.active.resize(roots.size() + 1);
+        for (std::uint32_t k = t; k < root.n_children; k += num_threads) {
+            walker.descend(root.first_child + k, 1, root_active);
+        }
+    });
+    for (auto const& part : partial) {
+        for (int state = 0; state < dfa.num_states; ++state) {
+            result[state] |= part[state];
+        }
+    }
     return result;
 }
 
+// consume_token() past a lazy DFA's state budget, from the position set positions
+static auto consume_positions(dfa_trie const& trie,
+                              regex::sm::graph const& dfa,
+                              regex::sm::position_set positions,
+                              std::string_view token) -> int
+{
+    for (std::size_t i = 0; i < token.size(); ++i) {
+        positions = dfa.step(positions, dfa.byte_class(token[i]));
+        if (positions.empty()) {
+            return dfa_trie::REJECTED;
+        }
+        if (dfa.accepts(positions)) {
+            return dfa_trie::ACCEPTED;
+        }
+        int state = dfa.find_state(positions);
+        if (state != -1) {
+            return trie.consume_token(dfa, state, token.substr(i + 1));
+        }
+    }
+    return dfa_trie::OVERFLOWED;
+}
+
 auto dfa_trie::consume_token(regex::sm::graph const& dfa, int state, std::string_view token) const
     -> int
 {
-    for (char ch : token) {
-        state = dfa.next_state(state, ch);
+    for (std::size_t i = 0; i < token.size(); ++i) {
+        int next = dfa.next_state(state, token[i]);
+        if (next == regex::sm::graph::OVERFLOW) {
+            return consume_positions(*this, dfa, dfa.positions(state), token.substr(i));
+        }
+        state = next;
         if (state != -1) {
-            if (dfa.accept_states.contains(state)) {
+            if (dfa.is_accept(state)) {
                 return ACCEPTED;
             }
         } else {
@@ -3,28 +3,64 @@
 
 #include "regex_dfa.hpp"
 
+#include <cstdint>
+#include <span>
+
 #include <roaring.hh>
 
 namespace corpus_search {
 
 class tokenizer;
 
-struct trie;
+// One node of the flattened tries. The children of a node are stored next to each other,
+// sorted by label. Token IDs are stored in DFS order, so the tokens of a whole subtree are
+// one contiguous slice of the token array.
+struct dfa_trie_node
+{
+    std::uint32_t first_child;
+    std::uint32_t tokens_begin; // tokens ending at this node are [tokens_begin, tokens_end)
+    std::uint32_t tokens_end;
+    std::uint32_t subtree_end; // tokens of the whole subtree are [tokens_begin, subtree_end)
+    std::uint16_t n_children;
+    std::uint8_t label; // byte on the edge from the parent
+    std::uint8_t reserved;
+};
+
 class dfa_trie
 {
-    std::vector<trie> tries;
+    // one trie per suffix offset, rooted at nodes[roots[offset]]
+    std::vector<std::uint32_t> roots;
+    std::vector<dfa_trie_node> nodes;
+    std::vector<std::uint32_t> token_ids;
 
 public:
     dfa_trie(tokenizer const& tok);
+    // restore a trie from the arrays of another one
+    dfa_trie(std::span<const std::uint32_t> roots,
+             std::span<const dfa_trie_node> nodes,
+             std::span<const std::uint32_t> token_ids);
     ~dfa_trie();
 
+    auto get_roots() const -> std::span<const std::uint32_t> { return roots; }
+    auto get_nodes() const -> std::span<const dfa_trie_node> { return nodes; }
+    auto get_token_ids() const -> std::span<const std::uint32_t> { return token_ids; }
+
     auto get_next_tids(regex::sm::graph const& dfa,
                        int state,
                        int target_state = -1,
                        int prefix_length = 0) const -> roaring::Roaring;
 
+    // get_next_tids(dfa, state, -1, prefix_length) for every state at once, in one walk of
+    // the trie that carries all states still alive at each node. Subtrees of the root are
+    // split over num_threads threads (0 = all cores). dfa must not be lazy.
+    auto get_next_tids_all(regex::sm::graph const& dfa,
+                           int prefix_length = 0,
+                           int num_threads = 1) const -> std::vector<roaring::Roaring>;
+
     static constexpr int ACCEPTED = -1;
     static constexpr int REJECTED = -2;
+    // the token ends in a position set past a lazy DFA's state budget
+    static constexpr int OVERFLOWED = -3;
     auto consume_token(regex::sm::graph const& dfa, int state, std::string_view token) const -> int;
 };
 
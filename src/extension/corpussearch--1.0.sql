@@ -14,3 +14,24 @@ COMMENT ON ACCESS METHOD ibpe IS 'inverted BPE index access method';
 CREATE OPERATOR CLASS text_ops
 DEFAULT FOR TYPE text USING ibpe AS
     OPERATOR 1 ~(text, text);
+
+-- Merge the pending list of an ibpe index into its main posting lists.
+-- Returns the number of pending entries merged.
+CREATE FUNCTION ibpe_clean_pending_list(regclass)
+    RETURNS bigint
+    AS 'MODULE_PATHNAME'
+    LANGUAGE C STRICT;
+
+-- Search an ibpe index for many literal strings at once, e.g. every form of a
+-- word from a dictionary. Returns a row per (literal, heap_tid) match, where
+-- literal is the 1-based position in the array; with per_literal => false,
+-- one row per heap_tid matching any literal, with a NULL literal. The rows are
+-- candidates, like those of an index scan that needs a recheck: the index can
+-- still hold entries of dead rows whose line pointers were reused, so join the
+-- result to the table on ctid and recheck with strpos(text, literals[literal]) > 0.
+CREATE FUNCTION ibpe_literal_matches(regclass,
+                                     literals text[],
+                                     per_literal boolean DEFAULT true)
+    RETURNS TABLE(literal integer, heap_tid tid)
+    AS 'MODULE_PATHNAME'
+    LANGUAGE C STRICT;
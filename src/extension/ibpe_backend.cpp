@@ -5,6 +5,7 @@
 
 #include <algorithm>
 #include <fmt/core.h>
+#include <memory>
 #include <nlohmann/json.hpp>
 #include <type_traits>
 #include <unordered_map>
@@ -110,36 +111,63 @@ auto corpus_search::backend::tokenizer_get_vocab_size(tokenizer tok) noexcept ->
     return reinterpret_cast<corpus_search::tokenizer *>(tok)->vocab_size();
 }
 
-auto corpus_search::backend::search_corpus(tokenizer tok,
-                                           index_accessor_cb callback,
-                                           char const *search_term) noexcept -> search_result
+auto corpus_search::backend::tokenizer_save_snapshot(tokenizer tok,
+                                                     char *err_msg,
+                                                     int err_len) noexcept -> bool
 {
     try {
         auto tok_ptr = reinterpret_cast<corpus_search::tokenizer *>(tok);
-        auto cb = [callback](int token) -> std::vector<corpus_search::token_range> {
-            int num_entries = callback.func(callback.user_data, token, nullptr, 0);
-            if (num_entries > 0) {
-                auto vec = std::vector<corpus_search::index_entry>(num_entries);
-                callback.func(callback.user_data,
-                              token,
-                              reinterpret_cast<index_entry *>(vec.data()),
-                              num_entries);
-
-                auto result = std::vector<corpus_search::token_range>(num_entries);
-                for (auto const &entry : vec) {
-                    result.push_back(corpus_search::token_range {
-                        entry.sent_id, entry.pos, static_cast<tokpos_t>(entry.pos + 1),
+        tok_ptr->save_snapshot(corpus_search::tokenizer::snapshot_path(tok_ptr->json_path()));
+        return true;
+    } catch (std::exception const &e) {
+        if (err_msg) {
+            std::strncpy(err_msg, e.what(), err_len - 1);
+        }
+        return false;
+    } catch (...) {
+        return false;
+    }
+}
+
+// the index as corpus_search::search sees it, read through callback
+static auto make_index_accessor(corpus_search::backend::index_accessor_cb callback)
+{
+    return [callback](int token) -> std::vector<corpus_search::token_range> {
+        int num_entries = callback.func(callback.user_data, token, nullptr, 0);
+        if (num_entries > 0) {
+            auto vec = std::vector<corpus_search::index_entry>(num_entries);
+            callback.func(callback.user_data,
+                          token,
+                          reinterpret_cast<corpus_search::backend::index_entry *>(vec.data()),
+                          num_entries);
+
+            auto result = std::vector<corpus_search::token_range>{};
+            result.reserve(num_entries);
+            for (auto const &entry : vec) {
+                result.push_back(corpus_search::token_range {
+                    entry.sent_id, entry.pos, static_cast<tokpos_t>(entry.pos + 1),
 #if CORPUS_SEARCH_NEXT_TOKEN_BITS > 0
-                            entry.next_tok,
+                        entry.next_tok,
 #endif
-                    });
-                }
-                return result;
+                });
             }
-            return {};
-        };
+            return result;
+        }
+        return {};
+    };
+}
 
-        auto result = corpus_search::search(*tok_ptr, cb, std::string(search_term));
+auto corpus_search::backend::search_corpus(tokenizer tok,
+                                           index_accessor_cb callback,
+                                           char const *search_term,
+                                           int max_dfa_states) noexcept -> search_result
+{
+    try {
+        auto tok_ptr = reinterpret_cast<corpus_search::tokenizer *>(tok);
+        auto result = corpus_search::search(*tok_ptr,
+                                            make_index_accessor(callback),
+                                            std::string(search_term),
+                                            max_dfa_states);
 
         auto sentid_vector = new std::vector<sentid_t>(std::move(result.candidates));
         return {
@@ -151,6 +179,37 @@ auto corpus_search::backend::search_corpus(tokenizer tok,
     }
 }
 
+auto corpus_search::backend::search_corpus_literals(tokenizer tok,
+                                                    index_accessor_cb callback,
+                                                    char const *const *literals,
+                                                    int n_literals,
+                                                    sentid_vec *per_literal,
+                                                    sentid_vec *any) noexcept -> bool
+{
+    try {
+        auto tok_ptr = reinterpret_cast<corpus_search::tokenizer *>(tok);
+        auto literal_strings = std::vector<std::string>(literals, literals + n_literals);
+        auto result = corpus_search::search_literals(*tok_ptr,
+                                                     make_index_accessor(callback),
+                                                     literal_strings);
+
+        // allocate everything before handing anything out
+        auto vectors = std::vector<std::unique_ptr<std::vector<sentid_t>>>{};
+        for (auto &sent_ids : result.per_literal) {
+            vectors.push_back(std::make_unique<std::vector<sentid_t>>(std::move(sent_ids)));
+        }
+        vectors.push_back(std::make_unique<std::vector<sentid_t>>(std::move(result.any)));
+
+        for (int i = 0; i < n_literals; ++i) {
+            per_literal[i] = reinterpret_cast<sentid_vec>(vectors[i].release());
+        }
+        *any = reinterpret_cast<sentid_vec>(vectors.back().release());
+        return true;
+    } catch (...) {
+        return false;
+    }
+}
+
 auto corpus_search::backend::sentid_vec_get_data(sentid_vec vec) noexcept -> sentid_t const *
 {
     return reinterpret_cast<std::vector<sentid_t> *>(vec)->data();
@@ -56,6 +56,8 @@ tokenizer create_tokenizer(char const *tokenizer_path,
 void destroy_tokenizer(tokenizer tok) noexcept;
 int tokenizer_tokenize(tokenizer tok, char const *string, int *out_tokens, size_t maxlen) noexcept;
 int tokenizer_get_vocab_size(tokenizer tok) noexcept;
+// write the snapshot later create_tokenizer calls for the same tokenizer.json load from
+bool tokenizer_save_snapshot(tokenizer tok, char *err_msg, int err_len) noexcept;
 
 // searcher
 typedef struct sentid_vec_data *sentid_vec;
@@ -73,9 +75,20 @@ typedef struct
     bool needs_recheck;
 } search_result;
 
+// max_dfa_states bounds the DFA of search_term (see corpus_search::search)
 search_result search_corpus(tokenizer tok,
                             index_accessor_cb callback,
-                            char const *search_term) noexcept;
+                            char const *search_term,
+                            int max_dfa_states) noexcept;
+// Search for n_literals literal strings at once (see corpus_search::search_literals). On
+// success fills per_literal[0, n_literals) and *any, which the caller destroys; the results
+// are candidates that need a recheck against the heap.
+bool search_corpus_literals(tokenizer tok,
+                            index_accessor_cb callback,
+                            char const *const *literals,
+                            int n_literals,
+                            sentid_vec *per_literal,
+                            sentid_vec *any) noexcept;
 sentid_t const *sentid_vec_get_data(sentid_vec vec) noexcept;
 size_t sentid_vec_get_size(sentid_vec vec) noexcept;
 void destroy_sentid_vec(sentid_vec vec) noexcept;
@@ -1,11 +1,16 @@
 #include "ibpe_build.h"
+#include "ibpe_pending.h"
 #include "ibpe_relcache.h"
 #include "ibpe_utils.h"
+#include "ibpe_xlog.h"
 
 #include <access/generic_xlog.h>
 #include <access/reloptions.h>
 #include <access/tableam.h>
+#include <access/xact.h>
 #include <commands/vacuum.h>
+#include <lib/ilist.h>
+#include <lib/stringinfo.h>
 #include <miscadmin.h>
 #include <nodes/execnodes.h>
 #include <storage/bufmgr.h>
@@ -48,8 +53,20 @@ static void ibpe_fill_metapage(Relation indexRelation, Page metaPage)
     }
     metadata->index_built = false;
     metadata->num_indexed_tokens = 0;
-    metadata->pending_blkno = InvalidBlockNumber;
-    metadata->n_pending = 0;
+    metadata->format_version = IBPE_FORMAT_VERSION;
+    metadata->ptr_blkno = InvalidBlockNumber;
+    metadata->sid_blkno = InvalidBlockNumber;
+    metadata->sid_tail_blkno = InvalidBlockNumber;
+    metadata->sid_live_bytes = 0;
+    metadata->sid_dead_bytes = 0;
+    metadata->generation = 0;
+    // tells this build apart from an earlier index that had the same relfilenode
+    if (!pg_strong_random(&metadata->build_stamp, sizeof(metadata->build_stamp))) {
+        elog(ERROR, "could not generate a random ibpe build stamp");
+    }
+    for (int p = 0; p < IBPE_PENDING_PARTITIONS; p++) {
+        metadata->pending_cut[p].tail = InvalidBlockNumber;
+    }
 
     ((PageHeader) metaPage)->pd_lower += sizeof(ibpe_metapage_data);
     Assert(((PageHeader) metaPage)->pd_lower <= ((PageHeader) metaPage)->pd_upper);
@@ -74,18 +91,32 @@ static void ibpe_init_metapage(Relation indexRelation, ForkNumber forknum)
 
     GenericXLogFinish(state);
     UnlockReleaseBuffer(metaBuffer);
-}
 
-// regular page manipulation
-static void ibpe_init_page(Page page, uint16 flags)
-{
-    PageInit(page, BLCKSZ, sizeof(ibpe_opaque_data));
+    // the pending roots follow at fixed block numbers, one WAL record each
+    for (int p = 0; p < IBPE_PENDING_PARTITIONS; p++) {
+        Buffer rootBuffer = ReadBufferExtended(indexRelation, forknum, P_NEW, RBM_NORMAL, NULL);
+        LockBuffer(rootBuffer, BUFFER_LOCK_EXCLUSIVE);
+        Assert(BufferGetBlockNumber(rootBuffer) == IBPE_PENDING_ROOT_BLKNO(p));
 
-    ibpe_opaque_data *opaque = ibpe_get_opaque(page);
-    opaque->flags = flags;
-    opaque->data_len = 0;
-    opaque->next_blkno = InvalidBlockNumber;
-    opaque->ibpe_page_id = IBPE_PAGE_ID;
+        state = GenericXLogStart(indexRelation);
+        Page rootPage = GenericXLogRegisterBuffer(state, rootBuffer, GENERIC_XLOG_FULL_IMAGE);
+
+        PageInit(rootPage, BLCKSZ, sizeof(ibpe_opaque_data));
+        ibpe_opaque_data *opaque = ibpe_get_opaque(rootPage);
+        opaque->flags = IBPE_PAGE_PENDING_ROOT;
+        opaque->data_len = sizeof(ibpe_pending_root_data);
+        opaque->next_blkno = InvalidBlockNumber;
+        opaque->ibpe_page_id = IBPE_PAGE_ID;
+
+        ibpe_pending_root_data *root = (ibpe_pending_root_data *) PageGetContents(rootPage);
+        memset(root, 0, sizeof(ibpe_pending_root_data));
+        root->head = InvalidBlockNumber;
+        root->tail = InvalidBlockNumber;
+        ((PageHeader) rootPage)->pd_lower += sizeof(ibpe_pending_root_data);
+
+        GenericXLogFinish(state);
+        UnlockReleaseBuffer(rootBuffer);
+    }
 }
 
 static Buffer ibpe_new_buffer(Relation indexRelation, BlockNumber *new_blkno)
@@ -118,6 +149,7 @@ static Buffer ibpe_new_buffer(Relation indexRelation, BlockNumber *new_blkno)
             }
 
             if (ibpe_is_page_deleted(page)) {
+                ibpe_log_reuse_page(indexRelation, page);
                 if (new_blkno) {
                     *new_blkno = blkno;
                 }
@@ -141,56 +173,62 @@ static Buffer ibpe_new_buffer(Relation indexRelation, BlockNumber *new_blkno)
     return buffer;
 }
 
-static BlockNumber ibpe_flush_page(Relation indexRelation, Page data)
+/*
+ * Write a staged page to a new block and link it after prev_blkno (if valid),
+ * in one WAL record. Returns the new block number.
+ */
+static BlockNumber ibpe_flush_page(Relation indexRelation, Page data, BlockNumber prev_blkno)
 {
     BlockNumber blkno;
     Buffer buffer = ibpe_new_buffer(indexRelation, &blkno);
 
-    GenericXLogState *state = GenericXLogStart(indexRelation);
-    Page page = GenericXLogRegisterBuffer(state, buffer, GENERIC_XLOG_FULL_IMAGE);
+    Buffer prev_buf = InvalidBuffer;
+    if (prev_blkno != InvalidBlockNumber) {
+        prev_buf = ReadBuffer(indexRelation, prev_blkno);
+        LockBuffer(prev_buf, BUFFER_LOCK_EXCLUSIVE);
+    }
 
-    memcpy(page, data, BLCKSZ);
+    ibpe_log_write_page(indexRelation, buffer, data, prev_buf);
 
-    GenericXLogFinish(state);
+    if (prev_buf != InvalidBuffer) {
+        UnlockReleaseBuffer(prev_buf);
+    }
     UnlockReleaseBuffer(buffer);
 
     return blkno;
 }
 
-static bool ibpe_add_record_to_page(Page page, char *record, int rec_size, uint16 *out_offset)
+/*
+ * Write out a finished page of one of the writer's chains and return its
+ * block number. last marks the final page of the chain.
+ */
+static BlockNumber ibpe_writer_flush_page(ibpe_index_writer *writer,
+                                          Page page,
+                                          BlockNumber prev_blkno,
+                                          BlockNumber *page_blkno,
+                                          bool last)
 {
-    /* We shouldn't be pointed to an invalid page */
-    Assert(!PageIsNew(page) && !ibpe_is_page_deleted(page));
-
-    /* Does new record fit on the page? */
-    if (ibpe_page_get_free_space(page) < rec_size) {
-        return false;
-    }
-
-    /* Copy new tuple to the end of page */
-    ibpe_opaque_data *opaque = ibpe_get_opaque(page);
-    char *mem = PageGetContents(page) + opaque->data_len;
-    memcpy(mem, record, rec_size);
-
-    /* Store offset to the new data */
-    if (out_offset) {
-        *out_offset = opaque->data_len;
+    if (!writer->bulk) {
+        return ibpe_flush_page(writer->indexRelation, page, prev_blkno);
     }
 
-    /* Adjust maxoff and pd_lower */
-    opaque->data_len += rec_size;
-    ((PageHeader) page)->pd_lower = (mem + rec_size) - page;
+    // the successor's block is known before it is filled, so link it right away
+    BlockNumber blkno = *page_blkno;
+    *page_blkno = last ? InvalidBlockNumber : writer->bulk_next_blkno++;
+    ibpe_get_opaque(page)->next_blkno = *page_blkno;
 
-    /* Assert we didn't overrun available space */
-    Assert(((PageHeader) page)->pd_lower <= ((PageHeader) page)->pd_upper);
+    BulkWriteBuffer buf = smgr_bulk_get_buf(writer->bulk);
+    memcpy(buf->data, page, BLCKSZ);
+    smgr_bulk_write(writer->bulk, blkno, buf, true);
 
-    return true;
+    return blkno;
 }
 
-static bool ibpe_push_record(Relation indexRelation,
+static bool ibpe_push_record(ibpe_index_writer *writer,
                              Page page,
                              uint16 page_flags,
                              BlockNumber *prev_blkno, // 0 if no previous block exists
+                             BlockNumber *page_blkno, // bulk mode: where page goes
                              char *record,            // force flush if NULL
                              int rec_size,
                              uint16 *out_offset)
@@ -203,22 +241,12 @@ static bool ibpe_push_record(Relation indexRelation,
     }
 
     if (!success) {
-        /* Cached page is full, flush it out and make a new one */
-        BlockNumber blkno = ibpe_flush_page(indexRelation, page);
-
-        // link previous block (if exists) to the flushed one
-        if (*prev_blkno != InvalidBlockNumber) {
-            int prev_buf = ReadBuffer(indexRelation, *prev_blkno);
-            LockBuffer(prev_buf, BUFFER_LOCK_EXCLUSIVE);
-
-            GenericXLogState *state = GenericXLogStart(indexRelation);
-            Page page = GenericXLogRegisterBuffer(state, prev_buf, GENERIC_XLOG_FULL_IMAGE);
-
-            ibpe_get_opaque(page)->next_blkno = blkno;
-
-            GenericXLogFinish(state);
-            UnlockReleaseBuffer(prev_buf);
-        }
+        /* Cached page is full, flush it out, link the previous block (if exists) to it */
+        BlockNumber blkno = ibpe_writer_flush_page(writer,
+                                                   page,
+                                                   *prev_blkno,
+                                                   page_blkno,
+                                                   record == NULL);
 
         // update previous block number
         *prev_blkno = blkno;
@@ -240,36 +268,16 @@ static bool ibpe_push_record(Relation indexRelation,
     return false;
 }
 
-typedef struct
-{
-    int token;
-    uint16 offset;
-} ibpe_token_and_offset;
-
 // build state management
 typedef struct
 {
-    Relation indexRelation;
     int64 indtuples; // total number of tuples indexed
-    int num_indexed_tokens;
-    int num_indexed_records;
     tokenizer tok;
 
     // interface to the C++ backend
     index_builder builder;
 
-    // List of SID records that need to be linked
-    // when the SID page is flushed the next time
-    int n_records_to_link;
-    ibpe_token_and_offset *records_to_link;
-
-    // Currently building pointer page
-    BlockNumber ptr_page_prevno;
-    PGAlignedBlock ptr_page;
-
-    // Currently building sentence id page
-    BlockNumber sid_page_prevno;
-    PGAlignedBlock sid_page;
+    ibpe_index_writer writer;
 } ibpe_build_state;
 
 #define IBPE_MAX_RECORDS_TO_LINK 4096
@@ -321,7 +329,7 @@ static void ibpe_build_callback(Relation indexRelation,
     build_state->indtuples++;
 }
 
-static void ibpe_flush_records_to_link(ibpe_build_state *state)
+static void ibpe_flush_records_to_link(ibpe_index_writer *state)
 {
     if (state->n_records_to_link == 0) {
         return; // nothing to flush
@@ -331,8 +339,15 @@ static void ibpe_flush_records_to_link(ibpe_build_state *state)
             .token = state->records_to_link[i].token,
             .blkno = state->sid_page_prevno,
             .offset = state->records_to_link[i].offset,
+            .n_entries = state->records_to_link[i].n_entries,
         };
 
+        if (state->ptr_map) {
+            // written out with the rest of the map by ibpe_index_writer_finish
+            state->ptr_map[ptr_record.token] = ptr_record;
+            continue;
+        }
+
         if (state->num_indexed_records < 5) {
             elog(NOTICE,
                  "Established link: token %d -> (blkno=%d, offset=%d)",
@@ -341,10 +356,11 @@ static void ibpe_flush_records_to_link(ibpe_build_state *state)
                  ptr_record.offset);
         }
 
-        ibpe_push_record(state->indexRelation,
+        ibpe_push_record(state,
                          state->ptr_page.data,
                          IBPE_PAGE_PTR,
                          &state->ptr_page_prevno,
+                         &state->ptr_page_blkno,
                          (char *) &ptr_record,
                          sizeof(ibpe_ptr_record),
                          NULL);
@@ -356,40 +372,112 @@ static void ibpe_flush_records_to_link(ibpe_build_state *state)
     state->n_records_to_link = 0;
 }
 
-static void ibpe_index_builder_iterate(void *user_data,
-                                       int token,
-                                       index_entry const *p_sentids,
-                                       int n_sentids)
+static void ibpe_index_writer_init(ibpe_index_writer *writer, Relation indexRelation)
 {
-    ibpe_build_state *state = user_data;
+    writer->indexRelation = indexRelation;
+    writer->num_indexed_tokens = 0;
+    writer->num_indexed_records = 0;
+    writer->sid_tail_blkno = InvalidBlockNumber;
+    writer->sid_bytes = 0;
+    writer->ptr_map = NULL;
+    writer->vocab_size = 0;
+
+    writer->n_records_to_link = 0;
+    writer->records_to_link = palloc0(sizeof(writer->records_to_link[0])
+                                      * IBPE_MAX_RECORDS_TO_LINK);
+
+    ibpe_init_page(writer->ptr_page.data, IBPE_PAGE_PTR);
+    ibpe_init_page(writer->sid_page.data, IBPE_PAGE_SID);
+    writer->ptr_page_prevno = InvalidBlockNumber;
+    writer->sid_page_prevno = InvalidBlockNumber;
+}
+
+void ibpe_index_writer_begin(ibpe_index_writer *writer, Relation indexRelation, bool bulk)
+{
+    ibpe_index_writer_init(writer, indexRelation);
+
+    if (bulk) {
+        // nothing else extends the relation while it is being built
+        writer->bulk = smgr_bulk_start_rel(indexRelation, MAIN_FORKNUM);
+        writer->bulk_next_blkno = RelationGetNumberOfBlocks(indexRelation);
+        writer->ptr_page_blkno = writer->bulk_next_blkno++;
+        writer->sid_page_blkno = writer->bulk_next_blkno++;
+        writer->ptr_head_blkno = writer->ptr_page_blkno;
+        writer->sid_head_blkno = writer->sid_page_blkno;
+        return;
+    }
+
+    writer->bulk = NULL;
+    writer->ptr_page_blkno = InvalidBlockNumber;
+    writer->sid_page_blkno = InvalidBlockNumber;
 
-    // elog(NOTICE,
-    //      "token %d -> Array[%d]{(sid=%d,pos=%d), ...}",
-    //      token,
-    //      n_sentids,
-    //      p_sentids[0].sent_id,
-    //      p_sentids[0].pos);
+    // Insert blank starter pages
+    writer->ptr_page_prevno = ibpe_flush_page(indexRelation,
+                                              writer->ptr_page.data,
+                                              InvalidBlockNumber);
+    writer->ptr_head_blkno = writer->ptr_page_prevno;
+
+    writer->sid_page_prevno = ibpe_flush_page(indexRelation,
+                                              writer->sid_page.data,
+                                              InvalidBlockNumber);
+    writer->sid_head_blkno = writer->sid_page_prevno;
+}
+
+void ibpe_index_writer_begin_append(ibpe_index_writer *writer,
+                                    Relation indexRelation,
+                                    BlockNumber sid_tail_blkno,
+                                    ibpe_ptr_record *map,
+                                    int vocab_size)
+{
+    ibpe_index_writer_init(writer, indexRelation);
+
+    writer->bulk = NULL;
+    writer->ptr_page_blkno = InvalidBlockNumber;
+    writer->sid_page_blkno = InvalidBlockNumber;
+    writer->ptr_map = map;
+    writer->vocab_size = vocab_size;
+
+    // lists already on the chain stay where they are; new pages are linked after its tail
+    writer->sid_head_blkno = InvalidBlockNumber;
+    writer->sid_page_prevno = sid_tail_blkno;
+
+    writer->ptr_page_prevno = ibpe_flush_page(indexRelation,
+                                              writer->ptr_page.data,
+                                              InvalidBlockNumber);
+    writer->ptr_head_blkno = writer->ptr_page_prevno;
+}
 
+void ibpe_index_writer_add(ibpe_index_writer *state,
+                           int token,
+                           index_entry const *p_sentids,
+                           int n_sentids)
+{
     uint16 offset;
 
     // push array size first
-    if (ibpe_push_record(state->indexRelation,
+    if (ibpe_push_record(state,
                          state->sid_page.data,
                          IBPE_PAGE_SID,
                          &state->sid_page_prevno,
+                         &state->sid_page_blkno,
                          (char *) &n_sentids,
                          sizeof(int),
                          &offset)) {
         ibpe_flush_records_to_link(state);
     }
-    state->records_to_link[state->n_records_to_link++] = (ibpe_token_and_offset){token, offset};
+    state->records_to_link[state->n_records_to_link++] = (ibpe_token_and_offset){
+        token,
+        offset,
+        n_sentids,
+    };
 
     // push sid elements
     for (int i = 0; i < n_sentids; ++i) {
-        if (ibpe_push_record(state->indexRelation,
+        if (ibpe_push_record(state,
                              state->sid_page.data,
                              IBPE_PAGE_SID,
                              &state->sid_page_prevno,
+                             &state->sid_page_blkno,
                              (char *) &p_sentids[i],
                              sizeof(index_entry),
                              NULL)) {
@@ -398,6 +486,70 @@ static void ibpe_index_builder_iterate(void *user_data,
     }
 
     state->num_indexed_tokens += 1;
+    state->sid_bytes += sizeof(int) + (uint64) n_sentids * sizeof(index_entry);
+}
+
+void ibpe_index_writer_finish(ibpe_index_writer *writer)
+{
+    // force flush remaining pages; an append that added nothing leaves the chain as it was
+    if (!writer->ptr_map || ibpe_get_opaque(writer->sid_page.data)->data_len > 0) {
+        ibpe_push_record(writer,
+                         writer->sid_page.data,
+                         IBPE_PAGE_SID,
+                         &writer->sid_page_prevno,
+                         &writer->sid_page_blkno,
+                         NULL, // force flush
+                         0,
+                         NULL);
+    }
+    if (writer->n_records_to_link > 0) {
+        ibpe_flush_records_to_link(writer);
+    }
+    writer->sid_tail_blkno = writer->sid_page_prevno;
+
+    if (writer->ptr_map) {
+        writer->num_indexed_tokens = 0;
+        for (int token = 0; token < writer->vocab_size; token++) {
+            ibpe_ptr_record *ptr_record = &writer->ptr_map[token];
+            if (ptr_record->blkno == InvalidBlockNumber) {
+                continue;
+            }
+            ibpe_push_record(writer,
+                             writer->ptr_page.data,
+                             IBPE_PAGE_PTR,
+                             &writer->ptr_page_prevno,
+                             &writer->ptr_page_blkno,
+                             (char *) ptr_record,
+                             sizeof(ibpe_ptr_record),
+                             NULL);
+            writer->num_indexed_tokens += 1;
+        }
+    }
+    ibpe_push_record(writer,
+                     writer->ptr_page.data,
+                     IBPE_PAGE_PTR,
+                     &writer->ptr_page_prevno,
+                     &writer->ptr_page_blkno,
+                     NULL, // force flush
+                     0,
+                     NULL);
+
+    if (writer->bulk) {
+        smgr_bulk_finish(writer->bulk);
+        writer->bulk = NULL;
+    }
+
+    pfree(writer->records_to_link);
+    writer->records_to_link = NULL;
+}
+
+static void ibpe_index_builder_iterate(void *user_data,
+                                       int token,
+                                       index_entry const *p_sentids,
+                                       int n_sentids)
+{
+    ibpe_build_state *state = user_data;
+    ibpe_index_writer_add(&state->writer, token, p_sentids, n_sentids);
 }
 
 /* build new index */
@@ -412,12 +564,15 @@ IndexBuildResult *ibpe_build(Relation heapRelation, Relation indexRelation, Inde
 
     ibpe_relcache *cache = ibpe_restore_or_create_cache(indexRelation);
 
+    // let backends that open the index later skip parsing tokenizer.json
+    char errmsg[256] = {};
+    if (!tokenizer_save_snapshot(cache->tok, errmsg, lengthof(errmsg))) {
+        elog(NOTICE, "Cannot write tokenizer snapshot: %s", errmsg);
+    }
+
     // initialize build state
     ibpe_build_state build_state;
-    build_state.indexRelation = indexRelation;
     build_state.indtuples = 0;
-    build_state.num_indexed_tokens = 0;
-    build_state.num_indexed_records = 0;
     build_state.tok = cache->tok;
 
     build_state.builder = create_index_builder();
@@ -425,18 +580,7 @@ IndexBuildResult *ibpe_build(Relation heapRelation, Relation indexRelation, Inde
         elog(ERROR, "Cannot allocate index builder");
     }
 
-    build_state.n_records_to_link = 0;
-    build_state.records_to_link = palloc0(sizeof(build_state.records_to_link[0])
-                                          * IBPE_MAX_RECORDS_TO_LINK);
-
-    // Insert blank starter pages
-    ibpe_init_page(build_state.ptr_page.data, IBPE_PAGE_PTR);
-    build_state.ptr_page_prevno = ibpe_flush_page(indexRelation, build_state.ptr_page.data);
-    Assert(build_state.ptr_page_prevno == 1);
-
-    ibpe_init_page(build_state.sid_page.data, IBPE_PAGE_SID);
-    build_state.sid_page_prevno = ibpe_flush_page(indexRelation, build_state.sid_page.data);
-    Assert(build_state.sid_page_prevno == 2);
+    ibpe_index_writer_begin(&build_state.writer, indexRelation, true);
 
     // scan the heap (table to be indexed)
     double reltuples = table_index_build_scan(heapRelation,
@@ -452,24 +596,7 @@ IndexBuildResult *ibpe_build(Relation heapRelation, Relation indexRelation, Inde
     // Populate index using result from builder
     index_builder_iterate(build_state.builder, ibpe_index_builder_iterate, &build_state);
 
-    // force flush remaining pages
-    ibpe_push_record(indexRelation,
-                     build_state.sid_page.data,
-                     IBPE_PAGE_SID,
-                     &build_state.sid_page_prevno,
-                     NULL, // force flush
-                     0,
-                     NULL);
-    if (build_state.n_records_to_link > 0) {
-        ibpe_flush_records_to_link(&build_state);
-    }
-    ibpe_push_record(indexRelation,
-                     build_state.ptr_page.data,
-                     IBPE_PAGE_PTR,
-                     &build_state.ptr_page_prevno,
-                     NULL, // force flush
-                     0,
-                     NULL);
+    ibpe_index_writer_finish(&build_state.writer);
 
     // free memory
     destroy_index_builder(build_state.builder);
@@ -483,7 +610,12 @@ IndexBuildResult *ibpe_build(Relation heapRelation, Relation indexRelation, Inde
 
     ibpe_metapage_data *metadata = (ibpe_metapage_data *) PageGetContents(metaPage);
     metadata->index_built = true;
-    metadata->num_indexed_tokens = build_state.num_indexed_tokens;
+    metadata->num_indexed_tokens = build_state.writer.num_indexed_tokens;
+    metadata->ptr_blkno = build_state.writer.ptr_head_blkno;
+    metadata->sid_blkno = build_state.writer.sid_head_blkno;
+    metadata->sid_tail_blkno = build_state.writer.sid_tail_blkno;
+    metadata->sid_live_bytes = build_state.writer.sid_bytes;
+    metadata->sid_dead_bytes = 0;
 
     // add built index data to relcache
     ibpe_relcache_reload_index(cache, indexRelation, metadata);
@@ -513,24 +645,251 @@ void ibpe_buildempty(Relation indexRelation)
 }
 
 /*
- * Link a freshly flushed page into the pending chain.
- * Updates cache->pending_head_blkno / pending_tail_blkno.
+ * Pending records buffered by ibpe_insert for the rest of the statement.
+ * Lives in ii_AmCache; every live buffer is also on ibpe_insert_buffers so
+ * that a scan in the same backend can flush it first.
+ *
+ * The records only reach disk through ibpe_insertcleanup (or a flush on
+ * work_mem or before a scan). The core callers of index_insert that pass an
+ * IndexInfo, ExecCloseIndices for executor inserts and COPY and
+ * validate_index for CREATE INDEX CONCURRENTLY, all call
+ * index_insert_cleanup before freeing ii_Context.
  */
-static void ibpe_pending_link(Relation indexRelation, ibpe_relcache *cache, BlockNumber new_blkno)
+typedef struct
 {
-    if (cache->pending_tail_blkno != InvalidBlockNumber) {
-        Buffer prev_buf = ReadBuffer(indexRelation, cache->pending_tail_blkno);
-        LockBuffer(prev_buf, BUFFER_LOCK_EXCLUSIVE);
+    dlist_node node;
+    Oid index_relid;
+    StringInfoData records; // encoded records, back to back
+    int64 n_entries;        // tokens in those records
+} ibpe_insert_buffer;
 
-        GenericXLogState *state = GenericXLogStart(indexRelation);
-        Page prev_page = GenericXLogRegisterBuffer(state, prev_buf, GENERIC_XLOG_FULL_IMAGE);
-        ibpe_get_opaque(prev_page)->next_blkno = new_blkno;
-        GenericXLogFinish(state);
-        UnlockReleaseBuffer(prev_buf);
+static dlist_head ibpe_insert_buffers = DLIST_STATIC_INIT(ibpe_insert_buffers);
+
+static void ibpe_insert_buffer_forget(void *arg)
+{
+    ibpe_insert_buffer *buffer = arg;
+    dlist_delete(&buffer->node);
+
+    // on abort the rows go away with the transaction; otherwise a caller skipped the cleanup
+    if (buffer->records.len > 0 && IsTransactionState()) {
+        elog(WARNING,
+             "ibpe: discarding %lld buffered index entries of index %u without writing them",
+             (long long) buffer->n_entries,
+             buffer->index_relid);
+    }
+}
+
+static ibpe_insert_buffer *ibpe_insert_buffer_create(Relation indexRelation,
+                                                     MemoryContext context)
+{
+    ibpe_insert_buffer *buffer = MemoryContextAllocZero(context, sizeof(ibpe_insert_buffer));
+    buffer->index_relid = RelationGetRelid(indexRelation);
+
+    MemoryContext old_cxt = MemoryContextSwitchTo(context);
+    initStringInfo(&buffer->records);
+    MemoryContextSwitchTo(old_cxt);
+
+    // drop out of the registry when the statement's context goes away, also on error
+    MemoryContextCallback *cb = MemoryContextAlloc(context, sizeof(MemoryContextCallback));
+    cb->func = ibpe_insert_buffer_forget;
+    cb->arg = buffer;
+    MemoryContextRegisterResetCallback(context, cb);
+
+    dlist_push_tail(&ibpe_insert_buffers, &buffer->node);
+    return buffer;
+}
+
+/* encode a sentence as pending records, each small enough for an empty page */
+static void ibpe_insert_buffer_add(ibpe_insert_buffer *buffer,
+                                   sentid_t sent_id,
+                                   int const *tokens,
+                                   int n_tokens)
+{
+    int capacity = ibpe_page_capacity();
+    for (int pos = 0; pos < n_tokens;) {
+        enlargeStringInfo(&buffer->records, capacity);
+        int n_encoded;
+        int rec_len = ibpe_encode_pending_record(buffer->records.data + buffer->records.len,
+                                                 capacity,
+                                                 sent_id,
+                                                 tokens,
+                                                 n_tokens,
+                                                 pos,
+                                                 &n_encoded);
+        if (rec_len == 0)
+            elog(ERROR, "ibpe_insert: could not encode pending record");
+
+        buffer->records.len += rec_len;
+        buffer->n_entries += n_encoded;
+        pos += n_encoded;
+    }
+}
+
+/*
+ * Append one encoded record to the pending chain of a partition. The caller
+ * holds an exclusive lock on the partition's root buffer.
+ *
+ * The record goes onto the tail page if it fits there; otherwise a new page
+ * is linked in. Tail, new page and root change in one WAL record, so the
+ * chain and its root never disagree after a crash.
+ */
+static void ibpe_pending_append(Relation indexRelation,
+                                Buffer root_buf,
+                                char *record,
+                                int rec_len,
+                                int n_entries)
+{
+    ibpe_pending_root_data *root = (ibpe_pending_root_data *) PageGetContents(
+        BufferGetPage(root_buf));
+
+    Buffer tail_buf = InvalidBuffer;
+    bool fits_tail = false;
+    if (root->tail != InvalidBlockNumber) {
+        tail_buf = ReadBuffer(indexRelation, root->tail);
+        LockBuffer(tail_buf, BUFFER_LOCK_EXCLUSIVE);
+        fits_tail = !root->tail_sealed
+                    && ibpe_page_get_free_space(BufferGetPage(tail_buf)) >= rec_len;
+    }
+
+    Buffer new_buf = InvalidBuffer;
+    if (fits_tail) {
+        ibpe_log_pending_append(indexRelation,
+                                root_buf,
+                                tail_buf,
+                                false,
+                                InvalidBuffer,
+                                record,
+                                rec_len,
+                                n_entries);
     } else {
-        cache->pending_head_blkno = new_blkno;
+        new_buf = ibpe_new_buffer(indexRelation, NULL);
+        ibpe_log_pending_append(indexRelation,
+                                root_buf,
+                                new_buf,
+                                true,
+                                tail_buf,
+                                record,
+                                rec_len,
+                                n_entries);
+    }
+
+    if (tail_buf != InvalidBuffer) {
+        UnlockReleaseBuffer(tail_buf);
+    }
+    if (new_buf != InvalidBuffer) {
+        UnlockReleaseBuffer(new_buf);
+    }
+}
+
+/*
+ * Move the buffered records to this backend's pending partition.
+ *
+ * Up to a page worth of records is appended record by record, filling the
+ * tail page. Larger batches are packed into new pages first and then linked
+ * in with a single root update, so the root lock is only held for that last
+ * step. Only inserters hashed to the same partition ever wait for it; the
+ * metapage is not touched at all.
+ */
+static void ibpe_insert_buffer_flush(Relation indexRelation, ibpe_insert_buffer *buffer)
+{
+    char *p = buffer->records.data;
+    char *end = p + buffer->records.len;
+
+    BlockNumber first_blkno = InvalidBlockNumber;
+    BlockNumber last_blkno = InvalidBlockNumber;
+    uint32 n_pages = 0;
+
+    if (buffer->records.len > ibpe_page_capacity()) {
+        PGAlignedBlock staging;
+        ibpe_init_page(staging.data, IBPE_PAGE_PENDING);
+
+        while (p < end) {
+            ibpe_pending_record rec;
+            char *next = (char *) ibpe_parse_pending_record(p, end, &rec);
+            if (!ibpe_add_record_to_page(staging.data, p, next - p, NULL)) {
+                last_blkno = ibpe_flush_page(indexRelation, staging.data, last_blkno);
+                if (first_blkno == InvalidBlockNumber)
+                    first_blkno = last_blkno;
+                n_pages++;
+
+                ibpe_init_page(staging.data, IBPE_PAGE_PENDING);
+                ibpe_add_record_to_page(staging.data, p, next - p, NULL);
+            }
+            p = next;
+        }
+
+        last_blkno = ibpe_flush_page(indexRelation, staging.data, last_blkno);
+        if (first_blkno == InvalidBlockNumber)
+            first_blkno = last_blkno;
+        n_pages++;
+    }
+
+    Buffer root_buf = ReadBuffer(indexRelation,
+                                 IBPE_PENDING_ROOT_BLKNO(ibpe_my_pending_partition()));
+    LockBuffer(root_buf, BUFFER_LOCK_EXCLUSIVE);
+
+    if (first_blkno != InvalidBlockNumber) {
+        ibpe_pending_root_data *root = (ibpe_pending_root_data *) PageGetContents(
+            BufferGetPage(root_buf));
+
+        Buffer tail_buf = InvalidBuffer;
+        if (root->tail != InvalidBlockNumber) {
+            tail_buf = ReadBuffer(indexRelation, root->tail);
+            LockBuffer(tail_buf, BUFFER_LOCK_EXCLUSIVE);
+        }
+
+        ibpe_log_pending_link(indexRelation,
+                              root_buf,
+                              tail_buf,
+                              first_blkno,
+                              last_blkno,
+                              n_pages,
+                              buffer->n_entries);
+
+        if (tail_buf != InvalidBuffer) {
+            UnlockReleaseBuffer(tail_buf);
+        }
+    } else {
+        while (p < end) {
+            ibpe_pending_record rec;
+            char *next = (char *) ibpe_parse_pending_record(p, end, &rec);
+            ibpe_pending_append(indexRelation, root_buf, p, next - p, rec.n_tokens);
+            p = next;
+        }
+    }
+
+    UnlockReleaseBuffer(root_buf);
+
+    resetStringInfo(&buffer->records);
+    buffer->n_entries = 0;
+}
+
+// flush, then merge into the main index once the pending list outgrows ibpe.pending_list_limit
+static void ibpe_insert_buffer_flush_and_merge(Relation indexRelation, ibpe_insert_buffer *buffer)
+{
+    if (buffer->records.len == 0) {
+        return;
+    }
+
+    ibpe_insert_buffer_flush(indexRelation, buffer);
+
+    // summed over all partitions, so a limit hit shows up no matter who inserted
+    int64 pending_bytes = (int64) ibpe_count_pending_pages(indexRelation) * BLCKSZ;
+    if (ibpe_pending_list_limit > 0 && pending_bytes > (int64) ibpe_pending_list_limit * 1024) {
+        ibpe_merge_pending(indexRelation, false, false);
+    }
+}
+
+void ibpe_flush_insert_buffers(Relation indexRelation)
+{
+    dlist_iter iter;
+    dlist_foreach(iter, &ibpe_insert_buffers)
+    {
+        ibpe_insert_buffer *buffer = dlist_container(ibpe_insert_buffer, node, iter.cur);
+        if (buffer->index_relid == RelationGetRelid(indexRelation)) {
+            ibpe_insert_buffer_flush_and_merge(indexRelation, buffer);
+        }
     }
-    cache->pending_tail_blkno = new_blkno;
 }
 
 /* insert this tuple */
@@ -577,84 +936,35 @@ bool ibpe_insert(Relation indexRelation,
     sentid_t sent_id = ibpe_tid_to_sentid(heap_tid);
 
     /*
-     * Resolve the tail of the pending chain if this is the first insert in
-     * the current session. pending_tail_blkno is set to InvalidBlockNumber by
-     * ibpe_relcache_fill, so it is unknown (not "no chain") whenever
-     * pending_head_blkno is valid.
+     * Buffer the sentence as compact pending records (see ibpe_pending.h) for
+     * the rest of the statement; ibpe_insertcleanup writes them out. A COPY
+     * or multi-row INSERT thus fills whole pages and locks its pending root
+     * once per batch instead of once per row.
      */
-    if (cache->pending_head_blkno != InvalidBlockNumber
-        && cache->pending_tail_blkno == InvalidBlockNumber) {
-        BlockNumber blkno = cache->pending_head_blkno;
-        for (;;) {
-            Buffer buf = ReadBuffer(indexRelation, blkno);
-            LockBuffer(buf, BUFFER_LOCK_SHARE);
-            Page page = BufferGetPage(buf);
-            BlockNumber next = ibpe_get_opaque(page)->next_blkno;
-            UnlockReleaseBuffer(buf);
-            if (next == InvalidBlockNumber) {
-                cache->pending_tail_blkno = blkno;
-                break;
-            }
-            blkno = next;
+    ibpe_insert_buffer *buffer = indexInfo ? indexInfo->ii_AmCache : NULL;
+    if (!buffer) {
+        MemoryContext context = indexInfo ? indexInfo->ii_Context : CurrentMemoryContext;
+        buffer = ibpe_insert_buffer_create(indexRelation, context);
+        if (indexInfo) {
+            indexInfo->ii_AmCache = buffer;
         }
     }
 
-    /*
-     * Write one ibpe_pending_entry per token.  We stage records into an
-     * in-memory page and flush it to a new block when full.  Each new block
-     * is appended to the pending chain via ibpe_pending_link().
-     *
-     * We always allocate fresh pages rather than modifying the existing tail
-     * in-place, which keeps the write path simple at the cost of leaving some
-     * unused space on the previous tail page.
-     */
-    PGAlignedBlock staging;
-    ibpe_init_page(staging.data, IBPE_PAGE_PENDING);
-    int n_written = 0;
-
-    for (int i = 0; i < n_tokens; i++) {
-        ibpe_pending_entry rec = {
-            .token = tokens[i],
-            .entry = {
-                .sent_id = sent_id,
-                .pos = (tokpos_t) i,
-#if CORPUS_SEARCH_NEXT_TOKEN_BITS > 0
-                .next_tok = (i + 1 < n_tokens)
-                    ? (tokens[i + 1] & ((1 << CORPUS_SEARCH_NEXT_TOKEN_BITS) - 1))
-                    : 0,
-#endif
-            },
-        };
-
-        if (!ibpe_add_record_to_page(staging.data, (char *) &rec, sizeof(rec), NULL)) {
-            BlockNumber new_blkno = ibpe_flush_page(indexRelation, staging.data);
-            ibpe_pending_link(indexRelation, cache, new_blkno);
+    ibpe_insert_buffer_add(buffer, sent_id, tokens, n_tokens);
+    pfree(tokens);
 
-            ibpe_init_page(staging.data, IBPE_PAGE_PENDING);
-            if (!ibpe_add_record_to_page(staging.data, (char *) &rec, sizeof(rec), NULL))
-                elog(ERROR, "ibpe_insert: could not add pending entry to empty page");
-        }
-        n_written++;
+    if (!indexInfo || buffer->records.len >= (Size) work_mem * 1024) {
+        ibpe_insert_buffer_flush_and_merge(indexRelation, buffer);
     }
 
-    // Flush the final staging page
-    BlockNumber final_blkno = ibpe_flush_page(indexRelation, staging.data);
-    ibpe_pending_link(indexRelation, cache, final_blkno);
-
-    // Update metapage
-    Buffer meta_buf = ReadBuffer(indexRelation, 0 /* metapage */);
-    LockBuffer(meta_buf, BUFFER_LOCK_EXCLUSIVE);
-
-    GenericXLogState *state = GenericXLogStart(indexRelation);
-    Page meta_page = GenericXLogRegisterBuffer(state, meta_buf, GENERIC_XLOG_FULL_IMAGE);
-
-    ibpe_metapage_data *meta = (ibpe_metapage_data *) PageGetContents(meta_page);
-    meta->pending_blkno = cache->pending_head_blkno;
-    meta->n_pending += n_written;
-
-    GenericXLogFinish(state);
-    UnlockReleaseBuffer(meta_buf);
-
-    pfree(tokens);
     return false;
 }
+
+/* flush rows buffered by ibpe_insert at the end of the statement */
+void ibpe_insertcleanup(Relation indexRelation, IndexInfo *indexInfo)
+{
+    ibpe_insert_buffer *buffer = indexInfo->ii_AmCache;
+    if (buffer) {
+        ibpe_insert_buffer_flush_and_merge(indexRelation, buffer);
+    }
+}
@@ -5,6 +5,80 @@
 // The include order is important
 #include <access/amapi.h>
 #include <fmgr.h>
+#include <storage/block.h>
+#include <storage/bulk_write.h>
+
+#include "ibpe_backend.h"
+#include "ibpe_relcache.h"
+
+typedef struct
+{
+    int token;
+    uint16 offset;
+    int n_entries;
+} ibpe_token_and_offset;
+
+/*
+ * Writes a fresh pair of PTR/SID page chains. Posting lists must be added in
+ * ascending token order. Used by ibpe_build (in bulk mode) and by the pending
+ * list merge (through shared buffers, next to concurrent inserters).
+ *
+ * Begun with ibpe_index_writer_begin_append, the writer instead appends the
+ * lists to an existing SID chain and repoints their tokens in a PTR map; the
+ * whole map is written out as a new PTR chain when the writer finishes.
+ */
+typedef struct
+{
+    Relation indexRelation;
+    int num_indexed_tokens;
+    int num_indexed_records;
+
+    // heads of the new chains, set by ibpe_index_writer_begin
+    BlockNumber ptr_head_blkno;
+    BlockNumber sid_head_blkno;
+
+    // set by ibpe_index_writer_finish
+    BlockNumber sid_tail_blkno;
+    uint64 sid_bytes; // bytes of the posting lists added
+
+    // append mode: map[0, vocab_size) becomes the new PTR chain
+    ibpe_ptr_record *ptr_map;
+    int vocab_size;
+
+    // Set when writing a fresh relation through the smgr bulk writer. Blocks
+    // are then handed out sequentially, so every page is written once, with
+    // its successor already linked; ptr/sid_page_blkno are the blocks the
+    // pages being filled will go to.
+    BulkWriteState *bulk;
+    BlockNumber bulk_next_blkno;
+    BlockNumber ptr_page_blkno;
+    BlockNumber sid_page_blkno;
+
+    // List of SID records that need to be linked
+    // when the SID page is flushed the next time
+    int n_records_to_link;
+    ibpe_token_and_offset *records_to_link;
+
+    // Currently building pointer page
+    BlockNumber ptr_page_prevno;
+    PGAlignedBlock ptr_page;
+
+    // Currently building sentence id page
+    BlockNumber sid_page_prevno;
+    PGAlignedBlock sid_page;
+} ibpe_index_writer;
+
+void ibpe_index_writer_begin(ibpe_index_writer *writer, Relation indexRelation, bool bulk);
+void ibpe_index_writer_begin_append(ibpe_index_writer *writer,
+                                    Relation indexRelation,
+                                    BlockNumber sid_tail_blkno,
+                                    ibpe_ptr_record *map,
+                                    int vocab_size);
+void ibpe_index_writer_add(ibpe_index_writer *writer,
+                           int token,
+                           index_entry const *p_entries,
+                           int n_entries);
+void ibpe_index_writer_finish(ibpe_index_writer *writer);
 
 /* build new index */
 IndexBuildResult *ibpe_build(Relation heapRelation,
@@ -24,4 +98,13 @@ bool ibpe_insert(Relation indexRelation,
                  bool indexUnchanged,
                  struct IndexInfo *indexInfo);
 
+/*
+ * flush rows buffered by ibpe_insert at the end of the statement; callers of
+ * index_insert that pass an IndexInfo must call index_insert_cleanup
+ */
+void ibpe_insertcleanup(Relation indexRelation, struct IndexInfo *indexInfo);
+
+/* write out rows of the running statement still buffered for this index */
+void ibpe_flush_insert_buffers(Relation indexRelation);
+
 #endif // IBPE_BUILD_H
@@ -0,0 +1,796 @@
+#include "ibpe_pending.h"
+#include "ibpe_build.h"
+#include "ibpe_relcache.h"
+#include "ibpe_xlog.h"
+
+#include <stdlib.h>
+
+#include <access/genam.h>
+#include <access/generic_xlog.h>
+#include <access/xlog.h>
+#include <catalog/pg_class.h>
+#include <miscadmin.h>
+#include <storage/indexfsm.h>
+#include <storage/lmgr.h>
+#include <utils/acl.h>
+#include <utils/guc.h>
+#include <utils/inval.h>
+#include <utils/memutils.h>
+#include <utils/rel.h>
+
+int ibpe_pending_list_limit = 4096;
+
+void ibpe_define_pending_gucs(void)
+{
+    DefineCustomIntVariable("ibpe.pending_list_limit",
+                            "Maximum size of the pending list of an ibpe index.",
+                            "Once the pending list grows past this size, the inserting backend "
+                            "merges it into the main posting lists. 0 disables the merge on insert.",
+                            &ibpe_pending_list_limit,
+                            4096,
+                            0,
+                            MAX_KILOBYTES,
+                            PGC_USERSET,
+                            GUC_UNIT_KB,
+                            NULL,
+                            NULL,
+                            NULL);
+
+    MarkGUCPrefixReserved("ibpe");
+}
+
+static int ibpe_varint_len(uint32 value)
+{
+    int len = 1;
+    while (value >= 0x80) {
+        value >>= 7;
+        len++;
+    }
+    return len;
+}
+
+static char *ibpe_varint_write(char *p, uint32 value)
+{
+    while (value >= 0x80) {
+        *p++ = (char) ((value & 0x7F) | 0x80);
+        value >>= 7;
+    }
+    *p++ = (char) value;
+    return p;
+}
+
+static char const *ibpe_varint_read(char const *p, char const *end, uint32 *value)
+{
+    uint32 result = 0;
+    for (int shift = 0; shift < 35; shift += 7) {
+        if (p >= end) {
+            elog(ERROR, "ibpe: corrupt pending record: truncated varint");
+        }
+        uint8 byte = (uint8) *p++;
+        result |= (uint32) (byte & 0x7F) << shift;
+        if ((byte & 0x80) == 0) {
+            *value = result;
+            return p;
+        }
+    }
+    elog(ERROR, "ibpe: corrupt pending record: varint too long");
+    return NULL; // not reached
+}
+
+int ibpe_encode_pending_record(char *out,
+                               int avail,
+                               sentid_t sent_id,
+                               int const *tokens,
+                               int n_tokens,
+                               int first_pos,
+                               int *n_encoded)
+{
+    int fixed = sizeof(sentid_t) + ibpe_varint_len(first_pos);
+
+    // take tokens while the record, lookahead included, still fits
+    int n = 0;
+    int token_bytes = 0;
+    while (first_pos + n < n_tokens) {
+        int next_bytes = token_bytes + ibpe_varint_len(tokens[first_pos + n]);
+        int end = first_pos + n + 1;
+        int lookahead_bytes = ibpe_varint_len(end < n_tokens ? tokens[end] + 1 : 0);
+        if (fixed + ibpe_varint_len(n + 1) + next_bytes + lookahead_bytes > avail) {
+            break;
+        }
+        token_bytes = next_bytes;
+        n++;
+    }
+
+    *n_encoded = n;
+    if (n == 0) {
+        return 0;
+    }
+
+    char *p = out;
+    memcpy(p, &sent_id, sizeof(sentid_t));
+    p += sizeof(sentid_t);
+    p = ibpe_varint_write(p, first_pos);
+    p = ibpe_varint_write(p, n);
+    for (int i = 0; i < n; i++) {
+        p = ibpe_varint_write(p, tokens[first_pos + i]);
+    }
+    int end = first_pos + n;
+    p = ibpe_varint_write(p, end < n_tokens ? tokens[end] + 1 : 0);
+
+    return p - out;
+}
+
+char const *ibpe_parse_pending_record(char const *p, char const *end, ibpe_pending_record *rec)
+{
+    if (p + sizeof(sentid_t) > end) {
+        elog(ERROR, "ibpe: corrupt pending record: truncated header");
+    }
+    memcpy(&rec->sent_id, p, sizeof(sentid_t));
+    p += sizeof(sentid_t);
+    p = ibpe_varint_read(p, end, &rec->first_pos);
+    p = ibpe_varint_read(p, end, &rec->n_tokens);
+
+    rec->tokens = p;
+    for (uint32 i = 0; i < rec->n_tokens; i++) {
+        uint32 token;
+        p = ibpe_varint_read(p, end, &token);
+    }
+    return ibpe_varint_read(p, end, &rec->lookahead);
+}
+
+/* decode a live record into n_tokens consecutive entries */
+static void ibpe_decode_pending_record(ibpe_pending_record const *rec, ibpe_pending_entry *out)
+{
+    char const *p = rec->tokens;
+    for (uint32 i = 0; i < rec->n_tokens; i++) {
+        uint32 token;
+        p = ibpe_varint_read(p, p + 5, &token);
+        out[i] = (ibpe_pending_entry){
+            .token = (int) token,
+            .entry = {
+                .sent_id = rec->sent_id,
+                .pos = (tokpos_t) (rec->first_pos + i),
+            },
+        };
+    }
+
+#if CORPUS_SEARCH_NEXT_TOKEN_BITS > 0
+    for (uint32 i = 0; i < rec->n_tokens; i++) {
+        int next = (i + 1 < rec->n_tokens) ? out[i + 1].token
+                   : (rec->lookahead > 0)  ? (int) rec->lookahead - 1
+                                           : 0;
+        out[i].entry.next_tok = next & ((1 << CORPUS_SEARCH_NEXT_TOKEN_BITS) - 1);
+    }
+#endif
+}
+
+int ibpe_my_pending_partition(void)
+{
+    return MyProcPid % IBPE_PENDING_PARTITIONS;
+}
+
+/* the part of partition p's chain that the merge of meta->generation left over */
+static ibpe_pending_chain ibpe_root_chain(Relation indexRelation,
+                                          ibpe_metapage_data const *meta,
+                                          ibpe_pending_root_data const *root,
+                                          int p)
+{
+    ibpe_pending_chain chain = {
+        .head = root->head,
+        .tail = root->tail,
+        .n_pending = root->n_pending,
+        .n_pages = root->n_pages,
+    };
+
+    ibpe_pending_cut const *cut = &meta->pending_cut[p];
+    if (root->generation == meta->generation || cut->tail == InvalidBlockNumber
+        || root->head == InvalidBlockNumber) {
+        return chain;
+    }
+
+    Buffer buf = ReadBuffer(indexRelation, cut->tail);
+    LockBuffer(buf, BUFFER_LOCK_SHARE);
+    chain.head = ibpe_get_opaque(BufferGetPage(buf))->next_blkno;
+    UnlockReleaseBuffer(buf);
+
+    if (chain.head == InvalidBlockNumber) {
+        chain.tail = InvalidBlockNumber;
+        chain.n_pending = 0;
+        chain.n_pages = 0;
+    } else {
+        chain.n_pending = Max(chain.n_pending - cut->n_entries, 0);
+        chain.n_pages -= Min(chain.n_pages, cut->n_pages);
+    }
+    return chain;
+}
+
+static void ibpe_read_metapage(Relation indexRelation, ibpe_metapage_data *meta)
+{
+    Buffer meta_buf = ReadBuffer(indexRelation, 0 /* metapage */);
+    LockBuffer(meta_buf, BUFFER_LOCK_SHARE);
+    *meta = *(ibpe_metapage_data *) PageGetContents(BufferGetPage(meta_buf));
+    UnlockReleaseBuffer(meta_buf);
+}
+
+static void ibpe_read_pending_root(Relation indexRelation, int p, ibpe_pending_root_data *root)
+{
+    Buffer root_buf = ReadBuffer(indexRelation, IBPE_PENDING_ROOT_BLKNO(p));
+    LockBuffer(root_buf, BUFFER_LOCK_SHARE);
+    *root = *(ibpe_pending_root_data *) PageGetContents(BufferGetPage(root_buf));
+    UnlockReleaseBuffer(root_buf);
+}
+
+void ibpe_snapshot_pending(Relation indexRelation,
+                           ibpe_metapage_data *meta,
+                           ibpe_pending_chain chains[IBPE_PENDING_PARTITIONS])
+{
+    for (;;) {
+        ibpe_read_metapage(indexRelation, meta);
+
+        for (int p = 0; p < IBPE_PENDING_PARTITIONS; p++) {
+            ibpe_pending_root_data root;
+            ibpe_read_pending_root(indexRelation, p, &root);
+            chains[p] = ibpe_root_chain(indexRelation, meta, &root, p);
+        }
+
+        // a merge installed meanwhile may have cut roots we read against the old cuts
+        ibpe_metapage_data now;
+        ibpe_read_metapage(indexRelation, &now);
+        if (now.generation == meta->generation) {
+            return;
+        }
+    }
+}
+
+uint32 ibpe_count_pending_pages(Relation indexRelation)
+{
+    ibpe_metapage_data meta;
+    ibpe_read_metapage(indexRelation, &meta);
+
+    uint32 n_pages = 0;
+    for (int p = 0; p < IBPE_PENDING_PARTITIONS; p++) {
+        ibpe_pending_root_data root;
+        ibpe_read_pending_root(indexRelation, p, &root);
+        if (root.generation != meta.generation) {
+            root.n_pages -= Min(root.n_pages, meta.pending_cut[p].n_pages);
+        }
+        n_pages += root.n_pages;
+    }
+    return n_pages;
+}
+
+static void ibpe_load_pending_chain(Relation indexRelation,
+                                    BufferAccessStrategy bas,
+                                    ibpe_pending_chain const *chain,
+                                    ibpe_pending_entry *pending,
+                                    int max_entries,
+                                    int *n_loaded)
+{
+    BlockNumber blkno = chain->head;
+    while (blkno != InvalidBlockNumber) {
+        Buffer buf = ReadBufferExtended(indexRelation, MAIN_FORKNUM, blkno, RBM_NORMAL, bas);
+        LockBuffer(buf, BUFFER_LOCK_SHARE);
+        Page page = BufferGetPage(buf);
+        ibpe_opaque_data *opaque = ibpe_get_opaque(page);
+
+        if ((opaque->flags & IBPE_PAGE_PENDING) == 0) {
+            elog(ERROR, "ibpe: page %u in the pending chain is not a pending page", blkno);
+        }
+
+        // the tail page may have gained records since our snapshot
+        char const *p = PageGetContents(page);
+        char const *end = p + opaque->data_len;
+        while (p < end) {
+            ibpe_pending_record rec;
+            p = ibpe_parse_pending_record(p, end, &rec);
+            if (rec.sent_id == 0 || *n_loaded + (int) rec.n_tokens > max_entries) {
+                continue;
+            }
+            ibpe_decode_pending_record(&rec, pending + *n_loaded);
+            *n_loaded += rec.n_tokens;
+        }
+
+        // pages linked after the tail were appended after our snapshot
+        BlockNumber next = (blkno == chain->tail) ? InvalidBlockNumber : opaque->next_blkno;
+        UnlockReleaseBuffer(buf);
+        blkno = next;
+    }
+}
+
+ibpe_pending_entry *ibpe_load_pending(Relation indexRelation,
+                                      BufferAccessStrategy bas,
+                                      ibpe_pending_chain const chains[IBPE_PENDING_PARTITIONS],
+                                      int *n_loaded)
+{
+    int max_entries = 0;
+    for (int p = 0; p < IBPE_PENDING_PARTITIONS; p++) {
+        if (chains[p].head != InvalidBlockNumber) {
+            max_entries += chains[p].n_pending;
+        }
+    }
+
+    *n_loaded = 0;
+    if (max_entries <= 0) {
+        return NULL;
+    }
+
+    ibpe_pending_entry *pending = palloc(max_entries * sizeof(ibpe_pending_entry));
+    for (int p = 0; p < IBPE_PENDING_PARTITIONS; p++) {
+        ibpe_load_pending_chain(indexRelation, bas, &chains[p], pending, max_entries, n_loaded);
+    }
+
+    return pending;
+}
+
+void ibpe_read_posting_list(Relation indexRelation,
+                            BufferAccessStrategy bas,
+                            ibpe_ptr_record const *ptr,
+                            index_entry *out)
+{
+    Buffer buffer = ReadBufferExtended(indexRelation, MAIN_FORKNUM, ptr->blkno, RBM_NORMAL, bas);
+    LockBuffer(buffer, BUFFER_LOCK_SHARE);
+    Page page = BufferGetPage(buffer);
+
+    char const *begin = PageGetContents(page) + ptr->offset;
+    char const *end = PageGetContents(page) + ibpe_get_opaque(page)->data_len;
+
+    int n_entries = *((int *) begin);
+    begin += sizeof(int);
+    if (n_entries != ptr->n_entries) {
+        elog(ERROR,
+             "ibpe: corrupt posting list of token %d: %d entries, expected %d",
+             ptr->token,
+             n_entries,
+             ptr->n_entries);
+    }
+
+    // posting lists are packed back to back and may continue on the following pages
+    for (int i = 0; i < n_entries; i++) {
+        if (begin + sizeof(index_entry) > end) {
+            BlockNumber next_blkno = ibpe_get_opaque(page)->next_blkno;
+            if (next_blkno == InvalidBlockNumber) {
+                elog(ERROR,
+                     "ibpe_read_posting_list: unexpected end of pages when reading #%d out of "
+                     "%d entries",
+                     i,
+                     n_entries);
+            }
+
+            UnlockReleaseBuffer(buffer);
+            buffer = ReadBufferExtended(indexRelation, MAIN_FORKNUM, next_blkno, RBM_NORMAL, bas);
+            LockBuffer(buffer, BUFFER_LOCK_SHARE);
+            page = BufferGetPage(buffer);
+            begin = PageGetContents(page);
+            end = begin + ibpe_get_opaque(page)->data_len;
+        }
+
+        out[i] = *((index_entry *) begin);
+        begin += sizeof(index_entry);
+    }
+
+    UnlockReleaseBuffer(buffer);
+}
+
+static int ibpe_cmp_pending_entry_qsort(const void *a, const void *b)
+{
+    const ibpe_pending_entry *ea = (const ibpe_pending_entry *) a;
+    const ibpe_pending_entry *eb = (const ibpe_pending_entry *) b;
+    if (ea->token != eb->token)
+        return ea->token < eb->token ? -1 : 1;
+    if (ea->entry.sent_id != eb->entry.sent_id)
+        return ea->entry.sent_id < eb->entry.sent_id ? -1 : 1;
+    if (ea->entry.pos != eb->entry.pos)
+        return ea->entry.pos < eb->entry.pos ? -1 : 1;
+    return 0;
+}
+
+void ibpe_sort_pending(ibpe_pending_entry *entries, int n_entries)
+{
+    if (n_entries > 1)
+        qsort(entries, n_entries, sizeof(ibpe_pending_entry), ibpe_cmp_pending_entry_qsort);
+}
+
+int ibpe_pending_lower_bound(ibpe_pending_entry const *entries, int n_entries, int token)
+{
+    int lo = 0, hi = n_entries;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (entries[mid].token < token)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+static bool ibpe_entry_less(index_entry const *a, index_entry const *b)
+{
+    if (a->sent_id != b->sent_id)
+        return a->sent_id < b->sent_id;
+    return a->pos < b->pos;
+}
+
+/*
+ * Mark every page of a chain deleted and hand it to the FSM, logging up to
+ * IBPE_MAX_DELETE_PAGES pages per WAL record. Stops after `last` if it is
+ * valid, otherwise at the end of the chain. The pages keep their contents, so
+ * hot standby scans of an earlier generation can read them until reuse.
+ */
+static void ibpe_free_chain(Relation indexRelation, BlockNumber head, BlockNumber last)
+{
+    Buffer bufs[IBPE_MAX_DELETE_PAGES];
+    int n_bufs = 0;
+
+    BlockNumber blkno = head;
+    while (blkno != InvalidBlockNumber) {
+        if (n_bufs == 0) {
+            CHECK_FOR_INTERRUPTS();
+        }
+
+        Buffer buf = ReadBuffer(indexRelation, blkno);
+        LockBuffer(buf, BUFFER_LOCK_EXCLUSIVE);
+        bufs[n_bufs++] = buf;
+
+        BlockNumber next = (blkno == last) ? InvalidBlockNumber
+                                           : ibpe_get_opaque(BufferGetPage(buf))->next_blkno;
+
+        if (n_bufs == IBPE_MAX_DELETE_PAGES || next == InvalidBlockNumber) {
+            ibpe_log_delete_pages(indexRelation, bufs, n_bufs);
+            for (int i = 0; i < n_bufs; i++) {
+                BlockNumber freed = BufferGetBlockNumber(bufs[i]);
+                UnlockReleaseBuffer(bufs[i]);
+                RecordFreeIndexPage(indexRelation, freed);
+            }
+            n_bufs = 0;
+        }
+        blkno = next;
+    }
+}
+
+/*
+ * Cut the prefixes recorded in the metapage off every root that lags behind
+ * its generation, i.e. finish the last merge. The pages cut off are returned
+ * in cut_off (head is InvalidBlockNumber if none); scans may still be reading
+ * them. Returns whether any pages were cut off. The caller holds the merge lock.
+ */
+static bool ibpe_apply_pending_cuts(Relation indexRelation,
+                                    ibpe_pending_chain cut_off[IBPE_PENDING_PARTITIONS])
+{
+    ibpe_metapage_data meta;
+    ibpe_read_metapage(indexRelation, &meta);
+
+    bool any_cut = false;
+    for (int p = 0; p < IBPE_PENDING_PARTITIONS; p++) {
+        cut_off[p] = (ibpe_pending_chain){.head = InvalidBlockNumber, .tail = InvalidBlockNumber};
+
+        Buffer root_buf = ReadBuffer(indexRelation, IBPE_PENDING_ROOT_BLKNO(p));
+        LockBuffer(root_buf, BUFFER_LOCK_EXCLUSIVE);
+        ibpe_pending_root_data *root = (ibpe_pending_root_data *) PageGetContents(
+            BufferGetPage(root_buf));
+
+        if (root->generation == meta.generation) {
+            UnlockReleaseBuffer(root_buf);
+            continue;
+        }
+
+        // inserters link new pages under the root lock, so the rest cannot change underneath us
+        ibpe_pending_cut const *cut = &meta.pending_cut[p];
+        BlockNumber rest = root->head;
+        if (cut->tail != InvalidBlockNumber && root->head != InvalidBlockNumber) {
+            cut_off[p].head = root->head;
+            cut_off[p].tail = cut->tail;
+            any_cut = true;
+
+            Buffer tail_buf = ReadBuffer(indexRelation, cut->tail);
+            LockBuffer(tail_buf, BUFFER_LOCK_SHARE);
+            rest = ibpe_get_opaque(BufferGetPage(tail_buf))->next_blkno;
+            UnlockReleaseBuffer(tail_buf);
+        }
+
+        GenericXLogState *state = GenericXLogStart(indexRelation);
+        Page root_page = GenericXLogRegisterBuffer(state, root_buf, 0);
+        root = (ibpe_pending_root_data *) PageGetContents(root_page);
+
+        if (cut_off[p].head != InvalidBlockNumber) {
+            root->head = rest;
+            if (rest == InvalidBlockNumber) {
+                root->tail = InvalidBlockNumber;
+                root->tail_sealed = false;
+            }
+            root->n_pending = Max(root->n_pending - cut->n_entries, 0);
+            root->n_pages -= Min(root->n_pages, cut->n_pages);
+        }
+        root->generation = meta.generation;
+
+        GenericXLogFinish(state);
+        UnlockReleaseBuffer(root_buf);
+    }
+
+    return any_cut;
+}
+
+/* recycle pages cut off by ibpe_apply_pending_cuts once no scan can read them */
+static void ibpe_free_pending_cuts(Relation indexRelation,
+                                   ibpe_pending_chain const cut_off[IBPE_PENDING_PARTITIONS])
+{
+    for (int p = 0; p < IBPE_PENDING_PARTITIONS; p++) {
+        if (cut_off[p].head != InvalidBlockNumber) {
+            ibpe_free_chain(indexRelation, cut_off[p].head, cut_off[p].tail);
+        }
+    }
+}
+
+/*
+ * Wait for scans that may still be reading pages we are about to recycle.
+ * This only covers the primary: scans on a hot standby hold no lock the
+ * replay of a merge waits for, so they are cancelled by a recovery conflict
+ * when a page they could still reach is reused (see ibpe_log_reuse_page).
+ */
+static void ibpe_wait_for_scans(Relation indexRelation)
+{
+    LockPage(indexRelation, IBPE_SCAN_LOCK_BLKNO, ExclusiveLock);
+    UnlockPage(indexRelation, IBPE_SCAN_LOCK_BLKNO, ExclusiveLock);
+}
+
+/* bytes a posting list of n_entries takes up on the SID chain */
+static uint64 ibpe_posting_list_bytes(int n_entries)
+{
+    return sizeof(int) + (uint64) n_entries * sizeof(index_entry);
+}
+
+int64 ibpe_merge_pending(Relation indexRelation, bool wait, bool compact)
+{
+    if (wait) {
+        LockPage(indexRelation, IBPE_MERGE_LOCK_BLKNO, ExclusiveLock);
+    } else if (!ConditionalLockPage(indexRelation, IBPE_MERGE_LOCK_BLKNO, ExclusiveLock)) {
+        return 0; // someone else is already merging
+    }
+
+    ibpe_relcache *cache = ibpe_restore_or_create_cache(indexRelation);
+
+    // a merge that crashed after installing its chains left some roots uncut
+    ibpe_pending_chain stale[IBPE_PENDING_PARTITIONS];
+    bool repaired = ibpe_apply_pending_cuts(indexRelation, stale);
+
+    /*
+     * Only merges replace the chains, and we hold the merge lock, so this
+     * snapshot stays valid. Sealing each tail makes inserters start a new page
+     * instead of appending records we would not see.
+     */
+    ibpe_metapage_data meta;
+    ibpe_read_metapage(indexRelation, &meta);
+
+    ibpe_pending_chain chains[IBPE_PENDING_PARTITIONS];
+    bool any_pending = false;
+    for (int p = 0; p < IBPE_PENDING_PARTITIONS; p++) {
+        Buffer root_buf = ReadBuffer(indexRelation, IBPE_PENDING_ROOT_BLKNO(p));
+        LockBuffer(root_buf, BUFFER_LOCK_EXCLUSIVE);
+        ibpe_pending_root_data *root = (ibpe_pending_root_data *) PageGetContents(
+            BufferGetPage(root_buf));
+
+        chains[p] = (ibpe_pending_chain){
+            .head = root->head,
+            .tail = root->tail,
+            .n_pending = root->n_pending,
+            .n_pages = root->n_pages,
+        };
+        if (root->head != InvalidBlockNumber) {
+            any_pending = true;
+            if (!root->tail_sealed) {
+                GenericXLogState *state = GenericXLogStart(indexRelation);
+                Page root_page = GenericXLogRegisterBuffer(state, root_buf, 0);
+                ((ibpe_pending_root_data *) PageGetContents(root_page))->tail_sealed = true;
+                GenericXLogFinish(state);
+            }
+        }
+        UnlockReleaseBuffer(root_buf);
+    }
+
+    /*
+     * A merge only writes the posting lists of the tokens it has pending
+     * entries for, appending them to the SID chain; the lists they supersede
+     * stay behind as garbage. Once that is more than half of the chain, a
+     * compacting merge (VACUUM) rewrites every list into fresh chains.
+     */
+    bool rewrite = meta.sid_tail_blkno == InvalidBlockNumber
+                   || (compact && meta.sid_dead_bytes > meta.sid_live_bytes);
+
+    if (!any_pending && !(rewrite && meta.index_built)) {
+        if (repaired) {
+            ibpe_wait_for_scans(indexRelation);
+            ibpe_free_pending_cuts(indexRelation, stale);
+        }
+        UnlockPage(indexRelation, IBPE_MERGE_LOCK_BLKNO, ExclusiveLock);
+        return 0;
+    }
+
+    MemoryContext merge_cxt = AllocSetContextCreate(CurrentMemoryContext,
+                                                    "ibpe pending merge",
+                                                    ALLOCSET_DEFAULT_SIZES);
+    MemoryContext old_cxt = MemoryContextSwitchTo(merge_cxt);
+
+    BufferAccessStrategy bas = GetAccessStrategy(BAS_BULKREAD);
+
+    int n_pending = 0;
+    ibpe_pending_entry *pending = ibpe_load_pending(indexRelation, bas, chains, &n_pending);
+
+    // records killed by VACUUM are not loaded
+    int n_live = n_pending;
+    ibpe_sort_pending(pending, n_live);
+
+    int vocab_size = tokenizer_get_vocab_size(cache->tok);
+    ibpe_ptr_record *map = palloc(vocab_size * sizeof(ibpe_ptr_record));
+    ibpe_load_ptr_map(indexRelation, meta.ptr_blkno, vocab_size, map, bas);
+
+    elog(NOTICE,
+         "ibpe_merge_pending: merging %d pending entries%s",
+         n_live,
+         rewrite ? " and rewriting the index" : "");
+
+    /*
+     * Either stream every posting list through a fresh writer in token order,
+     * or append the lists of the pending tokens to the SID chain and repoint
+     * their tokens in map, which the writer then writes out as a new PTR chain.
+     */
+    ibpe_index_writer writer;
+    if (rewrite) {
+        ibpe_index_writer_begin(&writer, indexRelation, false);
+    } else {
+        ibpe_index_writer_begin_append(&writer,
+                                       indexRelation,
+                                       meta.sid_tail_blkno,
+                                       map,
+                                       vocab_size);
+    }
+
+    int capacity = 1024;
+    index_entry *old_list = palloc(capacity * sizeof(index_entry));
+    index_entry *merged = palloc(capacity * sizeof(index_entry));
+    uint64 superseded_bytes = 0;
+
+    if (n_live > 0 && (pending[0].token < 0 || pending[n_live - 1].token >= vocab_size)) {
+        elog(ERROR,
+             "ibpe_merge_pending: pending token %d out of vocabulary",
+             pending[0].token < 0 ? pending[0].token : pending[n_live - 1].token);
+    }
+
+    // without a rewrite, only the tokens that have pending entries are visited
+    int pi = 0;
+    int token = (rewrite || n_live == 0) ? 0 : pending[0].token;
+    while (token < vocab_size && (rewrite || pi < n_live)) {
+        CHECK_FOR_INTERRUPTS();
+
+        int pend_begin = pi;
+        while (pi < n_live && pending[pi].token == token)
+            pi++;
+        int n_new = pi - pend_begin;
+
+        ibpe_ptr_record ptr = map[token];
+        int n_old = (ptr.blkno != InvalidBlockNumber) ? ptr.n_entries : 0;
+        if (n_old + n_new > 0) {
+            if (n_old + n_new > capacity) {
+                capacity = n_old + n_new;
+                old_list = repalloc(old_list, capacity * sizeof(index_entry));
+                merged = repalloc(merged, capacity * sizeof(index_entry));
+            }
+            if (n_old > 0) {
+                ibpe_read_posting_list(indexRelation, bas, &ptr, old_list);
+                superseded_bytes += ibpe_posting_list_bytes(n_old);
+            }
+
+            int i = 0, j = pend_begin, out = 0;
+            while (i < n_old || j < pi) {
+                if (j >= pi || (i < n_old && !ibpe_entry_less(&pending[j].entry, &old_list[i]))) {
+                    merged[out++] = old_list[i++];
+                } else {
+                    merged[out++] = pending[j++].entry;
+                }
+            }
+
+            ibpe_index_writer_add(&writer, token, merged, out);
+        }
+
+        token = (rewrite || pi == n_live) ? token + 1 : pending[pi].token;
+    }
+
+    ibpe_index_writer_finish(&writer);
+
+    // install the new chains and record which pending pages they absorbed
+    Buffer meta_buf = ReadBuffer(indexRelation, 0 /* metapage */);
+    LockBuffer(meta_buf, BUFFER_LOCK_EXCLUSIVE);
+
+    GenericXLogState *state = GenericXLogStart(indexRelation);
+    Page meta_page = GenericXLogRegisterBuffer(state, meta_buf, 0);
+    ibpe_metapage_data *m = (ibpe_metapage_data *) PageGetContents(meta_page);
+
+    m->index_built = true;
+    m->num_indexed_tokens = writer.num_indexed_tokens;
+    m->ptr_blkno = writer.ptr_head_blkno;
+    if (rewrite) {
+        m->sid_blkno = writer.sid_head_blkno;
+        m->sid_live_bytes = writer.sid_bytes;
+        m->sid_dead_bytes = 0;
+    } else {
+        m->sid_live_bytes += writer.sid_bytes - superseded_bytes;
+        m->sid_dead_bytes += superseded_bytes;
+    }
+    m->sid_tail_blkno = writer.sid_tail_blkno;
+    for (int p = 0; p < IBPE_PENDING_PARTITIONS; p++) {
+        m->pending_cut[p] = (ibpe_pending_cut){
+            .tail = chains[p].tail,
+            .n_entries = chains[p].n_pending,
+            .n_pages = chains[p].n_pages,
+        };
+    }
+    m->generation += 1;
+
+    GenericXLogFinish(state);
+    UnlockReleaseBuffer(meta_buf);
+
+    // until a root is cut, readers skip its merged prefix themselves
+    ibpe_pending_chain merged_pages[IBPE_PENDING_PARTITIONS];
+    ibpe_apply_pending_cuts(indexRelation, merged_pages);
+
+    // other backends reload token_sid_map from the new chain
+    CacheInvalidateRelcache(indexRelation);
+
+    ibpe_wait_for_scans(indexRelation);
+
+    ibpe_free_chain(indexRelation, meta.ptr_blkno, InvalidBlockNumber);
+    if (rewrite) {
+        ibpe_free_chain(indexRelation, meta.sid_blkno, InvalidBlockNumber);
+    }
+    ibpe_free_pending_cuts(indexRelation, stale);
+    ibpe_free_pending_cuts(indexRelation, merged_pages);
+    IndexFreeSpaceMapVacuum(indexRelation);
+
+    FreeAccessStrategy(bas);
+
+    MemoryContextSwitchTo(old_cxt);
+    MemoryContextDelete(merge_cxt);
+
+    UnlockPage(indexRelation, IBPE_MERGE_LOCK_BLKNO, ExclusiveLock);
+
+    elog(NOTICE, "ibpe_merge_pending: done, %d tokens in index", writer.num_indexed_tokens);
+
+    return n_live;
+}
+
+PG_FUNCTION_INFO_V1(ibpe_clean_pending_list);
+Datum ibpe_clean_pending_list(PG_FUNCTION_ARGS)
+{
+    Oid indexoid = PG_GETARG_OID(0);
+
+    if (RecoveryInProgress()) {
+        ereport(ERROR,
+                (errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+                 errmsg("recovery is in progress"),
+                 errhint("ibpe pending list cannot be cleaned up during recovery.")));
+    }
+
+    Relation indexRelation = index_open(indexoid, RowExclusiveLock);
+
+    if (indexRelation->rd_rel->relkind != RELKIND_INDEX
+        || indexRelation->rd_indam->ambuild != ibpe_build) {
+        ereport(ERROR,
+                (errcode(ERRCODE_WRONG_OBJECT_TYPE),
+                 errmsg("\"%s\" is not an ibpe index", RelationGetRelationName(indexRelation))));
+    }
+
+    if (RELATION_IS_OTHER_TEMP(indexRelation)) {
+        ereport(ERROR,
+                (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+                 errmsg("cannot access temporary indexes of other sessions")));
+    }
+
+    if (!object_ownercheck(RelationRelationId, indexoid, GetUserId())) {
+        aclcheck_error(ACLCHECK_NOT_OWNER, OBJECT_INDEX, RelationGetRelationName(indexRelation));
+    }
+
+    ibpe_flush_insert_buffers(indexRelation);
+    int64 merged = ibpe_merge_pending(indexRelation, true, false);
+
+    index_close(indexRelation, RowExclusiveLock);
+
+    PG_RETURN_INT64(merged);
+}
@@ -0,0 +1,131 @@
+#ifndef IBPE_PENDING_H
+#define IBPE_PENDING_H
+
+#include <postgres.h>
+// The include order is important
+#include <access/amapi.h>
+#include <fmgr.h>
+#include <storage/bufmgr.h>
+
+#include "ibpe_relcache.h"
+#include "ibpe_utils.h"
+
+/*
+ * Heavyweight page locks used as plain lock tags (no page is actually locked):
+ *  - MERGE: held exclusively by whoever rewrites the PTR/SID chains or edits
+ *           pending pages in place (merge, VACUUM).
+ *  - SCAN:  held in share mode by ibpe_getbitmap while it reads the chains;
+ *           a merge takes it exclusively once before recycling old pages.
+ */
+#define IBPE_MERGE_LOCK_BLKNO 0
+#define IBPE_SCAN_LOCK_BLKNO 1
+
+/*
+ * Pending chain pages hold variable-length records, one per inserted sentence
+ * (or per chunk of a sentence too long for one page):
+ *
+ *   sentid_t sent_id        unaligned; 0 once VACUUM has killed the record
+ *   varint   first_pos      position of the first token
+ *   varint   n_tokens
+ *   varint   tokens[n_tokens]
+ *   varint   lookahead      token following the chunk + 1, or 0 at the end of the sentence
+ *
+ * Varints are unsigned LEB128. Records never span pages.
+ */
+typedef struct
+{
+    sentid_t sent_id;
+    uint32 first_pos;
+    uint32 n_tokens;
+    char const *tokens; // first varint of the token array
+    uint32 lookahead;
+} ibpe_pending_record;
+
+/*
+ * Encode as many of tokens[first_pos, n_tokens) as fit into avail bytes.
+ * Returns the record length, or 0 if not even one token fits.
+ */
+int ibpe_encode_pending_record(char *out,
+                               int avail,
+                               sentid_t sent_id,
+                               int const *tokens,
+                               int n_tokens,
+                               int first_pos,
+                               int *n_encoded);
+
+/* parse the record at p; returns a pointer past it */
+char const *ibpe_parse_pending_record(char const *p, char const *end, ibpe_pending_record *rec);
+
+/* ibpe.pending_list_limit, in kB; 0 disables the automatic merge on insert */
+extern int ibpe_pending_list_limit;
+
+void ibpe_define_pending_gucs(void);
+
+/*
+ * Pending inserts are spread over IBPE_PENDING_PARTITIONS chains so that
+ * concurrent inserters do not all queue on one buffer lock. Each chain hangs
+ * off its own root page; a backend always appends to the same partition.
+ *
+ * A merge consumes a prefix of every chain. It records where each prefix ends
+ * in the metapage (pending_cut) in the same WAL record that installs the new
+ * PTR/SID chains and bumps the generation, then cuts the prefixes off the
+ * roots one by one. A root whose generation lags behind the metapage has not
+ * been cut yet; readers then start after pending_cut[p].tail themselves.
+ */
+typedef struct
+{
+    BlockNumber head; // InvalidBlockNumber if the chain is empty
+    BlockNumber tail;
+    int n_pending; // upper bound on the entries between head and tail
+    uint32 n_pages;
+} ibpe_pending_chain;
+
+/* the partition this backend inserts into */
+int ibpe_my_pending_partition(void);
+
+/*
+ * Take a consistent snapshot of the metapage and of every pending chain, with
+ * merged prefixes already cut off.
+ */
+void ibpe_snapshot_pending(Relation indexRelation,
+                           ibpe_metapage_data *meta,
+                           ibpe_pending_chain chains[IBPE_PENDING_PARTITIONS]);
+
+/* number of pending pages over all partitions */
+uint32 ibpe_count_pending_pages(Relation indexRelation);
+
+/*
+ * Decode every chain from head up to and including tail into one palloc'd
+ * array. Records killed by VACUUM are skipped, as are records appended after
+ * the snapshot that would overflow the array.
+ */
+ibpe_pending_entry *ibpe_load_pending(Relation indexRelation,
+                                      BufferAccessStrategy bas,
+                                      ibpe_pending_chain const chains[IBPE_PENDING_PARTITIONS],
+                                      int *n_loaded);
+
+/* sort by (token, sent_id, pos), i.e. posting lists grouped by token */
+void ibpe_sort_pending(ibpe_pending_entry *entries, int n_entries);
+
+/* index of the first entry of a sorted array whose token is >= token */
+int ibpe_pending_lower_bound(ibpe_pending_entry const *entries, int n_entries, int token);
+
+/* copy the posting list ptr points to into out, which has room for ptr->n_entries entries */
+void ibpe_read_posting_list(Relation indexRelation,
+                            BufferAccessStrategy bas,
+                            ibpe_ptr_record const *ptr,
+                            index_entry *out);
+
+/*
+ * Merge the pending list into the main index: write new posting lists for the
+ * tokens that have pending entries, append them to the SID chain, install a
+ * new PTR chain that points to them and recycle the old PTR and pending pages.
+ * If compact is set and superseded lists take up more of the SID chain than
+ * live ones, every list is rewritten into fresh chains instead, which costs
+ * about as much as a REINDEX; only VACUUM asks for that. If wait is false,
+ * returns immediately when another backend is already merging. Returns the
+ * number of live pending entries merged.
+ */
+int64 ibpe_merge_pending(Relation indexRelation, bool wait, bool compact);
+
+#endif // IBPE_PENDING_H
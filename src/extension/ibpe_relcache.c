@@ -1,5 +1,6 @@
 #include "ibpe_relcache.h"
 
+#include "ibpe_shmem.h"
 #include "ibpe_utils.h"
 
 #include <access/generic_xlog.h>
@@ -10,6 +11,7 @@
 #include <storage/bufmgr.h>
 #include <storage/indexfsm.h>
 #include <utils/builtins.h>
+#include <utils/memutils.h>
 #include <utils/rel.h>
 
 void ibpe_store_cache(Relation indexRelation, ibpe_relcache *cur_state)
@@ -27,38 +29,76 @@ void ibpe_store_cache(Relation indexRelation, ibpe_relcache *cur_state)
     *state_mem = *cur_state;
 }
 
-static void ibpe_free_relcache_callback(void *arg)
+/*
+ * Tokenizers loaded by this backend. They outlive the relcache entries that use
+ * them, so that rebuilding an entry (after every pending list merge) does not
+ * parse tokenizer.json again, and indexes built with the same tokenizer and
+ * mappings share one copy.
+ */
+typedef struct ibpe_tokenizer_entry
 {
-    elog(NOTICE, "freeing rd_amcache");
+    struct ibpe_tokenizer_entry *next;
+    char path[TOKENIZER_PATH_MAXLEN + 1];
+    int n_mappings;
+    char mappings[NORMALIZE_MAPPINGS_MAXLEN][2];
+    tokenizer tok;
+} ibpe_tokenizer_entry;
 
-    ibpe_relcache *state_mem = arg;
+static ibpe_tokenizer_entry *ibpe_tokenizers = NULL;
 
-    destroy_tokenizer(state_mem->tok);
-}
-
-void ibpe_relcache_reload_index(ibpe_relcache *cache,
-                                Relation indexRelation,
-                                ibpe_metapage_data *meta)
+static tokenizer ibpe_get_tokenizer(ibpe_metapage_data *meta)
 {
-    elog(NOTICE, "Loading index from disk");
-    if (!meta->index_built) {
-        elog(NOTICE, "Index not built yet. Exiting");
-        return;
+    for (ibpe_tokenizer_entry *entry = ibpe_tokenizers; entry; entry = entry->next) {
+        if (strcmp(entry->path, meta->tokenizer_path) == 0
+            && entry->n_mappings == meta->n_normalize_mappings
+            && memcmp(entry->mappings,
+                      meta->normalize_mappings,
+                      sizeof(entry->mappings[0]) * entry->n_mappings)
+                   == 0) {
+            return entry->tok;
+        }
     }
 
-    elog(NOTICE, "metadata: %d tokens found in index", meta->num_indexed_tokens);
+    elog(NOTICE,
+         "Loading tokenizer from '%s' with %d mappings",
+         meta->tokenizer_path,
+         meta->n_normalize_mappings);
 
-    cache->vocab_size = tokenizer_get_vocab_size(cache->tok);
-    cache->token_sid_map = MemoryContextAlloc(indexRelation->rd_indexcxt,
-                                              sizeof(ibpe_ptr_record) * cache->vocab_size);
+    char errmsg[256] = {};
+    tokenizer tok = create_tokenizer(meta->tokenizer_path,
+                                     meta->normalize_mappings,
+                                     meta->n_normalize_mappings,
+                                     errmsg,
+                                     lengthof(errmsg));
+    if (!tok) {
+        elog(ERROR, "Cannot load tokenizer: %s", errmsg);
+    }
 
-    BufferAccessStrategy bas = GetAccessStrategy(BAS_BULKREAD);
+    ibpe_tokenizer_entry *entry = MemoryContextAllocZero(TopMemoryContext,
+                                                         sizeof(ibpe_tokenizer_entry));
+    strlcpy(entry->path, meta->tokenizer_path, sizeof(entry->path));
+    entry->n_mappings = meta->n_normalize_mappings;
+    memcpy(entry->mappings,
+           meta->normalize_mappings,
+           sizeof(entry->mappings[0]) * entry->n_mappings);
+    entry->tok = tok;
+    entry->next = ibpe_tokenizers;
+    ibpe_tokenizers = entry;
+
+    return tok;
+}
 
+int ibpe_load_ptr_map(Relation indexRelation,
+                      BlockNumber ptr_blkno,
+                      int vocab_size,
+                      ibpe_ptr_record *map,
+                      BufferAccessStrategy bas)
+{
     int token_recs_added = 0;
     int tok_id = 0;
 
-    BlockNumber blkno = 1; // start of ptr pages
-    for (;;) {
+    BlockNumber blkno = ptr_blkno;
+    while (blkno != InvalidBlockNumber) {
         elog(NOTICE, "Reading page #%d / %d", blkno, RelationGetNumberOfBlocks(indexRelation));
 
         Buffer ptr_page_buf = ReadBufferExtended(indexRelation, MAIN_FORKNUM, blkno, RBM_NORMAL, bas);
@@ -83,20 +123,20 @@ void ibpe_relcache_reload_index(ibpe_relcache *cache,
                      rec->offset);
             }
 
+            if (rec->token < tok_id || rec->token >= vocab_size) {
+                elog(ERROR, "ibpe: corrupt pointer page %u: token %d out of order", blkno, rec->token);
+            }
+
             for (; tok_id < rec->token; tok_id++) {
                 // fill missing tokens with invalid pointers
-                cache->token_sid_map[tok_id] = (ibpe_ptr_record){
+                map[tok_id] = (ibpe_ptr_record){
                     .token = tok_id,
                     .blkno = InvalidBlockNumber,
                     .offset = -1,
                 };
             };
 
-            cache->token_sid_map[tok_id++] = (ibpe_ptr_record){
-                .token = rec->token,
-                .blkno = rec->blkno,
-                .offset = rec->offset,
-            };
+            map[tok_id++] = *rec;
             token_recs_added += 1;
 
             p += sizeof(ibpe_ptr_record);
@@ -105,30 +145,79 @@ void ibpe_relcache_reload_index(ibpe_relcache *cache,
         // follow pointer to next page
         elog(NOTICE, "Got next blkno = %u", opaque->next_blkno);
 
-        if (opaque->next_blkno == InvalidBlockNumber) {
-            UnlockReleaseBuffer(ptr_page_buf);
-            break;
-        }
-
         blkno = opaque->next_blkno;
 
         UnlockReleaseBuffer(ptr_page_buf);
     }
 
-    for (; tok_id < cache->vocab_size; tok_id++) {
+    for (; tok_id < vocab_size; tok_id++) {
         // fill missing tokens with invalid pointers
-        cache->token_sid_map[tok_id] = (ibpe_ptr_record){
+        map[tok_id] = (ibpe_ptr_record){
             .token = tok_id,
             .blkno = InvalidBlockNumber,
             .offset = -1,
         };
     }
 
+    return token_recs_added;
+}
+
+void ibpe_relcache_reload_index(ibpe_relcache *cache,
+                                Relation indexRelation,
+                                ibpe_metapage_data *meta)
+{
+    elog(NOTICE, "Loading index from disk");
+    if (!meta->index_built) {
+        elog(NOTICE, "Index not built yet. Exiting");
+        return;
+    }
+
+    elog(NOTICE, "metadata: %d tokens found in index", meta->num_indexed_tokens);
+
+    // the PTR/SID chains were replaced (e.g. by a pending list merge); drop the old map
+    if (cache->token_sid_map) {
+        pfree(cache->token_sid_map);
+        cache->token_sid_map = NULL;
+    }
+
+    cache->vocab_size = tokenizer_get_vocab_size(cache->tok);
+    cache->token_sid_map = MemoryContextAlloc(indexRelation->rd_indexcxt,
+                                              sizeof(ibpe_ptr_record) * cache->vocab_size);
+    cache->generation = meta->generation;
+
+    // temporary relations' relfilenodes are only unique within their backend
+    bool shared = !RelationUsesLocalBuffers(indexRelation);
+    if (shared
+        && ibpe_shared_map_lookup(&indexRelation->rd_locator,
+                                  meta->build_stamp,
+                                  meta->generation,
+                                  cache->vocab_size,
+                                  cache->token_sid_map)) {
+        elog(NOTICE, "Copied pointer map from shared memory");
+        return;
+    }
+
+    BufferAccessStrategy bas = GetAccessStrategy(BAS_BULKREAD);
+
+    int token_recs_added = ibpe_load_ptr_map(indexRelation,
+                                             meta->ptr_blkno,
+                                             cache->vocab_size,
+                                             cache->token_sid_map,
+                                             bas);
+
     FreeAccessStrategy(bas);
 
     elog(NOTICE, "Reading End. Added %d tokens", token_recs_added);
 
     Assert(token_recs_added == meta->num_indexed_tokens);
+
+    if (shared) {
+        ibpe_shared_map_publish(&indexRelation->rd_locator,
+                                meta->build_stamp,
+                                meta->generation,
+                                cache->vocab_size,
+                                cache->token_sid_map);
+    }
 }
 
 static ibpe_relcache *ibpe_relcache_fill(Relation indexRelation, ibpe_metapage_data *meta)
@@ -137,31 +226,11 @@ static ibpe_relcache *ibpe_relcache_fill(Relation indexRelation, ibpe_metapage_d
     ibpe_relcache *cache = MemoryContextAlloc(indexRelation->rd_indexcxt, sizeof(ibpe_relcache));
 
     // initialize tokenizer
-    elog(NOTICE,
-         "Loading tokenizer from '%s' with %d mappings",
-         meta->tokenizer_path,
-         meta->n_normalize_mappings);
-
-    char errmsg[256] = {};
-    cache->tok = create_tokenizer(meta->tokenizer_path,
-                                  meta->normalize_mappings,
-                                  meta->n_normalize_mappings,
-                                  errmsg,
-                                  lengthof(errmsg));
-    if (!cache->tok) {
-        elog(ERROR, "Cannot load tokenizer: %s", errmsg);
-    }
+    cache->tok = ibpe_get_tokenizer(meta);
 
-    // free tokenizer when cache is freed
-    MemoryContextCallback *cb = MemoryContextAlloc(indexRelation->rd_indexcxt,
-                                                   sizeof(MemoryContextCallback));
-    cb->func = ibpe_free_relcache_callback;
-    cb->arg = cache;
-    MemoryContextRegisterResetCallback(indexRelation->rd_indexcxt, cb);
-
-    // Initialize pending list pointers
-    cache->pending_head_blkno = meta->pending_blkno;
-    cache->pending_tail_blkno = InvalidBlockNumber; // resolved lazily on first insert
+    cache->vocab_size = 0;
+    cache->token_sid_map = NULL;
+    cache->generation = meta->generation;
 
     // Load index if already built
     ibpe_relcache_reload_index(cache, indexRelation, meta);
@@ -187,6 +256,15 @@ ibpe_relcache *ibpe_restore_or_create_cache(Relation indexRelation)
         if (meta->magickNumber != IBPE_MAGICK_NUMBER) {
             elog(ERROR, "Relation is not an ibpe index: invalid magick number.");
         }
+        if (meta->format_version != IBPE_FORMAT_VERSION) {
+            ereport(ERROR,
+                    (errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+                     errmsg("index \"%s\" has on-disk format version %u, expected %u",
+                            RelationGetRelationName(indexRelation),
+                            meta->format_version,
+                            IBPE_FORMAT_VERSION),
+                     errhint("REINDEX the index.")));
+        }
 
         // restore state from metapage
         state_mem = ibpe_relcache_fill(indexRelation, meta);
@@ -5,6 +5,7 @@
 // The include order is important
 #include <access/amapi.h>
 #include <fmgr.h>
+#include <storage/bufmgr.h>
 
 #include "ibpe_backend.h"
 #include "ibpe_utils.h"
@@ -14,6 +15,7 @@ typedef struct
     int token;
     BlockNumber blkno;
     int offset;
+    int n_entries; // length of the posting list at (blkno, offset)
 } ibpe_ptr_record;
 
 // relcache
@@ -22,17 +24,27 @@ typedef struct
     tokenizer tok;
 
     int vocab_size;
-    ibpe_ptr_record *token_sid_map;
+    ibpe_ptr_record *token_sid_map; // NULL until the index is built
 
-    // pending list state (updated by ibpe_insert)
-    BlockNumber pending_head_blkno; // InvalidBlockNumber if no pending pages yet
-    BlockNumber pending_tail_blkno; // last pending page (to avoid re-walking on insert)
+    // metapage generation token_sid_map was loaded from
+    uint32 generation;
 } ibpe_relcache;
 
 void ibpe_store_cache(Relation indexRelation, ibpe_relcache *cur_state);
 
 ibpe_relcache *ibpe_restore_or_create_cache(Relation indexRelation);
 
+/*
+ * Read the PTR chain starting at ptr_blkno into map[0, vocab_size).
+ * Tokens without a posting list get blkno = InvalidBlockNumber.
+ * Returns the number of tokens that have one.
+ */
+int ibpe_load_ptr_map(Relation indexRelation,
+                      BlockNumber ptr_blkno,
+                      int vocab_size,
+                      ibpe_ptr_record *map,
+                      BufferAccessStrategy bas);
+
 void ibpe_relcache_reload_index(ibpe_relcache *cache,
                                 Relation indexRelation,
                                 ibpe_metapage_data *meta);
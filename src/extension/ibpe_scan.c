@@ -1,18 +1,48 @@
 #include "ibpe_scan.h"
+#include "ibpe_build.h"
+#include "ibpe_pending.h"
 #include "ibpe_relcache.h"
 
+#include <access/genam.h>
 #include <access/relscan.h>
+#include <catalog/pg_class.h>
+#include <funcapi.h>
 #include <miscadmin.h>
 #include <pgstat.h>
-#include <stdlib.h>
 #include <storage/bufmgr.h>
+#include <storage/lmgr.h>
+#include <utils/acl.h>
+#include <utils/array.h>
 #include <utils/builtins.h>
+#include <utils/guc.h>
+#include <utils/lsyscache.h>
+#include <utils/rel.h>
 
 typedef struct
 {
     ibpe_relcache *state;
 } ibpe_scan_opaque;
 
+int ibpe_max_dfa_states = 10000;
+
+void ibpe_define_scan_gucs(void)
+{
+    DefineCustomIntVariable("ibpe.max_dfa_states",
+                            "Maximum number of DFA states built for an ibpe search.",
+                            "Larger DFAs are built lazily, only as far as the search needs them, "
+                            "and past this many states the search falls back to slower "
+                            "position-set matching and rechecks the rows.",
+                            &ibpe_max_dfa_states,
+                            10000,
+                            1,
+                            INT_MAX,
+                            PGC_USERSET,
+                            0,
+                            NULL,
+                            NULL,
+                            NULL);
+}
+
 /* prepare for index scan */
 IndexScanDesc ibpe_beginscan(Relation indexRelation, int nkeys, int norderbys)
 {
@@ -42,7 +72,7 @@ typedef struct
     Relation indexRelation;
     ibpe_relcache *cache;
     BufferAccessStrategy bas;
-    // flat array of all pending entries, loaded once per scan
+    // all pending entries, loaded and sorted by token once per scan
     ibpe_pending_entry *pending;
     int n_pending;
 } ibpe_access_index_state;
@@ -71,23 +101,11 @@ static int ibpe_access_index(void *user_data, int token, index_entry *data, int
             elog(ERROR, "ibpe_access_index: token %d out of range", token);
     }
 
-    // Collect and sort pending entries for this token up front
-    int pending_count = 0;
-    for (int p = 0; p < state->n_pending; p++) {
-        if (state->pending[p].token == token)
-            pending_count++;
-    }
-
-    index_entry *pending_sorted = NULL;
-    if (pending_count > 0) {
-        pending_sorted = palloc(pending_count * sizeof(index_entry));
-        int j = 0;
-        for (int p = 0; p < state->n_pending; p++) {
-            if (state->pending[p].token == token)
-                pending_sorted[j++] = state->pending[p].entry;
-        }
-        qsort(pending_sorted, pending_count, sizeof(index_entry), ibpe_cmp_index_entry);
-    }
+    // pending entries of this token form a sorted run
+    int pending_begin = ibpe_pending_lower_bound(state->pending, state->n_pending, token);
+    int pending_end = ibpe_pending_lower_bound(state->pending, state->n_pending, token + 1);
+    ibpe_pending_entry const *pending = state->pending + pending_begin;
+    int pending_count = pending_end - pending_begin;
 
     ibpe_ptr_record ptr = (state->cache->vocab_size > 0 && state->cache->token_sid_map != NULL)
                               ? state->cache->token_sid_map[token]
@@ -95,90 +113,78 @@ static int ibpe_access_index(void *user_data, int token, index_entry *data, int
                                                   .blkno = InvalidBlockNumber,
                                                   .offset = -1};
 
-    int num_main = 0;
-
-    if (ptr.blkno != InvalidBlockNumber) {
-        Buffer buffer = ReadBufferExtended(state->indexRelation,
-                                           MAIN_FORKNUM,
-                                           ptr.blkno,
-                                           RBM_NORMAL,
-                                           state->bas);
-        LockBuffer(buffer, BUFFER_LOCK_SHARE);
-        Page page = BufferGetPage(buffer);
-
-        char const *begin = PageGetContents(page) + ptr.offset;
-        char const *end = page + ((PageHeader) page)->pd_upper;
-
-        num_main = *((int *) begin);
-        begin += sizeof(int);
-
-        if (data) {
-            int pi = 0;
-            int out = 0;
-
-            for (int i = 0; i < num_main; i++) {
-                if (begin + sizeof(index_entry) > end) {
-                    int next_blkno = ibpe_get_opaque(page)->next_blkno;
-                    if (next_blkno == InvalidBlockNumber) {
-                        elog(ERROR,
-                             "ibpe_access_index: unexpected end of pages when reading #%d out of "
-                             "%d entries for token %d",
-                             i,
-                             num_main,
-                             token);
-                    }
-
-                    UnlockReleaseBuffer(buffer);
-                    buffer = ReadBufferExtended(state->indexRelation,
-                                                MAIN_FORKNUM,
-                                                next_blkno,
-                                                RBM_NORMAL,
-                                                state->bas);
-                    LockBuffer(buffer, BUFFER_LOCK_SHARE);
-                    page = BufferGetPage(buffer);
-                    begin = PageGetContents(page);
-                    end = page + ((PageHeader) page)->pd_upper;
-                }
-
-                index_entry main_entry = *((index_entry *) begin);
-                begin += sizeof(index_entry);
-
-                // Drain pending entries that sort before this main entry
-                while (pi < pending_count
-                       && ibpe_cmp_index_entry(&pending_sorted[pi], &main_entry) <= 0) {
-                    data[out++] = pending_sorted[pi++];
-                }
-
-                if (main_entry.sent_id == 0) {
-                    elog(NOTICE, "token=%d: data[%d]=%lu", token, out, (sentid_t) main_entry.sent_id);
-                }
-                data[out++] = main_entry;
-            }
+    // the PTR record has the length, so counting reads no page
+    int num_main = (ptr.blkno != InvalidBlockNumber) ? ptr.n_entries : 0;
+
+    if (data) {
+        if (num_main > 0) {
+            ibpe_read_posting_list(state->indexRelation, state->bas, &ptr, data);
+        }
 
-            // Drain remaining pending entries after all main entries
-            while (pi < pending_count) {
-                data[out++] = pending_sorted[pi++];
+        // merge pending entries into the main list from the back, in place
+        int i = num_main - 1;
+        int j = pending_count - 1;
+        int out = num_main + pending_count - 1;
+        while (j >= 0) {
+            if (i >= 0 && ibpe_cmp_index_entry(&data[i], &pending[j].entry) > 0) {
+                data[out--] = data[i--];
+            } else {
+                data[out--] = pending[j--].entry;
             }
         }
+    }
+
+    return num_main + pending_count;
+}
+
+/* take the scan lock and gather what ibpe_access_index reads; undone by ibpe_end_access */
+static void ibpe_begin_access(Relation indexRelation, ibpe_access_index_state *state)
+{
+    // rows this backend's running statement inserted may still be buffered
+    ibpe_flush_insert_buffers(indexRelation);
+
+    BufferAccessStrategy bas = GetAccessStrategy(BAS_BULKREAD);
+
+    // keeps a concurrent pending list merge from recycling the pages we read
+    LockPage(indexRelation, IBPE_SCAN_LOCK_BLKNO, ShareLock);
+
+    ibpe_metapage_data meta;
+    ibpe_pending_chain chains[IBPE_PENDING_PARTITIONS];
+    ibpe_snapshot_pending(indexRelation, &meta, chains);
 
-        UnlockReleaseBuffer(buffer);
-    } else if (data) {
-        // No main index entries; copy sorted pending directly
-        for (int i = 0; i < pending_count; i++)
-            data[i] = pending_sorted[i];
+    // the relcache may predate a merge that replaced the PTR/SID chains
+    ibpe_relcache *cache = ibpe_restore_or_create_cache(indexRelation);
+    if (meta.index_built && (cache->token_sid_map == NULL || cache->generation != meta.generation)) {
+        ibpe_relcache_reload_index(cache, indexRelation, &meta);
     }
 
-    if (pending_sorted)
-        pfree(pending_sorted);
+    // Load the pending entries of all partitions into a flat array for this scan
+    int n_pending = 0;
+    ibpe_pending_entry *pending_arr = ibpe_load_pending(indexRelation, bas, chains, &n_pending);
+    if (n_pending > 0) {
+        ibpe_sort_pending(pending_arr, n_pending);
+        elog(NOTICE, "ibpe_begin_access: loaded %d pending entries", n_pending);
+    }
 
-    return num_main + pending_count;
+    *state = (ibpe_access_index_state){
+        .indexRelation = indexRelation,
+        .cache = cache,
+        .bas = bas,
+        .pending = pending_arr,
+        .n_pending = n_pending,
+    };
+}
+
+static void ibpe_end_access(ibpe_access_index_state *state)
+{
+    UnlockPage(state->indexRelation, IBPE_SCAN_LOCK_BLKNO, ShareLock);
+    FreeAccessStrategy(state->bas);
 }
 
 /* fetch all valid tuples */
 int64 ibpe_getbitmap(IndexScanDesc scan, TIDBitmap *tbm)
 {
     ibpe_scan_opaque *scan_state = scan->opaque;
-    ibpe_relcache *cache = scan_state->state;
 
     ScanKey skey = scan->keyData;
 
@@ -206,71 +212,26 @@ int64 ibpe_getbitmap(IndexScanDesc scan, TIDBitmap *tbm)
     elog(NOTICE, "ibpe_getbitmap got search text='%s'", search_term);
 
     // run the actual search
-    BufferAccessStrategy bas = GetAccessStrategy(BAS_BULKREAD);
-
-    // Load all pending entries into a flat array for this scan
-    ibpe_pending_entry *pending_arr = NULL;
-    int n_pending = 0;
-
-    Buffer meta_buf = ReadBuffer(scan->indexRelation, 0 /* metapage */);
-    LockBuffer(meta_buf, BUFFER_LOCK_SHARE);
-    ibpe_metapage_data *meta = (ibpe_metapage_data *) PageGetContents(BufferGetPage(meta_buf));
-    BlockNumber pending_blkno = meta->pending_blkno;
-    int pending_total = meta->n_pending;
-    UnlockReleaseBuffer(meta_buf);
-
-    if (pending_blkno != InvalidBlockNumber && pending_total > 0) {
-        pending_arr = palloc(pending_total * sizeof(ibpe_pending_entry));
-
-        BlockNumber blkno = pending_blkno;
-        while (blkno != InvalidBlockNumber) {
-            Buffer buf = ReadBufferExtended(scan->indexRelation,
-                                            MAIN_FORKNUM,
-                                            blkno,
-                                            RBM_NORMAL,
-                                            bas);
-            LockBuffer(buf, BUFFER_LOCK_SHARE);
-            Page page = BufferGetPage(buf);
-            ibpe_opaque_data *opaque = ibpe_get_opaque(page);
-
-            Assert((opaque->flags & IBPE_PAGE_PENDING) != 0);
-
-            char *p = PageGetContents(page);
-            char *end = p + opaque->data_len;
-            while (p + sizeof(ibpe_pending_entry) <= end) {
-                if (n_pending < pending_total)
-                    pending_arr[n_pending++] = *((ibpe_pending_entry *) p);
-                p += sizeof(ibpe_pending_entry);
-            }
-
-            blkno = opaque->next_blkno;
-            UnlockReleaseBuffer(buf);
-        }
-        elog(NOTICE, "ibpe_getbitmap: loaded %d pending entries", n_pending);
-    }
-
-    ibpe_access_index_state access_state = {
-        .indexRelation = scan->indexRelation,
-        .cache = cache,
-        .bas = bas,
-        .pending = pending_arr,
-        .n_pending = n_pending,
-    };
+    ibpe_access_index_state access_state;
+    ibpe_begin_access(scan->indexRelation, &access_state);
+    scan_state->state = access_state.cache;
 
     index_accessor_cb callback = {
         .user_data = &access_state,
         .func = ibpe_access_index,
     };
-    search_result results = search_corpus(cache->tok, callback, search_term);
+    search_result results = search_corpus(access_state.cache->tok,
+                                           callback,
+                                           search_term,
+                                           ibpe_max_dfa_states);
+
+    ibpe_end_access(&access_state);
+
     if (!results.candidates) {
         elog(WARNING, "Search failed. Returning 0 results");
-
-        FreeAccessStrategy(bas);
         return 0;
     }
 
-    FreeAccessStrategy(bas);
-
     sentid_t const *data = sentid_vec_get_data(results.candidates);
     int size = sentid_vec_get_size(results.candidates);
 
@@ -278,10 +239,8 @@ int64 ibpe_getbitmap(IndexScanDesc scan, TIDBitmap *tbm)
 
     // fill tbm with results
     for (int i = 0; i < size; ++i) {
-        if (data[i] != 0) { // FIXME: search returns invalid sent_id=0 sometimes
-            ItemPointerData tid = ibpe_sentid_to_tid(data[i]);
-            tbm_add_tuples(tbm, &tid, 1, results.needs_recheck);
-        }
+        ItemPointerData tid = ibpe_sentid_to_tid(data[i]);
+        tbm_add_tuples(tbm, &tid, 1, results.needs_recheck);
     }
 
     destroy_sentid_vec(results.candidates);
@@ -289,6 +248,119 @@ int64 ibpe_getbitmap(IndexScanDesc scan, TIDBitmap *tbm)
     return size;
 }
 
+/* append a (literal, heap_tid) row for every sentence of sent_ids */
+static void ibpe_put_literal_matches(ReturnSetInfo *rsinfo,
+                                     sentid_vec sent_ids,
+                                     Datum literal,
+                                     bool literal_isnull)
+{
+    sentid_t const *data = sentid_vec_get_data(sent_ids);
+    size_t size = sentid_vec_get_size(sent_ids);
+
+    for (size_t i = 0; i < size; ++i) {
+        ItemPointerData tid = ibpe_sentid_to_tid(data[i]);
+        Datum values[2] = {literal, ItemPointerGetDatum(&tid)};
+        bool nulls[2] = {literal_isnull, false};
+        tuplestore_putvalues(rsinfo->setResult, rsinfo->setDesc, values, nulls);
+    }
+}
+
+/*
+ * ibpe_literal_matches(index regclass, literals text[], per_literal bool)
+ *
+ * Search for every literal of the array in one pass over the index. Returns a
+ * row per matching (literal, heap TID) pair, with literal the 1-based array
+ * position, or with per_literal = false one row per TID matching any literal.
+ * NULL elements match nothing. The TIDs are candidates that the caller must
+ * recheck, since entries of dead rows can outlive their line pointers.
+ */
+PG_FUNCTION_INFO_V1(ibpe_literal_matches);
+Datum ibpe_literal_matches(PG_FUNCTION_ARGS)
+{
+    Oid indexoid = PG_GETARG_OID(0);
+    ArrayType *literal_arr = PG_GETARG_ARRAYTYPE_P(1);
+    bool per_literal = PG_GETARG_BOOL(2);
+
+    InitMaterializedSRF(fcinfo, 0);
+    ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+
+    Relation indexRelation = index_open(indexoid, AccessShareLock);
+
+    if (indexRelation->rd_rel->relkind != RELKIND_INDEX
+        || indexRelation->rd_indam->ambuild != ibpe_build) {
+        ereport(ERROR,
+                (errcode(ERRCODE_WRONG_OBJECT_TYPE),
+                 errmsg("\"%s\" is not an ibpe index", RelationGetRelationName(indexRelation))));
+    }
+
+    if (RELATION_IS_OTHER_TEMP(indexRelation)) {
+        ereport(ERROR,
+                (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+                 errmsg("cannot access temporary indexes of other sessions")));
+    }
+
+    // the TIDs say which rows of the table contain the literals
+    Oid heapoid = indexRelation->rd_index->indrelid;
+    AclResult aclresult = pg_class_aclcheck(heapoid, GetUserId(), ACL_SELECT);
+    if (aclresult != ACLCHECK_OK) {
+        aclcheck_error(aclresult, OBJECT_TABLE, get_rel_name(heapoid));
+    }
+
+    Datum *elems;
+    bool *elem_nulls;
+    int n_elems;
+    deconstruct_array_builtin(literal_arr, TEXTOID, &elems, &elem_nulls, &n_elems);
+
+    char const **literals = palloc(sizeof(char const *) * Max(n_elems, 1));
+    int *literal_nos = palloc(sizeof(int) * Max(n_elems, 1));
+    int n_literals = 0;
+    for (int i = 0; i < n_elems; ++i) {
+        if (!elem_nulls[i]) {
+            literals[n_literals] = TextDatumGetCString(elems[i]);
+            literal_nos[n_literals] = i + 1;
+            n_literals++;
+        }
+    }
+
+    ibpe_access_index_state access_state;
+    ibpe_begin_access(indexRelation, &access_state);
+
+    index_accessor_cb callback = {
+        .user_data = &access_state,
+        .func = ibpe_access_index,
+    };
+    sentid_vec *matches = palloc(sizeof(sentid_vec) * Max(n_literals, 1));
+    sentid_vec any;
+    bool found = search_corpus_literals(access_state.cache->tok,
+                                        callback,
+                                        literals,
+                                        n_literals,
+                                        matches,
+                                        &any);
+
+    ibpe_end_access(&access_state);
+    index_close(indexRelation, AccessShareLock);
+
+    if (!found) {
+        ereport(ERROR, (errcode(ERRCODE_INTERNAL_ERROR), errmsg("ibpe literal search failed")));
+    }
+
+    if (per_literal) {
+        for (int i = 0; i < n_literals; ++i) {
+            ibpe_put_literal_matches(rsinfo, matches[i], Int32GetDatum(literal_nos[i]), false);
+        }
+    } else {
+        ibpe_put_literal_matches(rsinfo, any, (Datum) 0, true);
+    }
+
+    for (int i = 0; i < n_literals; ++i) {
+        destroy_sentid_vec(matches[i]);
+    }
+    destroy_sentid_vec(any);
+
+    return (Datum) 0;
+}
+
 /* end index scan */
 void ibpe_endscan(IndexScanDesc scan)
 {
@@ -6,6 +6,11 @@
 #include <access/amapi.h>
 #include <fmgr.h>
 
+/* ibpe.max_dfa_states */
+extern int ibpe_max_dfa_states;
+
+void ibpe_define_scan_gucs(void);
+
 /* prepare for index scan */
 IndexScanDesc ibpe_beginscan(Relation indexRelation, int nkeys, int norderbys);
 
@@ -0,0 +1,168 @@
+#include "ibpe_shmem.h"
+
+#include <port/atomics.h>
+#include <storage/dsm_registry.h>
+#include <storage/lwlock.h>
+#include <utils/dsa.h>
+#include <utils/memutils.h>
+
+typedef struct
+{
+    RelFileLocator locator;
+    uint64 build_stamp;
+    uint32 generation;
+    int vocab_size;
+    dsa_pointer map; // InvalidDsaPointer if the slot is free
+    pg_atomic_uint64 last_used;
+} ibpe_shared_map_slot;
+
+typedef struct
+{
+    LWLock lock; // protects everything below but last_used
+    int area_tranche;
+    dsa_handle area; // DSA_HANDLE_INVALID until the first map is published
+    pg_atomic_uint64 clock;
+    ibpe_shared_map_slot slots[IBPE_SHARED_MAPS];
+} ibpe_shared_directory;
+
+static ibpe_shared_directory *ibpe_directory = NULL;
+static dsa_area *ibpe_area = NULL;
+
+static void ibpe_init_directory(void *ptr)
+{
+    ibpe_shared_directory *dir = ptr;
+
+    LWLockInitialize(&dir->lock, LWLockNewTrancheId());
+    dir->area_tranche = LWLockNewTrancheId();
+    dir->area = DSA_HANDLE_INVALID;
+    pg_atomic_init_u64(&dir->clock, 0);
+    for (int i = 0; i < IBPE_SHARED_MAPS; ++i) {
+        dir->slots[i].map = InvalidDsaPointer;
+        pg_atomic_init_u64(&dir->slots[i].last_used, 0);
+    }
+}
+
+static ibpe_shared_directory *ibpe_attach_directory(void)
+{
+    if (!ibpe_directory) {
+        bool found;
+        ibpe_directory = GetNamedDSMSegment("ibpe_ptr_directory",
+                                            sizeof(ibpe_shared_directory),
+                                            ibpe_init_directory,
+                                            &found);
+        LWLockRegisterTranche(ibpe_directory->lock.tranche, "ibpe_ptr_directory");
+        LWLockRegisterTranche(ibpe_directory->area_tranche, "ibpe_ptr_area");
+    }
+    return ibpe_directory;
+}
+
+// map the DSA area into this backend, creating it if create is set; caller holds dir->lock
+static dsa_area *ibpe_attach_area(ibpe_shared_directory *dir, bool create)
+{
+    if (ibpe_area) {
+        return ibpe_area;
+    }
+    if (dir->area == DSA_HANDLE_INVALID && !create) {
+        return NULL;
+    }
+
+    // the mapping lives as long as the backend
+    MemoryContext oldcxt = MemoryContextSwitchTo(TopMemoryContext);
+    if (dir->area == DSA_HANDLE_INVALID) {
+        ibpe_area = dsa_create(dir->area_tranche);
+        dsa_pin(ibpe_area);
+        dir->area = dsa_get_handle(ibpe_area);
+    } else {
+        ibpe_area = dsa_attach(dir->area);
+    }
+    dsa_pin_mapping(ibpe_area);
+    MemoryContextSwitchTo(oldcxt);
+
+    return ibpe_area;
+}
+
+static ibpe_shared_map_slot *ibpe_find_slot(ibpe_shared_directory *dir,
+                                            RelFileLocator const *locator)
+{
+    for (int i = 0; i < IBPE_SHARED_MAPS; ++i) {
+        ibpe_shared_map_slot *slot = &dir->slots[i];
+        if (DsaPointerIsValid(slot->map) && RelFileLocatorEquals(slot->locator, *locator)) {
+            return slot;
+        }
+    }
+    return NULL;
+}
+
+bool ibpe_shared_map_lookup(RelFileLocator const *locator,
+                            uint64 build_stamp,
+                            uint32 generation,
+                            int vocab_size,
+                            ibpe_ptr_record *map)
+{
+    ibpe_shared_directory *dir = ibpe_attach_directory();
+    bool found = false;
+
+    LWLockAcquire(&dir->lock, LW_SHARED);
+    ibpe_shared_map_slot *slot = ibpe_find_slot(dir, locator);
+    if (slot && slot->build_stamp == build_stamp && slot->generation == generation
+        && slot->vocab_size == vocab_size) {
+        dsa_area *area = ibpe_attach_area(dir, false);
+        memcpy(map, dsa_get_address(area, slot->map), sizeof(ibpe_ptr_record) * vocab_size);
+        pg_atomic_write_u64(&slot->last_used, pg_atomic_fetch_add_u64(&dir->clock, 1));
+        found = true;
+    }
+    LWLockRelease(&dir->lock);
+
+    return found;
+}
+
+void ibpe_shared_map_publish(RelFileLocator const *locator,
+                             uint64 build_stamp,
+                             uint32 generation,
+                             int vocab_size,
+                             ibpe_ptr_record const *map)
+{
+    ibpe_shared_directory *dir = ibpe_attach_directory();
+
+    LWLockAcquire(&dir->lock, LW_EXCLUSIVE);
+    dsa_area *area = ibpe_attach_area(dir, true);
+
+    // reuse the slot of an older generation or build, else a free one, else the least recently used
+    ibpe_shared_map_slot *slot = ibpe_find_slot(dir, locator);
+    if (slot && slot->build_stamp == build_stamp && slot->generation >= generation) {
+        // someone else got here first, or already published a newer map
+        LWLockRelease(&dir->lock);
+        return;
+    }
+    if (!slot) {
+        for (int i = 0; i < IBPE_SHARED_MAPS; ++i) {
+            ibpe_shared_map_slot *cand = &dir->slots[i];
+            if (!DsaPointerIsValid(cand->map)) {
+                slot = cand;
+                break;
+            }
+            if (!slot
+                || pg_atomic_read_u64(&cand->last_used) < pg_atomic_read_u64(&slot->last_used)) {
+                slot = cand;
+            }
+        }
+    }
+    if (DsaPointerIsValid(slot->map)) {
+        dsa_free(area, slot->map);
+        slot->map = InvalidDsaPointer;
+    }
+
+    dsa_pointer shared = dsa_allocate_extended(area,
+                                               sizeof(ibpe_ptr_record) * vocab_size,
+                                               DSA_ALLOC_NO_OOM);
+    if (DsaPointerIsValid(shared)) {
+        memcpy(dsa_get_address(area, shared), map, sizeof(ibpe_ptr_record) * vocab_size);
+        slot->locator = *locator;
+        slot->build_stamp = build_stamp;
+        slot->generation = generation;
+        slot->vocab_size = vocab_size;
+        slot->map = shared;
+        pg_atomic_write_u64(&slot->last_used, pg_atomic_fetch_add_u64(&dir->clock, 1));
+    }
+    LWLockRelease(&dir->lock);
+}
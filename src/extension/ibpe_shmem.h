@@ -0,0 +1,44 @@
+#ifndef IBPE_SHMEM_H
+#define IBPE_SHMEM_H
+
+#include <postgres.h>
+// The include order is important
+#include <storage/relfilelocator.h>
+
+#include "ibpe_relcache.h"
+
+/*
+ * Pointer directories (token -> SID chain position) shared between backends.
+ *
+ * Walking the PTR chain is the bulk of the work a backend does the first time
+ * it touches an index. The first backend to do so publishes the result in a
+ * DSA area; later ones copy it from there instead. Maps are keyed by the
+ * index's relfilenode, build stamp and metapage generation, so a REINDEX,
+ * TRUNCATE or pending list merge simply stops matching the old entry. The
+ * build stamp also keeps a new index that reuses a dropped one's relfilenode
+ * from picking up its map. Stale entries are evicted least recently used
+ * first once every slot is taken.
+ *
+ * The directory lives in a segment of the DSM registry and needs no
+ * shared_preload_libraries entry.
+ */
+#define IBPE_SHARED_MAPS 64
+
+/*
+ * Copy the shared map for (locator, build_stamp, generation) into
+ * map[0, vocab_size). Returns false if no backend has published it yet.
+ */
+bool ibpe_shared_map_lookup(RelFileLocator const *locator,
+                            uint64 build_stamp,
+                            uint32 generation,
+                            int vocab_size,
+                            ibpe_ptr_record *map);
+
+/* publish map[0, vocab_size) for (locator, build_stamp, generation); best effort */
+void ibpe_shared_map_publish(RelFileLocator const *locator,
+                             uint64 build_stamp,
+                             uint32 generation,
+                             int vocab_size,
+                             ibpe_ptr_record const *map);
+
+#endif // IBPE_SHMEM_H
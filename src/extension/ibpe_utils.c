@@ -1,8 +1,10 @@
 #include "ibpe_utils.h"
 #include "ibpe_backend.h"
 #include "ibpe_build.h"
+#include "ibpe_pending.h"
 #include "ibpe_scan.h"
 #include "ibpe_vacuum.h"
+#include "ibpe_xlog.h"
 
 #include <string.h>
 
@@ -63,7 +65,7 @@ Datum ibpe_handler(PG_FUNCTION_ARGS)
     amroutine->ambuild = ibpe_build;
     amroutine->ambuildempty = ibpe_buildempty;
     amroutine->aminsert = ibpe_insert;
-    amroutine->aminsertcleanup = NULL;
+    amroutine->aminsertcleanup = ibpe_insertcleanup;
     amroutine->ambulkdelete = ibpe_bulkdelete;
     amroutine->amvacuumcleanup = ibpe_vacuumcleanup;
     amroutine->amcanreturn = NULL;
@@ -112,6 +114,52 @@ int ibpe_page_get_free_space(Page page)
     return space;
 }
 
+int ibpe_page_capacity(void)
+{
+    return BLCKSZ - MAXALIGN(SizeOfPageHeaderData) - MAXALIGN(sizeof(ibpe_opaque_data));
+}
+
+void ibpe_init_page(Page page, uint16 flags)
+{
+    PageInit(page, BLCKSZ, sizeof(ibpe_opaque_data));
+
+    ibpe_opaque_data *opaque = ibpe_get_opaque(page);
+    opaque->flags = flags;
+    opaque->data_len = 0;
+    opaque->next_blkno = InvalidBlockNumber;
+    opaque->ibpe_page_id = IBPE_PAGE_ID;
+}
+
+bool ibpe_add_record_to_page(Page page, char *record, int rec_size, uint16 *out_offset)
+{
+    /* We shouldn't be pointed to an invalid page */
+    Assert(!PageIsNew(page) && !ibpe_is_page_deleted(page));
+
+    /* Does new record fit on the page? */
+    if (ibpe_page_get_free_space(page) < rec_size) {
+        return false;
+    }
+
+    /* Copy new tuple to the end of page */
+    ibpe_opaque_data *opaque = ibpe_get_opaque(page);
+    char *mem = PageGetContents(page) + opaque->data_len;
+    memcpy(mem, record, rec_size);
+
+    /* Store offset to the new data */
+    if (out_offset) {
+        *out_offset = opaque->data_len;
+    }
+
+    /* Adjust maxoff and pd_lower */
+    opaque->data_len += rec_size;
+    ((PageHeader) page)->pd_lower = (mem + rec_size) - page;
+
+    /* Assert we didn't overrun available space */
+    Assert(((PageHeader) page)->pd_lower <= ((PageHeader) page)->pd_upper);
+
+    return true;
+}
+
 // index options
 static relopt_kind ibpe_relopt_kind;
 static relopt_parse_elt ibpe_relopt_tab[2];
@@ -143,6 +191,12 @@ void _PG_init(void)
     ibpe_relopt_tab[1].optname = "normalize_mappings";
     ibpe_relopt_tab[1].opttype = RELOPT_TYPE_STRING;
     ibpe_relopt_tab[1].offset = offsetof(ibpe_options_data, normalize_mappings);
+
+    ibpe_define_scan_gucs();
+    ibpe_define_pending_gucs();
+
+    // compact WAL records, if we are in shared_preload_libraries
+    ibpe_register_rmgr();
 }
 
 /* parse index reloptions */
@@ -30,12 +30,25 @@ typedef struct __attribute__((packed))
 // page flags
 #define IBPE_PAGE_META (1 << 0)
 #define IBPE_PAGE_DELETED (1 << 1)
-#define IBPE_PAGE_PTR (1 << 2)     // containing pageid and offset for each token
-#define IBPE_PAGE_SID (1 << 3)     // containing sentence ids
-#define IBPE_PAGE_PENDING (1 << 4) // pending inserts not yet merged into main index
+#define IBPE_PAGE_PTR (1 << 2)          // containing pageid and offset for each token
+#define IBPE_PAGE_SID (1 << 3)          // containing sentence ids
+#define IBPE_PAGE_PENDING (1 << 4)      // pending inserts not yet merged into main index
+#define IBPE_PAGE_PENDING_ROOT (1 << 5) // head and tail of one pending chain
 
 #define IBPE_PAGE_ID (0x1B9E)
 
+// pending inserts are spread over this many chains, each with a root page at block 1 + p
+#define IBPE_PENDING_PARTITIONS 8
+#define IBPE_PENDING_ROOT_BLKNO(p) ((BlockNumber) (1 + (p)))
+
+// pending pages of one partition consumed by the last merge
+typedef struct
+{
+    BlockNumber tail; // last merged page; InvalidBlockNumber if none
+    int n_entries;
+    uint32 n_pages;
+} ibpe_pending_cut;
+
 // data structure stored in the meta page (page #0 of the index relation)
 #define TOKENIZER_PATH_MAXLEN 255
 #define NORMALIZE_MAPPINGS_MAXLEN 8
@@ -47,13 +60,32 @@ typedef struct
     char normalize_mappings[NORMALIZE_MAPPINGS_MAXLEN][2];
     bool index_built;
     int num_indexed_tokens;
-    BlockNumber pending_blkno; // head of pending page chain; InvalidBlockNumber if none
-    int n_pending;             // total pending entries across all pending pages
+    uint32 format_version; // must equal IBPE_FORMAT_VERSION
+    BlockNumber ptr_blkno;      // head of the PTR page chain
+    BlockNumber sid_blkno;      // head of the SID page chain
+    BlockNumber sid_tail_blkno; // last page of the SID chain; merges append after it
+    uint64 sid_live_bytes;      // SID bytes the PTR chain points to
+    uint64 sid_dead_bytes;      // SID bytes of posting lists a merge superseded
+    uint32 generation;     // bumped whenever a merge replaces the PTR/SID chains
+    uint64 build_stamp;    // random, drawn whenever the metapage is initialized
+    ibpe_pending_cut pending_cut[IBPE_PENDING_PARTITIONS];
 } ibpe_metapage_data;
 
 #define IBPE_MAGICK_NUMBER (0xFEEDBEEF)
+#define IBPE_FORMAT_VERSION 6
 
-// one record in the pending page chain
+// data structure stored in a pending root page; only inserters of that partition lock it
+typedef struct
+{
+    BlockNumber head;  // first page of the chain; InvalidBlockNumber if empty
+    BlockNumber tail;  // last page of the chain
+    int n_pending;     // entries in the chain
+    uint32 n_pages;    // pages in the chain
+    bool tail_sealed;  // a merge is reading the tail; start a new page
+    uint32 generation; // metapage generation whose pending_cut has been applied
+} ibpe_pending_root_data;
+
+// one pending posting, as decoded from the pending chain (see ibpe_pending.h)
 typedef struct
 {
     int token;
@@ -95,6 +127,14 @@ bool ibpe_is_page_deleted(Page page);
 
 int ibpe_page_get_free_space(Page page);
 
+/* free space of an empty page */
+int ibpe_page_capacity(void);
+
+void ibpe_init_page(Page page, uint16 flags);
+
+/* append rec_size bytes to the data area; false if they do not fit */
+bool ibpe_add_record_to_page(Page page, char *record, int rec_size, uint16 *out_offset);
+
 // Callback routines
 
 /* parse index reloptions */
@@ -1,12 +1,15 @@
 #include "ibpe_vacuum.h"
 #include "ibpe_backend.h"
+#include "ibpe_pending.h"
 #include "ibpe_utils.h"
+#include "ibpe_xlog.h"
 
 #include <access/genam.h>
 #include <access/generic_xlog.h>
 #include <commands/vacuum.h>
 #include <storage/bufmgr.h>
 #include <storage/indexfsm.h>
+#include <storage/lmgr.h>
 
 /*
  * Bulk deletion of all index entries pointing to a set of heap tuples.
@@ -27,23 +30,23 @@ IndexBulkDeleteResult *ibpe_bulkdelete(IndexVacuumInfo *info,
     }
 
     /*
-     * Load pending chain info from metapage.  Dead entries in the main bulk
+     * Load the pending chains from their roots.  Dead entries in the main bulk
      * SID pages are left in place; needs_recheck=true means PostgreSQL rechecks
      * every TID and discards dead heap tuples automatically.  We only compact
      * the pending list, which is small and fully under our control.
      */
-    Buffer meta_buf = ReadBufferExtended(index, MAIN_FORKNUM, 0, RBM_NORMAL, info->strategy);
-    LockBuffer(meta_buf, BUFFER_LOCK_SHARE);
-    ibpe_metapage_data *meta = (ibpe_metapage_data *) PageGetContents(BufferGetPage(meta_buf));
-    BlockNumber pending_head = meta->pending_blkno;
-    int n_pending_total = meta->n_pending;
-    UnlockReleaseBuffer(meta_buf);
+    // a concurrent merge would recycle the pending pages under us
+    LockPage(index, IBPE_MERGE_LOCK_BLKNO, ExclusiveLock);
+
+    ibpe_metapage_data meta;
+    ibpe_pending_chain chains[IBPE_PENDING_PARTITIONS];
+    ibpe_snapshot_pending(index, &meta, chains);
 
     int n_deleted = 0;
 
-    /* Walk the pending chain, zeroing out dead entries in-place. */
-    if (pending_head != InvalidBlockNumber && n_pending_total > 0) {
-        BlockNumber blkno = pending_head;
+    /* Walk each pending chain, zeroing out dead entries in-place. */
+    for (int part = 0; part < IBPE_PENDING_PARTITIONS; part++) {
+        BlockNumber blkno = chains[part].head;
         while (blkno != InvalidBlockNumber) {
             vacuum_delay_point(false);
 
@@ -52,51 +55,52 @@ IndexBulkDeleteResult *ibpe_bulkdelete(IndexVacuumInfo *info,
             Page page = BufferGetPage(buf);
             ibpe_opaque_data *opaque = ibpe_get_opaque(page);
 
-            Assert((opaque->flags & IBPE_PAGE_PENDING) != 0);
+            if ((opaque->flags & IBPE_PAGE_PENDING) == 0) {
+                UnlockReleaseBuffer(buf);
+                break;
+            }
 
             BlockNumber next = opaque->next_blkno;
 
-            /* First pass: check whether this page has any dead entries. */
+            /* First pass: check whether this page has any dead records. */
             bool has_dead = false;
             {
-                char *p = PageGetContents(page);
-                char *end = p + opaque->data_len;
-                while (p + sizeof(ibpe_pending_entry) <= end) {
-                    ibpe_pending_entry *ent = (ibpe_pending_entry *) p;
-                    if (ent->entry.sent_id != 0) {
-                        ItemPointerData tid = ibpe_sentid_to_tid(ent->entry.sent_id);
-                        if (callback(&tid, callback_state)) {
-                            has_dead = true;
-                            break;
-                        }
+                char const *p = PageGetContents(page);
+                char const *end = p + opaque->data_len;
+                while (p < end && !has_dead) {
+                    ibpe_pending_record rec;
+                    p = ibpe_parse_pending_record(p, end, &rec);
+                    if (rec.sent_id != 0) {
+                        ItemPointerData tid = ibpe_sentid_to_tid(rec.sent_id);
+                        has_dead = callback(&tid, callback_state);
                     }
-                    p += sizeof(ibpe_pending_entry);
                 }
             }
 
             if (has_dead) {
                 /*
-                 * Second pass: zero out dead entries via WAL.  Setting token=-1
-                 * prevents the scan from matching this entry (all valid tokens
-                 * are >= 0).  Setting sent_id=0 makes ibpe_getbitmap skip it
-                 * even if a stale scan loads it.
+                 * Second pass: kill dead records via WAL by zeroing their
+                 * sent_id, which makes every reader of the pending chain
+                 * skip them.
                  */
                 GenericXLogState *xlog_state = GenericXLogStart(index);
-                Page xlog_page = GenericXLogRegisterBuffer(xlog_state, buf, GENERIC_XLOG_FULL_IMAGE);
+                Page xlog_page = GenericXLogRegisterBuffer(xlog_state, buf, 0);
 
                 char *p = PageGetContents(xlog_page);
                 char *end = p + ibpe_get_opaque(xlog_page)->data_len;
-                while (p + sizeof(ibpe_pending_entry) <= end) {
-                    ibpe_pending_entry *ent = (ibpe_pending_entry *) p;
-                    if (ent->entry.sent_id != 0) {
-                        ItemPointerData tid = ibpe_sentid_to_tid(ent->entry.sent_id);
+                while (p < end) {
+                    ibpe_pending_record rec;
+                    char *next_rec = (char *) ibpe_parse_pending_record(p, end, &rec);
+                    if (rec.sent_id != 0) {
+                        ItemPointerData tid = ibpe_sentid_to_tid(rec.sent_id);
                         if (callback(&tid, callback_state)) {
-                            ent->token = -1;
-                            ent->entry.sent_id = 0;
-                            n_deleted++;
+                            memset(p, 0, sizeof(sentid_t));
+                            // a sentence split over several records counts once
+                            if (rec.first_pos == 0)
+                                n_deleted++;
                         }
                     }
-                    p += sizeof(ibpe_pending_entry);
+                    p = next_rec;
                 }
 
                 GenericXLogFinish(xlog_state);
@@ -107,14 +111,15 @@ IndexBulkDeleteResult *ibpe_bulkdelete(IndexVacuumInfo *info,
         }
     }
 
+    UnlockPage(index, IBPE_MERGE_LOCK_BLKNO, ExclusiveLock);
+
     stats->tuples_removed += n_deleted;
 
     /*
-     * We intentionally leave meta->n_pending unchanged even though some
-     * entries were zeroed out.  n_pending is used only as an allocation
-     * bound in ibpe_getbitmap; dead entries (token = -1) are silently
-     * skipped by the token-matching loop in ibpe_access_index, so keeping
-     * the physical count correct avoids a subtle scan truncation bug.
+     * We intentionally leave each root's n_pending unchanged even though
+     * some records were killed.  n_pending is the physical entry count of the
+     * chain, which a merge subtracts once it has consumed those pages;
+     * readers only use it as an allocation bound and skip dead records.
      */
 
     /* Count pages and SID index tuples for planner statistics. */
@@ -142,6 +147,65 @@ IndexBulkDeleteResult *ibpe_bulkdelete(IndexVacuumInfo *info,
     return stats;
 }
 
+/*
+ * Mark PTR/SID pages that no metapage chain reaches as deleted. They are left
+ * behind by a merge that failed or crashed before installing its new chains.
+ * Orphaned pending pages (a crash between installing a merge and recycling
+ * its input) are not detected, since inserters extend that chain concurrently.
+ */
+static void ibpe_collect_orphans(Relation index, BufferAccessStrategy strategy)
+{
+    LockPage(index, IBPE_MERGE_LOCK_BLKNO, ExclusiveLock);
+
+    Buffer meta_buf = ReadBufferExtended(index, MAIN_FORKNUM, 0, RBM_NORMAL, strategy);
+    LockBuffer(meta_buf, BUFFER_LOCK_SHARE);
+    ibpe_metapage_data *meta = (ibpe_metapage_data *) PageGetContents(BufferGetPage(meta_buf));
+    BlockNumber heads[] = {meta->ptr_blkno, meta->sid_blkno};
+    UnlockReleaseBuffer(meta_buf);
+
+    // only merges, which we exclude, create PTR/SID pages; new blocks are not ours to judge
+    BlockNumber npages = RelationGetNumberOfBlocks(index);
+    bool *reachable = palloc0(npages * sizeof(bool));
+
+    for (int c = 0; c < lengthof(heads); c++) {
+        for (BlockNumber blkno = heads[c]; blkno != InvalidBlockNumber && blkno < npages;) {
+            Buffer buf = ReadBufferExtended(index, MAIN_FORKNUM, blkno, RBM_NORMAL, strategy);
+            LockBuffer(buf, BUFFER_LOCK_SHARE);
+            reachable[blkno] = true;
+            BlockNumber next = ibpe_get_opaque(BufferGetPage(buf))->next_blkno;
+            UnlockReleaseBuffer(buf);
+            blkno = next;
+        }
+    }
+
+    int n_orphans = 0;
+    for (BlockNumber blkno = 1; blkno < npages; blkno++) {
+        vacuum_delay_point(false);
+
+        if (reachable[blkno])
+            continue;
+
+        Buffer buf = ReadBufferExtended(index, MAIN_FORKNUM, blkno, RBM_NORMAL, strategy);
+        LockBuffer(buf, BUFFER_LOCK_EXCLUSIVE);
+        Page page = BufferGetPage(buf);
+
+        if (!PageIsNew(page) && !ibpe_is_page_deleted(page)
+            && (ibpe_get_opaque(page)->flags & (IBPE_PAGE_PTR | IBPE_PAGE_SID)) != 0) {
+            ibpe_log_delete_pages(index, &buf, 1);
+            n_orphans++;
+        }
+
+        UnlockReleaseBuffer(buf);
+    }
+
+    pfree(reachable);
+    UnlockPage(index, IBPE_MERGE_LOCK_BLKNO, ExclusiveLock);
+
+    if (n_orphans > 0) {
+        elog(NOTICE, "ibpe_vacuumcleanup: reclaimed %d orphaned pages", n_orphans);
+    }
+}
+
 /*
  * Post-VACUUM cleanup.
  *
@@ -160,6 +224,11 @@ IndexBulkDeleteResult *ibpe_vacuumcleanup(IndexVacuumInfo *info, IndexBulkDelete
         stats = palloc0_object(IndexBulkDeleteResult);
     }
 
+    // fold the pending list into the main posting lists, and drop superseded ones if need be
+    ibpe_merge_pending(index, true, true);
+
+    ibpe_collect_orphans(index, info->strategy);
+
     /*
 	 * Iterate over the pages: insert deleted pages into FSM and collect
 	 * statistics.
@@ -0,0 +1,566 @@
+#include "ibpe_xlog.h"
+#include "ibpe_utils.h"
+
+#include <access/bufmask.h>
+#include <access/generic_xlog.h>
+#include <access/transam.h>
+#include <access/xlog.h>
+#include <access/xlog_internal.h>
+#include <access/xloginsert.h>
+#include <access/xlogutils.h>
+#include <miscadmin.h>
+#include <storage/standby.h>
+
+bool ibpe_custom_wal = false;
+
+static RmgrData const ibpe_rmgr = {
+    .rm_name = IBPE_RMGR_NAME,
+    .rm_redo = ibpe_redo,
+    .rm_desc = ibpe_desc,
+    .rm_identify = ibpe_identify,
+    .rm_mask = ibpe_mask,
+};
+
+void ibpe_register_rmgr(void)
+{
+    if (!process_shared_preload_libraries_in_progress) {
+        return;
+    }
+
+    RegisterCustomRmgr(IBPE_RMGR_ID, &ibpe_rmgr);
+    ibpe_custom_wal = true;
+}
+
+// page changes shared by the logging functions and redo
+
+static void ibpe_set_next(Page page, BlockNumber next_blkno)
+{
+    ibpe_get_opaque(page)->next_blkno = next_blkno;
+}
+
+static void ibpe_mark_deleted(Page page, TransactionId horizon)
+{
+    ibpe_get_opaque(page)->flags |= IBPE_PAGE_DELETED;
+    ((PageHeader) page)->pd_prune_xid = horizon;
+}
+
+static void ibpe_root_add(Page root_page,
+                          BlockNumber first_blkno,
+                          BlockNumber last_blkno,
+                          uint32 n_pages,
+                          int n_entries)
+{
+    ibpe_pending_root_data *root = (ibpe_pending_root_data *) PageGetContents(root_page);
+    if (n_pages > 0) {
+        if (root->head == InvalidBlockNumber) {
+            root->head = first_blkno;
+        }
+        root->tail = last_blkno;
+        root->tail_sealed = false;
+        root->n_pages += n_pages;
+    }
+    root->n_pending += n_entries;
+}
+
+void ibpe_log_write_page(Relation indexRelation, Buffer buf, Page staging, Buffer prev_buf)
+{
+    BlockNumber blkno = BufferGetBlockNumber(buf);
+
+    if (!ibpe_custom_wal) {
+        GenericXLogState *state = GenericXLogStart(indexRelation);
+        Page page = GenericXLogRegisterBuffer(state, buf, GENERIC_XLOG_FULL_IMAGE);
+        memcpy(page, staging, BLCKSZ);
+        if (prev_buf != InvalidBuffer) {
+            ibpe_set_next(GenericXLogRegisterBuffer(state, prev_buf, 0), blkno);
+        }
+        GenericXLogFinish(state);
+        return;
+    }
+
+    START_CRIT_SECTION();
+
+    Page page = BufferGetPage(buf);
+    memcpy(page, staging, BLCKSZ);
+    MarkBufferDirty(buf);
+    if (prev_buf != InvalidBuffer) {
+        ibpe_set_next(BufferGetPage(prev_buf), blkno);
+        MarkBufferDirty(prev_buf);
+    }
+
+    if (RelationNeedsWAL(indexRelation)) {
+        ibpe_opaque_data *opaque = ibpe_get_opaque(page);
+        xl_ibpe_write_page xlrec = {
+            .flags = opaque->flags,
+            .next_blkno = opaque->next_blkno,
+        };
+
+        // only the data area; redo rebuilds the header and the special space
+        XLogBeginInsert();
+        XLogRegisterData((char *) &xlrec, sizeof(xlrec));
+        XLogRegisterBuffer(0, buf, REGBUF_WILL_INIT);
+        if (opaque->data_len > 0) {
+            XLogRegisterBufData(0, PageGetContents(page), opaque->data_len);
+        }
+        if (prev_buf != InvalidBuffer) {
+            XLogRegisterBuffer(1, prev_buf, REGBUF_STANDARD);
+        }
+
+        XLogRecPtr lsn = XLogInsert(IBPE_RMGR_ID, XLOG_IBPE_WRITE_PAGE);
+        PageSetLSN(page, lsn);
+        if (prev_buf != InvalidBuffer) {
+            PageSetLSN(BufferGetPage(prev_buf), lsn);
+        }
+    }
+
+    END_CRIT_SECTION();
+}
+
+void ibpe_log_pending_append(Relation indexRelation,
+                             Buffer root_buf,
+                             Buffer target_buf,
+                             bool init_target,
+                             Buffer prev_buf,
+                             char *record,
+                             int rec_len,
+                             int n_entries)
+{
+    BlockNumber target_blkno = BufferGetBlockNumber(target_buf);
+    uint32 n_new_pages = init_target ? 1 : 0;
+
+    // checked up front: an error inside the critical section would be a PANIC
+    int avail = init_target ? ibpe_page_capacity()
+                            : ibpe_page_get_free_space(BufferGetPage(target_buf));
+    if (rec_len > avail) {
+        elog(ERROR, "ibpe_insert: pending record does not fit on page %u", target_blkno);
+    }
+
+    if (!ibpe_custom_wal) {
+        GenericXLogState *state = GenericXLogStart(indexRelation);
+        Page target_page = GenericXLogRegisterBuffer(state,
+                                                     target_buf,
+                                                     init_target ? GENERIC_XLOG_FULL_IMAGE : 0);
+        if (init_target) {
+            ibpe_init_page(target_page, IBPE_PAGE_PENDING);
+        }
+        ibpe_add_record_to_page(target_page, record, rec_len, NULL);
+        if (prev_buf != InvalidBuffer) {
+            ibpe_set_next(GenericXLogRegisterBuffer(state, prev_buf, 0), target_blkno);
+        }
+        ibpe_root_add(GenericXLogRegisterBuffer(state, root_buf, 0),
+                      target_blkno,
+                      target_blkno,
+                      n_new_pages,
+                      n_entries);
+        GenericXLogFinish(state);
+        return;
+    }
+
+    START_CRIT_SECTION();
+
+    Page target_page = BufferGetPage(target_buf);
+    if (init_target) {
+        ibpe_init_page(target_page, IBPE_PAGE_PENDING);
+    }
+    ibpe_add_record_to_page(target_page, record, rec_len, NULL);
+    MarkBufferDirty(target_buf);
+    if (prev_buf != InvalidBuffer) {
+        ibpe_set_next(BufferGetPage(prev_buf), target_blkno);
+        MarkBufferDirty(prev_buf);
+    }
+    ibpe_root_add(BufferGetPage(root_buf), target_blkno, target_blkno, n_new_pages, n_entries);
+    MarkBufferDirty(root_buf);
+
+    if (RelationNeedsWAL(indexRelation)) {
+        xl_ibpe_pending_append xlrec = {
+            .n_entries = n_entries,
+            .flags = init_target ? XLOG_IBPE_INIT_PAGE : 0,
+        };
+
+        XLogBeginInsert();
+        XLogRegisterData((char *) &xlrec, sizeof(xlrec));
+        XLogRegisterBuffer(0, root_buf, REGBUF_STANDARD);
+        XLogRegisterBuffer(1, target_buf, init_target ? REGBUF_WILL_INIT : REGBUF_STANDARD);
+        XLogRegisterBufData(1, record, rec_len);
+        if (prev_buf != InvalidBuffer) {
+            XLogRegisterBuffer(2, prev_buf, REGBUF_STANDARD);
+        }
+
+        XLogRecPtr lsn = XLogInsert(IBPE_RMGR_ID, XLOG_IBPE_PENDING_APPEND);
+        PageSetLSN(BufferGetPage(root_buf), lsn);
+        PageSetLSN(target_page, lsn);
+        if (prev_buf != InvalidBuffer) {
+            PageSetLSN(BufferGetPage(prev_buf), lsn);
+        }
+    }
+
+    END_CRIT_SECTION();
+}
+
+void ibpe_log_pending_link(Relation indexRelation,
+                           Buffer root_buf,
+                           Buffer prev_buf,
+                           BlockNumber first_blkno,
+                           BlockNumber last_blkno,
+                           uint32 n_pages,
+                           int n_entries)
+{
+    if (!ibpe_custom_wal) {
+        GenericXLogState *state = GenericXLogStart(indexRelation);
+        if (prev_buf != InvalidBuffer) {
+            ibpe_set_next(GenericXLogRegisterBuffer(state, prev_buf, 0), first_blkno);
+        }
+        ibpe_root_add(GenericXLogRegisterBuffer(state, root_buf, 0),
+                      first_blkno,
+                      last_blkno,
+                      n_pages,
+                      n_entries);
+        GenericXLogFinish(state);
+        return;
+    }
+
+    START_CRIT_SECTION();
+
+    if (prev_buf != InvalidBuffer) {
+        ibpe_set_next(BufferGetPage(prev_buf), first_blkno);
+        MarkBufferDirty(prev_buf);
+    }
+    ibpe_root_add(BufferGetPage(root_buf), first_blkno, last_blkno, n_pages, n_entries);
+    MarkBufferDirty(root_buf);
+
+    if (RelationNeedsWAL(indexRelation)) {
+        xl_ibpe_pending_link xlrec = {
+            .first_blkno = first_blkno,
+            .last_blkno = last_blkno,
+            .n_pages = n_pages,
+            .n_entries = n_entries,
+        };
+
+        XLogBeginInsert();
+        XLogRegisterData((char *) &xlrec, sizeof(xlrec));
+        XLogRegisterBuffer(0, root_buf, REGBUF_STANDARD);
+        if (prev_buf != InvalidBuffer) {
+            XLogRegisterBuffer(1, prev_buf, REGBUF_STANDARD);
+        }
+
+        XLogRecPtr lsn = XLogInsert(IBPE_RMGR_ID, XLOG_IBPE_PENDING_LINK);
+        PageSetLSN(BufferGetPage(root_buf), lsn);
+        if (prev_buf != InvalidBuffer) {
+            PageSetLSN(BufferGetPage(prev_buf), lsn);
+        }
+    }
+
+    END_CRIT_SECTION();
+}
+
+void ibpe_log_delete_pages(Relation indexRelation, Buffer const *bufs, int n_bufs)
+{
+    Assert(n_bufs > 0 && n_bufs <= IBPE_MAX_DELETE_PAGES);
+
+    // every snapshot that may still lead a scan to these pages is older than this
+    xl_ibpe_delete_pages xlrec = {.horizon = ReadNextTransactionId()};
+
+    if (!ibpe_custom_wal) {
+        for (int i = 0; i < n_bufs; i += MAX_GENERIC_XLOG_PAGES) {
+            GenericXLogState *state = GenericXLogStart(indexRelation);
+            for (int j = i; j < Min(i + MAX_GENERIC_XLOG_PAGES, n_bufs); j++) {
+                ibpe_mark_deleted(GenericXLogRegisterBuffer(state, bufs[j], 0), xlrec.horizon);
+            }
+            GenericXLogFinish(state);
+        }
+        return;
+    }
+
+    bool needs_wal = RelationNeedsWAL(indexRelation);
+    if (needs_wal) {
+        XLogEnsureRecordSpace(n_bufs - 1, 0);
+    }
+
+    START_CRIT_SECTION();
+
+    for (int i = 0; i < n_bufs; i++) {
+        ibpe_mark_deleted(BufferGetPage(bufs[i]), xlrec.horizon);
+        MarkBufferDirty(bufs[i]);
+    }
+
+    if (needs_wal) {
+        XLogBeginInsert();
+        XLogRegisterData((char *) &xlrec, sizeof(xlrec));
+        for (int i = 0; i < n_bufs; i++) {
+            XLogRegisterBuffer(i, bufs[i], REGBUF_STANDARD);
+        }
+
+        XLogRecPtr lsn = XLogInsert(IBPE_RMGR_ID, XLOG_IBPE_DELETE_PAGES);
+        for (int i = 0; i < n_bufs; i++) {
+            PageSetLSN(BufferGetPage(bufs[i]), lsn);
+        }
+    }
+
+    END_CRIT_SECTION();
+}
+
+void ibpe_log_reuse_page(Relation indexRelation, Page page)
+{
+    /*
+     * Generic WAL has no way to raise a recovery conflict, so without the
+     * custom resource manager a hot standby query that began before a merge
+     * may read a page that has since been reused.
+     */
+    if (!ibpe_custom_wal || !RelationNeedsWAL(indexRelation) || !XLogStandbyInfoActive()) {
+        return;
+    }
+
+    xl_ibpe_reuse_page xlrec = {
+        .locator = indexRelation->rd_locator,
+        .horizon = ((PageHeader) page)->pd_prune_xid,
+    };
+
+    XLogBeginInsert();
+    XLogRegisterData((char *) &xlrec, sizeof(xlrec));
+    XLogInsert(IBPE_RMGR_ID, XLOG_IBPE_REUSE_PAGE);
+}
+
+// redo
+
+/* point block_id's page, if the record has it, at next_blkno */
+static void ibpe_redo_link(XLogReaderState *record, uint8 block_id, BlockNumber next_blkno)
+{
+    if (!XLogRecHasBlockRef(record, block_id)) {
+        return;
+    }
+
+    Buffer buf;
+    if (XLogReadBufferForRedo(record, block_id, &buf) == BLK_NEEDS_REDO) {
+        Page page = BufferGetPage(buf);
+        ibpe_set_next(page, next_blkno);
+        PageSetLSN(page, record->EndRecPtr);
+        MarkBufferDirty(buf);
+    }
+    if (BufferIsValid(buf)) {
+        UnlockReleaseBuffer(buf);
+    }
+}
+
+/* redo ibpe_root_add on block 0 */
+static void ibpe_redo_root(XLogReaderState *record,
+                           BlockNumber first_blkno,
+                           BlockNumber last_blkno,
+                           uint32 n_pages,
+                           int n_entries)
+{
+    Buffer buf;
+    if (XLogReadBufferForRedo(record, 0, &buf) == BLK_NEEDS_REDO) {
+        Page page = BufferGetPage(buf);
+        ibpe_root_add(page, first_blkno, last_blkno, n_pages, n_entries);
+        PageSetLSN(page, record->EndRecPtr);
+        MarkBufferDirty(buf);
+    }
+    if (BufferIsValid(buf)) {
+        UnlockReleaseBuffer(buf);
+    }
+}
+
+static void ibpe_redo_write_page(XLogReaderState *record)
+{
+    xl_ibpe_write_page *xlrec = (xl_ibpe_write_page *) XLogRecGetData(record);
+
+    BlockNumber blkno;
+    XLogRecGetBlockTag(record, 0, NULL, NULL, &blkno);
+
+    Buffer buf = XLogInitBufferForRedo(record, 0);
+    Page page = BufferGetPage(buf);
+    ibpe_init_page(page, xlrec->flags);
+
+    Size len = 0;
+    char *data = XLogRecGetBlockData(record, 0, &len);
+    if (len > 0 && !ibpe_add_record_to_page(page, data, len, NULL)) {
+        elog(PANIC, "ibpe_redo: page data does not fit on page %u", blkno);
+    }
+    ibpe_set_next(page, xlrec->next_blkno);
+
+    PageSetLSN(page, record->EndRecPtr);
+    MarkBufferDirty(buf);
+    UnlockReleaseBuffer(buf);
+
+    // the new page is unreachable until this link, so hot standby readers never see it half done
+    ibpe_redo_link(record, 1, blkno);
+}
+
+static void ibpe_redo_pending_append(XLogReaderState *record)
+{
+    xl_ibpe_pending_append *xlrec = (xl_ibpe_pending_append *) XLogRecGetData(record);
+    bool init_target = (xlrec->flags & XLOG_IBPE_INIT_PAGE) != 0;
+
+    BlockNumber target_blkno;
+    XLogRecGetBlockTag(record, 1, NULL, NULL, &target_blkno);
+
+    Buffer buf;
+    XLogRedoAction action;
+    if (init_target) {
+        buf = XLogInitBufferForRedo(record, 1);
+        ibpe_init_page(BufferGetPage(buf), IBPE_PAGE_PENDING);
+        action = BLK_NEEDS_REDO;
+    } else {
+        action = XLogReadBufferForRedo(record, 1, &buf);
+    }
+
+    if (action == BLK_NEEDS_REDO) {
+        Page page = BufferGetPage(buf);
+        Size len = 0;
+        char *data = XLogRecGetBlockData(record, 1, &len);
+        if (!ibpe_add_record_to_page(page, data, len, NULL)) {
+            elog(PANIC, "ibpe_redo: pending record does not fit on page %u", target_blkno);
+        }
+        PageSetLSN(page, record->EndRecPtr);
+        MarkBufferDirty(buf);
+    }
+    if (BufferIsValid(buf)) {
+        UnlockReleaseBuffer(buf);
+    }
+
+    // same order as readers walk: the root moves to the new tail last
+    ibpe_redo_link(record, 2, target_blkno);
+    ibpe_redo_root(record,
+                   target_blkno,
+                   target_blkno,
+                   init_target ? 1 : 0,
+                   xlrec->n_entries);
+}
+
+static void ibpe_redo_pending_link(XLogReaderState *record)
+{
+    xl_ibpe_pending_link *xlrec = (xl_ibpe_pending_link *) XLogRecGetData(record);
+
+    ibpe_redo_link(record, 1, xlrec->first_blkno);
+    ibpe_redo_root(record, xlrec->first_blkno, xlrec->last_blkno, xlrec->n_pages, xlrec->n_entries);
+}
+
+static void ibpe_redo_delete_pages(XLogReaderState *record)
+{
+    xl_ibpe_delete_pages *xlrec = (xl_ibpe_delete_pages *) XLogRecGetData(record);
+
+    for (int block_id = 0; block_id <= XLogRecMaxBlockId(record); block_id++) {
+        Buffer buf;
+        if (XLogReadBufferForRedo(record, block_id, &buf) == BLK_NEEDS_REDO) {
+            Page page = BufferGetPage(buf);
+            ibpe_mark_deleted(page, xlrec->horizon);
+            PageSetLSN(page, record->EndRecPtr);
+            MarkBufferDirty(buf);
+        }
+        if (BufferIsValid(buf)) {
+            UnlockReleaseBuffer(buf);
+        }
+    }
+}
+
+/*
+ * Standby scans do not take part in the primary's wait for scans before pages
+ * are deleted; instead, reusing a page conflicts with the queries that may
+ * still follow a stale PTR map or pending cut to it.
+ */
+static void ibpe_redo_reuse_page(XLogReaderState *record)
+{
+    xl_ibpe_reuse_page *xlrec = (xl_ibpe_reuse_page *) XLogRecGetData(record);
+
+    if (InHotStandby) {
+        ResolveRecoveryConflictWithSnapshot(xlrec->horizon, false, xlrec->locator);
+    }
+}
+
+void ibpe_redo(XLogReaderState *record)
+{
+    uint8 info = XLogRecGetInfo(record) & ~XLR_INFO_MASK;
+
+    switch (info) {
+    case XLOG_IBPE_WRITE_PAGE:
+        ibpe_redo_write_page(record);
+        break;
+    case XLOG_IBPE_PENDING_APPEND:
+        ibpe_redo_pending_append(record);
+        break;
+    case XLOG_IBPE_PENDING_LINK:
+        ibpe_redo_pending_link(record);
+        break;
+    case XLOG_IBPE_DELETE_PAGES:
+        ibpe_redo_delete_pages(record);
+        break;
+    case XLOG_IBPE_REUSE_PAGE:
+        ibpe_redo_reuse_page(record);
+        break;
+    default:
+        elog(PANIC, "ibpe_redo: unknown op code %u", info);
+    }
+}
+
+void ibpe_desc(StringInfo buf, XLogReaderState *record)
+{
+    char *rec = XLogRecGetData(record);
+    uint8 info = XLogRecGetInfo(record) & ~XLR_INFO_MASK;
+
+    switch (info) {
+    case XLOG_IBPE_WRITE_PAGE: {
+        xl_ibpe_write_page *xlrec = (xl_ibpe_write_page *) rec;
+        appendStringInfo(buf, "flags: 0x%x, next: %u", xlrec->flags, xlrec->next_blkno);
+        break;
+    }
+    case XLOG_IBPE_PENDING_APPEND: {
+        xl_ibpe_pending_append *xlrec = (xl_ibpe_pending_append *) rec;
+        appendStringInfo(buf,
+                         "n_entries: %d, new page: %s",
+                         xlrec->n_entries,
+                         (xlrec->flags & XLOG_IBPE_INIT_PAGE) ? "true" : "false");
+        break;
+    }
+    case XLOG_IBPE_PENDING_LINK: {
+        xl_ibpe_pending_link *xlrec = (xl_ibpe_pending_link *) rec;
+        appendStringInfo(buf,
+                         "first: %u, last: %u, n_pages: %u, n_entries: %d",
+                         xlrec->first_blkno,
+                         xlrec->last_blkno,
+                         xlrec->n_pages,
+                         xlrec->n_entries);
+        break;
+    }
+    case XLOG_IBPE_DELETE_PAGES: {
+        xl_ibpe_delete_pages *xlrec = (xl_ibpe_delete_pages *) rec;
+        appendStringInfo(buf,
+                         "n_pages: %d, horizon: %u",
+                         XLogRecMaxBlockId(record) + 1,
+                         xlrec->horizon);
+        break;
+    }
+    case XLOG_IBPE_REUSE_PAGE: {
+        xl_ibpe_reuse_page *xlrec = (xl_ibpe_reuse_page *) rec;
+        appendStringInfo(buf,
+                         "rel: %u/%u/%u, horizon: %u",
+                         xlrec->locator.spcOid,
+                         xlrec->locator.dbOid,
+                         xlrec->locator.relNumber,
+                         xlrec->horizon);
+        break;
+    }
+    }
+}
+
+const char *ibpe_identify(uint8 info)
+{
+    switch (info & ~XLR_INFO_MASK) {
+    case XLOG_IBPE_WRITE_PAGE:
+        return "WRITE_PAGE";
+    case XLOG_IBPE_PENDING_APPEND:
+        return "PENDING_APPEND";
+    case XLOG_IBPE_PENDING_LINK:
+        return "PENDING_LINK";
+    case XLOG_IBPE_DELETE_PAGES:
+        return "DELETE_PAGES";
+    case XLOG_IBPE_REUSE_PAGE:
+        return "REUSE_PAGE";
+    }
+    return NULL;
+}
+
+/* for wal_consistency_checking */
+void ibpe_mask(char *pagedata, BlockNumber blkno)
+{
+    mask_page_lsn_and_checksum(pagedata);
+    mask_unused_space(pagedata);
+}
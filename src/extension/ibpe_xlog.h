@@ -0,0 +1,162 @@
+#ifndef IBPE_XLOG_H
+#define IBPE_XLOG_H
+
+#include <postgres.h>
+// The include order is important
+#include <access/xlogreader.h>
+#include <lib/stringinfo.h>
+#include <storage/bufmgr.h>
+#include <utils/rel.h>
+
+/*
+ * Custom WAL resource manager for the page operations that dominate an ibpe
+ * index's WAL: writing out a freshly built page, appending to the pending
+ * chains and deleting the pages a merge replaced. Its records carry only the
+ * bytes that changed instead of the full page images a generic WAL record
+ * needs for a new page.
+ *
+ * Extension resource managers can only be registered while the library is
+ * loaded through shared_preload_libraries, and every server replaying the
+ * WAL (including standbys) must load it the same way. Without it, the same
+ * operations are logged through generic WAL.
+ *
+ * The ID is fixed at build time (CMake option IBPE_RMGR_ID, see BUILD.md).
+ * The default, 149, is an unregistered placeholder; deployments must replace
+ * it with an ID reserved on the PostgreSQL wiki's list of custom WAL resource
+ * managers. WAL written with one ID cannot be replayed by a build using
+ * another. RM_EXPERIMENTAL_ID is shared by every extension under development
+ * and is therefore refused.
+ */
+#ifndef IBPE_RMGR_ID
+#define IBPE_RMGR_ID 149
+#endif
+#define IBPE_RMGR_NAME "ibpe"
+
+StaticAssertDecl(IBPE_RMGR_ID >= RM_MIN_CUSTOM_ID && IBPE_RMGR_ID <= RM_MAX_CUSTOM_ID
+                     && IBPE_RMGR_ID != RM_EXPERIMENTAL_ID,
+                 "IBPE_RMGR_ID must be a reserved custom resource manager ID");
+
+#define XLOG_IBPE_WRITE_PAGE 0x00
+#define XLOG_IBPE_PENDING_APPEND 0x10
+#define XLOG_IBPE_PENDING_LINK 0x20
+#define XLOG_IBPE_DELETE_PAGES 0x30
+#define XLOG_IBPE_REUSE_PAGE 0x40
+
+/*
+ * Write a freshly built page.
+ *   block 0: the new page; data is its data area
+ *   block 1: optional previous page, linked to block 0
+ */
+typedef struct
+{
+    uint16 flags; // page flags of block 0
+    BlockNumber next_blkno;
+} xl_ibpe_write_page;
+
+#define XLOG_IBPE_INIT_PAGE 0x01 // block 1 is a new pending page
+
+/*
+ * Append one pending record.
+ *   block 0: the partition's root
+ *   block 1: the pending page the record goes to; data is the record
+ *   block 2: optional old tail, linked to block 1 if that is a new page
+ */
+typedef struct
+{
+    int32 n_entries;
+    uint8 flags;
+} xl_ibpe_pending_append;
+
+/*
+ * Link an already written run of pending pages to the end of a chain.
+ *   block 0: the partition's root
+ *   block 1: optional old tail, linked to first_blkno
+ */
+typedef struct
+{
+    BlockNumber first_blkno;
+    BlockNumber last_blkno;
+    uint32 n_pages;
+    int32 n_entries;
+} xl_ibpe_pending_link;
+
+/*
+ * Mark pages deleted. Their contents stay until the page is reused, and
+ * horizon goes to each page's pd_prune_xid for the reuse record.
+ *   blocks 0 .. n-1: the pages; no data
+ */
+typedef struct
+{
+    TransactionId horizon; // next XID when the pages were deleted
+} xl_ibpe_delete_pages;
+
+#define IBPE_MAX_DELETE_PAGES (XLR_MAX_BLOCK_ID + 1)
+
+/*
+ * A deleted page is about to be reused. No blocks; on a hot standby, replay
+ * cancels the queries whose snapshots are older than horizon, as they may
+ * still be reading the page through an earlier generation.
+ */
+typedef struct
+{
+    RelFileLocator locator;
+    TransactionId horizon; // pd_prune_xid of the deleted page
+} xl_ibpe_reuse_page;
+
+/* true once the resource manager is registered; set in the postmaster */
+extern bool ibpe_custom_wal;
+
+/* register the resource manager if loaded through shared_preload_libraries */
+void ibpe_register_rmgr(void);
+
+/*
+ * Fill buf with the contents of staging and link it after prev_buf, if valid.
+ * Both buffers are exclusively locked by the caller.
+ */
+void ibpe_log_write_page(Relation indexRelation, Buffer buf, Page staging, Buffer prev_buf);
+
+/*
+ * Append record to the pending page target_buf, initializing it first if
+ * init_target is set, link it after prev_buf (if valid) and count it in the
+ * root. All buffers are exclusively locked by the caller.
+ */
+void ibpe_log_pending_append(Relation indexRelation,
+                             Buffer root_buf,
+                             Buffer target_buf,
+                             bool init_target,
+                             Buffer prev_buf,
+                             char *record,
+                             int rec_len,
+                             int n_entries);
+
+/*
+ * Link the pages first_blkno..last_blkno after prev_buf (if valid) and count
+ * them in the root. Both buffers are exclusively locked by the caller.
+ */
+void ibpe_log_pending_link(Relation indexRelation,
+                           Buffer root_buf,
+                           Buffer prev_buf,
+                           BlockNumber first_blkno,
+                           BlockNumber last_blkno,
+                           uint32 n_pages,
+                           int n_entries);
+
+/*
+ * Mark up to IBPE_MAX_DELETE_PAGES pages deleted, keeping their contents.
+ * All buffers are exclusively locked by the caller.
+ */
+void ibpe_log_delete_pages(Relation indexRelation, Buffer const *bufs, int n_bufs);
+
+/*
+ * Log that the deleted page is being reused, so hot standby queries that may
+ * still read it are cancelled first. Does nothing unless the custom resource
+ * manager is registered and the WAL feeds hot standbys.
+ */
+void ibpe_log_reuse_page(Relation indexRelation, Page page);
+
+void ibpe_redo(XLogReaderState *record);
+void ibpe_desc(StringInfo buf, XLogReaderState *record);
+const char *ibpe_identify(uint8 info);
+void ibpe_mask(char *pagedata, BlockNumber blkno);
+
+#endif // IBPE_XLOG_H
@@ -1,9 +1,12 @@
 #include "index_builder.hpp"
 
+#include "corpus_file.hpp"
+#include "index_file.hpp"
+#include "parallel.hpp"
+
 #include <algorithm>
+#include <atomic>
 #include <fmt/core.h>
-#include <fstream>
-#include <msgpack.hpp>
 
 namespace corpus_search {
 
@@ -11,63 +14,22 @@ namespace {
 
 auto load_file(std::string const &path) -> std::unordered_map<sentid_t, std::vector<int>>
 {
-    // Open the file in binary mode, at the end to get the size
-    auto file = std::ifstream(path, std::ios::binary);
-
-    if (!file) {
-        throw std::runtime_error("Error reading file.");
-    }
-
-    auto unpacker = msgpack::unpacker();
-
     std::unordered_map<sentid_t, std::vector<int>> result;
-
-    int load_count = 0;
-
-    constexpr int try_read_size = 16 * 1024 * 1024;
-    while (file.good()) {
-        unpacker.reserve_buffer(try_read_size);
-
-        auto n_bytes_read = file.readsome(unpacker.buffer(), try_read_size);
-
-        if (n_bytes_read == 0) {
-            file.peek(); // Check if end-of-file is reached
-        }
-
-        if (n_bytes_read > 0) {
-            unpacker.buffer_consumed(n_bytes_read);
-
-            msgpack::object_handle handle;
-            while (unpacker.next(handle)) {
-                if (load_count % 100'000 == 0) {
-                    fmt::println("Loaded {} sentences...", load_count);
-                    std::fflush(stdout);
-                }
-
-                auto map = std::unordered_map<std::string, msgpack::object>(handle.get().convert());
-                auto sent_id = sentid_t(map.at("id").convert());
-                auto tokens = std::vector<int>(map.at("tokens").convert());
-                tokens.shrink_to_fit();
-
-                result[sent_id] = std::move(tokens);
-
-                load_count += 1;
-            }
-
-        } else if (file.eof()) {
-            break;
-        } else if (file.fail()) {
-            throw std::runtime_error("Error reading file.");
-        }
-    }
-
+    read_msgpack_corpus(path, [&result](sentid_t sent_id, std::span<const int> tokens) {
+        result[sent_id] = std::vector<int>(tokens.begin(), tokens.end());
+    });
     return result;
 }
 
 } // namespace
 
-auto index_builder::from_file(const std::string &tokenized_sentences_path) -> index_builder
+auto index_builder::from_file(const std::string &tokenized_sentences_path, int num_threads)
+    -> index_builder
 {
+    if (corpus_file::is_corpus_file(tokenized_sentences_path)) {
+        return from_corpus_file(tokenized_sentences_path, num_threads);
+    }
+
     // load index
     fmt::println("Loading sentences from {}...", tokenized_sentences_path);
     std::fflush(stdout);
@@ -88,15 +50,23 @@ auto index_builder::from_file(const std::string &tokenized_sentences_path) -> in
     std::fflush(stdout);
 
     // make index
-    fmt::println("Making index...");
+    num_threads = resolve_num_threads(num_threads);
+    fmt::println("Making index with {} threads...", num_threads);
     std::fflush(stdout);
 
-    index_builder index;
+    auto sentence_ptrs = std::vector<decltype(sentences)::const_pointer>{};
+    sentence_ptrs.reserve(sentences.size());
+    for (auto const &item : sentences) {
+        sentence_ptrs.push_back(&item);
+    }
 
-    for (auto &&[sent_id, tokens] : sentences) {
-        index.add_sentence(sent_id, tokens);
-    };
-    index.finalize_index();
+    auto index = build_parallel(
+        sentence_ptrs.size(),
+        [&sentence_ptrs](std::size_t i) {
+            auto const &[sent_id, tokens] = *sentence_ptrs[i];
+            return std::pair<sentid_t, std::span<const int>>{sent_id, tokens};
+        },
+        num_threads);
 
     int bytes = 0;
     for (auto const &[tok, entries] : index.get_index()) {
@@ -109,6 +79,132 @@ auto index_builder::from_file(const std::string &tokenized_sentences_path) -> in
     return index;
 }
 
+auto index_builder::from_corpus_file(std::string const &corpus_path, int num_threads)
+    -> index_builder
+{
+    fmt::println("Mapping corpus file {}...", corpus_path);
+    std::fflush(stdout);
+
+    auto corpus = corpus_file(corpus_path);
+
+    fmt::println("Mapped {} sentences, {} tokens.", corpus.size(), corpus.num_tokens());
+    std::fflush(stdout);
+
+    num_threads = resolve_num_threads(num_threads);
+    fmt::println("Making index with {} threads...", num_threads);
+    std::fflush(stdout);
+
+    // sentences are read straight out of the mapping; nothing is copied
+    auto index = build_parallel(
+        corpus.size(),
+        [&corpus](std::size_t i) {
+            return std::pair<sentid_t, std::span<const int>>{corpus.sent_id(i), corpus.tokens(i)};
+        },
+        num_threads);
+
+    fmt::println("Made index with {} distinct tokens.", index.get_index().size());
+    std::fflush(stdout);
+
+    return index;
+}
+
+auto index_builder::build_parallel(std::size_t num_sentences,
+                                   std::function<sentence_getter> const &get_sentence,
+                                   int num_threads) -> index_builder
+{
+    num_threads = resolve_num_threads(num_threads);
+    num_threads = static_cast<int>(
+        std::min<std::size_t>(num_threads, std::max<std::size_t>(num_sentences, 1)));
+
+    // index disjoint ranges of sentences into private shards
+    auto shards = std::vector<index_builder>(num_threads);
+    run_parallel(num_threads, [&](int t) {
+        auto begin = num_sentences * t / num_threads;
+        auto end = num_sentences * (t + 1) / num_threads;
+        for (auto i = begin; i < end; ++i) {
+            auto [sent_id, tokens] = get_sentence(i);
+            shards[t].add_sentence(sent_id, tokens);
+        }
+        shards[t].finalize_index();
+    });
+
+    return merge_shards(std::move(shards), num_threads);
+}
+
+auto index_builder::merge_shards(std::vector<index_builder> shards, int num_threads)
+    -> index_builder
+{
+    if (shards.size() == 1) {
+        return std::move(shards[0]);
+    }
+
+    auto tokens = std::vector<int>{};
+    for (auto const &shard : shards) {
+        for (auto const &[token, entries] : shard.result) {
+            tokens.push_back(token);
+        }
+    }
+    std::sort(tokens.begin(), tokens.end());
+    tokens.erase(std::unique(tokens.begin(), tokens.end()), tokens.end());
+
+    // Create every output slot up front, so that worker threads only ever
+    // touch existing elements and the map is never rehashed concurrently.
+    auto merged = index_builder{};
+    merged.result.reserve(tokens.size());
+    for (int token : tokens) {
+        merged.result[token];
+    }
+
+    // Tokens are handed out dynamically, since posting list sizes are very skewed.
+    auto next_token_idx = std::atomic<std::size_t>{0};
+    run_parallel(resolve_num_threads(num_threads), [&](int) {
+        auto run_ends = std::vector<std::size_t>{};
+        for (;;) {
+            auto idx = next_token_idx.fetch_add(1, std::memory_order_relaxed);
+            if (idx >= tokens.size()) {
+                break;
+            }
+            int token = tokens[idx];
+            auto &out = merged.result.at(token);
+
+            std::size_t total = 0;
+            for (auto const &shard : shards) {
+                if (auto it = shard.result.find(token); it != shard.result.end()) {
+                    total += it->second.size();
+                }
+            }
+            out.reserve(total);
+
+            // concatenate the sorted runs, then merge adjacent pairs in place
+            run_ends.clear();
+            for (auto &shard : shards) {
+                if (auto it = shard.result.find(token); it != shard.result.end()) {
+                    out.insert(out.end(), it->second.begin(), it->second.end());
+                    std::vector<index_entry>().swap(it->second); // release shard memory early
+                    run_ends.push_back(out.size());
+                }
+            }
+            while (run_ends.size() > 1) {
+                std::size_t n_merged = 0;
+                for (std::size_t r = 0; r < run_ends.size(); r += 2) {
+                    if (r + 1 < run_ends.size()) {
+                        auto begin = (r == 0) ? 0 : run_ends[r - 1];
+                        std::inplace_merge(out.begin() + begin,
+                                           out.begin() + run_ends[r],
+                                           out.begin() + run_ends[r + 1]);
+                        run_ends[n_merged++] = run_ends[r + 1];
+                    } else {
+                        run_ends[n_merged++] = run_ends[r];
+                    }
+                }
+                run_ends.resize(n_merged);
+            }
+        }
+    });
+
+    return merged;
+}
+
 void index_builder::add_sentence(sentid_t sent_id, std::span<const int> tokens)
 {
     if (sent_id < 0 || sent_id > index_entry::MAX_SENTID) {
@@ -144,4 +240,9 @@ auto index_builder::get_index() const -> std::unordered_map<int, std::vector<ind
     return result;
 }
 
+void index_builder::save(std::string const &index_path) const
+{
+    write_index_file(index_path, result);
+}
+
 } // namespace corpus_search
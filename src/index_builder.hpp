@@ -3,9 +3,11 @@
 
 #include "sizes.h"
 
+#include <functional>
 #include <span>
 #include <string>
 #include <unordered_map>
+#include <utility>
 #include <vector>
 
 namespace corpus_search {
@@ -60,17 +62,40 @@ struct index_entry
     }
 };
 
+// returns the (sent_id, tokens) pair of the i-th input sentence
+using sentence_getter = auto(std::size_t i) -> std::pair<sentid_t, std::span<const int>>;
+
 class index_builder
 {
     std::unordered_map<int, std::vector<index_entry>> result = {};
 
 public:
     index_builder() = default;
-    static index_builder from_file(std::string const &tokenized_sentences_path);
+    // Accepts either a msgpack dump or a corpus file (see corpus_file.hpp).
+    static index_builder from_file(std::string const &tokenized_sentences_path,
+                                   int num_threads = 0);
+
+    // Build directly from a memory-mapped corpus file, without materializing the sentences.
+    static index_builder from_corpus_file(std::string const &corpus_path, int num_threads = 0);
+
+    // Index sentences [0, num_sentences) on num_threads threads (0 = all cores).
+    // Each thread indexes a disjoint range of sentences into a private shard,
+    // and the shards are then merged per token. The result is finalized and
+    // identical to adding every sentence serially and calling finalize_index().
+    static index_builder build_parallel(std::size_t num_sentences,
+                                        std::function<sentence_getter> const &get_sentence,
+                                        int num_threads = 0);
+
+    // Merge finalized shards with disjoint sentence ids into one finalized index.
+    // Tokens are partitioned across num_threads threads.
+    static index_builder merge_shards(std::vector<index_builder> shards, int num_threads = 0);
 
     void add_sentence(sentid_t sent_id, std::span<const int> tokens);
     void finalize_index();
     auto get_index() const -> std::unordered_map<int, std::vector<index_entry>> const &;
+
+    // Write the finalized index to an index file; open it again with mmap_index.
+    void save(std::string const &index_path) const;
 };
 
 } // namespace corpus_search
@@ -0,0 +1,187 @@
+#include "index_file.hpp"
+
+#include <algorithm>
+#include <cstring>
+#include <fmt/core.h>
+#include <fstream>
+#include <stdexcept>
+#include <type_traits>
+
+namespace corpus_search {
+
+static_assert(std::is_trivially_copyable_v<index_entry>);
+static_assert(index_file_header::PAGE_SIZE % alignof(index_entry) == 0);
+
+static auto page_align(std::uint64_t offset) -> std::uint64_t
+{
+    constexpr std::uint64_t page_size = index_file_header::PAGE_SIZE;
+    return (offset + page_size - 1) / page_size * page_size;
+}
+
+void write_index_file(std::string const &path,
+                      std::unordered_map<int, std::vector<index_entry>> const &index)
+{
+    auto out = std::ofstream(path, std::ios::binary | std::ios::trunc);
+    if (!out) {
+        throw std::runtime_error(fmt::format("Error opening file {} for writing.", path));
+    }
+
+    auto tokens = std::vector<int>{};
+    tokens.reserve(index.size());
+    for (auto const &[token, entries] : index) {
+        tokens.push_back(token);
+    }
+    std::sort(tokens.begin(), tokens.end());
+
+    auto directory = std::vector<index_file_token>{};
+    directory.reserve(tokens.size());
+    std::uint64_t num_entries = 0;
+    for (int token : tokens) {
+        auto count = index.at(token).size();
+        directory.push_back({token, 0, num_entries, count});
+        num_entries += count;
+    }
+
+    auto header = index_file_header{};
+    std::memcpy(header.magic, index_file_header::MAGIC, sizeof(header.magic));
+    header.version = index_file_header::VERSION;
+    header.page_size = index_file_header::PAGE_SIZE;
+    header.entry_size = sizeof(index_entry);
+    header.sentid_bits = index_entry::SENTID_BITS;
+    header.pos_bits = index_entry::POS_BITS;
+    header.next_tok_bits = index_entry::NEXT_TOK_BITS;
+    header.num_tokens = directory.size();
+    header.num_entries = num_entries;
+    header.directory_offset = page_align(sizeof(index_file_header));
+    header.postings_offset = page_align(header.directory_offset
+                                        + directory.size() * sizeof(index_file_token));
+    header.file_size = header.postings_offset + num_entries * sizeof(index_entry);
+
+    auto pad_to = [&out](std::uint64_t offset) {
+        static constexpr char zeros[index_file_header::PAGE_SIZE] = {};
+        auto pos = static_cast<std::uint64_t>(out.tellp());
+        out.write(zeros, offset - pos);
+    };
+
+    out.write(reinterpret_cast<char const *>(&header), sizeof(header));
+    pad_to(header.directory_offset);
+    out.write(reinterpret_cast<char const *>(directory.data()),
+              directory.size() * sizeof(index_file_token));
+    pad_to(header.postings_offset);
+    for (int token : tokens) {
+        auto const &entries = index.at(token);
+        out.write(reinterpret_cast<char const *>(entries.data()),
+                  entries.size() * sizeof(index_entry));
+    }
+
+    out.close();
+    if (out.fail()) {
+        throw std::runtime_error(fmt::format("Error writing file {}.", path));
+    }
+}
+
+mmap_index::mmap_index(std::string const &path, bool populate, mapped_file::advice hint)
+    : file(path, mapped_file::advice::normal, populate)
+{
+    if (file.size() < sizeof(index_file_header)) {
+        throw std::runtime_error(fmt::format("{} is not an index file: too small", path));
+    }
+
+    auto const &header = *reinterpret_cast<index_file_header const *>(file.data());
+    if (std::memcmp(header.magic, index_file_header::MAGIC, sizeof(header.magic)) != 0) {
+        throw std::runtime_error(fmt::format("{} is not an index file: bad magic", path));
+    }
+    if (header.version != index_file_header::VERSION) {
+        throw std::runtime_error(
+            fmt::format("{}: unsupported index file version {}", path, header.version));
+    }
+    if (header.entry_size != sizeof(index_entry) || header.sentid_bits != index_entry::SENTID_BITS
+        || header.pos_bits != index_entry::POS_BITS
+        || header.next_tok_bits != index_entry::NEXT_TOK_BITS) {
+        throw std::runtime_error(fmt::format(
+            "{}: index entry layout ({}/{}/{} bits, {} bytes) does not match this build",
+            path,
+            header.sentid_bits,
+            header.pos_bits,
+            header.next_tok_bits,
+            header.entry_size));
+    }
+    if (header.file_size != file.size() || header.page_size != index_file_header::PAGE_SIZE
+        || header.directory_offset % header.page_size != 0
+        || header.postings_offset % header.page_size != 0
+        || header.directory_offset > file.size()
+        || header.num_tokens > (file.size() - header.directory_offset) / sizeof(index_file_token)
+        || header.postings_offset > file.size()
+        || header.num_entries > (file.size() - header.postings_offset) / sizeof(index_entry)) {
+        throw std::runtime_error(fmt::format("{}: corrupt index file: truncated section", path));
+    }
+
+    directory = {reinterpret_cast<index_file_token const *>(file.data() + header.directory_offset),
+                 header.num_tokens};
+    entries = {reinterpret_cast<index_entry const *>(file.data() + header.postings_offset),
+               header.num_entries};
+
+    // postings() relies on these
+    for (std::size_t i = 0; i < directory.size(); ++i) {
+        auto const &item = directory[i];
+        if ((i > 0 && directory[i - 1].token >= item.token) || item.first > entries.size()
+            || item.count > entries.size() - item.first) {
+            throw std::runtime_error(fmt::format("{}: corrupt index file: bad directory", path));
+        }
+    }
+
+    if (hint != mapped_file::advice::normal) {
+        file.advise(hint, header.postings_offset);
+    }
+}
+
+auto mmap_index::postings(int token) const -> std::span<const index_entry>
+{
+    auto it = std::lower_bound(directory.begin(),
+                               directory.end(),
+                               token,
+                               [](index_file_token const &item, int t) { return item.token < t; });
+    if (it == directory.end() || it->token != token) {
+        return {};
+    }
+    return entries.subspan(it->first, it->count);
+}
+
+auto mmap_index::tokens() const -> std::vector<int>
+{
+    auto result = std::vector<int>{};
+    result.reserve(directory.size());
+    for (auto const &item : directory) {
+        result.push_back(item.token);
+    }
+    return result;
+}
+
+void mmap_index::prefetch(int token) const
+{
+    auto list = postings(token);
+    if (!list.empty()) {
+        auto offset = reinterpret_cast<char const *>(list.data()) - file.data();
+        file.advise(mapped_file::advice::will_need, offset, list.size_bytes());
+    }
+}
+
+auto mmap_index::accessor() const -> std::function<index_accessor>
+{
+    return [this](int token) {
+        auto list = postings(token);
+        auto result = std::vector<token_range>{};
+        result.reserve(list.size());
+        for (auto const &entry : list) {
+            result.push_back({
+                entry.sent_id, entry.pos, static_cast<tokpos_t>(entry.pos + 1),
+#if CORPUS_SEARCH_NEXT_TOKEN_BITS > 0
+                    entry.next_tok,
+#endif
+            });
+        }
+        return result;
+    };
+}
+
+} // namespace corpus_search
@@ -0,0 +1,89 @@
+#ifndef INDEX_FILE_HPP
+#define INDEX_FILE_HPP
+
+#include "index_builder.hpp"
+#include "mapped_file.hpp"
+#include "searcher.hpp"
+#include "sizes.h"
+
+#include <cstdint>
+#include <functional>
+#include <span>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+namespace corpus_search {
+
+// Serialized, finalized index, meant to be mmap'd and searched in place.
+// All integers are stored in native byte order; every section starts on a page boundary.
+//
+//   header | directory (index_file_token)[num_tokens] | postings (index_entry)[num_entries]
+//
+// The directory is sorted by token. Posting lists are stored as raw index_entry arrays,
+// so the file is only readable by builds with the same index_entry layout.
+struct index_file_header
+{
+    static constexpr char MAGIC[8] = {'C', 'S', 'I', 'N', 'D', 'E', 'X', '\0'};
+    static constexpr std::uint32_t VERSION = 1;
+    static constexpr std::uint32_t PAGE_SIZE = 4096;
+
+    char magic[8];
+    std::uint32_t version;
+    std::uint32_t page_size;
+
+    // index_entry layout
+    std::uint32_t entry_size;
+    std::uint32_t sentid_bits;
+    std::uint32_t pos_bits;
+    std::uint32_t next_tok_bits;
+
+    std::uint64_t num_tokens;
+    std::uint64_t num_entries;
+    std::uint64_t directory_offset;
+    std::uint64_t postings_offset;
+    std::uint64_t file_size;
+};
+
+struct index_file_token
+{
+    std::int32_t token;
+    std::uint32_t reserved;
+    std::uint64_t first; // index of the first entry in the postings section
+    std::uint64_t count;
+};
+
+void write_index_file(std::string const &path,
+                      std::unordered_map<int, std::vector<index_entry>> const &index);
+
+class mmap_index
+{
+    mapped_file file;
+    std::span<const index_file_token> directory;
+    std::span<const index_entry> entries;
+
+public:
+    // populate pre-faults the whole file (MAP_POPULATE); hint applies to the posting lists.
+    explicit mmap_index(std::string const &path,
+                        bool populate = false,
+                        mapped_file::advice hint = mapped_file::advice::normal);
+
+    auto num_tokens() const -> std::size_t { return directory.size(); }
+    auto num_entries() const -> std::size_t { return entries.size(); }
+
+    // all tokens in the index, in ascending order
+    auto tokens() const -> std::vector<int>;
+
+    // empty if the token does not occur in the index
+    auto postings(int token) const -> std::span<const index_entry>;
+
+    // ask the kernel to start reading in a posting list
+    void prefetch(int token) const;
+
+    // index accessor for search(); the mmap_index must outlive it
+    auto accessor() const -> std::function<index_accessor>;
+};
+
+} // namespace corpus_search
+
+#endif // INDEX_FILE_HPP
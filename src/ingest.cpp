@@ -0,0 +1,321 @@
+#include "ingest.hpp"
+
+#include <algorithm>
+#include <charconv>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <fmt/core.h>
+#include <fstream>
+#include <mutex>
+#include <optional>
+#include <stdexcept>
+#include <string_view>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace corpus_search {
+
+namespace {
+
+using steady_clock = std::chrono::steady_clock;
+
+auto seconds_since(steady_clock::time_point start) -> double
+{
+    return std::chrono::duration<double>(steady_clock::now() - start).count();
+}
+
+// Multi-producer, multi-consumer FIFO with a fixed capacity.
+// pop() returns nullopt once every producer has called close() and the queue is drained.
+// cancel() wakes everybody up and makes all further push()/pop() calls fail.
+template<typename T>
+class bounded_queue
+{
+    std::mutex mutex;
+    std::condition_variable not_empty;
+    std::condition_variable not_full;
+    std::deque<T> items;
+    std::size_t capacity;
+    int open_producers;
+    bool cancelled = false;
+
+public:
+    bounded_queue(std::size_t capacity, int num_producers)
+        : capacity(capacity)
+        , open_producers(num_producers)
+    {}
+
+    auto push(T item, double &stall_secs) -> bool
+    {
+        auto lock = std::unique_lock(mutex);
+        auto start = steady_clock::now();
+        not_full.wait(lock, [this] { return cancelled || items.size() < capacity; });
+        stall_secs += seconds_since(start);
+        if (cancelled) {
+            return false;
+        }
+        items.push_back(std::move(item));
+        not_empty.notify_one();
+        return true;
+    }
+
+    auto pop(double &stall_secs) -> std::optional<T>
+    {
+        auto lock = std::unique_lock(mutex);
+        auto start = steady_clock::now();
+        not_empty.wait(lock,
+                       [this] { return cancelled || !items.empty() || open_producers == 0; });
+        stall_secs += seconds_since(start);
+        if (cancelled || items.empty()) {
+            return std::nullopt;
+        }
+        auto item = std::move(items.front());
+        items.pop_front();
+        not_full.notify_one();
+        return item;
+    }
+
+    void close()
+    {
+        auto lock = std::lock_guard(mutex);
+        open_producers -= 1;
+        not_empty.notify_all();
+    }
+
+    void cancel()
+    {
+        auto lock = std::lock_guard(mutex);
+        cancelled = true;
+        not_empty.notify_all();
+        not_full.notify_all();
+    }
+};
+
+struct text_batch
+{
+    std::vector<sentid_t> sent_ids;
+    std::vector<std::string> texts;
+};
+
+struct token_batch
+{
+    std::vector<sentid_t> sent_ids;
+    std::vector<std::vector<int>> tokens;
+};
+
+auto parse_line(std::string_view line,
+                std::size_t line_no,
+                ingest_format format,
+                sentid_t &sent_id,
+                std::string_view &text) -> bool
+{
+    if (!line.empty() && line.back() == '\r') {
+        line.remove_suffix(1);
+    }
+
+    if (format == ingest_format::lines) {
+        sent_id = static_cast<sentid_t>(line_no);
+        text = line;
+        return !line.empty();
+    }
+
+    auto tab = line.find('\t');
+    if (tab == std::string_view::npos) {
+        if (line.empty()) {
+            return false;
+        }
+        throw std::runtime_error(fmt::format("Line {}: expected <sent_id>\\t<text>", line_no + 1));
+    }
+    auto id_str = line.substr(0, tab);
+    auto [ptr, ec] = std::from_chars(id_str.data(), id_str.data() + id_str.size(), sent_id);
+    if (ec != std::errc{} || ptr != id_str.data() + id_str.size()) {
+        throw std::runtime_error(
+            fmt::format("Line {}: invalid sentence id '{}'", line_no + 1, id_str));
+    }
+    text = line.substr(tab + 1);
+    return true;
+}
+
+void print_stage(std::string_view name, ingest_stage_stats const &stage, std::string_view unit)
+{
+    auto per_sec = [](double count, double secs) { return secs > 0 ? count / secs : 0.0; };
+    fmt::println("  {:<9}: {} {} in {:.2f}s busy ({:.0f} {}/s, {:.0f} tokens/s), "
+                 "{:.2f}s stalled",
+                 name,
+                 stage.items,
+                 unit,
+                 stage.busy_secs,
+                 per_sec(stage.items, stage.busy_secs),
+                 unit,
+                 per_sec(stage.tokens, stage.busy_secs),
+                 stage.stall_secs);
+}
+
+} // namespace
+
+auto ingest_text(std::istream &input,
+                 std::function<tokenizer_factory> const &make_tokenizer,
+                 ingest_options const &options) -> ingest_result
+{
+    int num_workers = options.num_threads;
+    if (num_workers <= 0) {
+        num_workers = std::max(1u, std::thread::hardware_concurrency());
+    }
+    auto batch_size = std::max<std::size_t>(options.batch_size, 1);
+    auto capacity = options.queue_capacity > 0 ? options.queue_capacity
+                                               : 2 * static_cast<std::size_t>(num_workers);
+
+    fmt::println("Ingesting text with {} tokenizer threads...", num_workers);
+    std::fflush(stdout);
+
+    auto wall_start = steady_clock::now();
+
+    auto text_queue = bounded_queue<text_batch>(capacity, 1);
+    auto token_queue = bounded_queue<token_batch>(capacity, num_workers);
+
+    auto result = ingest_result{};
+    auto worker_stats = std::vector<ingest_stage_stats>(num_workers);
+
+    // The first error wins; it cancels both queues so that every stage unblocks and exits.
+    auto error_mutex = std::mutex{};
+    auto error = std::exception_ptr{};
+    auto fail = [&] {
+        {
+            auto lock = std::lock_guard(error_mutex);
+            if (!error) {
+                error = std::current_exception();
+            }
+        }
+        text_queue.cancel();
+        token_queue.cancel();
+    };
+
+    {
+        auto threads = std::vector<std::jthread>{};
+
+        threads.emplace_back([&] {
+            auto &stats = result.stats.reader;
+            try {
+                auto busy_start = steady_clock::now();
+                auto batch = text_batch{};
+                auto line = std::string{};
+                std::size_t line_no = 0;
+                for (; std::getline(input, line); ++line_no) {
+                    result.stats.bytes_read += line.size() + 1;
+                    stats.items += 1;
+
+                    sentid_t sent_id;
+                    std::string_view text;
+                    if (!parse_line(line, line_no, options.format, sent_id, text)) {
+                        continue;
+                    }
+                    batch.sent_ids.push_back(sent_id);
+                    batch.texts.emplace_back(text);
+
+                    if (batch.texts.size() >= batch_size) {
+                        stats.busy_secs += seconds_since(busy_start);
+                        if (!text_queue.push(std::exchange(batch, {}), stats.stall_secs)) {
+                            return;
+                        }
+                        busy_start = steady_clock::now();
+                    }
+                }
+                if (input.bad()) {
+                    throw std::runtime_error("Error reading input.");
+                }
+                stats.busy_secs += seconds_since(busy_start);
+                if (!batch.texts.empty()) {
+                    text_queue.push(std::move(batch), stats.stall_secs);
+                }
+                text_queue.close();
+            } catch (...) {
+                fail();
+            }
+        });
+
+        for (int w = 0; w < num_workers; ++w) {
+            threads.emplace_back([&, w] {
+                auto &stats = worker_stats[w];
+                try {
+                    auto tok = make_tokenizer();
+                    while (auto batch = text_queue.pop(stats.stall_secs)) {
+                        auto busy_start = steady_clock::now();
+                        auto out = token_batch{std::move(batch->sent_ids), {}};
+                        out.tokens.reserve(batch->texts.size());
+                        for (auto const &text : batch->texts) {
+                            out.tokens.push_back(tok->tokenize(text, options.add_special_tokens));
+                            stats.tokens += out.tokens.back().size();
+                        }
+                        stats.items += out.tokens.size();
+                        stats.busy_secs += seconds_since(busy_start);
+
+                        if (!token_queue.push(std::move(out), stats.stall_secs)) {
+                            return;
+                        }
+                    }
+                    token_queue.close();
+                } catch (...) {
+                    fail();
+                }
+            });
+        }
+
+        // index on this thread; add_sentence is cheap next to tokenization
+        auto &stats = result.stats.indexer;
+        try {
+            while (auto batch = token_queue.pop(stats.stall_secs)) {
+                auto busy_start = steady_clock::now();
+                for (std::size_t i = 0; i < batch->tokens.size(); ++i) {
+                    result.index.add_sentence(batch->sent_ids[i], batch->tokens[i]);
+                    stats.tokens += batch->tokens[i].size();
+                }
+                stats.items += batch->tokens.size();
+                stats.busy_secs += seconds_since(busy_start);
+            }
+        } catch (...) {
+            fail();
+        }
+    } // join all threads
+
+    if (error) {
+        std::rethrow_exception(error);
+    }
+
+    auto finalize_start = steady_clock::now();
+    result.index.finalize_index();
+    result.stats.indexer.busy_secs += seconds_since(finalize_start);
+
+    for (auto const &stats : worker_stats) {
+        result.stats.tokenizer.items += stats.items;
+        result.stats.tokenizer.tokens += stats.tokens;
+        result.stats.tokenizer.busy_secs += stats.busy_secs;
+        result.stats.tokenizer.stall_secs += stats.stall_secs;
+    }
+    result.stats.wall_secs = seconds_since(wall_start);
+
+    fmt::println("Ingested {} sentences ({} MB) in {:.2f}s",
+                 result.stats.indexer.items,
+                 result.stats.bytes_read / 1'000'000,
+                 result.stats.wall_secs);
+    print_stage("read", result.stats.reader, "lines");
+    print_stage("tokenize", result.stats.tokenizer, "sentences");
+    print_stage("index", result.stats.indexer, "sentences");
+    std::fflush(stdout);
+
+    return result;
+}
+
+auto ingest_text(std::string const &input_path,
+                 std::function<tokenizer_factory> const &make_tokenizer,
+                 ingest_options const &options) -> ingest_result
+{
+    auto file = std::ifstream(input_path);
+    if (!file) {
+        throw std::runtime_error(fmt::format("Error opening file: {}", input_path));
+    }
+    return ingest_text(file, make_tokenizer, options);
+}
+
+} // namespace corpus_search
@@ -0,0 +1,75 @@
+#ifndef INGEST_HPP
+#define INGEST_HPP
+
+#include "index_builder.hpp"
+#include "sizes.h"
+#include "tokenizer.hpp"
+
+#include <cstddef>
+#include <functional>
+#include <istream>
+#include <memory>
+#include <string>
+
+namespace corpus_search {
+
+// Raw UTF-8 text -> tokenize -> index, in one streaming pass.
+//
+//   reader --[text batches]--> tokenizer workers --[token batches]--> indexer
+//
+// Both queues are bounded, so a slow stage stalls the stages before it instead of
+// buffering the whole corpus in memory.
+
+enum class ingest_format
+{
+    lines, // one sentence per line; the sentence id is the 0-based line number
+    tsv,   // "<sent_id>\t<text>" per line
+};
+
+struct ingest_options
+{
+    ingest_format format = ingest_format::lines;
+    int num_threads = 0;            // tokenizer workers (0 = all cores)
+    std::size_t batch_size = 1024;  // lines per batch
+    std::size_t queue_capacity = 0; // batches per queue (0 = 2 * num_threads)
+    bool add_special_tokens = true; // wrap each sentence in BOS/EOS
+};
+
+struct ingest_stage_stats
+{
+    std::size_t items = 0;   // lines read / sentences tokenized / sentences indexed
+    std::size_t tokens = 0;  // tokens produced or consumed (0 for the reader)
+    double busy_secs = 0.0;  // summed over the stage's threads, excluding queue waits
+    double stall_secs = 0.0; // time spent blocked on a full or empty queue
+};
+
+struct ingest_stats
+{
+    std::size_t bytes_read = 0;
+    double wall_secs = 0.0;
+    ingest_stage_stats reader;
+    ingest_stage_stats tokenizer;
+    ingest_stage_stats indexer;
+};
+
+struct ingest_result
+{
+    index_builder index;
+    ingest_stats stats;
+};
+
+// tokenizers-cpp keeps per-call state in its handle, so every worker gets its own instance.
+using tokenizer_factory = auto() -> std::unique_ptr<tokenizer>;
+
+// The returned index is finalized.
+auto ingest_text(std::istream &input,
+                 std::function<tokenizer_factory> const &make_tokenizer,
+                 ingest_options const &options = {}) -> ingest_result;
+
+auto ingest_text(std::string const &input_path,
+                 std::function<tokenizer_factory> const &make_tokenizer,
+                 ingest_options const &options = {}) -> ingest_result;
+
+} // namespace corpus_search
+
+#endif // INGEST_HPP
@@ -0,0 +1,110 @@
+#include "mapped_file.hpp"
+
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <fmt/core.h>
+#include <stdexcept>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <utility>
+
+namespace corpus_search {
+
+static auto to_madvise_flag(mapped_file::advice hint) -> int
+{
+    switch (hint) {
+    case mapped_file::advice::sequential:
+        return MADV_SEQUENTIAL;
+    case mapped_file::advice::random:
+        return MADV_RANDOM;
+    case mapped_file::advice::will_need:
+        return MADV_WILLNEED;
+    default:
+        return MADV_NORMAL;
+    }
+}
+
+mapped_file::mapped_file(std::string const &path, advice hint, bool populate)
+{
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        throw std::runtime_error(
+            fmt::format("Error opening file {}: {}", path, std::strerror(errno)));
+    }
+
+    struct stat st;
+    if (::fstat(fd, &st) != 0) {
+        int err = errno;
+        ::close(fd);
+        throw std::runtime_error(
+            fmt::format("Error reading file {}: {}", path, std::strerror(err)));
+    }
+    m_size = st.st_size;
+
+    if (m_size > 0) {
+        int flags = MAP_PRIVATE;
+#ifdef MAP_POPULATE
+        if (populate) {
+            flags |= MAP_POPULATE;
+        }
+#endif
+        void *addr = ::mmap(nullptr, m_size, PROT_READ, flags, fd, 0);
+        if (addr == MAP_FAILED) {
+            int err = errno;
+            ::close(fd);
+            throw std::runtime_error(
+                fmt::format("Error mapping file {}: {}", path, std::strerror(err)));
+        }
+        m_data = addr;
+    }
+    ::close(fd); // the mapping keeps its own reference
+
+    if (hint != advice::normal) {
+        advise(hint);
+    }
+}
+
+mapped_file::~mapped_file()
+{
+    if (m_data) {
+        ::munmap(m_data, m_size);
+    }
+}
+
+mapped_file::mapped_file(mapped_file &&other) noexcept
+    : m_data(std::exchange(other.m_data, nullptr))
+    , m_size(std::exchange(other.m_size, 0))
+{}
+
+mapped_file &mapped_file::operator=(mapped_file &&other) noexcept
+{
+    if (this != &other) {
+        if (m_data) {
+            ::munmap(m_data, m_size);
+        }
+        m_data = std::exchange(other.m_data, nullptr);
+        m_size = std::exchange(other.m_size, 0);
+    }
+    return *this;
+}
+
+void mapped_file::advise(advice hint, std::size_t offset, std::size_t length) const
+{
+    if (!m_data || offset >= m_size) {
+        return;
+    }
+    if (length == 0 || offset + length > m_size) {
+        length = m_size - offset;
+    }
+    // madvise wants a page-aligned start address
+    auto page_size = static_cast<std::size_t>(::sysconf(_SC_PAGESIZE));
+    auto aligned_offset = offset / page_size * page_size;
+    // hints are best-effort; ignore failures
+    ::madvise(static_cast<char *>(m_data) + aligned_offset,
+              length + (offset - aligned_offset),
+              to_madvise_flag(hint));
+}
+
+} // namespace corpus_search
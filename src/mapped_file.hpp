@@ -0,0 +1,49 @@
+#ifndef MAPPED_FILE_HPP
+#define MAPPED_FILE_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+namespace corpus_search {
+
+// Read-only memory mapping of a whole file.
+class mapped_file
+{
+    void *m_data = nullptr;
+    std::size_t m_size = 0;
+
+public:
+    enum class advice { normal, sequential, random, will_need };
+
+    mapped_file() = default;
+    explicit mapped_file(std::string const &path,
+                         advice hint = advice::normal,
+                         bool populate = false);
+    ~mapped_file();
+
+    mapped_file(mapped_file const &) = delete;
+    mapped_file &operator=(mapped_file const &) = delete;
+    mapped_file(mapped_file &&other) noexcept;
+    mapped_file &operator=(mapped_file &&other) noexcept;
+
+    auto data() const -> char const * { return static_cast<char const *>(m_data); }
+    auto size() const -> std::size_t { return m_size; }
+
+    // apply an access pattern hint to [offset, offset + length)
+    void advise(advice hint, std::size_t offset = 0, std::size_t length = 0) const;
+};
+
+// whether count elements of elem_size bytes at an 8-byte aligned offset fit in a file
+inline auto in_bounds(std::size_t file_size,
+                      std::uint64_t offset,
+                      std::uint64_t count,
+                      std::size_t elem_size) -> bool
+{
+    return offset % alignof(std::uint64_t) == 0 && offset <= file_size
+           && count <= (file_size - offset) / elem_size;
+}
+
+} // namespace corpus_search
+
+#endif // MAPPED_FILE_HPP
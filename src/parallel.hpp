@@ -0,0 +1,46 @@
+#ifndef PARALLEL_HPP
+#define PARALLEL_HPP
+
+#include <algorithm>
+#include <exception>
+#include <functional>
+#include <thread>
+#include <vector>
+
+namespace corpus_search {
+
+// 0 or less means one thread per core
+inline auto resolve_num_threads(int num_threads) -> int
+{
+    if (num_threads <= 0) {
+        num_threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    return num_threads;
+}
+
+// Run fn(thread_idx) on num_threads threads, rethrowing the first exception raised.
+inline void run_parallel(int num_threads, std::function<void(int)> const &fn)
+{
+    auto errors = std::vector<std::exception_ptr>(num_threads);
+    {
+        auto threads = std::vector<std::jthread>{};
+        for (int t = 0; t < num_threads; ++t) {
+            threads.emplace_back([&fn, &errors, t] {
+                try {
+                    fn(t);
+                } catch (...) {
+                    errors[t] = std::current_exception();
+                }
+            });
+        }
+    } // join all threads
+    for (auto const &error : errors) {
+        if (error) {
+            std::rethrow_exception(error);
+        }
+    }
+}
+
+} // namespace corpus_search
+
+#endif // PARALLEL_HPP
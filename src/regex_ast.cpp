@@ -1,15 +1,46 @@
 #include "regex_ast.hpp"
 
+#include <algorithm>
+#include <array>
 #include <fmt/core.h>
 #include <fmt/ranges.h>
+#include <map>
+#include <mutex>
 #include <roaring.hh>
+#include <tuple>
 #include <unicode/uniset.h>
+#include <unordered_map>
 #include <utf8.h>
 
 namespace corpus_search::regex {
 
 static constexpr char32_t UNICODE_MAX = 0x10FFFF;
 
+// \p{...} sets resolved through ICU so far, by pattern; shared by all queries of the process
+static auto property_set(std::string const& pattern) -> roaring::Roaring
+{
+    static std::mutex mutex;
+    static std::unordered_map<std::string, roaring::Roaring> cache;
+
+    auto lock = std::lock_guard(mutex);
+    if (auto it = cache.find(pattern); it != cache.end()) {
+        return it->second;
+    }
+
+    UErrorCode status = U_ZERO_ERROR;
+    icu::UnicodeSet icuset(icu::UnicodeString::fromUTF8(pattern), status);
+    if (U_FAILURE(status)) {
+        throw std::runtime_error("unknown unicode property: " + pattern);
+    }
+
+    auto set = roaring::Roaring{};
+    for (int32_t i = 0; i < icuset.getRangeCount(); ++i) {
+        set.addRangeClosed(icuset.getRangeStart(i), icuset.getRangeEnd(i));
+    }
+    set.runOptimize();
+    return cache[pattern] = set;
+}
+
 template<typename T>
 static auto character_set(T const& node) -> roaring::Roaring
 {
@@ -69,16 +100,7 @@ static auto character_set(T const& node) -> roaring::Roaring
         }
         pattern += "}]";
 
-        UErrorCode status = U_ZERO_ERROR;
-        icu::UnicodeSet icuset(icu::UnicodeString::fromUTF8(pattern), status);
-        if (U_FAILURE(status)) {
-            throw std::runtime_error("unknown unicode property: " + pattern);
-        }
-
-        auto set = roaring::Roaring{};
-        for (int32_t i = 0; i < icuset.getRangeCount(); ++i) {
-            set.addRangeClosed(icuset.getRangeStart(i), icuset.getRangeEnd(i));
-        }
+        auto set = property_set(pattern);
         if (node.negate) {
             set.flipClosed(0, UNICODE_MAX);
         }
@@ -92,152 +114,167 @@ static auto character_set(T const& node) -> roaring::Roaring
     }
 }
 
-static auto make_start(std::string_view smin) -> ast::node
+// UTF-8 encoding of cp, without rejecting surrogates; returns the number of bytes
+static auto encode_utf8(char32_t cp, std::array<int, 4>& bytes) -> int
 {
-    int smin_0 = smin[0] & 0xFF;
-    if (smin.size() == 1) {
-        return {ast::node_range{
-            smin_0,
-            0b1011'1111,
-        }};
+    if (cp <= 0x7F) {
+        bytes[0] = cp;
+        return 1;
     }
-
-    auto result = ast::node_union{};
-
-    auto first = ast::node_concat{{
-        {ast::node_range{smin_0, smin_0}},
-        make_start(smin.substr(1)),
-    }};
-    result.args.push_back({first});
-
-    if (smin_0 < 0b1011'1111) {
-        auto initial = ast::node_concat{{
-            {ast::node_range{smin_0 + 1, 0b1011'1111}},
-        }};
-        for (int i = 1; i < smin.size(); ++i) {
-            initial.args.push_back({ast::node_range{
-                0b1000'0000,
-                0b1011'1111,
-            }});
-        }
-        result.args.push_back({initial});
+    int n = cp <= 0x7FF ? 2 : cp <= 0xFFFF ? 3 : 4;
+    for (int i = n - 1; i > 0; --i) {
+        bytes[i] = 0b1000'0000 | (cp & 0b0011'1111);
+        cp >>= 6;
     }
-
-    return {result};
+    bytes[0] = ((0xF00 >> n) & 0xFF) | cp;
+    return n;
 }
 
-static auto make_last(std::string_view smax) -> ast::node
+// codepoints whose UTF-8 encodings are the byte strings ranges[0] x ... x ranges[len - 1]
+struct utf8_sequence
 {
-    int smax_0 = smax[0] & 0xFF;
-    if (smax.size() == 1) {
-        return {ast::node_range{
-            0b1000'0000,
-            smax_0,
-        }};
-    }
-
-    auto result = ast::node_union{};
+    int len;
+    std::array<ast::node_range, 4> ranges;
+};
 
-    if (smax_0 > 0b1000'0000) {
-        auto initial = ast::node_concat{{
-            {ast::node_range{0b1000'0000, smax_0 - 1}},
-        }};
-        for (int i = 1; i < smax.size(); ++i) {
-            initial.args.push_back({ast::node_range{
-                0b1000'0000,
-                0b1011'1111,
-            }});
+// Split [lo, hi] into utf8_sequences, in codepoint order (as in RE2 and utf8-ranges). Once a
+// byte range of a sequence spans more than one byte, the ones after it are all [80-BF].
+static void split_utf8(char32_t lo, char32_t hi, std::vector<utf8_sequence>& out)
+{
+    for (char32_t boundary : {0x7F, 0x7FF, 0xFFFF}) {
+        if (lo <= boundary && boundary < hi) {
+            split_utf8(lo, boundary, out);
+            split_utf8(boundary + 1, hi, out);
+            return;
         }
-        result.args.push_back({initial});
     }
 
-    auto last = ast::node_concat{{
-        {ast::node_range{smax_0, smax_0}},
-        make_last(smax.substr(1)),
-    }};
-    result.args.push_back({last});
+    auto lo_bytes = std::array<int, 4>{};
+    auto hi_bytes = std::array<int, 4>{};
+    int n = encode_utf8(lo, lo_bytes);
+    encode_utf8(hi, hi_bytes);
+
+    for (int i = 1; i < n; ++i) {
+        auto mask = (char32_t{1} << (6 * i)) - 1;
+        if ((lo & ~mask) != (hi & ~mask)) {
+            if ((lo & mask) != 0) {
+                split_utf8(lo, lo | mask, out);
+                split_utf8((lo | mask) + 1, hi, out);
+                return;
+            }
+            if ((hi & mask) != mask) {
+                split_utf8(lo, (hi & ~mask) - 1, out);
+                split_utf8(hi & ~mask, hi, out);
+                return;
+            }
+        }
+    }
 
-    return {result};
+    auto seq = utf8_sequence{n};
+    for (int i = 0; i < n; ++i) {
+        seq.ranges[i] = {lo_bytes[i], hi_bytes[i]};
+    }
+    out.push_back(seq);
 }
 
-static auto utf8_range_n(std::string_view smin, std::string_view smax, int n)
-    -> std::vector<ast::node>
+// Trie of utf8_sequences. Sequences with the same prefix have equal or disjoint ranges at the
+// next byte, so each edge is one byte range.
+struct utf8_trie
 {
-    std::vector<ast::node> result;
-
-    int smin_0 = smin[0] & 0xFF;
-    int smax_0 = smax[0] & 0xFF;
-    if (n == 1) {
-        result.push_back({ast::node_range{smin_0, smax_0}});
-    } else if (smin_0 < smax_0) {
-        auto start = ast::node_concat{{
-            {ast::node_range{smin_0, smin_0}},
-            make_start(smin.substr(1)),
-        }};
-        result.push_back({std::move(start)});
-        if (smax_0 > smin_0 + 1) {
-            auto middle = ast::node_concat{{
-                {ast::node_range{smin_0 + 1, smax_0 - 1}},
-            }};
-            for (int i = 1; i < n; ++i) {
-                middle.args.push_back({ast::node_range{
-                    0b1000'0000,
-                    0b1011'1111,
-                }});
+    static constexpr int FINAL = -1;
+
+    // node -> (byte range, child node or FINAL)
+    std::vector<std::vector<std::pair<ast::node_range, int>>> edges{1};
+
+    void insert(utf8_sequence const& seq)
+    {
+        int node = 0;
+        for (int i = 0; i < seq.len; ++i) {
+            auto range = seq.ranges[i];
+            auto& out = edges[node];
+            // sequences come in codepoint order, so a shared prefix is the last edge
+            if (!out.empty() && out.back().first.min == range.min
+                && out.back().first.max == range.max) {
+                node = out.back().second;
+                continue;
             }
-            result.push_back({std::move(middle)});
-        }
-        auto last = ast::node_concat{{
-            {ast::node_range{smax_0, smax_0}},
-            make_last(smax.substr(1)),
-        }};
-        result.push_back({std::move(last)});
-    } else {
-        auto vec = utf8_range_n(smin.substr(1), smax.substr(1), n - 1);
-        if (vec.size() == 1) {
-            result.push_back({ast::node_concat{{
-                {ast::node_range{smin_0, smax_0}},
-                vec[0],
-            }}});
-        } else {
-            result.push_back({ast::node_concat{{
-                {ast::node_range{smin_0, smax_0}},
-                {ast::node_union{std::move(vec)}},
-            }}});
+            int child = FINAL;
+            if (i + 1 < seq.len) {
+                child = edges.size();
+                edges.emplace_back();
+            }
+            edges[node].emplace_back(range, child);
+            node = child;
         }
     }
+};
 
-    return result;
-}
-
-static auto range_to_node(char32_t min, char32_t max) -> std::vector<ast::node>
+// Convert the trie to an AST, sharing equal suffixes: subtrees with the same structure get
+// one ID, and edges of a node into the same ID share one branch with their ranges merged.
+struct utf8_trie_converter
 {
-    auto result = std::vector<ast::node>{};
+    utf8_trie const& trie;
+    std::map<std::vector<std::tuple<int, int, int>>, int> suffix_ids{};
+    std::vector<ast::node> suffixes{};
+
+    auto convert(int node) -> int
+    {
+        auto key = std::vector<std::tuple<int, int, int>>{};
+        for (auto [range, child] : trie.edges[node]) {
+            key.emplace_back(range.min, range.max, child == utf8_trie::FINAL ? -1 : convert(child));
+        }
+        if (auto it = suffix_ids.find(key); it != suffix_ids.end()) {
+            return it->second;
+        }
 
-    static constexpr auto utf8_ranges = {
-        std::make_pair(0, 0x7F),
-        std::make_pair(0x80, 0x7FF),
-        std::make_pair(0x800, 0xFFFF),
-        std::make_pair(0x10000, 0x10FFFF),
-    };
-    for (auto crange : utf8_ranges) {
-        if (max >= crange.first && crange.second >= min) { // has overlap
-            const auto cmin = std::max(min, char32_t(crange.first));
-            const auto cmax = std::min(max, char32_t(crange.second));
-            auto smin = utf8::utf32to8(std::u32string_view(&cmin, 1));
-            auto smax = utf8::utf32to8(std::u32string_view(&cmax, 1));
-            assert(smin.size() == smax.size());
-            auto vec = utf8_range_n(smin, smax, smin.size());
-            result.insert(result.end(), vec.begin(), vec.end());
+        // byte ranges into each suffix, in order of first appearance
+        auto targets = std::vector<int>{};
+        auto ranges = std::vector<std::vector<ast::node_range>>{};
+        for (auto [min, max, suffix] : key) {
+            auto it = std::find(targets.begin(), targets.end(), suffix);
+            if (it == targets.end()) {
+                targets.push_back(suffix);
+                ranges.emplace_back();
+                it = targets.end() - 1;
+            }
+            auto& vec = ranges[it - targets.begin()];
+            if (!vec.empty() && vec.back().max + 1 == min) {
+                vec.back().max = max;
+            } else {
+                vec.emplace_back(min, max);
+            }
         }
-    }
 
-    return result;
-}
+        auto branches = ast::node_union{};
+        for (std::size_t i = 0; i < targets.size(); ++i) {
+            auto head = ast::node{ast::node_range{ranges[i][0]}};
+            if (ranges[i].size() > 1) {
+                auto alts = ast::node_union{};
+                for (auto range : ranges[i]) {
+                    alts.args.push_back({range});
+                }
+                head = ast::node{std::move(alts)};
+            }
+            if (targets[i] == -1) {
+                branches.args.push_back(std::move(head));
+            } else {
+                branches.args.push_back({ast::node_concat{{
+                    std::move(head),
+                    suffixes[targets[i]],
+                }}});
+            }
+        }
+
+        int id = suffixes.size();
+        suffixes.push_back({std::move(branches)});
+        suffix_ids.emplace(std::move(key), id);
+        return id;
+    }
+};
 
 static auto bitmap_to_node(roaring::Roaring const& set) -> ast::node
 {
-    auto result = ast::node_union{};
+    auto sequences = std::vector<utf8_sequence>{};
 
     char32_t range_min = 0;
     char32_t range_max = -1;
@@ -253,19 +290,25 @@ static auto bitmap_to_node(roaring::Roaring const& set) -> ast::node
             if (range_max == -1) {
                 range_min = cur_idx;
             } else if (range_max + 1 < cur_idx) {
-                auto vec = range_to_node(range_min, range_max);
-                result.args.insert(result.args.end(), vec.begin(), vec.end());
+                split_utf8(range_min, range_max, sequences);
                 range_min = cur_idx;
             }
             range_max = cur_idx;
         }
     }
     if (range_max != -1) {
-        auto vec = range_to_node(range_min, range_max);
-        result.args.insert(result.args.end(), vec.begin(), vec.end());
+        split_utf8(range_min, range_max, sequences);
     }
 
-    return {result};
+    if (sequences.empty()) {
+        return {ast::node_union{}};
+    }
+    auto trie = utf8_trie{};
+    for (auto const& seq : sequences) {
+        trie.insert(seq);
+    }
+    auto converter = utf8_trie_converter{trie};
+    return converter.suffixes[converter.convert(0)];
 }
 
 template<typename T>
@@ -303,14 +346,14 @@ static auto convert(T const& node) -> ast::node
         if (node.max == std::numeric_limits<int>::max()) {
             end = ast::node_star{elem};
         } else if (node.min < node.max) {
-            auto max_repeat = ast::node_concat{};
+            // x{0,3} = (x(x(x)?)?)?, so the first set holds one copy of x instead of three
             for (int i = node.min + 1; i <= node.max; ++i) {
-                max_repeat.args.push_back({ast::node_union{{
+                auto rest = i == node.min + 1 ? elem : ast::node{ast::node_concat{{elem, end}}};
+                end = ast::node_union{{
                     ast::node{ast::node_empty{}},
-                    elem,
-                }}});
+                    std::move(rest),
+                }};
             }
-            end = max_repeat;
         }
 
         if (node.min == 0) {
@@ -392,6 +435,329 @@ static auto convert(T const& node) -> ast::node
     }
 }
 
+// plain ε; assertions are ε to the DFA too, but must survive for needs_recheck
+static auto is_epsilon(ast::node const& node) -> bool
+{
+    auto empty = std::get_if<ast::node_empty>(&node.get());
+    return empty && empty->assertion == ast::assertion_kind::none;
+}
+
+// structural key of a node; equal keys mean equal subtrees
+static void node_key(ast::node const& node, std::string& out)
+{
+    std::visit(
+        [&out](auto&& n) {
+            using T = std::decay_t<decltype(n)>;
+            if constexpr (std::is_same_v<T, ast::node_empty>) {
+                out += 'e';
+                out += static_cast<char>(n.assertion);
+            } else if constexpr (std::is_same_v<T, ast::node_range>) {
+                out += 'r';
+                out += static_cast<char>(n.min);
+                out += static_cast<char>(n.max);
+            } else if constexpr (std::is_same_v<T, ast::node_star>) {
+                out += "s(";
+                node_key(n.arg, out);
+                out += ")";
+            } else {
+                out += std::is_same_v<T, ast::node_union> ? "u(" : "c(";
+                for (auto&& arg : n.args) {
+                    node_key(arg, out);
+                }
+                out += ")";
+            }
+        },
+        node.get());
+}
+
+static auto node_key(ast::node const& node) -> std::string
+{
+    auto key = std::string{};
+    node_key(node, key);
+    return key;
+}
+
+// the factors of a concatenation, or the node itself
+static auto concat_items(ast::node const& node) -> std::vector<ast::node>
+{
+    if (auto concat = std::get_if<ast::node_concat>(&node.get())) {
+        return concat->args;
+    }
+    return {node};
+}
+
+static auto make_concat(std::vector<ast::node> items) -> ast::node
+{
+    if (items.empty()) {
+        return {ast::node_empty{}};
+    } else if (items.size() == 1) {
+        return std::move(items[0]);
+    }
+    return {ast::node_concat{std::move(items)}};
+}
+
+// x·x* as found in x+
+static auto is_plus(ast::node const& node) -> bool
+{
+    auto concat = std::get_if<ast::node_concat>(&node.get());
+    if (!concat || concat->args.size() != 2) {
+        return false;
+    }
+    auto star = std::get_if<ast::node_star>(&concat->args[1].get());
+    return star && node_key(star->arg) == node_key(concat->args[0]);
+}
+
+// Trie of the branches of a union, seen as sequences of concatenated items. Equal items get
+// one ID, so branches with a common prefix share a path and duplicate branches collapse.
+struct branch_trie
+{
+    std::vector<ast::node> items{};
+    std::unordered_map<std::string, int> item_ids{};
+
+    // node -> (item, child node)
+    std::vector<std::vector<std::pair<int, int>>> edges{1};
+    // nodes where a branch ends
+    std::vector<bool> final{false};
+
+    void insert(ast::node const& branch)
+    {
+        if (auto u = std::get_if<ast::node_union>(&branch.get())) {
+            for (auto&& arg : u->args) {
+                insert(arg);
+            }
+            return;
+        }
+        int node = 0;
+        if (!is_epsilon(branch)) {
+            for (auto& item : concat_items(branch)) {
+                auto [it, inserted] = item_ids.emplace(node_key(item), items.size());
+                if (inserted) {
+                    items.push_back(std::move(item));
+                }
+                auto& out = edges[node];
+                auto edge = std::find_if(out.begin(), out.end(), [&](auto const& e) {
+                    return e.first == it->second;
+                });
+                if (edge != out.end()) {
+                    node = edge->second;
+                    continue;
+                }
+                int child = edges.size();
+                edges.emplace_back();
+                final.push_back(false);
+                edges[node].emplace_back(it->second, child);
+                node = child;
+            }
+        }
+        final[node] = true;
+    }
+};
+
+// Convert the trie back to an AST, like utf8_trie_converter: equal subtrees get one suffix ID,
+// and the items of a node leading into the same suffix become one branch, so common suffixes
+// are factored out as well. Byte ranges among those items are merged.
+struct branch_trie_converter
+{
+    struct suffix
+    {
+        bool final;
+        std::vector<int> targets;            // suffix IDs of the children, in order of appearance
+        std::vector<std::vector<int>> heads; // items into each target
+    };
+
+    branch_trie const& trie;
+    std::map<std::pair<bool, std::vector<std::pair<int, int>>>, int> suffix_ids{};
+    std::vector<suffix> suffixes{};
+    std::vector<int> uses{}; // branches built from each suffix
+
+    auto convert(int node) -> int
+    {
+        // (item, suffix ID) per edge
+        auto children = std::vector<std::pair<int, int>>{};
+        for (auto [item, child] : trie.edges[node]) {
+            children.emplace_back(item, convert(child));
+        }
+        auto key = std::pair{trie.final[node], children};
+        std::ranges::sort(key.second);
+        if (auto it = suffix_ids.find(key); it != suffix_ids.end()) {
+            return it->second;
+        }
+
+        auto result = suffix{trie.final[node]};
+        for (auto [item, target] : children) {
+            auto it = std::find(result.targets.begin(), result.targets.end(), target);
+            if (it == result.targets.end()) {
+                result.targets.push_back(target);
+                result.heads.emplace_back();
+                it = result.targets.end() - 1;
+                uses[target] += 1;
+            }
+            result.heads[it - result.targets.begin()].push_back(item);
+        }
+
+        int id = suffixes.size();
+        suffixes.push_back(std::move(result));
+        uses.push_back(0);
+        suffix_ids.emplace(std::move(key), id);
+        return id;
+    }
+
+    auto alternatives(std::vector<int> const& item_ids) const -> ast::node
+    {
+        auto ranges = std::vector<ast::node_range>{};
+        auto others = std::vector<ast::node>{};
+        for (int id : item_ids) {
+            if (auto range = std::get_if<ast::node_range>(&trie.items[id].get())) {
+                ranges.push_back(*range);
+            } else {
+                others.push_back(trie.items[id]);
+            }
+        }
+        std::ranges::sort(ranges, {}, &ast::node_range::min);
+
+        auto alts = ast::node_union{};
+        for (auto const& range : ranges) {
+            auto last = alts.args.empty() ? nullptr
+                                          : std::get_if<ast::node_range>(&alts.args.back().get());
+            if (last && range.min <= last->max + 1) {
+                last->max = std::max(last->max, range.max);
+            } else {
+                alts.args.push_back({range});
+            }
+        }
+        for (auto& other : others) {
+            alts.args.push_back(std::move(other));
+        }
+        if (alts.args.size() == 1) {
+            return std::move(alts.args[0]);
+        }
+        return {std::move(alts)};
+    }
+
+    // Build the AST of suffix root. Children have lower IDs than their parents, so suffixes are
+    // built in ID order, and each is moved into its last user instead of copied.
+    auto build(int root) -> ast::node
+    {
+        auto nodes = std::vector<ast::node>(suffixes.size());
+        for (int id = 0; id <= root; ++id) {
+            auto const& suf = suffixes[id];
+            auto branches = ast::node_union{};
+            for (std::size_t i = 0; i < suf.targets.size(); ++i) {
+                auto items = concat_items(alternatives(suf.heads[i]));
+                int target = suf.targets[i];
+                auto rest = --uses[target] == 0 ? std::move(nodes[target]) : nodes[target];
+                if (auto concat = std::get_if<ast::node_concat>(&rest.get())) {
+                    std::ranges::move(concat->args, std::back_inserter(items));
+                } else if (!is_epsilon(rest)) {
+                    items.push_back(std::move(rest));
+                }
+                branches.args.push_back(make_concat(std::move(items)));
+            }
+
+            if (suf.final) {
+                // a nullable branch makes ε redundant; ε|x+ is x*
+                bool absorbed = false;
+                for (auto& branch : branches.args) {
+                    if (std::holds_alternative<ast::node_star>(branch.get())) {
+                        absorbed = true;
+                    } else if (!absorbed && is_plus(branch)) {
+                        auto star = std::get<ast::node_concat>(branch.get()).args[1];
+                        branch = std::move(star);
+                        absorbed = true;
+                    }
+                }
+                if (!absorbed) {
+                    branches.args.insert(branches.args.begin(), {ast::node_empty{}});
+                }
+            }
+
+            if (branches.args.size() == 1) {
+                nodes[id] = std::move(branches.args[0]);
+            } else {
+                nodes[id] = std::move(branches);
+            }
+        }
+        return std::move(nodes[root]);
+    }
+};
+
+// Union of already simplified branches, with nested unions flattened, duplicates dropped,
+// common prefixes and suffixes factored out and byte ranges merged. A dictionary of words
+// turns into a trie of its prefixes with equal tails merged.
+static auto simplify_union(std::vector<ast::node> const& branches) -> ast::node
+{
+    auto trie = branch_trie{};
+    for (auto&& branch : branches) {
+        trie.insert(branch);
+    }
+    auto converter = branch_trie_converter{trie};
+    return converter.build(converter.convert(0));
+}
+
+// Rewrites the AST into an equivalent one with fewer positions: see simplify_union, plus
+// flattened concatenations without ε, (x*)* = (x|ε)* = (x+)* = x*, and x*x* = x*.
+static auto simplify(ast::node const& node) -> ast::node
+{
+    return std::visit(
+        [](auto&& n) -> ast::node {
+            using T = std::decay_t<decltype(n)>;
+            if constexpr (std::is_same_v<T, ast::node_union>) {
+                if (n.args.empty()) {
+                    return {n};
+                }
+                auto branches = std::vector<ast::node>{};
+                for (auto&& arg : n.args) {
+                    branches.push_back(simplify(arg));
+                }
+                return simplify_union(branches);
+            } else if constexpr (std::is_same_v<T, ast::node_concat>) {
+                auto items = std::vector<ast::node>{};
+                for (auto&& arg : n.args) {
+                    for (auto& item : concat_items(simplify(arg))) {
+                        if (is_epsilon(item)) {
+                            continue;
+                        }
+                        if (!items.empty() && std::holds_alternative<ast::node_star>(item.get())
+                            && node_key(items.back()) == node_key(item)) {
+                            continue;
+                        }
+                        items.push_back(std::move(item));
+                    }
+                }
+                return make_concat(std::move(items));
+            } else if constexpr (std::is_same_v<T, ast::node_star>) {
+                auto arg = simplify(n.arg);
+                if (std::holds_alternative<ast::node_star>(arg.get()) || is_epsilon(arg)) {
+                    return arg;
+                }
+                if (is_plus(arg)) {
+                    return std::get<ast::node_concat>(arg.get()).args[1];
+                }
+                if (auto u = std::get_if<ast::node_union>(&arg.get())) {
+                    // ε and inner stars are redundant under a star
+                    auto branches = std::vector<ast::node>{};
+                    for (auto&& branch : u->args) {
+                        if (auto star = std::get_if<ast::node_star>(&branch.get())) {
+                            branches.push_back(star->arg);
+                        } else if (is_plus(branch)) {
+                            branches.push_back(std::get<ast::node_concat>(branch.get()).args[0]);
+                        } else if (!is_epsilon(branch)) {
+                            branches.push_back(branch);
+                        }
+                    }
+                    if (branches.empty()) {
+                        return {ast::node_empty{}};
+                    }
+                    arg = simplify_union(branches);
+                }
+                return {ast::node_star{std::move(arg)}};
+            } else {
+                return {n};
+            }
+        },
+        node.get());
+}
+
 static auto normalize(ast::node const& node) -> ast::node
 {
     // collapse single-child nodes
@@ -437,7 +803,7 @@ static auto normalize(ast::node const& node) -> ast::node
 auto cst_to_ast(cst::pattern const& cst) -> ast::node
 {
     auto result = convert(cst);
-    return normalize(result);
+    return normalize(simplify(result));
 }
 
 auto print_ast(ast::node const& n) -> std::string
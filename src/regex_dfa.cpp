@@ -1,17 +1,45 @@
 #include "regex_dfa.hpp"
 
 #include <algorithm>
+#include <bit>
 #include <map>
 #include <ranges>
 #include <set>
+#include <unordered_map>
 
 namespace corpus_search::regex {
 
+using sm::position_set;
+using sm::position_set_hash;
+
+static auto count_positions(ast::node const& node) -> int
+{
+    return std::visit(
+        [](auto&& node) -> int {
+            using T = std::decay_t<decltype(node)>;
+            if constexpr (std::is_same_v<T, ast::node_range>) {
+                return 1;
+            } else if constexpr (std::is_same_v<T, ast::node_union>
+                                 || std::is_same_v<T, ast::node_concat>) {
+                int count = 0;
+                for (auto&& arg : node.args) {
+                    count += count_positions(arg);
+                }
+                return count;
+            } else if constexpr (std::is_same_v<T, ast::node_star>) {
+                return count_positions(node.arg);
+            } else {
+                return 0;
+            }
+        },
+        node.get());
+}
+
 enum class node_type { concat, star, other };
 struct node_table
 {
-    std::set<int> firstpos;
-    std::set<int> lastpos;
+    position_set firstpos;
+    position_set lastpos;
     bool nullable;
 
     node_type type = node_type::other;
@@ -20,6 +48,7 @@ struct node_table
 
 struct mark_state
 {
+    int num_positions = 0;
     int cur_pos = 0;
     int cur_index = 0;
     bool has_assertion = false;
@@ -28,7 +57,7 @@ struct mark_state
     std::map<int, node_table> nodes{};
 
     // leaf pos -> character range
-    std::map<int, ast::node_range> leaf_map{};
+    std::vector<ast::node_range> leaf_map{};
 
     auto visit_ast(ast::node const& node) -> node_table
     {
@@ -44,25 +73,30 @@ struct mark_state
                     if (node.assertion != ast::assertion_kind::none) {
                         has_assertion = true;
                     }
-                    return {{}, {}, true};
+                    return {position_set(num_positions), position_set(num_positions), true};
                 } else if constexpr (std::is_same_v<T, ast::node_range>) {
                     cur_pos++;
-                    leaf_map[my_pos] = node;
-                    return {{my_pos}, {my_pos}, false};
+                    leaf_map.push_back(node);
+                    auto result = node_table{
+                        position_set(num_positions), position_set(num_positions), false};
+                    result.firstpos.insert(my_pos);
+                    result.lastpos.insert(my_pos);
+                    return result;
                 } else if constexpr (std::is_same_v<T, ast::node_union>) {
-                    auto result = node_table{};
-                    result.nullable = false;
+                    auto result = node_table{
+                        position_set(num_positions), position_set(num_positions), false};
                     for (auto&& arg : node.args) {
                         auto p = visit_ast(arg);
-                        result.firstpos.insert(p.firstpos.begin(), p.firstpos.end());
-                        result.lastpos.insert(p.lastpos.begin(), p.lastpos.end());
+                        result.firstpos |= p.firstpos;
+                        result.lastpos |= p.lastpos;
                         result.nullable = result.nullable || p.nullable;
                     }
                     return result;
                 } else if constexpr (std::is_same_v<T, ast::node_concat>) {
                     assert(node.args.size() == 2);
 
-                    auto result = node_table{};
+                    auto result = node_table{
+                        position_set(num_positions), position_set(num_positions), false};
                     result.type = node_type::concat;
 
                     int ch0_idx = cur_index;
@@ -74,14 +108,14 @@ struct mark_state
                     result.children.push_back(ch1_idx);
 
                     result.nullable = p0.nullable && p1.nullable;
-                    result.firstpos.insert(p0.firstpos.begin(), p0.firstpos.end());
+                    result.firstpos |= p0.firstpos;
                     if (p0.nullable) {
-                        result.firstpos.insert(p1.firstpos.begin(), p1.firstpos.end());
+                        result.firstpos |= p1.firstpos;
                     }
 
-                    result.lastpos.insert(p1.lastpos.begin(), p1.lastpos.end());
+                    result.lastpos |= p1.lastpos;
                     if (p1.nullable) {
-                        result.lastpos.insert(p0.lastpos.begin(), p0.lastpos.end());
+                        result.lastpos |= p0.lastpos;
                     }
 
                     return result;
@@ -104,67 +138,178 @@ struct mark_state
     }
 };
 
-struct comparator
+// Hopcroft's partition refinement over the byte classes the edges were built from.
+// Missing transitions go to an implicit dead state, which is dropped again at the end
+// together with every state equivalent to it.
+static auto minimize(sm::graph const& dfa, sm::byte_classes const& classes) -> sm::graph
 {
-    bool operator()(const ast::node_range& a, const ast::node_range& b) const
-    {
-        return a.min < b.min;
+    int const k = classes.num_classes;
+    int const n = dfa.num_states + 1;
+    int const dead = dfa.num_states;
+
+    // predecessors of each (class, target) pair, in CSR form
+    auto delta = std::vector<int>(n * k, dead);
+    for (auto const& [state, transitions] : dfa.edges) {
+        for (auto const& tr : transitions) {
+            for (int c = classes.of_byte[tr.range.min]; c <= classes.of_byte[tr.range.max]; ++c) {
+                delta[state * k + c] = tr.target_state;
+            }
+        }
+    }
+    auto inv_start = std::vector<int>(k * n + 1, 0);
+    for (int s = 0; s < n; ++s) {
+        for (int c = 0; c < k; ++c) {
+            inv_start[c * n + delta[s * k + c] + 1]++;
+        }
+    }
+    for (int i = 0; i < k * n; ++i) {
+        inv_start[i + 1] += inv_start[i];
+    }
+    auto inv = std::vector<int>(n * k);
+    auto fill = std::vector<int>(inv_start.begin(), inv_start.end() - 1);
+    for (int s = 0; s < n; ++s) {
+        for (int c = 0; c < k; ++c) {
+            inv[fill[c * n + delta[s * k + c]]++] = s;
+        }
     }
-};
 
-static auto merge_identical_states(sm::graph dfa) -> sm::graph
-{
-    using state_key = std::pair<std::set<sm::transition>, bool>;
-
-    bool is_changed;
-    do {
-        std::map<state_key, int> unique_states;
-        std::map<int, int> old_to_new_state;
-
-        is_changed = false;
-        for (auto&& [state_id, transition] : dfa.edges) {
-            auto key = state_key{
-                {transition.begin(), transition.end()},
-                dfa.accept_states.contains(state_id),
-            };
-            if (unique_states.contains(key)) {
-                old_to_new_state[state_id] = unique_states[key];
-                is_changed = true;
-            } else {
-                int new_id = unique_states.size();
-                old_to_new_state[state_id] = new_id;
-                unique_states[key] = new_id;
+    // Blocks are contiguous slices of elems; the marked states of a block are moved to its front.
+    auto elems = std::vector<int>(n);
+    auto loc = std::vector<int>(n);
+    auto block_of = std::vector<int>(n);
+    auto begin = std::vector<int>{};
+    auto end = std::vector<int>{};
+    auto marked = std::vector<int>{};
+
+    // initial partition: accept states, and all others including the dead state
+    int pos = 0;
+    for (bool accept : {true, false}) {
+        int first = pos;
+        for (int s = 0; s < n; ++s) {
+            if ((s != dead && dfa.accept_states.contains(s)) == accept) {
+                elems[pos] = s;
+                loc[s] = pos++;
+                block_of[s] = begin.size();
             }
         }
-
-        sm::graph result;
-        result.start_state = old_to_new_state.at(dfa.start_state);
-        result.num_states = unique_states.size();
-        result.needs_recheck = dfa.needs_recheck;
-        for (int state : dfa.accept_states) {
-            result.accept_states.insert(old_to_new_state.at(state));
+        if (pos > first) {
+            begin.push_back(first);
+            end.push_back(pos);
+            marked.push_back(0);
         }
-        for (auto&& [state_id, transitions] : dfa.edges) {
-            int new_id = old_to_new_state.at(state_id);
-            if (result.edges.contains(new_id)) {
-                continue;
+    }
+
+    auto worklist = std::vector<int>{};
+    for (int b = 0; b < begin.size(); ++b) {
+        worklist.push_back(b);
+    }
+    auto splitter = std::vector<int>{};
+    auto touched = std::vector<int>{};
+    while (!worklist.empty()) {
+        int b = worklist.back();
+        worklist.pop_back();
+        splitter.assign(elems.begin() + begin[b], elems.begin() + end[b]);
+
+        for (int c = 0; c < k; ++c) {
+            for (int t : splitter) {
+                for (int i = inv_start[c * n + t]; i < inv_start[c * n + t + 1]; ++i) {
+                    int s = inv[i];
+                    int sb = block_of[s];
+                    int front = begin[sb] + marked[sb];
+                    if (loc[s] < front) {
+                        continue; // already marked
+                    }
+                    int other = elems[front];
+                    std::swap(elems[loc[s]], elems[front]);
+                    loc[other] = loc[s];
+                    loc[s] = front;
+                    if (marked[sb]++ == 0) {
+                        touched.push_back(sb);
+                    }
+                }
             }
-            result.edges[new_id] = {};
-            for (auto&& tr : transitions) {
-                int new_target = old_to_new_state.at(tr.target_state);
-                result.edges[new_id].push_back({tr.range, new_target});
+
+            for (int sb : touched) {
+                int mid = begin[sb] + marked[sb];
+                marked[sb] = 0;
+                if (mid == end[sb]) {
+                    continue;
+                }
+                // the smaller half becomes the new block, and always goes on the worklist:
+                // if sb is there already both halves are, otherwise the smaller one suffices
+                int nb = begin.size();
+                if (mid - begin[sb] <= end[sb] - mid) {
+                    begin.push_back(begin[sb]);
+                    end.push_back(mid);
+                    begin[sb] = mid;
+                } else {
+                    begin.push_back(mid);
+                    end.push_back(end[sb]);
+                    end[sb] = mid;
+                }
+                marked.push_back(0);
+                for (int i = begin[nb]; i < end[nb]; ++i) {
+                    block_of[elems[i]] = nb;
+                }
+                worklist.push_back(nb);
             }
+            touched.clear();
         }
+    }
 
-        dfa = std::move(result);
+    // number the surviving blocks in order of their first state, so the start state stays 0
+    int const dead_block = block_of[dead];
+    auto block_id = std::vector<int>(begin.size(), -1);
+    auto representative = std::vector<int>{};
+    for (int s = 0; s < dead; ++s) {
+        int b = block_of[s];
+        if (b != dead_block && block_id[b] == -1) {
+            block_id[b] = representative.size();
+            representative.push_back(s);
+        }
+    }
 
-    } while (is_changed);
+    sm::graph result;
+    result.start_state = block_id[block_of[dfa.start_state]];
+    result.num_states = representative.size();
+    result.needs_recheck = dfa.needs_recheck;
+    for (int state : dfa.accept_states) {
+        result.accept_states.insert(block_id[block_of[state]]);
+    }
+    for (int new_id = 0; new_id < result.num_states; ++new_id) {
+        auto vec = std::vector<sm::transition>{};
+        for (auto const& tr : dfa.edges.at(representative[new_id])) {
+            if (block_of[tr.target_state] == dead_block) {
+                continue;
+            }
+            int target = block_id[block_of[tr.target_state]];
+            if (!vec.empty() && vec.back().target_state == target
+                && vec.back().range.max + 1 == tr.range.min) {
+                vec.back().range.max = tr.range.max;
+            } else {
+                vec.push_back({tr.range, target});
+            }
+        }
+        result.edges[new_id] = std::move(vec);
+    }
 
-    return dfa;
+    return result;
 }
 
-// McNaughton-Yamada-Thompson algorithm
-auto ast_to_dfa(ast::node const& node) -> sm::graph
+// followpos of every leaf position, the input of the subset construction
+struct position_automaton
+{
+    int num_positions;
+    int final_pos;
+    bool has_assertion;
+    position_set start;
+    std::vector<position_set> followpos;
+    std::vector<ast::node_range> leaf_ranges;
+    sm::byte_classes classes;
+    std::vector<std::pair<int, int>> leaf_classes; // first and last byte class of each leaf
+};
+
+static auto build_positions(ast::node const& node) -> position_automaton
 {
     auto aug_node = ast::node{ast::node_concat{{
         node,
@@ -172,168 +317,295 @@ auto ast_to_dfa(ast::node const& node) -> sm::graph
     }}};
 
     // fill firstpos, lastpos, and nullable
-    mark_state visit_state{};
+    mark_state visit_state{.num_positions = count_positions(aug_node)};
     visit_state.visit_ast(aug_node);
 
     auto const& nodes = visit_state.nodes;
-    auto const& leaf_map = visit_state.leaf_map;
-    int const final_pos = visit_state.cur_pos - 1;
+    auto result = position_automaton{
+        .num_positions = visit_state.num_positions,
+        .final_pos = visit_state.cur_pos - 1,
+        .has_assertion = visit_state.has_assertion,
+        .start = nodes.at(0).firstpos,
+        .followpos = std::vector<position_set>(visit_state.cur_pos,
+                                               position_set(visit_state.num_positions)),
+        .leaf_ranges = std::move(visit_state.leaf_map),
+    };
 
-    auto followpos = std::vector<std::set<int>>(visit_state.cur_pos);
+    auto& followpos = result.followpos;
     for (int i = 0; i < nodes.size(); ++i) {
         auto const& pos = nodes.at(i);
 
         if (pos.type == node_type::concat) {
-            int ch0_idx = pos.children[0];
-            const auto ch1 = nodes.at(pos.children[1]);
-            for (int p : nodes.at(ch0_idx).lastpos) {
-                followpos[p].insert(ch1.firstpos.begin(), ch1.firstpos.end());
-            }
+            auto const& ch1 = nodes.at(pos.children[1]);
+            nodes.at(pos.children[0]).lastpos.for_each([&](int p) {
+                followpos[p] |= ch1.firstpos;
+            });
         } else if (pos.type == node_type::star) {
-            for (int p : pos.lastpos) {
-                followpos[p].insert(pos.firstpos.begin(), pos.firstpos.end());
-            }
+            pos.lastpos.for_each([&](int p) { followpos[p] |= pos.firstpos; });
+        }
+    }
+
+    // transitions are computed per byte class of the leaves
+    result.classes = sm::partition_bytes(
+        std::vector<ast::node_range>(result.leaf_ranges.begin(),
+                                     result.leaf_ranges.begin() + result.final_pos));
+    for (auto const& range : result.leaf_ranges) {
+        result.leaf_classes.emplace_back(result.classes.of_byte[range.min],
+                                         result.classes.of_byte[range.max]);
+    }
+
+    return result;
+}
+
+struct sm::lazy_builder
+{
+    position_automaton nfa;
+    int max_states;
+
+    // position set of every state built so far
+    std::vector<position_set> states;
+    std::unordered_map<position_set, int, position_set_hash> seen_states;
+};
+
+sm::graph::graph() = default;
+sm::graph::graph(graph&&) noexcept = default;
+auto sm::graph::operator=(graph&&) noexcept -> graph& = default;
+sm::graph::~graph() = default;
+
+static auto add_lazy_state(sm::graph const& dfa, position_set positions) -> int
+{
+    int state = dfa.num_states++;
+    dfa.table.resize(dfa.num_states * dfa.classes.num_classes, sm::graph::UNEXPLORED);
+    dfa.accept_bits.resize((dfa.num_states + 63) / 64);
+    if (dfa.accepts(positions)) {
+        dfa.accept_states.insert(state);
+        dfa.accept_bits[state >> 6] |= std::uint64_t{1} << (state & 63);
+    }
+    dfa.lazy->seen_states.emplace(positions, state);
+    dfa.lazy->states.push_back(std::move(positions));
+    return state;
+}
+
+static auto make_lazy_graph(position_automaton nfa, int max_states) -> sm::graph
+{
+    sm::graph result;
+    result.start_state = 0;
+    result.needs_recheck = nfa.has_assertion;
+    result.classes = nfa.classes;
+    auto start = nfa.start;
+    result.lazy = std::make_unique<sm::lazy_builder>(
+        sm::lazy_builder{.nfa = std::move(nfa), .max_states = max_states});
+    add_lazy_state(result, std::move(start));
+    return result;
+}
+
+auto sm::graph::explore(int state, int cls) const -> int
+{
+    auto next = step(lazy->states[state], cls);
+    int target = -1;
+    if (!next.empty()) {
+        target = find_state(next);
+        if (target == -1) {
+            target = num_states < lazy->max_states ? add_lazy_state(*this, std::move(next))
+                                                   : OVERFLOW;
         }
     }
+    table[state * classes.num_classes + cls] = target;
+    return target;
+}
 
-    std::vector<std::set<int>> states;
-    std::map<std::set<int>, int> seen_states;
+auto sm::graph::positions(int state) const -> position_set const&
+{
+    return lazy->states[state];
+}
+
+auto sm::graph::step(position_set const& from, int cls) const -> position_set
+{
+    auto const& nfa = lazy->nfa;
+    auto result = position_set(nfa.num_positions);
+    from.for_each([&](int p) {
+        auto [first, last] = nfa.leaf_classes[p];
+        if (p != nfa.final_pos && first <= cls && cls <= last) {
+            result |= nfa.followpos[p];
+        }
+    });
+    return result;
+}
+
+auto sm::graph::accepts(position_set const& positions) const -> bool
+{
+    return positions.contains(lazy->nfa.final_pos);
+}
+
+auto sm::graph::find_state(position_set const& positions) const -> int
+{
+    auto it = lazy->seen_states.find(positions);
+    return it != lazy->seen_states.end() ? it->second : -1;
+}
+
+// McNaughton-Yamada-Thompson algorithm
+auto ast_to_dfa(ast::node const& node, int max_states) -> sm::graph
+{
+    auto nfa = build_positions(node);
+
+    auto const& classes = nfa.classes;
+    auto class_min = std::vector<int>(classes.num_classes, 256);
+    auto class_max = std::vector<int>(classes.num_classes, -1);
+    for (int b = 0; b < 256; ++b) {
+        int c = classes.of_byte[b];
+        class_min[c] = std::min(class_min[c], b);
+        class_max[c] = std::max(class_max[c], b);
+    }
+
+    std::vector<position_set> states;
+    std::unordered_map<position_set, int, position_set_hash> seen_states;
 
     sm::graph result;
     result.start_state = 0;
     result.num_states = 1;
 
-    auto init_state = nodes.at(0).firstpos;
-    states.push_back(init_state);
-    seen_states[init_state] = 0;
+    states.push_back(nfa.start);
+    seen_states[nfa.start] = 0;
 
     // initial state could also be an accept state
-    if (init_state.contains(final_pos)) {
+    if (nfa.start.contains(nfa.final_pos)) {
         result.accept_states.insert(0);
     }
 
+    auto targets = std::vector<position_set>(classes.num_classes,
+                                             position_set(nfa.num_positions));
     for (int s = 0; s < states.size(); ++s) {
-        auto const& state = states[s];
-
-        auto transitions = std::map<ast::node_range, std::set<int>, comparator>{};
-        for (int p : state) {
-            if (p == final_pos) {
-                continue;
-            }
-            auto ch_range = leaf_map.at(p);
-
-            auto to_add = std::map<ast::node_range, std::set<int>, comparator>{};
-            auto lbound = transitions.upper_bound({ch_range.min, 0});
-            if (lbound != transitions.begin()) {
-                --lbound;
-            }
-            auto ubound = transitions.upper_bound({ch_range.max, 0});
-            while (lbound != ubound && ch_range.min <= ch_range.max) {
-                auto other_range = lbound->first;
-                auto omin = std::max(ch_range.min, other_range.min);
-                auto omax = std::min(ch_range.max, other_range.max);
-                if (omin <= omax) {
-                    // there is overlap
-                    auto other_state = lbound->second;
-
-                    // add non-overlapping parts
-                    if (ch_range.min < omin) {
-                        to_add[{ch_range.min, omin - 1}] = followpos[p];
-                    }
-                    if (other_range.min < omin) {
-                        to_add[{other_range.min, omin - 1}] = other_state;
-                    }
-                    if (omax < other_range.max) {
-                        to_add[{omax + 1, other_range.max}] = other_state;
-                    }
-
-                    // add overlapping part
-                    auto union_state = followpos[p];
-                    union_state.insert(other_state.begin(), other_state.end());
-                    to_add[{omin, omax}] = std::move(union_state);
-
-                    // remove overlapping part from current range
-                    ch_range.min = omax + 1;
-                    lbound = transitions.erase(lbound);
-                } else {
-                    lbound++;
-                }
+        // positions reachable on each byte class
+        for (auto& target : targets) {
+            std::ranges::fill(target.words, 0);
+        }
+        states[s].for_each([&](int p) {
+            if (p == nfa.final_pos) {
+                return;
             }
-            transitions.insert(to_add.begin(), to_add.end());
-            if (ch_range.min <= ch_range.max) {
-                transitions[ch_range] = followpos[p];
+            for (int c = nfa.leaf_classes[p].first; c <= nfa.leaf_classes[p].second; ++c) {
+                targets[c] |= nfa.followpos[p];
             }
-        }
+        });
 
         auto vec = std::vector<sm::transition>{};
-        for (auto&& [range, new_state] : transitions) {
+        for (int c = 0; c < classes.num_classes; ++c) {
+            auto const& new_state = targets[c];
+            if (new_state.empty()) {
+                continue;
+            }
             // add as new state if not seen before
-            if (seen_states.count(new_state) == 0) {
-                int new_state_id = result.num_states++;
-                seen_states[new_state] = new_state_id;
+            auto [it, inserted] = seen_states.try_emplace(new_state, result.num_states);
+            if (inserted) {
+                if (max_states > 0 && result.num_states == max_states) {
+                    // too big to build up front; build only the states searches reach
+                    return make_lazy_graph(std::move(nfa), max_states);
+                }
                 states.push_back(new_state);
-                if (new_state.contains(final_pos)) {
-                    result.accept_states.insert(new_state_id);
+                if (new_state.contains(nfa.final_pos)) {
+                    result.accept_states.insert(result.num_states);
                 }
+                result.num_states++;
+            }
+            int target = it->second;
+
+            // adjacent classes going to the same state share one range
+            if (!vec.empty() && vec.back().target_state == target
+                && vec.back().range.max + 1 == class_min[c]) {
+                vec.back().range.max = class_max[c];
+            } else {
+                vec.push_back(sm::transition{{class_min[c], class_max[c]}, target});
             }
-            vec.push_back(sm::transition{
-                range,
-                seen_states[new_state],
-            });
         }
         result.edges[s] = std::move(vec);
     }
 
     assert(result.accept_states.size() > 0);
 
-    result.needs_recheck = visit_state.has_assertion;
+    result.needs_recheck = nfa.has_assertion;
+
+    auto dfa = minimize(result, classes);
+    dfa.compile();
+    return dfa;
+}
+
+auto sm::partition_bytes(std::vector<ast::node_range> const& ranges) -> sm::byte_classes
+{
+    // a new class starts at every range boundary
+    auto starts_class = std::array<bool, 257>{};
+    for (auto const& range : ranges) {
+        starts_class[range.min] = true;
+        starts_class[range.max + 1] = true;
+    }
 
-    return merge_identical_states(std::move(result));
+    auto result = byte_classes{};
+    int cls = 0;
+    for (int b = 0; b < 256; ++b) {
+        if (starts_class[b] && b > 0) {
+            cls++;
+        }
+        result.of_byte[b] = cls;
+    }
+    result.num_classes = cls + 1;
+    return result;
 }
 
-auto sm::graph::next_state(int state, char ch) const -> int
+void sm::graph::compile()
 {
-    int const idx = ch & 0xFF;
-
-    // binary search for range containing idx
-    auto const& e_list = edges.at(state);
-    auto ubound = std::upper_bound(e_list.begin(),
-                                   e_list.end(),
-                                   regex::sm::transition{{idx}},
-                                   [](auto const& a, auto const& b) {
-                                       return a.range.min < b.range.min;
-                                   });
-    if (ubound != e_list.begin()) {
-        --ubound;
+    auto ranges = std::vector<ast::node_range>{};
+    for (auto const& [state, transitions] : edges) {
+        for (auto const& tr : transitions) {
+            ranges.push_back(tr.range);
+        }
     }
+    classes = partition_bytes(ranges);
 
-    if (ubound != e_list.end()) {
-        if (ubound->range.min <= idx && idx <= ubound->range.max) {
-            return ubound->target_state;
+    table.assign(num_states * classes.num_classes, -1);
+    for (auto const& [state, transitions] : edges) {
+        for (auto const& tr : transitions) {
+            for (int c = classes.of_byte[tr.range.min]; c <= classes.of_byte[tr.range.max]; ++c) {
+                table[state * classes.num_classes + c] = tr.target_state;
+            }
         }
     }
 
-    return -1;
+    accept_bits.assign((num_states + 63) / 64, 0);
+    for (int state : accept_states) {
+        accept_bits[state >> 6] |= std::uint64_t{1} << (state & 63);
+    }
 }
 
 auto sm::graph::match(std::string_view str) const -> bool
 {
     int state = start_state;
-    for (char ch : str) {
-        state = next_state(state, ch);
+    for (std::size_t i = 0; i < str.size(); ++i) {
+        int next = next_state(state, str[i]);
+        if (next == OVERFLOW) {
+            // out of states; simulate the rest on position sets
+            auto cur = step(positions(state), byte_class(str[i]));
+            for (char ch : str.substr(i + 1)) {
+                cur = step(cur, byte_class(ch));
+            }
+            return accepts(cur);
+        }
+        state = next;
         if (state == -1) {
             return false;
         }
     }
-    return accept_states.contains(state);
+    return is_accept(state);
 }
 
 void print_dfa(sm::graph const& dfa)
 {
-    fmt::println("DFA: start_state={}, accept_states=[{}], num_states={}",
+    fmt::println("DFA: start_state={}, accept_states=[{}], num_states={}, num_classes={}",
                  dfa.start_state,
                  fmt::join(dfa.accept_states, ", "),
-                 dfa.num_states);
+                 dfa.num_states,
+                 dfa.classes.num_classes);
+    if (dfa.is_lazy()) {
+        fmt::println("(lazy, at most {} states)", dfa.lazy->max_states);
+    }
 
     auto printch = [](char ch) {
         if (std::isprint(ch)) {
@@ -343,7 +615,7 @@ void print_dfa(sm::graph const& dfa)
     };
 
     for (auto&& [state, edges] : dfa.edges) {
-        fmt::println("State {} {}", state, dfa.accept_states.contains(state) ? "(accept)" : "");
+        fmt::println("State {} {}", state, dfa.is_accept(state) ? "(accept)" : "");
         for (auto&& edge : edges) {
             fmt::println("  [{}-{}] --> State {}",
                          printch(edge.range.min),
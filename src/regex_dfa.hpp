@@ -3,8 +3,14 @@
 
 #include "regex_ast.hpp"
 
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cstdint>
 #include <map>
+#include <memory>
 #include <set>
+#include <vector>
 
 namespace corpus_search::regex {
 namespace sm {
@@ -21,21 +27,132 @@ struct transition
     }
 };
 
+// Bytes that no range tells apart share a class; classes are numbered in byte order.
+struct byte_classes
+{
+    std::array<std::uint8_t, 256> of_byte{};
+    int num_classes = 1;
+};
+
+// partition 0-255 by the boundaries of every range in ranges
+auto partition_bytes(std::vector<ast::node_range> const& ranges) -> byte_classes;
+
+// Set of leaf positions of a regex, sized once for the whole regex.
+struct position_set
+{
+    std::vector<std::uint64_t> words;
+
+    position_set() = default;
+    explicit position_set(int num_positions)
+        : words((num_positions + 63) / 64)
+    {}
+
+    void insert(int p) { words[p >> 6] |= std::uint64_t{1} << (p & 63); }
+    auto contains(int p) const -> bool { return (words[p >> 6] >> (p & 63)) & 1; }
+    auto empty() const -> bool
+    {
+        return std::ranges::all_of(words, [](std::uint64_t w) { return w == 0; });
+    }
+    auto operator|=(position_set const& other) -> position_set&
+    {
+        for (std::size_t i = 0; i < words.size(); ++i) {
+            words[i] |= other.words[i];
+        }
+        return *this;
+    }
+    auto operator==(position_set const& other) const -> bool = default;
+
+    template<typename F>
+    void for_each(F&& f) const
+    {
+        for (std::size_t i = 0; i < words.size(); ++i) {
+            for (auto w = words[i]; w != 0; w &= w - 1) {
+                f(static_cast<int>(i * 64 + std::countr_zero(w)));
+            }
+        }
+    }
+};
+
+struct position_set_hash
+{
+    auto operator()(position_set const& set) const -> std::size_t
+    {
+        auto h = std::size_t{0};
+        for (auto w : set.words) {
+            h = (h ^ w) * 0x100000001b3ULL;
+        }
+        return h;
+    }
+};
+
+struct lazy_builder;
+
 struct graph
 {
+    graph();
+    graph(graph&&) noexcept;
+    auto operator=(graph&&) noexcept -> graph&;
+    ~graph();
+
+    // Fields marked mutable grow as const lookups explore a lazy graph (see below).
+
     // start -> (target, range)
     std::map<int, std::vector<transition>> edges;
     int start_state;
-    std::set<int> accept_states;
-    int num_states = 0;
+    mutable std::set<int> accept_states;
+    mutable int num_states = 0;
     bool needs_recheck = false;
 
-    auto next_state(int state, char ch) const -> int;
+    // Compiled form used on the hot paths, built by compile() once edges are final:
+    // classes of the edge ranges, a dense num_states x num_classes table of target states
+    // (-1 if none) and a bitmap of accept states.
+    byte_classes classes;
+    mutable std::vector<std::int32_t> table;
+    mutable std::vector<std::uint64_t> accept_bits;
+
+    void compile();
+
+    // A lazy graph has no edges. Its states are the position sets of the subset
+    // construction, added to table (and num_states, accept_states, accept_bits) the first
+    // time a transition reaches them. Once max_states exist, transitions to new sets give
+    // OVERFLOW, and callers go on from positions(state) with step() instead. Exploring is
+    // not thread-safe.
+    static constexpr int UNEXPLORED = -2;
+    static constexpr int OVERFLOW = -3;
+    std::unique_ptr<lazy_builder> lazy;
+
+    auto is_lazy() const -> bool { return lazy != nullptr; }
+    auto explore(int state, int cls) const -> int;
+    auto positions(int state) const -> position_set const&;
+    auto step(position_set const& from, int cls) const -> position_set;
+    auto accepts(position_set const& positions) const -> bool;
+    // state whose position set is positions, or -1 if it was never built
+    auto find_state(position_set const& positions) const -> int;
+
+    auto is_accept(int state) const -> bool
+    {
+        return (accept_bits[state >> 6] >> (state & 63)) & 1;
+    }
+    auto byte_class(char ch) const -> int { return classes.of_byte[ch & 0xFF]; }
+    auto next_state_by_class(int state, int cls) const -> int
+    {
+        int next = table[state * classes.num_classes + cls];
+        if (next == UNEXPLORED) [[unlikely]] {
+            next = explore(state, cls);
+        }
+        return next;
+    }
+    auto next_state(int state, char ch) const -> int
+    {
+        return next_state_by_class(state, byte_class(ch));
+    }
     auto match(std::string_view str) const -> bool;
 };
 } // namespace sm
 
-auto ast_to_dfa(ast::node const& node) -> sm::graph;
+// Minimal DFA of node. If the subset construction needs more than max_states states (0 for
+// no limit), returns a lazy graph bounded by max_states instead.
+auto ast_to_dfa(ast::node const& node, int max_states = 0) -> sm::graph;
 
 void print_dfa(sm::graph const& dfa);
 
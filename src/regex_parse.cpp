@@ -1,549 +1,431 @@
 #include "regex_parse.hpp"
-#include "meta_utils.hpp"
 
 #include <fmt/core.h>
 #include <fmt/ranges.h>
-#include <tao/pegtl.hpp>
-#include <tao/pegtl/contrib/analyze.hpp>
-#include <tao/pegtl/contrib/parse_tree.hpp>
-#include <tao/pegtl/contrib/parse_tree_to_dot.hpp>
-#include <tao/pegtl/contrib/utf32.hpp>
 #include <utf8.h>
 
-#include <any>
-#include <charconv>
-#include <iostream>
+#include <limits>
+#include <stdexcept>
 #include <string>
+#include <string_view>
+#include <utility>
 #include <variant>
 
 namespace corpus_search::regex {
 
-namespace pegtl = tao::pegtl;
-namespace u8 = tao::pegtl::utf8;
-
-namespace parser {
-
-// Forward declarations
-
-struct pattern;
-struct alternative;
-struct element;
-struct quantifier;
-struct quantifiable_element;
-
-struct assertion;
-struct edge_assertion;
-struct word_boundary_assertion;
-
-struct group;
-struct capturing_group;
-struct character_class;
-struct character_class_element;
-struct character_class_range;
-
-struct character_set;
-struct any_character_set;
-struct escape_character_set;
-struct unicode_property_character_set;
-
-struct character;
-struct character_inside_brackets;
-struct alphabet;
-struct alphanum;
-struct number;
-
-// Define grammar rules
-
-struct pattern : pegtl::seq<pegtl::list<alternative, u8::one<U'|'>>, pegtl::eolf>
-{
-    static auto apply(pegtl::parse_tree::node* node, std::vector<std::any> args) -> cst::pattern;
-};
-
-struct alternative : pegtl::plus<element>
-{
-    static auto apply(pegtl::parse_tree::node* node, std::vector<std::any> args)
-        -> cst::alternative;
-};
-
-struct element : pegtl::sor<assertion, quantifier, quantifiable_element>
-{
-    static auto apply(pegtl::parse_tree::node* node,
-                      std::variant<cst::assertion, cst::quantifier, cst::quantifiable_element> arg)
-        -> cst::element;
-};
-
-// non-capturing group
-struct group : pegtl::seq<u8::one<U'('>,
-                          u8::one<U'?'>,
-                          u8::one<U':'>,
-                          pegtl::list<alternative, u8::one<U'|'>>,
-                          u8::one<U')'>>
-{
-    static auto apply(pegtl::parse_tree::node* node, std::vector<std::any> args) -> cst::group;
-};
-
-struct capturing_group
-    : pegtl::seq<u8::one<U'('>,
-                 pegtl::opt<pegtl::seq<u8::one<U'?'>, u8::one<U'<'>, pegtl::until<u8::one<U'>'>>>>,
-                 pegtl::list<alternative, u8::one<U'|'>>,
-                 u8::one<U')'>>
-{
-    static auto apply(pegtl::parse_tree::node* node, std::vector<std::any> args)
-        -> cst::capturing_group;
-};
-
-struct quantifiable_element
-    : pegtl::sor<group, capturing_group, character_class, character_set, character>
-{
-    static auto apply(
-        pegtl::parse_tree::node* node,
-        std::variant<cst::group, cst::capturing_group, cst::character_class, cst::character_set, char32_t>
-            arg) -> cst::quantifiable_element;
-};
-
-struct quantifier
-    : pegtl::seq<quantifiable_element,
-                 pegtl::sor<u8::one<U'*', U'+', U'?'>,
-                            pegtl::seq<u8::one<U'{'>,
-                                       pegtl::opt<pegtl::seq<number, u8::one<U','>>>, // min
-                                       number,                                        // max
-                                       u8::one<U'}'>>>,
-                 pegtl::opt<u8::one<U'?'>> // greedy
-                 >
-{
-    static auto apply(pegtl::parse_tree::node* node, std::vector<std::any> args) -> cst::quantifier;
-};
-
-struct character_class : pegtl::seq<u8::one<U'['>,
-                                    pegtl::opt<u8::one<U'^'>>, // negate
-                                    pegtl::plus<character_class_element>,
-                                    u8::one<U']'>>
-{
-    static auto apply(pegtl::parse_tree::node* node, std::vector<std::any> args)
-        -> cst::character_class;
-};
-
-struct character_class_element : pegtl::sor<escape_character_set,
-                                            unicode_property_character_set,
-                                            character_class_range,
-                                            character_inside_brackets>
-{
-    static auto apply(pegtl::parse_tree::node* node,
-                      std::variant<cst::escape_character_set,
-                                   cst::unicode_property_character_set,
-                                   cst::character_class_range,
-                                   char32_t> arg) -> cst::character_class_element;
-};
-
-struct character_class_range
-    : pegtl::seq<character_inside_brackets, u8::one<U'-'>, character_inside_brackets>
-{
-    static auto apply(pegtl::parse_tree::node* node, char32_t min, char32_t max)
-        -> cst::character_class_range;
-};
-
-struct assertion : pegtl::sor<edge_assertion, word_boundary_assertion>
-{
-    static auto apply(pegtl::parse_tree::node* node,
-                      std::variant<cst::edge_assertion, cst::word_boundary_assertion> arg)
-        -> cst::assertion;
-};
-
-struct edge_assertion : u8::one<U'^', U'$'>
-{
-    static auto apply(pegtl::parse_tree::node* node) -> cst::edge_assertion;
-};
-
-struct word_boundary_assertion : pegtl::seq<u8::one<U'\\'>, u8::one<U'b', U'B'>>
-{
-    static auto apply(pegtl::parse_tree::node* node) -> cst::word_boundary_assertion;
-};
-
-struct character_set
-    : pegtl::sor<any_character_set, escape_character_set, unicode_property_character_set>
-{
-    static auto apply(pegtl::parse_tree::node* node,
-                      std::variant<cst::any_character_set,
-                                   cst::escape_character_set,
-                                   cst::unicode_property_character_set> arg) -> cst::character_set;
-};
-
-struct any_character_set : u8::one<U'.'>
-{
-    static auto apply(pegtl::parse_tree::node* node) -> cst::any_character_set;
-};
-
-struct escape_character_set
-    : pegtl::seq<u8::one<U'\\'>, u8::one<U'd', U'D', U's', U'S', U'w', U'W'>>
-{
-    static auto apply(pegtl::parse_tree::node* node) -> cst::escape_character_set;
-};
-
-struct unicode_property_character_set : pegtl::seq<u8::one<U'\\'>,
-                                                   u8::one<U'p', U'P'>,
-                                                   u8::one<U'{'>,
-                                                   alphabet,
-                                                   pegtl::opt<u8::one<U'='>, alphanum>,
-                                                   u8::one<U'}'>>
-{
-    static auto apply(pegtl::parse_tree::node* node, std::vector<std::any> args)
-        -> cst::unicode_property_character_set;
-};
-
-#define META_CHARS U'.', U'^', U'$', U'*', U'+', U'?', U'(', U')', U'[', U'{', U'\\', U'|'
-struct character : pegtl::if_then_else<u8::one<U'\\'>, u8::one<META_CHARS>, u8::not_one<META_CHARS>>
-{
-    static auto apply(pegtl::parse_tree::node* node) -> char32_t;
-};
-
-#define BRACKET_META_CHARS U'^', U'-', U']', U'\\'
-struct character_inside_brackets
-    : pegtl::if_then_else<u8::one<U'\\'>, u8::one<BRACKET_META_CHARS>, u8::not_one<BRACKET_META_CHARS>>
-{
-    static auto apply(pegtl::parse_tree::node* node) -> char32_t;
-};
-
-struct alphabet : pegtl::plus<u8::ranges<U'a', U'z', U'A', U'Z', U'_'>>
-{
-    static auto apply(pegtl::parse_tree::node* node) -> std::string;
-};
-
-struct alphanum : pegtl::plus<u8::ranges<U'a', U'z', U'A', U'Z', U'0', U'9', U'_'>>
-{
-    static auto apply(pegtl::parse_tree::node* node) -> std::string;
-};
+// Recursive descent parser for the grammar below. Every rule either succeeds and consumes its
+// match, or fails and leaves pos where it was, so ordered choices backtrack like a PEG.
+//
+//   pattern          <- alternatives EOF
+//   alternatives     <- alternative ('|' alternative)*
+//   alternative      <- element+
+//   element          <- assertion / quantifiable ([*+?] / '{' (number ',')? number '}') '?'?
+//   quantifiable     <- group / capturing_group / character_class / character_set / character
+//   group            <- '(?:' alternatives ')'
+//   capturing_group  <- '(' ('?<' [^>]* '>')? alternatives ')'
+//   character_class  <- '[' '^'? (escape_set / property_set / range / class_char)+ ']'
+//   range            <- class_char '-' class_char
+//   assertion        <- '^' / '$' / '\b' / '\B'
+//   character_set    <- '.' / escape_set / property_set
+//   escape_set       <- '\' [dDsSwW]
+//   property_set     <- '\' [pP] '{' [a-zA-Z_]+ ('=' [a-zA-Z0-9_]+)? '}'
+//   character        <- '\' META / !META .
+//   class_char       <- '\' BRACKET_META / !BRACKET_META .
+struct pattern_parser
+{
+    static constexpr auto META_CHARS = std::u32string_view{U".^$*+?()[{\\|"};
+    static constexpr auto BRACKET_META_CHARS = std::u32string_view{U"^-]\\"};
+
+    std::u32string_view input;
+    std::size_t pos = 0;
+    // semantic errors are only reported once the whole pattern has parsed
+    std::optional<std::string> error = std::nullopt;
+
+    // build a recursive_wrapper'd variant holding value
+    template<typename Wrapper, typename T>
+    static auto wrap(T&& value) -> Wrapper
+    {
+        using type = typename Wrapper::type;
+        return Wrapper{type{std::in_place_type<std::decay_t<T>>, std::forward<T>(value)}};
+    }
 
-struct number : pegtl::plus<u8::range<U'0', U'9'>>
-{
-    static auto apply(pegtl::parse_tree::node* node) -> int;
-};
+    auto peek(std::size_t offset = 0) const -> char32_t
+    {
+        return pos + offset < input.size() ? input[pos + offset] : U'\0';
+    }
 
-// Parser implementation
+    auto has(std::size_t count) const -> bool { return pos + count <= input.size(); }
 
-auto pattern::apply(pegtl::parse_tree::node* node, std::vector<std::any> args) -> cst::pattern
-{
-    auto result = cst::pattern{};
-    for (auto&& arg : args) {
-        result.alternatives.push_back(std::any_cast<cst::alternative>(std::move(arg)));
+    auto eat(char32_t ch) -> bool
+    {
+        if (has(1) && input[pos] == ch) {
+            pos += 1;
+            return true;
+        }
+        return false;
     }
-    return result;
-}
 
-auto alternative::apply(pegtl::parse_tree::node* node, std::vector<std::any> args)
-    -> cst::alternative
-{
-    auto result = cst::alternative{};
-    for (auto&& arg : args) {
-        result.elements.push_back(std::any_cast<cst::element>(std::move(arg)));
+    auto pattern() -> std::optional<cst::pattern>
+    {
+        auto result = cst::pattern{};
+        if (!alternatives(result.alternatives) || pos != input.size()) {
+            return std::nullopt;
+        }
+        return result;
     }
-    return result;
-}
 
-auto element::apply(pegtl::parse_tree::node* node,
-                    std::variant<cst::assertion, cst::quantifier, cst::quantifiable_element> arg)
-    -> cst::element
-{
-    return {arg};
-}
-
-auto group::apply(pegtl::parse_tree::node* node, std::vector<std::any> args) -> cst::group
-{
-    auto result = cst::group{};
-    for (auto&& arg : args) {
-        result.alternatives.push_back(std::any_cast<cst::alternative>(std::move(arg)));
+    auto alternatives(std::vector<cst::alternative>& out) -> bool
+    {
+        auto first = alternative();
+        if (!first) {
+            return false;
+        }
+        out.push_back(std::move(*first));
+        while (true) {
+            auto start = pos;
+            if (!eat(U'|')) {
+                break;
+            }
+            auto next = alternative();
+            if (!next) {
+                pos = start;
+                break;
+            }
+            out.push_back(std::move(*next));
+        }
+        return true;
     }
-    return result;
-}
 
-auto capturing_group::apply(pegtl::parse_tree::node* node, std::vector<std::any> args)
-    -> cst::capturing_group
-{
-    auto result = cst::capturing_group{};
-    if (node->children.at(1)->string_view() != "") {
-        auto str = node->children.at(1)->children.at(0)->children.at(2)->string_view();
-        result.name = str.substr(0, str.size() - 1);
-    } else {
-        result.name = std::nullopt;
-    }
-    for (auto&& arg : args) {
-        result.alternatives.push_back(std::any_cast<cst::alternative>(std::move(arg)));
+    auto alternative() -> std::optional<cst::alternative>
+    {
+        auto result = cst::alternative{};
+        while (auto elem = element()) {
+            result.elements.push_back(std::move(*elem));
+        }
+        if (result.elements.empty()) {
+            return std::nullopt;
+        }
+        return result;
     }
-    return result;
-}
 
-auto quantifiable_element::apply(
-    pegtl::parse_tree::node* node,
-    std::variant<cst::group, cst::capturing_group, cst::character_class, cst::character_set, char32_t>
-        arg) -> cst::quantifiable_element
-{
-    return {arg};
-}
+    auto element() -> std::optional<cst::element>
+    {
+        if (auto anchor = assertion()) {
+            return wrap<cst::element>(std::move(*anchor));
+        }
+        auto elem = quantifiable_element();
+        if (!elem) {
+            return std::nullopt;
+        }
 
-auto quantifier::apply(pegtl::parse_tree::node* node, std::vector<std::any> args) -> cst::quantifier
-{
-    auto result = cst::quantifier{};
-    result.element = std::any_cast<cst::quantifiable_element>(std::move(args[0]));
-    if (args.size() == 1) {
-        if (node->children.at(1)->string_view() == "*") {
+        auto start = pos;
+        auto result = cst::quantifier{};
+        if (eat(U'*')) {
             result.min = 0;
             result.max = std::numeric_limits<int>::max();
-        } else if (node->children.at(1)->string_view() == "+") {
+        } else if (eat(U'+')) {
             result.min = 1;
             result.max = std::numeric_limits<int>::max();
-        } else if (node->children.at(1)->string_view() == "?") {
+        } else if (eat(U'?')) {
             result.min = 0;
             result.max = 1;
-        } else {
-            assert(false);
-        }
-    } else if (args.size() == 2) {
-        result.min = std::any_cast<int>(args[1]);
-        result.max = std::any_cast<int>(args[1]);
-    } else if (args.size() == 3) {
-        result.min = std::any_cast<int>(args[1]);
-        result.max = std::any_cast<int>(args[2]);
+        } else if (!repeat(result.min, result.max)) {
+            pos = start;
+            return wrap<cst::element>(std::move(*elem));
+        }
+        result.greedy = !eat(U'?');
+        result.element = std::move(*elem);
+        return wrap<cst::element>(std::move(result));
     }
-    result.greedy = node->children.at(2)->string_view() != "?";
-    return result;
-}
 
-auto character_class::apply(pegtl::parse_tree::node* node, std::vector<std::any> args)
-    -> cst::character_class
-{
-    auto result = cst::character_class{};
-    result.negate = node->children.at(1)->string_view() == "^";
-    for (auto&& arg : args) {
-        result.elements.push_back(std::any_cast<cst::character_class_element>(std::move(arg)));
+    // '{' (number ',')? number '}'
+    auto repeat(int& min, int& max) -> bool
+    {
+        if (!eat(U'{')) {
+            return false;
+        }
+        auto first = number();
+        if (!first) {
+            return false;
+        }
+        min = max = *first;
+        if (eat(U',')) {
+            auto second = number();
+            if (!second) {
+                return false;
+            }
+            max = *second;
+        }
+        return eat(U'}');
     }
-    return result;
-}
-
-auto character_class_element::apply(pegtl::parse_tree::node* node,
-                                    std::variant<cst::escape_character_set,
-                                                 cst::unicode_property_character_set,
-                                                 cst::character_class_range,
-                                                 char32_t> arg) -> cst::character_class_element
-{
-    return {arg};
-}
 
-auto character_class_range::apply(pegtl::parse_tree::node* node, char32_t min, char32_t max)
-    -> cst::character_class_range
-{
-    if (min > max) {
-        throw std::runtime_error("invalid character class range");
+    auto number() -> std::optional<int>
+    {
+        auto start = pos;
+        auto result = 0;
+        auto overflow = false;
+        while (has(1) && input[pos] >= U'0' && input[pos] <= U'9') {
+            auto digit = static_cast<int>(input[pos] - U'0');
+            if (result > (std::numeric_limits<int>::max() - digit) / 10) {
+                overflow = true;
+            } else {
+                result = result * 10 + digit;
+            }
+            pos += 1;
+        }
+        if (pos == start) {
+            return std::nullopt;
+        }
+        if (overflow && !error) {
+            error = "cannot parse number";
+        }
+        return result;
     }
-    return {min, max};
-}
-
-auto assertion::apply(pegtl::parse_tree::node* node,
-                      std::variant<cst::edge_assertion, cst::word_boundary_assertion> arg)
-    -> cst::assertion
-{
-    return {arg};
-}
 
-auto edge_assertion::apply(pegtl::parse_tree::node* node) -> cst::edge_assertion
-{
-    auto result = cst::edge_assertion{};
-    if (node->string_view() == "^") {
-        result.kind = cst::assertion_kind::start;
-    } else if (node->string_view() == "$") {
-        result.kind = cst::assertion_kind::end;
+    auto quantifiable_element() -> std::optional<cst::quantifiable_element>
+    {
+        if (auto grp = group()) {
+            return wrap<cst::quantifiable_element>(std::move(*grp));
+        }
+        if (auto grp = capturing_group()) {
+            return wrap<cst::quantifiable_element>(std::move(*grp));
+        }
+        if (auto cls = character_class()) {
+            return wrap<cst::quantifiable_element>(std::move(*cls));
+        }
+        if (auto set = character_set()) {
+            return wrap<cst::quantifiable_element>(std::move(*set));
+        }
+        if (auto ch = character()) {
+            return wrap<cst::quantifiable_element>(*ch);
+        }
+        return std::nullopt;
     }
-    return result;
-}
 
-auto word_boundary_assertion::apply(pegtl::parse_tree::node* node) -> cst::word_boundary_assertion
-{
-    auto result = cst::word_boundary_assertion{};
-    if (node->string_view() == "\\b") {
-        result.negate = false;
-    } else if (node->string_view() == "\\B") {
-        result.negate = true;
+    auto group() -> std::optional<cst::group>
+    {
+        auto start = pos;
+        auto result = cst::group{};
+        if (eat(U'(') && eat(U'?') && eat(U':') && alternatives(result.alternatives)
+            && eat(U')')) {
+            return result;
+        }
+        pos = start;
+        return std::nullopt;
     }
-    return result;
-}
 
-auto character_set::apply(pegtl::parse_tree::node* node,
-                          std::variant<cst::any_character_set,
-                                       cst::escape_character_set,
-                                       cst::unicode_property_character_set> arg)
-    -> cst::character_set
-{
-    return {arg};
-}
-
-auto any_character_set::apply(pegtl::parse_tree::node* node) -> cst::any_character_set
-{
-    // nothing to do here
-    return {};
-}
-
-auto escape_character_set::apply(pegtl::parse_tree::node* node) -> cst::escape_character_set
-{
-    auto result = cst::escape_character_set{};
-    auto ch = node->string_view().at(1);
-    switch (ch) {
-    case 'd':
-        result.kind = cst::character_set_kind::digit;
-        result.negate = false;
-        break;
-    case 'D':
-        result.kind = cst::character_set_kind::digit;
-        result.negate = true;
-        break;
-    case 's':
-        result.kind = cst::character_set_kind::space;
-        result.negate = false;
-        break;
-    case 'S':
-        result.kind = cst::character_set_kind::space;
-        result.negate = true;
-        break;
-    case 'w':
-        result.kind = cst::character_set_kind::word;
-        result.negate = false;
-        break;
-    case 'W':
-        result.kind = cst::character_set_kind::word;
-        result.negate = true;
-        break;
+    auto capturing_group() -> std::optional<cst::capturing_group>
+    {
+        auto start = pos;
+        auto result = cst::capturing_group{};
+        if (!eat(U'(')) {
+            return std::nullopt;
+        }
+        if (peek() == U'?' && peek(1) == U'<') {
+            auto close = input.find(U'>', pos + 2);
+            if (close != std::u32string_view::npos) {
+                result.name = utf8::utf32to8(input.substr(pos + 2, close - pos - 2));
+                pos = close + 1;
+            }
+        }
+        if (alternatives(result.alternatives) && eat(U')')) {
+            return result;
+        }
+        pos = start;
+        return std::nullopt;
     }
-    return result;
-}
 
-auto unicode_property_character_set::apply(pegtl::parse_tree::node* node, std::vector<std::any> args)
-    -> cst::unicode_property_character_set
-{
-    auto result = cst::unicode_property_character_set{};
-    result.negate = node->children.at(1)->string_view() == "P";
-    result.property = std::any_cast<std::string>(args[0]);
-    if (args.size() == 2) {
-        result.value = std::any_cast<std::string>(args[1]);
-    } else {
-        result.value = std::nullopt;
+    auto character_class() -> std::optional<cst::character_class>
+    {
+        auto start = pos;
+        auto result = cst::character_class{};
+        if (!eat(U'[')) {
+            return std::nullopt;
+        }
+        result.negate = eat(U'^');
+        while (auto elem = character_class_element()) {
+            result.elements.push_back(std::move(*elem));
+        }
+        if (result.elements.empty() || !eat(U']')) {
+            pos = start;
+            return std::nullopt;
+        }
+        return result;
     }
-    return result;
-}
 
-auto character::apply(pegtl::parse_tree::node* node) -> char32_t
-{
-    auto str = utf8::utf8to32(node->string_view());
-    if (str.starts_with(U'\\')) {
-        return str.at(1);
+    auto character_class_element() -> std::optional<cst::character_class_element>
+    {
+        if (auto set = escape_character_set()) {
+            return wrap<cst::character_class_element>(*set);
+        }
+        if (auto set = unicode_property_character_set()) {
+            return wrap<cst::character_class_element>(std::move(*set));
+        }
+        auto min = character_inside_brackets();
+        if (!min) {
+            return std::nullopt;
+        }
+        auto range_start = pos;
+        if (eat(U'-')) {
+            if (auto max = character_inside_brackets()) {
+                if (*min > *max && !error) {
+                    error = "invalid character class range";
+                }
+                return wrap<cst::character_class_element>(cst::character_class_range{*min, *max});
+            }
+        }
+        pos = range_start;
+        return wrap<cst::character_class_element>(*min);
     }
-    return str.at(0);
-}
 
-auto character_inside_brackets::apply(pegtl::parse_tree::node* node) -> char32_t
-{
-    auto str = utf8::utf8to32(node->string_view());
-    if (str.starts_with(U'\\')) {
-        return str.at(1);
+    auto assertion() -> std::optional<cst::assertion>
+    {
+        if (eat(U'^')) {
+            return wrap<cst::assertion>(cst::edge_assertion{cst::assertion_kind::start});
+        }
+        if (eat(U'$')) {
+            return wrap<cst::assertion>(cst::edge_assertion{cst::assertion_kind::end});
+        }
+        if (peek() == U'\\' && (peek(1) == U'b' || peek(1) == U'B')) {
+            auto negate = peek(1) == U'B';
+            pos += 2;
+            return wrap<cst::assertion>(cst::word_boundary_assertion{negate});
+        }
+        return std::nullopt;
     }
-    return str.at(0);
-}
 
-auto alphabet::apply(pegtl::parse_tree::node* node) -> std::string
-{
-    return node->string();
-}
-
-auto alphanum::apply(pegtl::parse_tree::node* node) -> std::string
-{
-    return node->string();
-}
-
-auto number::apply(pegtl::parse_tree::node* node) -> int
-{
-    auto str = node->string_view();
-    int result;
-    auto begin = str.data();
-    auto end = str.data() + str.size();
-    auto status = std::from_chars(begin, end, result);
-    if (status.ec != std::errc{} || status.ptr != end) {
-        throw std::runtime_error("cannot parse number");
+    auto character_set() -> std::optional<cst::character_set>
+    {
+        if (eat(U'.')) {
+            return wrap<cst::character_set>(cst::any_character_set{});
+        }
+        if (auto set = escape_character_set()) {
+            return wrap<cst::character_set>(*set);
+        }
+        if (auto set = unicode_property_character_set()) {
+            return wrap<cst::character_set>(std::move(*set));
+        }
+        return std::nullopt;
     }
-    return result;
-}
-} // namespace parser
 
-template<typename... Ts>
-static auto visit_impl(pegtl::parse_tree::node* node) -> std::any
-{
-    if (node->is_root()) {
-        node = node->children.at(0).get();
+    auto escape_character_set() -> std::optional<cst::escape_character_set>
+    {
+        if (peek() != U'\\') {
+            return std::nullopt;
+        }
+        auto result = cst::escape_character_set{};
+        switch (peek(1)) {
+        case U'd':
+        case U'D':
+            result.kind = cst::character_set_kind::digit;
+            break;
+        case U's':
+        case U'S':
+            result.kind = cst::character_set_kind::space;
+            break;
+        case U'w':
+        case U'W':
+            result.kind = cst::character_set_kind::word;
+            break;
+        default:
+            return std::nullopt;
+        }
+        result.negate = peek(1) == U'D' || peek(1) == U'S' || peek(1) == U'W';
+        pos += 2;
+        return result;
     }
-    std::vector<std::any> params;
-    for (auto&& child : node->children) {
-        auto param = visit_impl<Ts...>(child.get());
-        if (param.type() == typeid(std::vector<std::any>)) {
-            auto const& vec = std::any_cast<std::vector<std::any> const&>(param);
-            params.insert(params.end(), vec.begin(), vec.end());
-        } else {
-            params.push_back(param);
+
+    auto unicode_property_character_set() -> std::optional<cst::unicode_property_character_set>
+    {
+        if (peek() != U'\\' || (peek(1) != U'p' && peek(1) != U'P') || peek(2) != U'{') {
+            return std::nullopt;
+        }
+        auto start = pos;
+        auto result = cst::unicode_property_character_set{};
+        result.negate = peek(1) == U'P';
+        pos += 3;
+
+        auto is_alpha = [](char32_t ch) {
+            return (ch >= U'a' && ch <= U'z') || (ch >= U'A' && ch <= U'Z') || ch == U'_';
+        };
+        auto is_alnum = [&](char32_t ch) { return is_alpha(ch) || (ch >= U'0' && ch <= U'9'); };
+        auto word = [&](auto&& pred) {
+            auto begin = pos;
+            while (has(1) && pred(input[pos])) {
+                pos += 1;
+            }
+            return utf8::utf32to8(input.substr(begin, pos - begin));
+        };
+
+        result.property = word(is_alpha);
+        if (result.property.empty()) {
+            pos = start;
+            return std::nullopt;
         }
+        auto value_start = pos;
+        if (eat(U'=')) {
+            result.value = word(is_alnum);
+            if (result.value->empty()) {
+                result.value = std::nullopt;
+                pos = value_start;
+            }
+        }
+        if (!eat(U'}')) {
+            pos = start;
+            return std::nullopt;
+        }
+        return result;
     }
 
-    std::any result;
-    bool invoked = ((node->is_type<Ts>()
-                     && ((result = internal::invoke(Ts::apply, params.begin(), params.end(), node),
-                          true)))
-                    || ...);
-    if (!invoked) {
-        result = params;
+    // a literal character, or one of meta_chars escaped by a backslash
+    auto literal(std::u32string_view meta_chars) -> std::optional<char32_t>
+    {
+        if (!has(1)) {
+            return std::nullopt;
+        }
+        if (input[pos] == U'\\') {
+            if (!has(2) || meta_chars.find(input[pos + 1]) == std::u32string_view::npos) {
+                return std::nullopt;
+            }
+            pos += 2;
+            return input[pos - 1];
+        }
+        if (meta_chars.find(input[pos]) != std::u32string_view::npos) {
+            return std::nullopt;
+        }
+        pos += 1;
+        return input[pos - 1];
     }
-    return result;
-}
 
-static cst::pattern visit_tree(pegtl::parse_tree::node* node)
-{
-    auto result = visit_impl<parser::pattern,
-                             parser::alternative,
-                             parser::element,
-                             parser::group,
-                             parser::capturing_group,
-                             parser::quantifiable_element,
-                             parser::quantifier,
-                             parser::character_class,
-                             parser::character_class_element,
-                             parser::character_class_range,
-                             parser::assertion,
-                             parser::edge_assertion,
-                             parser::word_boundary_assertion,
-                             parser::character_set,
-                             parser::any_character_set,
-                             parser::escape_character_set,
-                             parser::unicode_property_character_set,
-                             parser::character,
-                             parser::character_inside_brackets,
-                             parser::alphabet,
-                             parser::alphanum,
-                             parser::number>(node);
-
-    return std::any_cast<cst::pattern>(std::move(result));
-}
+    auto character() -> std::optional<char32_t> { return literal(META_CHARS); }
+
+    auto character_inside_brackets() -> std::optional<char32_t>
+    {
+        return literal(BRACKET_META_CHARS);
+    }
+};
 
 auto parse(std::string const& input, bool verbose) -> cst::pattern
 {
-    pegtl::memory_input in(input.data(), input.data() + input.size(), "");
-
-    const std::size_t issues = tao::pegtl::analyze<parser::pattern>();
-    if (issues > 0) {
-        throw std::runtime_error("Grammar has issues.");
+    if (!utf8::is_valid(input.begin(), input.end())) {
+        throw std::runtime_error("Not parsed.");
     }
+    auto codepoints = utf8::utf8to32(input);
 
-    auto root = pegtl::parse_tree::parse<parser::pattern>(in);
-    if (!root) {
+    auto parser = pattern_parser{codepoints};
+    auto result = parser.pattern();
+    if (!result) {
         throw std::runtime_error("Not parsed.");
     }
+    if (parser.error) {
+        throw std::runtime_error(*parser.error);
+    }
 
     if (verbose) {
-        pegtl::parse_tree::print_dot(std::cout, *root);
+        fmt::println("{}", print_cst(*result));
     }
 
-    return visit_tree(root.get());
+    return std::move(*result);
 }
 
 template<typename T>
@@ -5,6 +5,7 @@
 #include <fmt/chrono.h>
 #include <fmt/core.h>
 #include <fmt/ranges.h>
+#include <map>
 #include <msgpack.hpp>
 #include <nlohmann/json.hpp>
 #include <queue>
@@ -102,6 +103,36 @@ auto merge_sorted_lists(std::vector<std::vector<token_range>> const &cand_lists)
 
 constexpr int CANDS_THRESHOLD = 10'000'000;
 
+// Tokens following a token boundary in each state. A full DFA gets them for every state in
+// one trie walk; a lazy one only for the states the search reaches.
+struct next_tids_cache
+{
+    tokenizer const &tok;
+    regex::sm::graph const &dfa;
+    std::unordered_map<int, roaring::Roaring> by_state;
+
+    next_tids_cache(tokenizer const &tok, regex::sm::graph const &dfa)
+        : tok(tok)
+        , dfa(dfa)
+    {
+        if (!dfa.is_lazy()) {
+            auto all = tok.trie().get_next_tids_all(dfa);
+            for (int state = 0; state < dfa.num_states; ++state) {
+                by_state.emplace(state, std::move(all[state]));
+            }
+        }
+    }
+
+    auto operator()(int state) -> roaring::Roaring const &
+    {
+        auto it = by_state.find(state);
+        if (it == by_state.end()) {
+            it = by_state.emplace(state, tok.trie().get_next_tids(dfa, state)).first;
+        }
+        return it->second;
+    }
+};
+
 struct cand_result
 {
     std::optional<std::vector<token_range>> cands;
@@ -113,6 +144,7 @@ auto generate_cands(int state,
                     std::string const &prev_prefix, // for debugging only
                     tokenizer const &tok,
                     regex::sm::graph const &dfa,
+                    next_tids_cache &next_tids,
                     std::function<index_accessor> const &index,
                     std::unordered_map<int, cand_result> &cache,
                     int level = 1) -> cand_result
@@ -121,7 +153,7 @@ auto generate_cands(int state,
         return cache.at(state);
     }
 
-    auto next_tokens = tok.trie().get_next_tids(dfa, state);
+    auto const &next_tokens = next_tids(state);
 
     fmt::println("lvl {} (state={}): '{}' (+ {} tokens)",
                  level,
@@ -149,6 +181,10 @@ auto generate_cands(int state,
         assert(new_state != dfa_trie::REJECTED);
         if (new_state == dfa_trie::ACCEPTED) {
             full_cands.push_back(std::move(matches));
+        } else if (new_state == dfa_trie::OVERFLOWED) {
+            // the DFA cannot follow this token; keep the prefix and recheck
+            full_cands.push_back(std::move(matches));
+            needs_recheck = true;
         } else if (visited_states.contains(new_state)) {
             // infinite recursion detected
             fmt::println("Warning: infinite recursion detected; aborting..");
@@ -162,6 +198,7 @@ auto generate_cands(int state,
                                     cur_prefix,
                                     tok,
                                     dfa,
+                                    next_tids,
                                     index,
                                     cache,
                                     level + 1);
@@ -191,11 +228,179 @@ auto generate_cands(int state,
     return cache[state] = {full_result, needs_recheck};
 }
 
+// Byte trie of the literals of search_literals(). Children are sorted by label, like the
+// children of a dfa_trie node, so the two tries can be walked side by side.
+struct literal_trie
+{
+    struct node
+    {
+        std::vector<std::pair<std::uint8_t, std::uint32_t>> children;
+        std::vector<int> literals; // literals ending here
+    };
+    std::vector<node> nodes = std::vector<node>(1);
+
+    void insert(std::string_view literal, int literal_id)
+    {
+        auto node_idx = std::uint32_t{0};
+        for (auto ch : literal) {
+            auto label = static_cast<std::uint8_t>(ch);
+            auto &children = nodes[node_idx].children;
+            auto it = std::lower_bound(children.begin(),
+                                       children.end(),
+                                       std::pair{label, std::uint32_t{0}});
+            if (it == children.end() || it->first != label) {
+                it = children.insert(it, {label, static_cast<std::uint32_t>(nodes.size())});
+                nodes.emplace_back();
+            }
+            node_idx = it->second;
+        }
+        nodes[node_idx].literals.push_back(literal_id);
+    }
+};
+
+// What reading one token does at a position of the literal trie
+struct literal_step
+{
+    std::vector<int> completed; // literals the token reaches the end of
+    int next = -1;              // literal trie node the token ends on, if it has children
+};
+
+using literal_steps = std::map<int, literal_step>;
+
+// Walk the token trie below tok_idx and the literal trie below lit_idx side by side,
+// collecting the step of every token whose bytes agree with some literal.
+void walk_literal_trie(std::span<const dfa_trie_node> tok_nodes,
+                       std::span<const std::uint32_t> token_ids,
+                       std::uint32_t tok_idx,
+                       literal_trie const &lits,
+                       std::uint32_t lit_idx,
+                       literal_steps &steps)
+{
+    auto const &tok_node = tok_nodes[tok_idx];
+    auto const &lit_children = lits.nodes[lit_idx].children;
+    auto lit_it = lit_children.begin();
+    for (std::uint32_t k = 0; k < tok_node.n_children && lit_it != lit_children.end(); ++k) {
+        auto child_idx = tok_node.first_child + k;
+        auto const &child = tok_nodes[child_idx];
+        while (lit_it != lit_children.end() && lit_it->first < child.label) {
+            ++lit_it;
+        }
+        if (lit_it == lit_children.end() || lit_it->first != child.label) {
+            continue;
+        }
+
+        auto const &lit_child = lits.nodes[lit_it->second];
+        // every token in the subtree runs through the end of these literals
+        for (int literal : lit_child.literals) {
+            for (auto t = child.tokens_begin; t < child.subtree_end; ++t) {
+                steps[token_ids[t]].completed.push_back(literal);
+            }
+        }
+        if (!lit_child.children.empty()) {
+            for (auto t = child.tokens_begin; t < child.tokens_end; ++t) {
+                steps[token_ids[t]].next = lit_it->second;
+            }
+            walk_literal_trie(tok_nodes, token_ids, child_idx, lits, lit_it->second, steps);
+        }
+    }
+}
+
+// Joins postings along the literal trie, depth first. The ranges reaching a node are joined
+// once and shared by every literal below it.
+struct literal_searcher
+{
+    tokenizer const &tok;
+    std::function<index_accessor> const &index;
+    literal_trie const &lits;
+    std::vector<std::vector<sentid_t>> &matches; // unsorted, with duplicates
+
+    // a literal trie node is reached by every segmentation of its prefix; walk it once
+    std::unordered_map<std::uint32_t, literal_steps> steps_cache;
+    // many literals go through the same tokens; read each posting list once
+    std::unordered_map<int, std::vector<token_range>> postings_cache;
+
+    auto postings(int token) -> std::vector<token_range> const &
+    {
+        auto it = postings_cache.find(token);
+        if (it == postings_cache.end()) {
+            it = postings_cache.emplace(token, index(token)).first;
+        }
+        return it->second;
+    }
+
+    auto steps(std::uint32_t lit_idx) -> literal_steps const &
+    {
+        auto it = steps_cache.find(lit_idx);
+        if (it == steps_cache.end()) {
+            auto result = literal_steps{};
+            auto const &trie = tok.trie();
+            walk_literal_trie(trie.get_nodes(),
+                              trie.get_token_ids(),
+                              trie.get_roots()[0],
+                              lits,
+                              lit_idx,
+                              result);
+            it = steps_cache.emplace(lit_idx, std::move(result)).first;
+        }
+        return it->second;
+    }
+
+    // ranges is where the prefix read so far occurs, ending with token
+    void take_step(literal_step const &step, std::vector<token_range> const &ranges)
+    {
+        if (!step.completed.empty()) {
+            auto sent_ids = get_sent_ids(ranges);
+            for (int literal : step.completed) {
+                matches[literal].insert(matches[literal].end(), sent_ids.begin(), sent_ids.end());
+            }
+        }
+        if (step.next != -1) {
+            extend(step.next, ranges);
+        }
+    }
+
+    void extend(std::uint32_t lit_idx, std::vector<token_range> const &prefix)
+    {
+        for (auto const &[token, step] : steps(lit_idx)) {
+            auto const &next = postings(token);
+            if (next.empty()) {
+                continue;
+            }
+            auto joined = followed_by(prefix, next);
+            if (!joined.empty()) {
+                take_step(step, joined);
+            }
+        }
+    }
+
+    // Like the start state of a regex search, the first token may begin before the literal.
+    void run()
+    {
+        auto const &trie = tok.trie();
+        for (int pad = 0; pad < tok.max_token_bytes(); ++pad) {
+            auto first = literal_steps{};
+            walk_literal_trie(trie.get_nodes(),
+                              trie.get_token_ids(),
+                              trie.get_roots()[pad],
+                              lits,
+                              0,
+                              first);
+            for (auto const &[token, step] : first) {
+                auto const &ranges = postings(token);
+                if (!ranges.empty()) {
+                    take_step(step, ranges);
+                }
+            }
+        }
+    }
+};
+
 } // namespace
 
 auto search(tokenizer const &tok,
             std::function<index_accessor> const &index,
-            std::string const &regex) -> search_result
+            std::string const &regex,
+            int max_dfa_states) -> search_result
 {
     fmt::println("Regex = {}", regex);
 
@@ -205,7 +410,7 @@ auto search(tokenizer const &tok,
     auto ast = corpus_search::regex::cst_to_ast(cst);
     fmt::println("AST: {}", corpus_search::regex::print_ast(ast));
 
-    auto dfa = corpus_search::regex::ast_to_dfa(ast);
+    auto dfa = corpus_search::regex::ast_to_dfa(ast, max_dfa_states);
     fmt::println("DFA: start_state={}, accept_states=[{}], num_states={}",
                  dfa.start_state,
                  fmt::join(dfa.accept_states, ", "),
@@ -213,7 +418,7 @@ auto search(tokenizer const &tok,
 
     corpus_search::regex::print_dfa(dfa);
 
-    if (dfa.accept_states.contains(dfa.start_state)) {
+    if (dfa.is_accept(dfa.start_state)) {
         // every string matches
         fmt::println("DFA accepts empty string; returning all sentence IDs.");
         std::vector<sentid_t> output;
@@ -238,9 +443,13 @@ auto search(tokenizer const &tok,
         int token;
         int pad_size;
     };
+    // Only the start state can also be entered in the middle of a token.
+    auto next_tids = next_tids_cache(tok, dfa);
     auto next_tokens = std::vector<token_and_offset>{};
     for (int pad = 0; pad < tok.max_token_bytes(); ++pad) {
-        for (int token : tok.trie().get_next_tids(dfa, dfa.start_state, -1, pad)) {
+        auto tids = pad == 0 ? next_tids(dfa.start_state)
+                             : tok.trie().get_next_tids(dfa, dfa.start_state, -1, pad);
+        for (int token : tids) {
             next_tokens.push_back({token, pad});
         }
     }
@@ -260,9 +469,19 @@ auto search(tokenizer const &tok,
 
         if (new_state == dfa_trie::ACCEPTED) {
             cand_lists.push_back(std::move(matches));
+        } else if (new_state == dfa_trie::OVERFLOWED) {
+            cand_lists.push_back(std::move(matches));
+            needs_recheck = true;
         } else {
             visited_states.insert(new_state);
-            auto r = generate_cands(new_state, visited_states, token_str, tok, dfa, index, cache);
+            auto r = generate_cands(new_state,
+                                    visited_states,
+                                    token_str,
+                                    tok,
+                                    dfa,
+                                    next_tids,
+                                    index,
+                                    cache);
             visited_states.erase(new_state);
             if (r.cands.has_value()) {
                 cand_lists.push_back(followed_by(matches, r.cands.value()));
@@ -300,4 +519,39 @@ auto search(tokenizer const &tok,
     };
 }
 
+auto search_literals(tokenizer const &tok,
+                     std::function<index_accessor> const &index,
+                     std::vector<std::string> const &literals) -> literal_search_result
+{
+    auto lits = literal_trie{};
+    auto result = literal_search_result{};
+    result.per_literal.resize(literals.size());
+    for (int i = 0; i < literals.size(); ++i) {
+        if (literals[i].empty()) {
+            // every sentence contains the empty string
+            result.per_literal[i] = get_sent_ids(index(tok.BOS_TOKEN_ID));
+        } else {
+            lits.insert(literals[i], i);
+        }
+    }
+    fmt::println("Literals = {} ({} trie nodes)", literals.size(), lits.nodes.size());
+
+    auto searcher = literal_searcher{tok, index, lits, result.per_literal};
+    searcher.run();
+    fmt::println("Read {} posting lists for {} literal trie nodes",
+                 searcher.postings_cache.size(),
+                 searcher.steps_cache.size());
+    std::fflush(stdout);
+
+    for (auto &sent_ids : result.per_literal) {
+        std::sort(sent_ids.begin(), sent_ids.end());
+        sent_ids.erase(std::unique(sent_ids.begin(), sent_ids.end()), sent_ids.end());
+        result.any.insert(result.any.end(), sent_ids.begin(), sent_ids.end());
+    }
+    std::sort(result.any.begin(), result.any.end());
+    result.any.erase(std::unique(result.any.begin(), result.any.end()), result.any.end());
+
+    return result;
+}
+
 } // namespace corpus_search
@@ -36,9 +36,31 @@ struct search_result
     bool needs_recheck;
 };
 
+// Regexes whose DFA has more than max_dfa_states states are searched with a lazy DFA of
+// at most that many states.
+constexpr int DEFAULT_MAX_DFA_STATES = 10'000;
+
 auto search(tokenizer const &tok,
             std::function<index_accessor> const &index,
-            std::string const &regex) -> search_result;
+            std::string const &regex,
+            int max_dfa_states = DEFAULT_MAX_DFA_STATES) -> search_result;
+
+struct literal_search_result
+{
+    // sentences containing each literal, in the order the literals were given
+    std::vector<std::vector<sentid_t>> per_literal;
+    // sentences containing any of them
+    std::vector<sentid_t> any;
+};
+
+// Search for many literal strings at once, e.g. every form of a word from a dictionary.
+// The literals share one byte trie, and postings are joined token by token along it, so a
+// prefix common to many literals is joined once for all of them. The result is exact with
+// respect to the postings, but an index can still hold postings of deleted sentences, so
+// callers must recheck the sentences as they do for a regex search.
+auto search_literals(tokenizer const &tok,
+                     std::function<index_accessor> const &index,
+                     std::vector<std::string> const &literals) -> literal_search_result;
 
 } // namespace corpus_search
 
@@ -0,0 +1,437 @@
+#include "segmented_index.hpp"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <filesystem>
+#include <fmt/core.h>
+#include <fstream>
+#include <map>
+#include <sstream>
+#include <stdexcept>
+#include <unistd.h>
+#include <unordered_set>
+
+namespace corpus_search {
+
+namespace {
+
+constexpr char const *MANIFEST_NAME = "MANIFEST";
+constexpr char const *MANIFEST_HEADER = "corpus_search_segments 1";
+
+auto segment_file_name(std::uint64_t id) -> std::string
+{
+    return fmt::format("seg_{:010}.idx", id);
+}
+
+// flush a file, or the entries of a directory, to stable storage
+void sync_path(std::string const &path)
+{
+    int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        throw std::runtime_error(
+            fmt::format("Error opening file {}: {}", path, std::strerror(errno)));
+    }
+    if (::fsync(fd) != 0) {
+        int err = errno;
+        ::close(fd);
+        throw std::runtime_error(
+            fmt::format("Error syncing file {}: {}", path, std::strerror(err)));
+    }
+    ::close(fd);
+}
+
+// merge the consecutive sorted runs out[0, run_ends[0]), out[run_ends[0], run_ends[1]), ...
+void merge_runs(std::vector<index_entry> &out, std::vector<std::size_t> &run_ends)
+{
+    while (run_ends.size() > 1) {
+        std::size_t n_merged = 0;
+        for (std::size_t r = 0; r < run_ends.size(); r += 2) {
+            if (r + 1 < run_ends.size()) {
+                auto begin = (r == 0) ? 0 : run_ends[r - 1];
+                std::inplace_merge(out.begin() + begin,
+                                   out.begin() + run_ends[r],
+                                   out.begin() + run_ends[r + 1]);
+                run_ends[n_merged++] = run_ends[r + 1];
+            } else {
+                run_ends[n_merged++] = run_ends[r];
+            }
+        }
+        run_ends.resize(n_merged);
+    }
+}
+
+} // namespace
+
+segmented_index::segmented_index(std::string directory, segmented_index_options options)
+    : directory(std::move(directory))
+    , options(options)
+{
+    this->options.merge_factor = std::max<std::size_t>(this->options.merge_factor, 2);
+
+    std::filesystem::create_directories(this->directory);
+    load_manifest();
+
+    if (this->options.background_merge) {
+        merge_thread = std::jthread([this](std::stop_token stop) { merge_loop(stop); });
+    }
+}
+
+segmented_index::~segmented_index()
+{
+    if (merge_thread.joinable()) {
+        merge_thread.request_stop();
+        merge_thread.join();
+    }
+    // unflushed sentences would be lost otherwise
+    try {
+        flush();
+    } catch (std::exception const &e) {
+        fmt::println("Warning: flushing segmented index failed: {}", e.what());
+        std::fflush(stdout);
+    }
+}
+
+auto segmented_index::segment_path(std::string const &file_name) const -> std::string
+{
+    return (std::filesystem::path(directory) / file_name).string();
+}
+
+auto segmented_index::open_segment(std::uint64_t id, int tier) const
+    -> std::shared_ptr<const segment>
+{
+    auto file_name = segment_file_name(id);
+    return std::make_shared<const segment>(
+        segment{id, tier, file_name, mmap_index(segment_path(file_name))});
+}
+
+void segmented_index::load_manifest()
+{
+    auto segments = snapshot{};
+    auto live_files = std::unordered_set<std::string>{};
+
+    auto manifest_path = segment_path(MANIFEST_NAME);
+    if (std::filesystem::exists(manifest_path)) {
+        auto file = std::ifstream(manifest_path);
+        auto line = std::string{};
+        if (!std::getline(file, line) || line != MANIFEST_HEADER) {
+            throw std::runtime_error(fmt::format("{}: unsupported manifest", manifest_path));
+        }
+        while (std::getline(file, line)) {
+            auto fields = std::istringstream(line);
+            auto kind = std::string{};
+            fields >> kind;
+            if (kind == "next_id") {
+                fields >> next_segment_id;
+            } else if (kind == "segment") {
+                std::uint64_t id;
+                int tier;
+                fields >> id >> tier;
+                if (fields.fail()) {
+                    throw std::runtime_error(
+                        fmt::format("{}: malformed line '{}'", manifest_path, line));
+                }
+                segments.push_back(open_segment(id, tier));
+                live_files.insert(segments.back()->file_name);
+            } else if (!kind.empty()) {
+                throw std::runtime_error(
+                    fmt::format("{}: malformed line '{}'", manifest_path, line));
+            }
+        }
+    }
+
+    // Leftovers of an interrupted flush or merge, or inputs of a merge that was installed
+    // just before a crash; none of them is referenced by the manifest.
+    for (auto const &entry : std::filesystem::directory_iterator(directory)) {
+        auto name = entry.path().filename().string();
+        bool is_segment = name.starts_with("seg_") && name.ends_with(".idx");
+        if ((is_segment && !live_files.contains(name)) || name == "MANIFEST.tmp") {
+            std::filesystem::remove(entry.path());
+        }
+    }
+
+    current.store(std::make_shared<const snapshot>(std::move(segments)));
+}
+
+void segmented_index::write_manifest(snapshot const &segments)
+{
+    // write a new manifest next to the old one, then atomically replace it
+    auto tmp_path = segment_path("MANIFEST.tmp");
+    {
+        auto file = std::ofstream(tmp_path, std::ios::trunc);
+        file << MANIFEST_HEADER << '\n';
+        file << "next_id " << next_segment_id << '\n';
+        for (auto const &seg : segments) {
+            file << "segment " << seg->id << ' ' << seg->tier << '\n';
+        }
+        file.close();
+        if (file.fail()) {
+            throw std::runtime_error(fmt::format("Error writing file {}.", tmp_path));
+        }
+    }
+    // A manifest must never name a segment, or be itself, truncated after a crash. Segments
+    // are synced before they get here; the directory sync persists their names and the rename.
+    sync_path(tmp_path);
+    std::filesystem::rename(tmp_path, segment_path(MANIFEST_NAME));
+    sync_path(directory);
+}
+
+void segmented_index::add_sentence(sentid_t sent_id, std::span<const int> tokens)
+{
+    bool needs_flush;
+    {
+        auto lock = std::unique_lock(memtable_mutex);
+        active.add_sentence(sent_id, tokens);
+        active_entries += tokens.size();
+        needs_flush = options.memtable_max_entries > 0
+                      && active_entries >= options.memtable_max_entries;
+    }
+    if (needs_flush) {
+        flush();
+    }
+}
+
+void segmented_index::flush()
+{
+    bool flushed = false;
+    {
+        auto manifest_lock = std::lock_guard(manifest_mutex);
+
+        // The memtable stays visible to readers as `frozen` until the segment replacing it
+        // is part of the snapshot. A frozen memtable left behind by a failed flush goes first.
+        for (int round = 0; round < 2; ++round) {
+            auto to_flush = std::shared_ptr<const index_builder>{};
+            {
+                auto lock = std::unique_lock(memtable_mutex);
+                if (!frozen) {
+                    if (active_entries == 0) {
+                        break;
+                    }
+                    frozen = std::make_shared<const index_builder>(std::move(active));
+                    active = index_builder{};
+                    active_entries = 0;
+                }
+                to_flush = frozen;
+            }
+
+            auto sorted = *to_flush;
+            sorted.finalize_index();
+
+            auto id = next_segment_id++;
+            sorted.save(segment_path(segment_file_name(id)));
+            sync_path(segment_path(segment_file_name(id)));
+            auto next = std::make_shared<snapshot>(*current.load());
+            next->push_back(open_segment(id, 0));
+            write_manifest(*next);
+
+            {
+                auto lock = std::unique_lock(memtable_mutex);
+                current.store(std::move(next));
+                frozen.reset();
+            }
+            flushed = true;
+        }
+    }
+
+    if (flushed) {
+        request_merge();
+    }
+}
+
+auto segmented_index::merge_once() -> bool
+{
+    auto run_lock = std::lock_guard(merge_run_mutex);
+
+    auto inputs = snapshot{};
+    int tier = 0;
+    std::uint64_t id = 0;
+    {
+        auto manifest_lock = std::lock_guard(manifest_mutex);
+        auto by_tier = std::map<int, snapshot>{};
+        for (auto const &seg : *current.load()) {
+            by_tier[seg->tier].push_back(seg);
+        }
+        for (auto &[t, segments] : by_tier) {
+            if (segments.size() >= options.merge_factor) {
+                inputs.assign(segments.begin(), segments.begin() + options.merge_factor);
+                tier = t + 1;
+                break;
+            }
+        }
+        if (inputs.empty()) {
+            return false;
+        }
+        id = next_segment_id++;
+    }
+
+    // merging happens outside the lock; flushes only ever append new segments
+    auto tokens = std::vector<int>{};
+    for (auto const &seg : inputs) {
+        auto seg_tokens = seg->index.tokens();
+        tokens.insert(tokens.end(), seg_tokens.begin(), seg_tokens.end());
+    }
+    std::sort(tokens.begin(), tokens.end());
+    tokens.erase(std::unique(tokens.begin(), tokens.end()), tokens.end());
+
+    auto merged = std::unordered_map<int, std::vector<index_entry>>{};
+    merged.reserve(tokens.size());
+    auto run_ends = std::vector<std::size_t>{};
+    for (int token : tokens) {
+        auto &out = merged[token];
+        run_ends.clear();
+        for (auto const &seg : inputs) {
+            auto postings = seg->index.postings(token);
+            if (!postings.empty()) {
+                out.insert(out.end(), postings.begin(), postings.end());
+                run_ends.push_back(out.size());
+            }
+        }
+        merge_runs(out, run_ends);
+    }
+
+    write_index_file(segment_path(segment_file_name(id)), merged);
+    sync_path(segment_path(segment_file_name(id)));
+    merged = {};
+    auto output = open_segment(id, tier);
+
+    {
+        auto manifest_lock = std::lock_guard(manifest_mutex);
+        auto segments = current.load();
+        for (auto const &seg : inputs) {
+            if (std::find(segments->begin(), segments->end(), seg) == segments->end()) {
+                // someone else merged the inputs already; installing would index them twice
+                std::filesystem::remove(segment_path(output->file_name));
+                return true;
+            }
+        }
+        auto next = std::make_shared<snapshot>();
+        for (auto const &seg : *segments) {
+            if (std::find(inputs.begin(), inputs.end(), seg) == inputs.end()) {
+                next->push_back(seg);
+            }
+        }
+        next->push_back(output);
+        write_manifest(*next);
+        current.store(std::move(next));
+    }
+
+    // Readers holding an older snapshot keep their mappings alive after the unlink.
+    for (auto const &seg : inputs) {
+        std::filesystem::remove(segment_path(seg->file_name));
+    }
+
+    return true;
+}
+
+void segmented_index::merge_loop(std::stop_token stop)
+{
+    for (;;) {
+        {
+            auto lock = std::unique_lock(merge_mutex);
+            if (!merge_cv.wait(lock, stop, [this] { return merge_pending; })) {
+                return; // stop requested
+            }
+            merge_pending = false;
+            merging = true;
+        }
+
+        try {
+            while (!stop.stop_requested() && merge_once()) {
+            }
+        } catch (std::exception const &e) {
+            fmt::println("Warning: segment merge failed: {}", e.what());
+            std::fflush(stdout);
+        }
+
+        {
+            auto lock = std::lock_guard(merge_mutex);
+            merging = false;
+        }
+        merge_cv.notify_all();
+    }
+}
+
+void segmented_index::request_merge()
+{
+    if (!options.background_merge) {
+        while (merge_once()) {
+        }
+        return;
+    }
+    {
+        auto lock = std::lock_guard(merge_mutex);
+        merge_pending = true;
+    }
+    merge_cv.notify_all();
+}
+
+void segmented_index::wait_for_merges()
+{
+    if (!options.background_merge) {
+        return;
+    }
+    auto lock = std::unique_lock(merge_mutex);
+    merge_cv.wait(lock, [this] { return !merge_pending && !merging; });
+}
+
+auto segmented_index::num_segments() const -> std::size_t
+{
+    return current.load()->size();
+}
+
+auto segmented_index::postings(int token) const -> std::vector<index_entry>
+{
+    auto result = std::vector<index_entry>{};
+    auto run_ends = std::vector<std::size_t>{};
+
+    auto segments = std::shared_ptr<const snapshot>{};
+    {
+        // the snapshot and the memtables are swapped together under this lock
+        auto lock = std::shared_lock(memtable_mutex);
+        segments = current.load();
+        for (auto const *memtable : {&active, frozen.get()}) {
+            if (memtable == nullptr) {
+                continue;
+            }
+            auto const &index = memtable->get_index();
+            if (auto it = index.find(token); it != index.end()) {
+                auto begin = result.size();
+                result.insert(result.end(), it->second.begin(), it->second.end());
+                std::sort(result.begin() + begin, result.end());
+                run_ends.push_back(result.size());
+            }
+        }
+    }
+
+    for (auto const &seg : *segments) {
+        auto list = seg->index.postings(token);
+        if (!list.empty()) {
+            result.insert(result.end(), list.begin(), list.end());
+            run_ends.push_back(result.size());
+        }
+    }
+
+    merge_runs(result, run_ends);
+    return result;
+}
+
+auto segmented_index::accessor() const -> std::function<index_accessor>
+{
+    return [this](int token) {
+        auto entries = postings(token);
+        auto result = std::vector<token_range>{};
+        result.reserve(entries.size());
+        for (auto const &entry : entries) {
+            result.push_back({
+                entry.sent_id, entry.pos, static_cast<tokpos_t>(entry.pos + 1),
+#if CORPUS_SEARCH_NEXT_TOKEN_BITS > 0
+                    entry.next_tok,
+#endif
+            });
+        }
+        return result;
+    };
+}
+
+} // namespace corpus_search
@@ -0,0 +1,113 @@
+#ifndef SEGMENTED_INDEX_HPP
+#define SEGMENTED_INDEX_HPP
+
+#include "index_builder.hpp"
+#include "index_file.hpp"
+#include "searcher.hpp"
+#include "sizes.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <span>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace corpus_search {
+
+struct segmented_index_options
+{
+    // flush the in-memory segment once it holds this many entries (0 = only on flush())
+    std::size_t memtable_max_entries = 4'000'000;
+    // merge a tier as soon as it holds this many segments
+    std::size_t merge_factor = 4;
+    // merge on a background thread; otherwise merges run inline at the end of flush()
+    bool background_merge = true;
+};
+
+// Append-only index made of an in-memory mutable segment plus immutable on-disk segments
+// (index files, see index_file.hpp) listed in a MANIFEST inside `directory`.
+//
+// Flushed segments start in tier 0; merge_factor segments of tier t are merged into one
+// segment of tier t + 1. Readers work on an immutable snapshot of the segment list, which
+// flushes and merges swap atomically, so queries never wait for either. Sentence ids must be
+// unique across the whole index.
+class segmented_index
+{
+    struct segment
+    {
+        std::uint64_t id;
+        int tier;
+        std::string file_name;
+        mmap_index index;
+    };
+    using snapshot = std::vector<std::shared_ptr<const segment>>;
+
+    std::string directory;
+    segmented_index_options options;
+
+    // serializes flushes, merge installs and manifest writes
+    std::mutex manifest_mutex;
+    std::uint64_t next_segment_id = 0;
+    std::atomic<std::shared_ptr<const snapshot>> current;
+
+    // in-memory segments: `active` takes writes, `frozen` is being flushed.
+    // Neither is finalized; readers sort the posting lists they copy out.
+    mutable std::shared_mutex memtable_mutex;
+    index_builder active;
+    std::size_t active_entries = 0;
+    std::shared_ptr<const index_builder> frozen;
+
+    // one merge_once() at a time: concurrent ones would pick the same inputs. Inline merges
+    // run on every flushing thread, so the background thread alone is not enough.
+    std::mutex merge_run_mutex;
+
+    std::mutex merge_mutex;
+    std::condition_variable_any merge_cv;
+    bool merge_pending = false;
+    bool merging = false;
+    std::jthread merge_thread;
+
+    auto segment_path(std::string const &file_name) const -> std::string;
+    void load_manifest();
+    void write_manifest(snapshot const &segments);
+    auto open_segment(std::uint64_t id, int tier) const -> std::shared_ptr<const segment>;
+
+    // returns false if no tier needs merging
+    auto merge_once() -> bool;
+    void merge_loop(std::stop_token stop);
+    void request_merge();
+
+public:
+    explicit segmented_index(std::string directory, segmented_index_options options = {});
+    // stops the background merger and flushes what is still in memory
+    ~segmented_index();
+
+    segmented_index(segmented_index const &) = delete;
+    segmented_index &operator=(segmented_index const &) = delete;
+
+    void add_sentence(sentid_t sent_id, std::span<const int> tokens);
+
+    // write the in-memory segment to disk; no-op if it is empty
+    void flush();
+
+    // block until the background merger has nothing left to do
+    void wait_for_merges();
+
+    auto num_segments() const -> std::size_t;
+
+    // sorted postings of a token across all segments, including unflushed sentences
+    auto postings(int token) const -> std::vector<index_entry>;
+
+    // index accessor for search(); the segmented_index must outlive it
+    auto accessor() const -> std::function<index_accessor>;
+};
+
+} // namespace corpus_search
+
+#endif // SEGMENTED_INDEX_HPP
@@ -1,9 +1,14 @@
 #include "tokenizer.hpp"
 #include "dfa_trie.hpp"
+#include "mapped_file.hpp"
 
+#include <algorithm>
+#include <array>
+#include <cstring>
 #include <filesystem>
 #include <fstream>
 #include <sstream>
+#include <type_traits>
 #include <unordered_map>
 #include <unordered_set>
 
@@ -11,10 +16,13 @@
 #include <fmt/ranges.h>
 #include <nlohmann/json.hpp>
 #include <tokenizers_cpp.h>
+#include <unistd.h>
 #include <utf8.h>
 
 namespace corpus_search {
 
+static_assert(std::is_trivially_copyable_v<dfa_trie_node>);
+
 static auto load_json_file(std::string const &path) -> nlohmann::json
 {
     // Check if file exists
@@ -53,22 +61,56 @@ auto tokenizer::unnormalize(std::string_view string) const -> std::string
     return replace_chars(string, m_inv_normalize_mapping);
 }
 
+static auto make_hf_tokenizer(nlohmann::json json) -> std::unique_ptr<tokenizers::Tokenizer>
+{
+    json["pre_tokenizer"] = nullptr; // remove unicode conversion to allow partial characters
+    return tokenizers::Tokenizer::FromBlobJSON(json.dump());
+}
+
+// size and modification time of tokenizer.json, recorded in snapshots
+static auto json_file_stamp(std::string const &path) -> std::pair<std::uint64_t, std::int64_t>
+{
+    return {
+        std::filesystem::file_size(path),
+        std::filesystem::last_write_time(path).time_since_epoch().count(),
+    };
+}
+
+static auto sorted_mappings(std::unordered_map<char, char> const &mapping)
+    -> std::vector<std::array<char, 2>>
+{
+    auto result = std::vector<std::array<char, 2>>{};
+    for (auto [from, to] : mapping) {
+        result.push_back({from, to});
+    }
+    std::sort(result.begin(), result.end());
+    return result;
+}
+
 tokenizer::tokenizer(std::string tokenizer_json_path,
                      std::unordered_map<char, char> normalize_mapping,
                      bool verbose)
-    : m_normalize_mapping(std::move(normalize_mapping))
+    : m_json_path(std::move(tokenizer_json_path))
+    , m_normalize_mapping(std::move(normalize_mapping))
 {
     for (auto [from, to] : m_normalize_mapping) {
         m_inv_normalize_mapping[to] = from;
         m_inv_normalize_mapping[from] = to; // switch places with the original symbols
     }
 
-    auto const json = load_json_file(tokenizer_json_path);
+    if (!load_snapshot(snapshot_path(m_json_path), verbose)) {
+        load_json(verbose);
+        m_trie = std::make_unique<dfa_trie>(*this);
+    }
+}
+
+void tokenizer::load_json(bool verbose)
+{
+    auto const json = load_json_file(m_json_path);
 
     // Load HF Tokenizers tokenizer
-    auto json_for_tok = json;
-    json_for_tok["pre_tokenizer"] = nullptr; // remove unicode conversion to allow partial characters
-    hf_tokenizer = tokenizers::Tokenizer::FromBlobJSON(json_for_tok.dump());
+    std::call_once(hf_once, [&] { hf_tokenizer = make_hf_tokenizer(json); });
+    m_vocab_size = hf_tokenizer->GetVocabSize();
 
     // Do other preprocessing stuff
     auto special_tokens = std::unordered_set<int>{};
@@ -107,15 +149,243 @@ tokenizer::tokenizer(std::string tokenizer_json_path,
     if (verbose) {
         fmt::println("Max token length in bytes = {}", m_max_token_bytes);
     }
+}
+
+// Whether the sections of a snapshot, and everything they point to, lie inside of the file.
+// The trie is walked recursively, so children must also come after their parent.
+static auto snapshot_is_sane(mapped_file const &file, tokenizer_snapshot_header const &header)
+    -> bool
+{
+    auto const *data = file.data();
+    if (header.vocab_size < 0 || header.max_token_bytes < 0
+        || header.num_trie_roots != static_cast<std::uint64_t>(header.max_token_bytes)
+        || !in_bounds(file.size(), header.mappings_offset, header.num_mappings, 2)
+        || !in_bounds(file.size(),
+                      header.tokens_offset,
+                      header.num_tokens,
+                      sizeof(tokenizer_snapshot_token))
+        || !in_bounds(file.size(),
+                      header.trie_roots_offset,
+                      header.num_trie_roots,
+                      sizeof(std::uint32_t))
+        || !in_bounds(file.size(),
+                      header.trie_nodes_offset,
+                      header.num_trie_nodes,
+                      sizeof(dfa_trie_node))
+        || !in_bounds(file.size(),
+                      header.trie_tokens_offset,
+                      header.num_trie_tokens,
+                      sizeof(std::uint32_t))
+        || !in_bounds(file.size(), header.bytes_offset, 0, 1)) {
+        return false;
+    }
 
-    m_trie = std::make_unique<dfa_trie>(*this);
+    auto num_bytes = file.size() - header.bytes_offset;
+    auto tokens = std::span(
+        reinterpret_cast<tokenizer_snapshot_token const *>(data + header.tokens_offset),
+        header.num_tokens);
+    for (auto const &token : tokens) {
+        if (token.offset > num_bytes || token.length > num_bytes - token.offset
+            || token.length > static_cast<std::uint32_t>(header.max_token_bytes)) {
+            return false;
+        }
+    }
+
+    auto roots = std::span(reinterpret_cast<std::uint32_t const *>(data + header.trie_roots_offset),
+                           header.num_trie_roots);
+    for (auto root : roots) {
+        if (root >= header.num_trie_nodes) {
+            return false;
+        }
+    }
+    auto nodes = std::span(reinterpret_cast<dfa_trie_node const *>(data + header.trie_nodes_offset),
+                           header.num_trie_nodes);
+    for (std::size_t i = 0; i < nodes.size(); ++i) {
+        auto const &node = nodes[i];
+        if ((node.n_children > 0
+             && (node.first_child <= i
+                 || node.first_child + std::uint64_t{node.n_children} > nodes.size()))
+            || node.tokens_begin > node.tokens_end || node.tokens_end > node.subtree_end
+            || node.subtree_end > header.num_trie_tokens) {
+            return false;
+        }
+    }
+    return true;
+}
+
+auto tokenizer::load_snapshot(std::string const &path, bool verbose) -> bool
+{
+    if (!std::filesystem::exists(path) || !std::filesystem::exists(m_json_path)) {
+        return false;
+    }
+
+    auto file = mapped_file(path, mapped_file::advice::sequential);
+    auto const *data = file.data();
+    auto header = tokenizer_snapshot_header{};
+    if (file.size() < sizeof(header)) {
+        return false;
+    }
+    std::memcpy(&header, data, sizeof(header));
+
+    // another format, or written by a build with another layout; rewritten by the next save
+    if (std::memcmp(header.magic, tokenizer_snapshot_header::MAGIC, sizeof(header.magic)) != 0
+        || header.version != tokenizer_snapshot_header::VERSION
+        || header.byte_order_mark != tokenizer_snapshot_header::BYTE_ORDER_MARK
+        || header.trie_node_size != sizeof(dfa_trie_node)) {
+        if (verbose) {
+            fmt::println("Ignoring incompatible tokenizer snapshot {}", path);
+        }
+        return false;
+    }
+    if (header.file_size != file.size() || !snapshot_is_sane(file, header)) {
+        fmt::println("Warning: ignoring corrupt tokenizer snapshot {}", path);
+        std::fflush(stdout);
+        return false;
+    }
+
+    auto mappings = sorted_mappings(m_normalize_mapping);
+    auto [json_size, json_mtime] = json_file_stamp(m_json_path);
+    if (header.json_size != json_size || header.json_mtime != json_mtime
+        || header.num_mappings != mappings.size()
+        || std::memcmp(data + header.mappings_offset,
+                       mappings.data(),
+                       mappings.size() * sizeof(mappings[0]))
+               != 0) {
+        if (verbose) {
+            fmt::println("Ignoring stale tokenizer snapshot {}", path);
+        }
+        return false;
+    }
+
+    auto const *tokens = reinterpret_cast<tokenizer_snapshot_token const *>(
+        data + header.tokens_offset);
+    auto const *bytes = data + header.bytes_offset;
+    tid_to_token.reserve(header.num_tokens);
+    for (std::uint64_t i = 0; i < header.num_tokens; ++i) {
+        tid_to_token.emplace(tokens[i].token,
+                             std::string(bytes + tokens[i].offset, tokens[i].length));
+    }
+    m_vocab_size = header.vocab_size;
+    m_max_token_bytes = header.max_token_bytes;
+
+    m_trie = std::make_unique<dfa_trie>(
+        std::span(reinterpret_cast<std::uint32_t const *>(data + header.trie_roots_offset),
+                  header.num_trie_roots),
+        std::span(reinterpret_cast<dfa_trie_node const *>(data + header.trie_nodes_offset),
+                  header.num_trie_nodes),
+        std::span(reinterpret_cast<std::uint32_t const *>(data + header.trie_tokens_offset),
+                  header.num_trie_tokens));
+
+    if (verbose) {
+        fmt::println("Loaded tokenizer snapshot {} ({} tokens)", path, header.num_tokens);
+    }
+    return true;
+}
+
+auto tokenizer::snapshot_path(std::string const &tokenizer_json_path) -> std::string
+{
+    return tokenizer_json_path + ".snapshot";
+}
+
+void tokenizer::save_snapshot(std::string const &path) const
+{
+    auto mappings = sorted_mappings(m_normalize_mapping);
+
+    auto token_ids = std::vector<int>{};
+    token_ids.reserve(tid_to_token.size());
+    for (auto const &[tid, token] : tid_to_token) {
+        token_ids.push_back(tid);
+    }
+    std::sort(token_ids.begin(), token_ids.end());
+
+    auto tokens = std::vector<tokenizer_snapshot_token>{};
+    tokens.reserve(token_ids.size());
+    std::uint64_t num_bytes = 0;
+    for (int tid : token_ids) {
+        auto length = tid_to_token.at(tid).size();
+        tokens.push_back({tid, static_cast<std::uint32_t>(length), num_bytes});
+        num_bytes += length;
+    }
+
+    auto align = [](std::uint64_t offset) { return (offset + 7) / 8 * 8; };
+
+    auto header = tokenizer_snapshot_header{};
+    std::memcpy(header.magic, tokenizer_snapshot_header::MAGIC, sizeof(header.magic));
+    header.version = tokenizer_snapshot_header::VERSION;
+    header.vocab_size = m_vocab_size;
+    header.max_token_bytes = m_max_token_bytes;
+    header.num_mappings = mappings.size();
+    header.byte_order_mark = tokenizer_snapshot_header::BYTE_ORDER_MARK;
+    header.trie_node_size = sizeof(dfa_trie_node);
+    std::tie(header.json_size, header.json_mtime) = json_file_stamp(m_json_path);
+    header.num_tokens = tokens.size();
+    header.num_trie_roots = m_trie->get_roots().size();
+    header.num_trie_nodes = m_trie->get_nodes().size();
+    header.num_trie_tokens = m_trie->get_token_ids().size();
+    header.mappings_offset = sizeof(header);
+    header.tokens_offset = align(header.mappings_offset + mappings.size() * sizeof(mappings[0]));
+    header.trie_roots_offset = align(header.tokens_offset + tokens.size() * sizeof(tokens[0]));
+    header.trie_nodes_offset = align(header.trie_roots_offset
+                                     + header.num_trie_roots * sizeof(std::uint32_t));
+    header.trie_tokens_offset = align(header.trie_nodes_offset
+                                      + header.num_trie_nodes * sizeof(dfa_trie_node));
+    header.bytes_offset = align(header.trie_tokens_offset
+                                + header.num_trie_tokens * sizeof(std::uint32_t));
+    header.file_size = header.bytes_offset + num_bytes;
+
+    // write next to the destination, then atomically replace it
+    auto tmp_path = fmt::format("{}.tmp{}", path, ::getpid());
+    {
+        auto out = std::ofstream(tmp_path, std::ios::binary | std::ios::trunc);
+        if (!out) {
+            throw std::runtime_error(fmt::format("Error opening file {} for writing.", tmp_path));
+        }
+
+        auto pad_to = [&out](std::uint64_t offset) {
+            static constexpr char zeros[8] = {};
+            auto pos = static_cast<std::uint64_t>(out.tellp());
+            out.write(zeros, offset - pos);
+        };
+
+        out.write(reinterpret_cast<char const *>(&header), sizeof(header));
+        out.write(reinterpret_cast<char const *>(mappings.data()),
+                  mappings.size() * sizeof(mappings[0]));
+        pad_to(header.tokens_offset);
+        out.write(reinterpret_cast<char const *>(tokens.data()), tokens.size() * sizeof(tokens[0]));
+        auto write_span = [&out, &pad_to](std::uint64_t offset, auto span) {
+            pad_to(offset);
+            out.write(reinterpret_cast<char const *>(span.data()), span.size_bytes());
+        };
+        write_span(header.trie_roots_offset, m_trie->get_roots());
+        write_span(header.trie_nodes_offset, m_trie->get_nodes());
+        write_span(header.trie_tokens_offset, m_trie->get_token_ids());
+        pad_to(header.bytes_offset);
+        for (int tid : token_ids) {
+            auto const &token = tid_to_token.at(tid);
+            out.write(token.data(), token.size());
+        }
+
+        out.close();
+        if (out.fail()) {
+            std::filesystem::remove(tmp_path);
+            throw std::runtime_error(fmt::format("Error writing file {}.", tmp_path));
+        }
+    }
+    std::filesystem::rename(tmp_path, path);
 }
 
 tokenizer::~tokenizer() = default;
 
+auto tokenizer::hf() const -> tokenizers::Tokenizer &
+{
+    std::call_once(hf_once,
+                   [this] { hf_tokenizer = make_hf_tokenizer(load_json_file(m_json_path)); });
+    return *hf_tokenizer;
+}
+
 auto tokenizer::vocab_size() const -> int
 {
-    return hf_tokenizer->GetVocabSize();
+    return m_vocab_size;
 }
 
 auto tokenizer::max_token_bytes() const -> int
@@ -125,7 +395,7 @@ auto tokenizer::max_token_bytes() const -> int
 
 auto tokenizer::tokenize(std::string_view string, bool add_special_tokens) const -> std::vector<int>
 {
-    auto result = hf_tokenizer->Encode(to_unicode(normalize(string)));
+    auto result = hf().Encode(to_unicode(normalize(string)));
     if (add_special_tokens) {
         result.insert(result.begin(), BOS_TOKEN_ID);
         result.push_back(EOS_TOKEN_ID);
@@ -1,7 +1,9 @@
 #ifndef TOKENIZER_HPP
 #define TOKENIZER_HPP
 
+#include <cstdint>
 #include <memory>
+#include <mutex>
 #include <string>
 #include <unordered_map>
 #include <vector>
@@ -17,11 +19,65 @@ namespace corpus_search {
 
 class dfa_trie;
 
+// Binary snapshot of everything a tokenizer derives from tokenizer.json, except for the
+// HF tokenizer itself. All integers are stored in native byte order and the trie nodes in
+// their native layout, so the header records both; every section is 8-byte aligned.
+//
+//   header | mappings (char[2])[num_mappings] | tokens (tokenizer_snapshot_token)[num_tokens]
+//          | trie roots (uint32)[num_trie_roots] | trie nodes (dfa_trie_node)[num_trie_nodes]
+//          | trie token IDs (uint32)[num_trie_tokens] | token bytes
+//
+// A snapshot is only used if tokenizer.json still has the recorded size and modification time
+// and the normalize mappings are the same.
+struct tokenizer_snapshot_header
+{
+    static constexpr char MAGIC[8] = {'C', 'S', 'T', 'O', 'K', 'S', 'N', '\0'};
+    static constexpr std::uint32_t VERSION = 3;
+    static constexpr std::uint32_t BYTE_ORDER_MARK = 0x01020304;
+
+    char magic[8];
+    std::uint32_t version;
+    std::int32_t vocab_size;
+    std::int32_t max_token_bytes;
+    std::uint32_t num_mappings;    // sorted by the character they replace
+    std::uint32_t byte_order_mark; // BYTE_ORDER_MARK in the byte order of the writer
+    std::uint32_t trie_node_size;  // sizeof(dfa_trie_node) in the writer
+
+    // tokenizer.json the snapshot was taken from
+    std::uint64_t json_size;
+    std::int64_t json_mtime;
+
+    std::uint64_t num_tokens;
+    std::uint64_t num_trie_roots;
+    std::uint64_t num_trie_nodes;
+    std::uint64_t num_trie_tokens;
+
+    std::uint64_t mappings_offset;
+    std::uint64_t tokens_offset;
+    std::uint64_t trie_roots_offset;
+    std::uint64_t trie_nodes_offset;
+    std::uint64_t trie_tokens_offset;
+    std::uint64_t bytes_offset;
+    std::uint64_t file_size;
+};
+
+struct tokenizer_snapshot_token
+{
+    std::int32_t token;
+    std::uint32_t length;
+    std::uint64_t offset; // relative to bytes_offset
+};
+
 class tokenizer
 {
-    std::unique_ptr<tokenizers::Tokenizer> hf_tokenizer;
+    std::string m_json_path;
+
+    // only needed to encode text, so created on first use
+    mutable std::once_flag hf_once;
+    mutable std::unique_ptr<tokenizers::Tokenizer> hf_tokenizer;
 
     std::unordered_map<int, std::string> tid_to_token;
+    int m_vocab_size;
     int m_max_token_bytes;
 
     std::unordered_map<char, char> m_normalize_mapping;
@@ -32,20 +88,31 @@ class tokenizer
     auto normalize(std::string_view string) const -> std::string;
     auto unnormalize(std::string_view string) const -> std::string;
 
+    auto hf() const -> tokenizers::Tokenizer &;
+    void load_json(bool verbose);
+    auto load_snapshot(std::string const &path, bool verbose) -> bool;
+
 public:
     // TODO: un-hardcode these
     static constexpr int BOS_TOKEN_ID = 0;
     static constexpr int EOS_TOKEN_ID = 1;
 
+    // Uses the snapshot at snapshot_path(tokenizer_json_path) if it is up to date.
     tokenizer(std::string tokenizer_json_path,
               std::unordered_map<char, char> normalize_mapping,
               bool verbose);
     ~tokenizer();
 
+    static auto snapshot_path(std::string const &tokenizer_json_path) -> std::string;
+
+    // write a snapshot to path, atomically replacing any existing file
+    void save_snapshot(std::string const &path) const;
+
+    auto json_path() const -> auto const & { return m_json_path; }
     auto vocab_size() const -> int;
     auto max_token_bytes() const -> int;
 
-    auto get_hf_tokenizer() const { return hf_tokenizer.get(); }
+    auto get_hf_tokenizer() const { return &hf(); }
     auto get_tid_to_token() const -> auto const & { return tid_to_token; }
     auto normalize_mapping() const -> auto const & { return m_normalize_mapping; }
     auto inv_normalize_mapping() const -> auto const & { return m_inv_normalize_mapping; }
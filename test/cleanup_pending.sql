@@ -0,0 +1,16 @@
+-- Cleanup everything created by test_pending.sql.
+-- Safe to run at any point: all statements use IF EXISTS.
+
+DROP TABLE IF EXISTS t_pending_test_g CASCADE;
+DROP TABLE IF EXISTS t_pending_test_h CASCADE;
+DROP TABLE IF EXISTS t_pending_test_h_nolimit CASCADE;
+DROP TABLE IF EXISTS t_pending_test_i CASCADE;
+DROP TABLE IF EXISTS t_pending_test_j CASCADE;
+DROP TABLE IF EXISTS t_pending_test_k CASCADE;
+DROP TABLE IF EXISTS t_pending_test_l CASCADE;
+
+DROP FUNCTION IF EXISTS check_pattern(TEXT, REGCLASS, TEXT);
+DROP FUNCTION IF EXISTS assert_eq(TEXT, BIGINT, BIGINT);
+DROP FUNCTION IF EXISTS assert_index_matches_seqscan(TEXT, TEXT[], TEXT[]);
+
+DROP EXTENSION IF EXISTS corpussearch CASCADE;
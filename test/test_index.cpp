@@ -0,0 +1,492 @@
+#include "test.hpp"
+
+#include <gmock/gmock.h>
+#include <gtest/gtest.h>
+
+#include <filesystem>
+#include <fstream>
+#include <random>
+#include <sstream>
+#include <thread>
+
+#include "corpus_file.hpp"
+#include "dfa_trie.hpp"
+#include "index_builder.hpp"
+#include "index_file.hpp"
+#include "ingest.hpp"
+#include "segmented_index.hpp"
+
+using sentence_list = std::vector<std::pair<sentid_t, std::vector<int>>>;
+
+static auto make_sentences(int num_sentences, int vocab_size, unsigned seed) -> sentence_list
+{
+    auto rng = std::mt19937(seed);
+    auto len_dist = std::uniform_int_distribution<int>(0, 40);
+    // skewed token distribution, like a real corpus
+    auto tok_dist = std::geometric_distribution<int>(0.05);
+
+    auto result = sentence_list{};
+    for (int i = 0; i < num_sentences; ++i) {
+        auto tokens = std::vector<int>(len_dist(rng));
+        for (auto &token : tokens) {
+            token = std::min(tok_dist(rng), vocab_size - 1);
+        }
+        result.emplace_back(static_cast<sentid_t>(i * 3 + 1), std::move(tokens));
+    }
+    // ids do not need to arrive in order
+    std::shuffle(result.begin(), result.end(), rng);
+    return result;
+}
+
+static auto build_serial(sentence_list const &sentences) -> corpus_search::index_builder
+{
+    auto index = corpus_search::index_builder{};
+    for (auto const &[sent_id, tokens] : sentences) {
+        index.add_sentence(sent_id, tokens);
+    }
+    index.finalize_index();
+    return index;
+}
+
+static void expect_same_index(corpus_search::index_builder const &expected,
+                              corpus_search::index_builder const &actual)
+{
+    auto const &lhs = expected.get_index();
+    auto const &rhs = actual.get_index();
+    ASSERT_EQ(lhs.size(), rhs.size());
+    for (auto const &[token, entries] : lhs) {
+        ASSERT_TRUE(rhs.contains(token)) << "missing token " << token;
+        auto const &other = rhs.at(token);
+        ASSERT_EQ(entries.size(), other.size()) << "token " << token;
+        for (std::size_t i = 0; i < entries.size(); ++i) {
+            ASSERT_EQ(entries[i].hash(), other[i].hash()) << "token " << token << ", entry " << i;
+        }
+    }
+}
+
+TEST(IndexBuilder, ParallelMatchesSerial)
+{
+    auto sentences = make_sentences(20'000, 500, 42);
+    auto serial = build_serial(sentences);
+
+    for (int num_threads : {1, 2, 3, 8}) {
+        auto parallel = corpus_search::index_builder::build_parallel(
+            sentences.size(),
+            [&sentences](std::size_t i) {
+                return std::pair<sentid_t, std::span<const int>>{sentences[i].first,
+                                                                 sentences[i].second};
+            },
+            num_threads);
+        expect_same_index(serial, parallel);
+    }
+}
+
+TEST(IndexBuilder, MergeShards)
+{
+    auto sentences = make_sentences(5'000, 200, 7);
+    auto serial = build_serial(sentences);
+
+    auto shards = std::vector<corpus_search::index_builder>(4);
+    for (std::size_t i = 0; i < sentences.size(); ++i) {
+        shards[i % shards.size()].add_sentence(sentences[i].first, sentences[i].second);
+    }
+    for (auto &shard : shards) {
+        shard.finalize_index();
+    }
+    expect_same_index(serial, corpus_search::index_builder::merge_shards(std::move(shards), 3));
+}
+
+TEST(IndexBuilder, ParallelEmpty)
+{
+    auto index = corpus_search::index_builder::build_parallel(
+        0, [](std::size_t) -> std::pair<sentid_t, std::span<const int>> { return {}; }, 4);
+    EXPECT_TRUE(index.get_index().empty());
+}
+
+TEST(CorpusFile, RoundTrip)
+{
+    auto sentences = make_sentences(3'000, 300, 11);
+    sentences.emplace_back(999'999, std::vector<int>{}); // empty sentence
+
+    auto path = (std::filesystem::temp_directory_path() / "test_corpus_roundtrip.bin").string();
+    {
+        auto writer = corpus_search::corpus_file_writer(path);
+        for (auto const &[sent_id, tokens] : sentences) {
+            writer.add_sentence(sent_id, tokens);
+        }
+        writer.finish();
+    }
+
+    ASSERT_TRUE(corpus_search::corpus_file::is_corpus_file(path));
+    {
+        auto corpus = corpus_search::corpus_file(path);
+        ASSERT_EQ(corpus.size(), sentences.size());
+        for (std::size_t i = 0; i < sentences.size(); ++i) {
+            EXPECT_EQ(corpus.sent_id(i), sentences[i].first);
+            auto tokens = corpus.tokens(i);
+            EXPECT_EQ(std::vector<int>(tokens.begin(), tokens.end()), sentences[i].second);
+        }
+    }
+
+    expect_same_index(build_serial(sentences),
+                      corpus_search::index_builder::from_file(path, 3));
+
+    std::filesystem::remove(path);
+}
+
+TEST(CorpusFile, RejectsCorruptFile)
+{
+    auto path = (std::filesystem::temp_directory_path() / "test_corpus_corrupt.bin").string();
+    {
+        auto writer = corpus_search::corpus_file_writer(path);
+        writer.add_sentence(1, std::vector<int>{1, 2, 3});
+        writer.finish();
+    }
+    std::filesystem::resize_file(path, std::filesystem::file_size(path) - 8);
+    EXPECT_THROW(corpus_search::corpus_file{path}, std::runtime_error);
+
+    {
+        auto out = std::ofstream(path, std::ios::binary | std::ios::trunc);
+        out << "not a corpus file";
+    }
+    EXPECT_FALSE(corpus_search::corpus_file::is_corpus_file(path));
+    EXPECT_THROW(corpus_search::corpus_file{path}, std::runtime_error);
+
+    std::filesystem::remove(path);
+}
+
+static auto make_test_tokenizer() -> std::unique_ptr<corpus_search::tokenizer>
+{
+    return std::make_unique<corpus_search::tokenizer>(
+        get_tok_path(),
+        std::unordered_map<char, char>{{'.', 'x'}, {'/', 'Z'}, {'\\', 'X'}, {'`', 'C'}},
+        false);
+}
+
+TEST(Tokenizer, SnapshotRoundTrip)
+{
+    auto dir = std::filesystem::temp_directory_path() / "test_tokenizer_snapshot";
+    std::filesystem::create_directories(dir);
+    auto json_path = (dir / "tokenizer.json").string();
+    std::filesystem::copy_file(get_tok_path(),
+                               json_path,
+                               std::filesystem::copy_options::overwrite_existing);
+    auto mapping = std::unordered_map<char, char>{{'.', 'x'}, {'/', 'Z'}};
+
+    auto from_json = corpus_search::tokenizer(json_path, mapping, false);
+    auto snapshot_path = corpus_search::tokenizer::snapshot_path(json_path);
+    from_json.save_snapshot(snapshot_path);
+
+    auto from_snapshot = corpus_search::tokenizer(json_path, mapping, false);
+    EXPECT_EQ(from_snapshot.vocab_size(), from_json.vocab_size());
+    EXPECT_EQ(from_snapshot.max_token_bytes(), from_json.max_token_bytes());
+    EXPECT_EQ(from_snapshot.get_tid_to_token(), from_json.get_tid_to_token());
+    EXPECT_EQ(from_snapshot.tokenize("學而時習之 hello."), from_json.tokenize("學而時習之 hello."));
+    EXPECT_TRUE(std::ranges::equal(from_snapshot.trie().get_token_ids(),
+                                   from_json.trie().get_token_ids()));
+
+    // a corrupt snapshot is ignored, and the tokenizer is rebuilt from tokenizer.json
+    {
+        auto file = std::fstream(snapshot_path, std::ios::in | std::ios::out | std::ios::binary);
+        auto num_trie_nodes = std::uint64_t{1} << 40;
+        file.seekp(offsetof(corpus_search::tokenizer_snapshot_header, num_trie_nodes));
+        file.write(reinterpret_cast<char const *>(&num_trie_nodes), sizeof(num_trie_nodes));
+    }
+    auto from_corrupt = corpus_search::tokenizer(json_path, mapping, false);
+    EXPECT_EQ(from_corrupt.get_tid_to_token(), from_json.get_tid_to_token());
+    EXPECT_TRUE(std::ranges::equal(from_corrupt.trie().get_token_ids(),
+                                   from_json.trie().get_token_ids()));
+
+    // a snapshot taken with other mappings is ignored
+    auto unmapped = corpus_search::tokenizer(json_path, {}, false);
+    EXPECT_NE(unmapped.get_tid_to_token(), from_json.get_tid_to_token());
+
+    std::filesystem::remove_all(dir);
+}
+
+static auto make_text_lines(int num_lines) -> std::vector<std::string>
+{
+    auto rng = std::mt19937(3);
+    auto words = std::vector<std::string>{
+        "學而時習之", "不亦說乎", "有朋", "自遠方來", "hello", ".",
+    };
+    auto word_dist = std::uniform_int_distribution<std::size_t>(0, words.size() - 1);
+    auto len_dist = std::uniform_int_distribution<int>(1, 12);
+
+    auto lines = std::vector<std::string>(num_lines);
+    for (auto &line : lines) {
+        for (int n = len_dist(rng); n > 0; --n) {
+            line += words[word_dist(rng)];
+        }
+    }
+    return lines;
+}
+
+TEST(Ingest, LinesMatchesSerial)
+{
+    auto lines = make_text_lines(2'000);
+    lines[10].clear(); // blank lines are skipped but still use up an id
+
+    auto text = std::stringstream{};
+    auto expected = sentence_list{};
+    for (std::size_t i = 0; i < lines.size(); ++i) {
+        text << lines[i] << "\n";
+        if (!lines[i].empty()) {
+            expected.emplace_back(i, get_tok().tokenize(lines[i], true));
+        }
+    }
+
+    auto options = corpus_search::ingest_options{};
+    options.num_threads = 3;
+    options.batch_size = 64;
+    options.queue_capacity = 2; // force backpressure
+    auto [index, stats] = corpus_search::ingest_text(text, make_test_tokenizer, options);
+
+    EXPECT_EQ(stats.reader.items, lines.size());
+    EXPECT_EQ(stats.tokenizer.items, expected.size());
+    EXPECT_EQ(stats.indexer.items, expected.size());
+    expect_same_index(build_serial(expected), index);
+}
+
+TEST(Ingest, TsvMatchesSerial)
+{
+    auto lines = make_text_lines(500);
+
+    auto text = std::stringstream{};
+    auto expected = sentence_list{};
+    for (std::size_t i = 0; i < lines.size(); ++i) {
+        auto sent_id = static_cast<sentid_t>(i * 7 + 5);
+        text << sent_id << "\t" << lines[i] << "\r\n";
+        expected.emplace_back(sent_id, get_tok().tokenize(lines[i], true));
+    }
+
+    auto options = corpus_search::ingest_options{};
+    options.format = corpus_search::ingest_format::tsv;
+    options.num_threads = 2;
+    options.batch_size = 50;
+    auto [index, stats] = corpus_search::ingest_text(text, make_test_tokenizer, options);
+
+    expect_same_index(build_serial(expected), index);
+}
+
+TEST(Ingest, MalformedTsv)
+{
+    auto text = std::stringstream{"1\tfoo\nnot a tsv line\n2\tbar\n"};
+    auto options = corpus_search::ingest_options{};
+    options.format = corpus_search::ingest_format::tsv;
+    options.num_threads = 2;
+    EXPECT_THROW(corpus_search::ingest_text(text, make_test_tokenizer, options),
+                 std::runtime_error);
+}
+
+TEST(IndexFile, RoundTrip)
+{
+    auto sentences = make_sentences(5'000, 400, 5);
+    auto index = build_serial(sentences);
+
+    auto path = (std::filesystem::temp_directory_path() / "test_index_roundtrip.idx").string();
+    index.save(path);
+
+    for (bool populate : {false, true}) {
+        auto mapped = corpus_search::mmap_index(path,
+                                                populate,
+                                                corpus_search::mapped_file::advice::random);
+        ASSERT_EQ(mapped.num_tokens(), index.get_index().size());
+
+        auto accessor = mapped.accessor();
+        for (auto const &[token, entries] : index.get_index()) {
+            auto postings = mapped.postings(token);
+            ASSERT_EQ(postings.size(), entries.size()) << "token " << token;
+            for (std::size_t i = 0; i < entries.size(); ++i) {
+                ASSERT_EQ(postings[i].hash(), entries[i].hash());
+            }
+
+            mapped.prefetch(token);
+            auto ranges = accessor(token);
+            ASSERT_EQ(ranges.size(), entries.size());
+            for (std::size_t i = 0; i < entries.size(); ++i) {
+                EXPECT_EQ(ranges[i].sent_id, entries[i].sent_id);
+                EXPECT_EQ(ranges[i].i, entries[i].pos);
+                EXPECT_EQ(ranges[i].j, entries[i].pos + 1);
+            }
+        }
+        EXPECT_TRUE(mapped.postings(-1).empty());
+        EXPECT_TRUE(mapped.postings(1'000'000).empty());
+    }
+
+    std::filesystem::remove(path);
+}
+
+TEST(IndexFile, EmptyIndex)
+{
+    auto path = (std::filesystem::temp_directory_path() / "test_index_empty.idx").string();
+    corpus_search::index_builder{}.save(path);
+
+    auto mapped = corpus_search::mmap_index(path);
+    EXPECT_EQ(mapped.num_tokens(), 0);
+    EXPECT_TRUE(mapped.postings(0).empty());
+
+    std::filesystem::remove(path);
+}
+
+TEST(IndexFile, RejectsCorruptFile)
+{
+    auto path = (std::filesystem::temp_directory_path() / "test_index_corrupt.idx").string();
+    build_serial(make_sentences(100, 50, 1)).save(path);
+
+    std::filesystem::resize_file(path, std::filesystem::file_size(path) - 1);
+    EXPECT_THROW(corpus_search::mmap_index{path}, std::runtime_error);
+
+    {
+        auto out = std::ofstream(path, std::ios::binary | std::ios::trunc);
+        out << "not an index file";
+    }
+    EXPECT_THROW(corpus_search::mmap_index{path}, std::runtime_error);
+
+    std::filesystem::remove(path);
+}
+
+static void expect_same_postings(corpus_search::index_builder const &expected,
+                                 corpus_search::segmented_index const &actual)
+{
+    for (auto const &[token, entries] : expected.get_index()) {
+        auto postings = actual.postings(token);
+        ASSERT_EQ(postings.size(), entries.size()) << "token " << token;
+        for (std::size_t i = 0; i < entries.size(); ++i) {
+            ASSERT_EQ(postings[i].hash(), entries[i].hash()) << "token " << token;
+        }
+    }
+}
+
+TEST(SegmentedIndex, FlushMergeReopen)
+{
+    auto dir = (std::filesystem::temp_directory_path() / "test_segmented_index").string();
+    std::filesystem::remove_all(dir);
+
+    auto sentences = make_sentences(4'000, 300, 9);
+    auto expected = build_serial(sentences);
+
+    for (bool background : {false, true}) {
+        std::filesystem::remove_all(dir);
+        {
+            auto options = corpus_search::segmented_index_options{};
+            options.memtable_max_entries = 5'000;
+            options.merge_factor = 3;
+            options.background_merge = background;
+            auto index = corpus_search::segmented_index(dir, options);
+
+            for (std::size_t i = 0; i < sentences.size(); ++i) {
+                index.add_sentence(sentences[i].first, sentences[i].second);
+                if (i == sentences.size() / 2) {
+                    // unflushed sentences are searchable too
+                    auto partial = build_serial({sentences.begin(), sentences.begin() + i + 1});
+                    expect_same_postings(partial, index);
+                }
+            }
+            expect_same_postings(expected, index);
+
+            index.flush();
+            index.wait_for_merges();
+            EXPECT_LT(index.num_segments(), 3 * 3);
+            expect_same_postings(expected, index);
+        }
+
+        auto reopened = corpus_search::segmented_index(dir);
+        expect_same_postings(expected, reopened);
+    }
+
+    std::filesystem::remove_all(dir);
+}
+
+TEST(SegmentedIndex, FlushOnDestruction)
+{
+    auto dir = (std::filesystem::temp_directory_path() / "test_segmented_destroy").string();
+    std::filesystem::remove_all(dir);
+
+    auto sentences = make_sentences(500, 100, 21);
+    {
+        auto options = corpus_search::segmented_index_options{};
+        options.memtable_max_entries = 0;
+        auto index = corpus_search::segmented_index(dir, options);
+        for (auto const &[sent_id, tokens] : sentences) {
+            index.add_sentence(sent_id, tokens);
+        }
+        EXPECT_EQ(index.num_segments(), 0);
+    }
+
+    auto reopened = corpus_search::segmented_index(dir);
+    expect_same_postings(build_serial(sentences), reopened);
+    std::filesystem::remove_all(dir);
+}
+
+TEST(SegmentedIndex, ConcurrentInlineMerges)
+{
+    auto dir = (std::filesystem::temp_directory_path() / "test_segmented_inline").string();
+    std::filesystem::remove_all(dir);
+
+    auto sentences = make_sentences(4'000, 50, 17);
+    auto options = corpus_search::segmented_index_options{};
+    options.memtable_max_entries = 500;
+    options.merge_factor = 2;
+    options.background_merge = false;
+    {
+        auto index = corpus_search::segmented_index(dir, options);
+
+        // every writer flushes and merges on its own thread; no merge may run twice
+        auto writers = std::vector<std::thread>{};
+        for (std::size_t t = 0; t < 4; ++t) {
+            writers.emplace_back([&, t] {
+                for (std::size_t i = t; i < sentences.size(); i += 4) {
+                    index.add_sentence(sentences[i].first, sentences[i].second);
+                }
+            });
+        }
+        for (auto &writer : writers) {
+            writer.join();
+        }
+        index.flush();
+        expect_same_postings(build_serial(sentences), index);
+    }
+
+    auto reopened = corpus_search::segmented_index(dir, options);
+    expect_same_postings(build_serial(sentences), reopened);
+    std::filesystem::remove_all(dir);
+}
+
+TEST(SegmentedIndex, ConcurrentReaders)
+{
+    auto dir = (std::filesystem::temp_directory_path() / "test_segmented_readers").string();
+    std::filesystem::remove_all(dir);
+
+    auto sentences = make_sentences(3'000, 50, 13);
+    auto options = corpus_search::segmented_index_options{};
+    options.memtable_max_entries = 2'000;
+    options.merge_factor = 2;
+    auto index = corpus_search::segmented_index(dir, options);
+
+    auto done = std::atomic<bool>{false};
+    auto reader = std::thread([&] {
+        std::size_t last_size = 0;
+        while (!done) {
+            // postings only ever grow, and always come out sorted and duplicate-free
+            auto postings = index.postings(0);
+            EXPECT_GE(postings.size(), last_size);
+            EXPECT_TRUE(std::adjacent_find(postings.begin(),
+                                           postings.end(),
+                                           [](auto const &a, auto const &b) { return !(a < b); })
+                        == postings.end());
+            last_size = postings.size();
+        }
+    });
+
+    for (auto const &[sent_id, tokens] : sentences) {
+        index.add_sentence(sent_id, tokens);
+    }
+    index.flush();
+    index.wait_for_merges();
+    done = true;
+    reader.join();
+
+    expect_same_postings(build_serial(sentences), index);
+    std::filesystem::remove_all(dir);
+}
@@ -0,0 +1,399 @@
+\set ON_ERROR_STOP on
+\set TOKENIZER_PATH '/var/lib/postgresql/tokenizer.json'
+\set NORMALIZE_MAPPINGS '{".": "x", "/": "Z", "\\\\": "X", "`": "C"}'
+
+create extension corpussearch;
+
+-- Helper: assert that two counts are equal, raise if not.
+CREATE OR REPLACE FUNCTION assert_eq(label TEXT, a BIGINT, b BIGINT) RETURNS void AS $$
+BEGIN
+    IF a IS DISTINCT FROM b THEN
+        RAISE EXCEPTION 'FAIL [%]: expected % got %', label, b, a;
+    END IF;
+    RAISE NOTICE 'PASS [%]', label;
+END;
+$$ LANGUAGE plpgsql;
+
+-- Helper: assert that a query via index returns the same rows as seq scan.
+-- Uses EXCEPT in both directions so order doesn't matter.
+CREATE OR REPLACE FUNCTION assert_index_matches_seqscan(
+    label TEXT,
+    idx_results TEXT[],
+    seq_results TEXT[]
+) RETURNS void AS $$
+DECLARE
+    diff_count INT;
+BEGIN
+    -- rows in idx but not in seq
+    SELECT count(*) INTO diff_count
+    FROM (
+        SELECT unnest(idx_results)
+        EXCEPT
+        SELECT unnest(seq_results)
+    ) d;
+    IF diff_count > 0 THEN
+        RAISE EXCEPTION 'FAIL [%]: index returned % row(s) not in seqscan', label, diff_count;
+    END IF;
+
+    -- rows in seq but not in idx
+    SELECT count(*) INTO diff_count
+    FROM (
+        SELECT unnest(seq_results)
+        EXCEPT
+        SELECT unnest(idx_results)
+    ) d;
+    IF diff_count > 0 THEN
+        RAISE EXCEPTION 'FAIL [%]: seqscan returned % row(s) not in index', label, diff_count;
+    END IF;
+
+    RAISE NOTICE 'PASS [%]', label;
+END;
+$$ LANGUAGE plpgsql;
+
+
+-- Helper: compare an index scan against a seq scan for one pattern.
+CREATE OR REPLACE FUNCTION check_pattern(label TEXT, tbl REGCLASS, pattern TEXT)
+RETURNS void AS $$
+DECLARE
+    idx_rows TEXT[];
+    seq_rows TEXT[];
+BEGIN
+    SET LOCAL enable_seqscan = off;
+    SET LOCAL enable_bitmapscan = on;
+    EXECUTE format('SELECT array_agg(text ORDER BY text) FROM %s WHERE text ~ $1', tbl)
+        INTO idx_rows USING pattern;
+
+    SET LOCAL enable_seqscan = on;
+    SET LOCAL enable_bitmapscan = off;
+    EXECUTE format('SELECT array_agg(text ORDER BY text) FROM %s WHERE text ~ $1', tbl)
+        INTO seq_rows USING pattern;
+
+    PERFORM assert_index_matches_seqscan(label, idx_rows, seq_rows);
+END;
+$$ LANGUAGE plpgsql;
+
+-- ============================================================
+-- TEST G: explicit merge with ibpe_clean_pending_list
+--   Rows inserted after the bulk build sit in the pending list
+--   until ibpe_clean_pending_list folds them into the main
+--   posting lists. A second call has nothing left to merge.
+-- ============================================================
+\echo '=== TEST G: ibpe_clean_pending_list ==='
+
+CREATE TABLE t_pending_test_g (text TEXT);
+
+INSERT INTO t_pending_test_g VALUES
+    ('ho ngi ta'),
+    ('si ta so ngi ta'),
+    ('ta ho si');
+
+CREATE INDEX idx_g ON t_pending_test_g USING ibpe (text) WITH (
+    tokenizer_path = :'TOKENIZER_PATH',
+    normalize_mappings = :'NORMALIZE_MAPPINGS'
+);
+
+INSERT INTO t_pending_test_g VALUES
+    ('si ta si ho'),
+    ('ngi.ta ho');
+
+DO $$
+BEGIN
+    PERFORM assert_eq('G1: first merge moves pending entries',
+                      (ibpe_clean_pending_list('idx_g') > 0)::int, 1);
+    PERFORM assert_eq('G2: second merge finds nothing',
+                      ibpe_clean_pending_list('idx_g'), 0);
+END $$;
+
+SELECT check_pattern('G3: ngi after merge', 't_pending_test_g', 'ngi');
+SELECT check_pattern('G4: ho after merge', 't_pending_test_g', 'ho');
+SELECT check_pattern('G5: ngi.ta after merge', 't_pending_test_g', 'ngi\.ta');
+
+-- rows inserted after the merge land in a new pending list
+INSERT INTO t_pending_test_g VALUES ('ho si ho');
+SELECT check_pattern('G6: ho across merged and pending', 't_pending_test_g', 'ho');
+
+DROP TABLE t_pending_test_g;
+
+-- ============================================================
+-- TEST H: merge triggered by ibpe.pending_list_limit
+--   With a 16 kB limit, inserting enough rows into an empty
+--   index makes ibpe_insert merge on its own. The same rows
+--   inserted with the limit disabled all stay pending, so only
+--   a merge on insert leaves fewer entries to clean up.
+-- ============================================================
+\echo '=== TEST H: automatic merge on insert ==='
+
+CREATE TABLE t_pending_test_h (text TEXT);
+CREATE TABLE t_pending_test_h_nolimit (text TEXT);
+
+CREATE INDEX idx_h ON t_pending_test_h USING ibpe (text) WITH (
+    tokenizer_path = :'TOKENIZER_PATH',
+    normalize_mappings = :'NORMALIZE_MAPPINGS'
+);
+CREATE INDEX idx_h_nolimit ON t_pending_test_h_nolimit USING ibpe (text) WITH (
+    tokenizer_path = :'TOKENIZER_PATH',
+    normalize_mappings = :'NORMALIZE_MAPPINGS'
+);
+
+SET ibpe.pending_list_limit = 16;
+
+INSERT INTO t_pending_test_h
+SELECT (ARRAY['ho ngi ta', 'si ta so ngi ta', 'ta ho si', 'si ta si ho'])[1 + i % 4] || ' ' || i
+FROM generate_series(1, 2000) AS i;
+
+SET ibpe.pending_list_limit = 0;
+
+INSERT INTO t_pending_test_h_nolimit
+SELECT (ARRAY['ho ngi ta', 'si ta so ngi ta', 'ta ho si', 'si ta si ho'])[1 + i % 4] || ' ' || i
+FROM generate_series(1, 2000) AS i;
+
+RESET ibpe.pending_list_limit;
+
+DO $$
+DECLARE
+    left_over BIGINT := ibpe_clean_pending_list('idx_h');
+    all_pending BIGINT := ibpe_clean_pending_list('idx_h_nolimit');
+BEGIN
+    PERFORM assert_eq('H1: without a limit nothing was merged on insert',
+                      (all_pending > 0)::int, 1);
+    PERFORM assert_eq('H2: pending list was merged on insert',
+                      (left_over < all_pending)::int, 1);
+END $$;
+
+SELECT check_pattern('H3: ngi after automatic merge', 't_pending_test_h', 'ngi');
+SELECT check_pattern('H4: si ta after automatic merge', 't_pending_test_h', 'si ta');
+
+DROP TABLE t_pending_test_h;
+DROP TABLE t_pending_test_h_nolimit;
+
+-- ============================================================
+-- TEST I: VACUUM merges the pending list
+--   Dead pending entries are dropped by ibpe_bulkdelete and
+--   the rest is merged by ibpe_vacuumcleanup, leaving nothing
+--   for ibpe_clean_pending_list.
+-- ============================================================
+\echo '=== TEST I: vacuum merges pending ==='
+
+CREATE TABLE t_pending_test_i (text TEXT);
+
+CREATE INDEX idx_i ON t_pending_test_i USING ibpe (text) WITH (
+    tokenizer_path = :'TOKENIZER_PATH',
+    normalize_mappings = :'NORMALIZE_MAPPINGS'
+);
+
+INSERT INTO t_pending_test_i VALUES
+    ('ho ngi ta'),
+    ('si ta so ngi ta'),
+    ('ta ho si');
+
+DELETE FROM t_pending_test_i WHERE text = 'ta ho si';
+
+VACUUM t_pending_test_i;
+
+DO $$
+BEGIN
+    PERFORM assert_eq('I1: vacuum left nothing pending',
+                      ibpe_clean_pending_list('idx_i'), 0);
+END $$;
+
+SELECT check_pattern('I2: ngi after vacuum', 't_pending_test_i', 'ngi');
+SELECT check_pattern('I3: ho after vacuum', 't_pending_test_i', 'ho');
+
+DROP TABLE t_pending_test_i;
+
+-- ============================================================
+-- TEST J: statement-level insert batching
+--   ibpe_insert buffers rows until the end of the statement
+--   (ibpe_insertcleanup) or until work_mem fills up. A large
+--   INSERT ... SELECT goes through both flush paths; a scan
+--   inside a later statement of the same function must see
+--   every row.
+-- ============================================================
+\echo '=== TEST J: insert batching ==='
+
+CREATE TABLE t_pending_test_j (text TEXT);
+
+CREATE INDEX idx_j ON t_pending_test_j USING ibpe (text) WITH (
+    tokenizer_path = :'TOKENIZER_PATH',
+    normalize_mappings = :'NORMALIZE_MAPPINGS'
+);
+
+SET work_mem = 64;
+
+INSERT INTO t_pending_test_j
+SELECT (ARRAY['ho ngi ta', 'si ta so ngi ta', 'ta ho si', 'si ta si ho'])[1 + i % 4] || ' ' || i
+FROM generate_series(1, 5000) AS i;
+
+RESET work_mem;
+
+SELECT check_pattern('J1: ngi after batched insert', 't_pending_test_j', 'ngi');
+SELECT check_pattern('J2: ta ho after batched insert', 't_pending_test_j', 'ta ho');
+
+-- a single-row insert followed by a scan in the same transaction
+DO $$
+BEGIN
+    INSERT INTO t_pending_test_j VALUES ('ngi.ta si');
+    PERFORM check_pattern('J3: row visible to the next statement', 't_pending_test_j', 'ngi\.ta');
+END $$;
+
+DROP TABLE t_pending_test_j;
+
+-- ============================================================
+-- TEST K: pending partitions
+--   Each backend appends to the pending chain of its own
+--   partition. Rows inserted from several connections are
+--   spread over different chains; scans must read all of
+--   them, before and after a merge, and a merge must leave
+--   nothing behind in any chain.
+-- ============================================================
+\echo '=== TEST K: pending partitions ==='
+
+CREATE TABLE t_pending_test_k (text TEXT);
+
+CREATE INDEX idx_k ON t_pending_test_k USING ibpe (text) WITH (
+    tokenizer_path = :'TOKENIZER_PATH',
+    normalize_mappings = :'NORMALIZE_MAPPINGS'
+);
+
+INSERT INTO t_pending_test_k VALUES ('ho ngi ta'), ('ta ho si');
+\c
+INSERT INTO t_pending_test_k VALUES ('si ta so ngi ta');
+\c
+INSERT INTO t_pending_test_k VALUES ('si ta si ho'), ('ngi.ta si');
+\c
+
+SELECT check_pattern('K1: ngi across partitions', 't_pending_test_k', 'ngi');
+SELECT check_pattern('K2: ta ho across partitions', 't_pending_test_k', 'ta ho');
+
+DO $$
+BEGIN
+    PERFORM assert_eq('K3: merge consumes every partition',
+                      (ibpe_clean_pending_list('idx_k') > 0)::int, 1);
+    PERFORM assert_eq('K4: nothing left in any partition',
+                      ibpe_clean_pending_list('idx_k'), 0);
+END $$;
+
+INSERT INTO t_pending_test_k VALUES ('ho si ta');
+
+SELECT check_pattern('K5: ngi after merge', 't_pending_test_k', 'ngi');
+SELECT check_pattern('K6: ho si after merge', 't_pending_test_k', 'ho si');
+
+DROP TABLE t_pending_test_k;
+
+-- ============================================================
+-- TEST L: ibpe_literal_matches
+--   A dictionary search returns, for each literal, candidates
+--   that after a strpos() recheck are the rows a seq scan finds,
+--   over both merged and pending entries. Without per_literal it
+--   returns their union, each row once.
+-- ============================================================
+\echo '=== TEST L: ibpe_literal_matches ==='
+
+CREATE TABLE t_pending_test_l (text TEXT);
+
+INSERT INTO t_pending_test_l VALUES
+    ('ho ngi ta'),
+    ('si ta so ngi ta'),
+    ('ta ho si');
+
+CREATE INDEX idx_l ON t_pending_test_l USING ibpe (text) WITH (
+    tokenizer_path = :'TOKENIZER_PATH',
+    normalize_mappings = :'NORMALIZE_MAPPINGS'
+);
+
+INSERT INTO t_pending_test_l VALUES
+    ('si ta si ho'),
+    ('ngi.ta ho'),
+    ('ho si ta');
+
+DO $$
+DECLARE
+    literals TEXT[] := ARRAY['ho', 'ngi ta', 'ngi.ta', 'ta ho', 'si ta si', 'a s', 'TT'];
+    idx_rows TEXT[];
+    seq_rows TEXT[];
+BEGIN
+    FOR i IN 1 .. array_length(literals, 1) LOOP
+        SELECT array_agg(t.text ORDER BY t.text) INTO idx_rows
+        FROM ibpe_literal_matches('idx_l', literals) m
+        JOIN t_pending_test_l t ON t.ctid = m.heap_tid
+        WHERE m.literal = i AND strpos(t.text, literals[i]) > 0;
+
+        SELECT array_agg(text ORDER BY text) INTO seq_rows
+        FROM t_pending_test_l
+        WHERE strpos(text, literals[i]) > 0;
+
+        PERFORM assert_index_matches_seqscan('L1: ' || literals[i], idx_rows, seq_rows);
+    END LOOP;
+
+    SELECT array_agg(t.text ORDER BY t.text) INTO idx_rows
+    FROM ibpe_literal_matches('idx_l', literals, per_literal => false) m
+    JOIN t_pending_test_l t ON t.ctid = m.heap_tid
+    WHERE EXISTS (SELECT 1 FROM unnest(literals) l WHERE strpos(t.text, l) > 0);
+
+    SELECT array_agg(text ORDER BY text) INTO seq_rows
+    FROM t_pending_test_l
+    WHERE EXISTS (SELECT 1 FROM unnest(literals) l WHERE strpos(text, l) > 0);
+
+    PERFORM assert_index_matches_seqscan('L2: union of all literals', idx_rows, seq_rows);
+    PERFORM assert_eq('L3: union has each row once',
+                      (SELECT count(*) FROM ibpe_literal_matches('idx_l', literals, false)),
+                      (SELECT count(DISTINCT heap_tid)
+                       FROM ibpe_literal_matches('idx_l', literals, false)));
+END $$;
+
+DROP TABLE t_pending_test_l;
+
+-- ============================================================
+-- TEST M: a merge rewrites only the lists of pending tokens
+--   Merging one row with new tokens into a bulk-built index
+--   writes their short lists and a new PTR chain, not a copy
+--   of every posting list. Lists superseded by repeated merges
+--   are left behind until VACUUM compacts the index; results
+--   match a seq scan before and after.
+-- ============================================================
+\echo '=== TEST M: incremental merge ==='
+
+CREATE TABLE t_pending_test_m (text TEXT);
+
+INSERT INTO t_pending_test_m
+SELECT (ARRAY['ho ngi ta', 'si ta so ngi ta', 'ta ho si', 'si ta si ho'])[1 + i % 4] || ' ' || i
+FROM generate_series(1, 5000) AS i;
+
+CREATE INDEX idx_m ON t_pending_test_m USING ibpe (text) WITH (
+    tokenizer_path = :'TOKENIZER_PATH',
+    normalize_mappings = :'NORMALIZE_MAPPINGS'
+);
+
+DO $$
+DECLARE
+    built_size BIGINT := pg_relation_size('idx_m');
+BEGIN
+    INSERT INTO t_pending_test_m VALUES ('zzqq');
+    PERFORM assert_eq('M1: the row was merged',
+                      (ibpe_clean_pending_list('idx_m') > 0)::int, 1);
+    PERFORM assert_eq('M2: merging one row does not rewrite the index',
+                      (pg_relation_size('idx_m') < built_size * 3 / 2)::int, 1);
+
+    FOR i IN 1 .. 10 LOOP
+        INSERT INTO t_pending_test_m SELECT 'ho si ' || j FROM generate_series(1, 200) AS j;
+        PERFORM ibpe_clean_pending_list('idx_m');
+    END LOOP;
+END $$;
+
+SELECT check_pattern('M3: ho si after repeated merges', 't_pending_test_m', 'ho si');
+SELECT check_pattern('M4: zzqq after repeated merges', 't_pending_test_m', 'zzqq');
+
+DELETE FROM t_pending_test_m WHERE text LIKE 'ta ho si%';
+VACUUM t_pending_test_m;
+
+SELECT check_pattern('M5: ho si after compaction', 't_pending_test_m', 'ho si');
+SELECT check_pattern('M6: ngi ta after compaction', 't_pending_test_m', 'ngi ta');
+
+DROP TABLE t_pending_test_m;
+
+DROP FUNCTION check_pattern(TEXT, REGCLASS, TEXT);
+DROP FUNCTION assert_eq(TEXT, BIGINT, BIGINT);
+DROP FUNCTION assert_index_matches_seqscan(TEXT, TEXT[], TEXT[]);
+DROP EXTENSION corpussearch CASCADE;
+
+\echo '=== ALL TESTS PASSED ==='
@@ -358,6 +358,179 @@ TEST(Regex, UnicodeProperty)
                });
 }
 
+TEST(Regex, ParserParity)
+{
+    // CSTs as built by the former PEGTL parse_tree front-end
+    auto cases = std::vector<std::pair<std::string, std::string>>{
+        {"a{2,5}?b{3}",
+         "pattern(alternative(element(quantifier(element=quantifiable_element(a), min=2, max=5, "
+         "greedy=false)) element(quantifier(element=quantifiable_element(b), min=3, max=3, "
+         "greedy=true))))"},
+        {"a??",
+         "pattern(alternative(element(quantifier(element=quantifiable_element(a), min=0, max=1, "
+         "greedy=false))))"},
+        {"(?<nm>x|y)(z)",
+         "pattern(alternative(element(quantifiable_element(capturing_group(name=nm, "
+         "alternatives=[alternative(element(quantifiable_element(x))) | "
+         "alternative(element(quantifiable_element(y)))]))) "
+         "element(quantifiable_element(capturing_group(name=nullopt, "
+         "alternatives=[alternative(element(quantifiable_element(z)))])))))"},
+        {"(?<a|b>c)",
+         "pattern(alternative(element(quantifiable_element(capturing_group(name=a|b, "
+         "alternatives=[alternative(element(quantifiable_element(c)))])))))"},
+        {"[^\\d\\p{Script=Han}a-z\\]\\-]",
+         "pattern(alternative(element(quantifiable_element(character_class(negate=true, "
+         "elements=[character_class_element(escape_character_set(kind=digit)), "
+         "character_class_element(unicode_property_character_set(negate=false, property=Script, "
+         "value=Han)), character_class_element(character_class_range(min='a', max='z')), "
+         "character_class_element(]), character_class_element(-)])))))"},
+        {"[[]",
+         "pattern(alternative(element(quantifiable_element(character_class(negate=false, "
+         "elements=[character_class_element([)])))))"},
+        {"\\p{L}\\P{gc=Nd}.",
+         "pattern(alternative(element(quantifiable_element(character_set(unicode_property_"
+         "character_set(negate=false, property=L, value=nullopt)))) "
+         "element(quantifiable_element(character_set(unicode_property_character_set(negate=true, "
+         "property=gc, value=Nd)))) element(quantifiable_element(character_set(any_character_"
+         "set())))))"},
+        {"^\\bx\\B$",
+         "pattern(alternative(element(assertion(edge_assertion(kind=start))) "
+         "element(assertion(word_boundary_assertion(negate=false))) "
+         "element(quantifiable_element(x)) "
+         "element(assertion(word_boundary_assertion(negate=true))) "
+         "element(assertion(edge_assertion(kind=end)))))"},
+        {"a\\.\\*]}-",
+         "pattern(alternative(element(quantifiable_element(a)) element(quantifiable_element(.)) "
+         "element(quantifiable_element(*)) element(quantifiable_element(])) "
+         "element(quantifiable_element(})) element(quantifiable_element(-))))"},
+        {"가[가-힣]|b",
+         "pattern(alternative(element(quantifiable_element(가)) "
+         "element(quantifiable_element(character_class(negate=false, "
+         "elements=[character_class_element(character_class_range(min='가', max='힣'))])))) | "
+         "alternative(element(quantifiable_element(b))))"},
+    };
+    for (auto&& [regex, expected] : cases) {
+        auto cst = corpus_search::regex::parse(regex);
+        EXPECT_EQ(corpus_search::regex::print_cst(cst), expected) << "Regex " << regex;
+    }
+
+    for (auto regex : {"", "a|", "(a|)", "a**", "a{3,}", "a{,3}", "{", "\\x", "[a-]", "[^]",
+                       "(?<ab", "\\p{x=}", "[z-a", "[z-a]", "a{99999999999}"}) {
+        EXPECT_THROW(corpus_search::regex::parse(regex), std::runtime_error) << "Regex " << regex;
+    }
+}
+
+TEST(Regex, Utf8Ranges)
+{
+    auto encode = [](char32_t cp) {
+        auto str = std::string{};
+        if (cp < 0x80) {
+            str += static_cast<char>(cp);
+        } else if (cp < 0x800) {
+            str += static_cast<char>(0xC0 | (cp >> 6));
+            str += static_cast<char>(0x80 | (cp & 0x3F));
+        } else if (cp < 0x10000) {
+            str += static_cast<char>(0xE0 | (cp >> 12));
+            str += static_cast<char>(0x80 | ((cp >> 6) & 0x3F));
+            str += static_cast<char>(0x80 | (cp & 0x3F));
+        } else {
+            str += static_cast<char>(0xF0 | (cp >> 18));
+            str += static_cast<char>(0x80 | ((cp >> 12) & 0x3F));
+            str += static_cast<char>(0x80 | ((cp >> 6) & 0x3F));
+            str += static_cast<char>(0x80 | (cp & 0x3F));
+        }
+        return str;
+    };
+
+    auto dfa = test_parse(HANJA_RE);
+    for (char32_t cp = 0; cp < 0x20000; ++cp) {
+        bool expected = (0x4E00 <= cp && cp <= 0x9FCC) || (0x3400 <= cp && cp <= 0x4DB5);
+        EXPECT_EQ(dfa.match(encode(cp)), expected) << fmt::format("U+{:04X}", std::uint32_t{cp});
+    }
+
+    dfa = test_parse("[~-\U00010401]");
+    for (char32_t cp = 0; cp < 0x20000; ++cp) {
+        bool expected = 0x7E <= cp && cp <= 0x10401;
+        EXPECT_EQ(dfa.match(encode(cp)), expected) << fmt::format("U+{:04X}", std::uint32_t{cp});
+    }
+
+    // resolved once, then served from the property cache
+    auto han = test_parse("\\p{Script=Han}");
+    auto han_again = test_parse("\\p{Script=Han}");
+    EXPECT_EQ(han.num_states, han_again.num_states);
+    EXPECT_TRUE(han_again.match("\xE6\xB1\x89"));
+}
+
+TEST(Regex, ByteClasses)
+{
+    auto classes = corpus_search::regex::sm::partition_bytes({{'a', 'c'}, {'b', 'd'}});
+    EXPECT_EQ(classes.num_classes, 5);
+    EXPECT_EQ(classes.of_byte[0], classes.of_byte['a' - 1]);
+    EXPECT_NE(classes.of_byte['a'], classes.of_byte['b']);
+    EXPECT_EQ(classes.of_byte['b'], classes.of_byte['c']);
+    EXPECT_NE(classes.of_byte['c'], classes.of_byte['d']);
+    EXPECT_EQ(classes.of_byte['e'], classes.of_byte[255]);
+
+    // the class table agrees with the edge lists
+    auto dfa = test_parse("[^a-c][a-z]*(ab|\\.)");
+    for (auto const& [state, edges] : dfa.edges) {
+        for (int b = 0; b < 256; ++b) {
+            int expected = -1;
+            for (auto const& edge : edges) {
+                if (edge.range.min <= b && b <= edge.range.max) {
+                    expected = edge.target_state;
+                }
+            }
+            EXPECT_EQ(dfa.next_state(state, static_cast<char>(b)), expected)
+                << "state " << state << ", byte " << b;
+        }
+    }
+}
+
+TEST(Regex, MinimalDFA)
+{
+    auto dfa = test_parse("(a|b)*abb", {{"abb", true}, {"babb", true}, {"abab", false}});
+    EXPECT_EQ(dfa.num_states, 4);
+
+    // the tails after "aa" and "bb" are the same state
+    dfa = test_parse("aab*|bbb*", {{"aa", true}, {"bbbb", true}, {"ab", false}});
+    EXPECT_EQ(dfa.num_states, 4);
+}
+
+TEST(Regex, SimplifyAST)
+{
+    auto simplified = [](std::string const& regex) {
+        auto cst = corpus_search::regex::parse(regex);
+        return corpus_search::regex::print_ast(corpus_search::regex::cst_to_ast(cst));
+    };
+
+    // common prefixes and suffixes are factored out, duplicates dropped
+    EXPECT_EQ(simplified("kaxnan|kaxnom"), "(((('k'·'a')·'x')·'n')·(('a'·'n')|('o'·'m')))");
+    EXPECT_EQ(simplified("abc|abc|ab"), "(('a'·'b')·(ε|'c'))");
+    EXPECT_EQ(simplified("abc|xbc|ybc"), "((('a'|['x'-'y'])·'b')·'c')");
+    // adjacent ranges are merged
+    EXPECT_EQ(simplified("[a-c]|[d-f]|x"), "(['a'-'f']|'x')");
+    // nested stars and optionals
+    EXPECT_EQ(simplified("(a*)*"), "*('a')");
+    EXPECT_EQ(simplified("(a+)?"), "*('a')");
+    EXPECT_EQ(simplified("(a?|b)*"), "*(['a'-'b'])");
+    // bounded repeats nest their optional copies
+    EXPECT_EQ(simplified("x{0,3}"), "(ε|('x'·(ε|('x'·(ε|'x')))))");
+    // assertions are kept for needs_recheck
+    EXPECT_TRUE(test_parse("^ab|^ac").needs_recheck);
+
+    test_parse("kaxnan|kaxnom|kaxna|axnan",
+               {
+                   {"kaxnan", true},
+                   {"kaxnom", true},
+                   {"kaxna", true},
+                   {"axnan", true},
+                   {"kaxn", false},
+                   {"kaxnon", false},
+                   {"axnom", false},
+               });
+}
+
 TEST(Regex, RegexTrie)
 {
     auto dfa = test_parse("(k[aeiou]\\.){3}k");
@@ -420,6 +593,98 @@ TEST(Regex, RegexTrie)
     ASSERT_EQ(state, corpus_search::dfa_trie::ACCEPTED);
 }
 
+// tokens whose bytes from prefix_length on lead from state to target_state (any state if -1),
+// or to an accept state in target_state, one token at a time
+static auto next_tids_brute_force(corpus_search::regex::sm::graph const& dfa,
+                                  int state,
+                                  int target_state,
+                                  int prefix_length) -> roaring::Roaring
+{
+    auto result = roaring::Roaring{};
+    for (auto const& [tid, token] : get_tok().get_tid_to_token()) {
+        if (token.size() <= prefix_length) {
+            continue;
+        }
+        int cur = state;
+        for (auto i = prefix_length; cur != -1; ++i) {
+            if (dfa.accept_states.contains(cur) || i == token.size()) {
+                if (target_state == -1 || cur == target_state) {
+                    result.add(tid);
+                }
+                break;
+            }
+            cur = dfa.edges.contains(cur) ? dfa.next_state(cur, token[i]) : -1;
+        }
+    }
+    return result;
+}
+
+TEST(Regex, RegexTrieMatchesBruteForce)
+{
+    auto const& trie = get_tok().trie();
+    for (auto regex : {"(k[aeiou]\\.){3}k", "a(a|ba)*|c*a", HANJA_RE "`i"}) {
+        auto dfa = test_parse(regex);
+        for (int pad = 0; pad < 3; ++pad) {
+            for (int num_threads : {1, 4}) {
+                auto all = trie.get_next_tids_all(dfa, pad, num_threads);
+                for (int state = 0; state < dfa.num_states; ++state) {
+                    EXPECT_EQ(all[state], next_tids_brute_force(dfa, state, -1, pad))
+                        << regex << ", state " << state << ", pad " << pad;
+                }
+            }
+        }
+        for (int state = 0; state < dfa.num_states; ++state) {
+            if (!dfa.edges.contains(state)) {
+                continue;
+            }
+            for (int pad = 0; pad < 3; ++pad) {
+                EXPECT_EQ(trie.get_next_tids(dfa, state, -1, pad),
+                          next_tids_brute_force(dfa, state, -1, pad))
+                    << regex << ", state " << state << ", pad " << pad;
+                EXPECT_EQ(trie.get_next_tids(dfa, state, dfa.start_state, pad),
+                          next_tids_brute_force(dfa, state, dfa.start_state, pad))
+                    << regex << ", state " << state << ", pad " << pad;
+            }
+        }
+    }
+}
+
+TEST(Regex, LazyDFA)
+{
+    auto const& trie = get_tok().trie();
+    for (auto regex : {"(a|b)*a(a|b){15}", "(k[aeiou]\\.){3}k", HANJA_RE "`i"}) {
+        auto ast = corpus_search::regex::cst_to_ast(corpus_search::regex::parse(regex));
+        auto full = corpus_search::regex::ast_to_dfa(ast);
+        for (int max_states : {1, 4, 64}) {
+            auto lazy = corpus_search::regex::ast_to_dfa(ast, max_states);
+            if (full.num_states > max_states) {
+                EXPECT_TRUE(lazy.is_lazy()) << regex;
+            }
+
+            for (auto str : {"ab", "aaaaaaaaaaaaaaaab", "kakekik", "k", "漢字`i"}) {
+                EXPECT_EQ(lazy.match(str), full.match(str)) << regex << ", " << str;
+            }
+            for (int pad = 0; pad < 3; ++pad) {
+                EXPECT_EQ(trie.get_next_tids(lazy, lazy.start_state, -1, pad),
+                          trie.get_next_tids(full, full.start_state, -1, pad))
+                    << regex << ", pad " << pad;
+            }
+            for (auto const& [tid, token] : get_tok().get_tid_to_token()) {
+                int lazy_state = trie.consume_token(lazy, lazy.start_state, token);
+                int full_state = trie.consume_token(full, full.start_state, token);
+                if (lazy_state == corpus_search::dfa_trie::OVERFLOWED) {
+                    EXPECT_GE(full_state, 0) << regex << ", " << token;
+                } else if (lazy_state < 0 || full_state < 0) {
+                    EXPECT_EQ(lazy_state, full_state) << regex << ", " << token;
+                }
+            }
+            if (lazy.is_lazy()) {
+                EXPECT_LE(lazy.num_states, max_states) << regex;
+            }
+        }
+    }
+}
+
 TEST(Regex, RegexTrieParity)
 {
     const std::string regex = "[^\u4FCD-\u9FCC\u3400-\u4DB5]`i";
@@ -9,30 +9,32 @@
 
 #include "searcher.hpp"
 
+static auto access_index(int token) -> std::vector<corpus_search::token_range>
+{
+    std::vector<corpus_search::token_range> result{};
+    auto& index = get_index().get_index();
+    if (index.count(token) == 0) {
+        return result;
+    }
+    auto const& vec = index.at(token);
+    result.reserve(vec.size());
+    for (auto const& entry : vec) {
+        result.push_back({
+            entry.sent_id, entry.pos, static_cast<tokpos_t>(entry.pos + 1),
+#if CORPUS_SEARCH_NEXT_TOKEN_BITS > 0
+                entry.next_tok,
+#endif
+        });
+    }
+    return result;
+}
+
 static auto measure_time(std::string search_term) -> std::vector<sentid_t>
 {
     using namespace std::chrono;
     auto start_time = high_resolution_clock::now();
 
-    auto index_accessor = [](int token) {
-        std::vector<corpus_search::token_range> result{};
-        auto& index = get_index().get_index();
-        if (index.count(token) == 0) {
-            return result;
-        }
-        auto const& vec = index.at(token);
-        result.reserve(vec.size());
-        for (auto const& entry : vec) {
-            result.push_back({
-                entry.sent_id, entry.pos, static_cast<tokpos_t>(entry.pos + 1),
-#if CORPUS_SEARCH_NEXT_TOKEN_BITS > 0
-                    entry.next_tok,
-#endif
-            });
-        }
-        return result;
-    };
-    auto result = search(get_tok(), index_accessor, search_term);
+    auto result = search(get_tok(), access_index, search_term);
 
     auto end_time = high_resolution_clock::now();
 
@@ -147,3 +149,30 @@ TEST_F(Searcher, SearchRegexMatchAll)
 {
     EXPECT_EQ(measure_time(".*").size(), 1733874);
 }
+
+TEST_F(Searcher, SearchLiterals)
+{
+    auto literals = std::vector<std::string>{
+        "ho.ni", "ngi.ta", "ka.nan.ho", "o.non", "國家", "家non", "TT", "ngi.ta"};
+    auto result = search_literals(get_tok(), access_index, literals);
+
+    // the same sentences as the regexes for each literal
+    ASSERT_EQ(result.per_literal.size(), literals.size());
+    EXPECT_EQ(result.per_literal[0].size(), 94299);
+    EXPECT_EQ(result.per_literal[1].size(), 2'472);
+    EXPECT_EQ(result.per_literal[2].size(), 719);
+    EXPECT_EQ(result.per_literal[3].size(), 74946);
+    EXPECT_EQ(result.per_literal[4].size(), 296);
+    EXPECT_EQ(result.per_literal[5].size(), 59);
+    EXPECT_EQ(result.per_literal[6].size(), 0);
+    EXPECT_EQ(result.per_literal[7], result.per_literal[1]);
+    EXPECT_EQ(result.per_literal[1], measure_time("ngi\\.ta"));
+
+    auto any = std::vector<sentid_t>{};
+    for (auto const& sent_ids : result.per_literal) {
+        any.insert(any.end(), sent_ids.begin(), sent_ids.end());
+    }
+    std::sort(any.begin(), any.end());
+    any.erase(std::unique(any.begin(), any.end()), any.end());
+    EXPECT_EQ(result.any, any);
+}